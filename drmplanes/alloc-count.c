@@ -0,0 +1,77 @@
+#include "alloc-count.h"
+
+#include <stddef.h>
+#include <errno.h>
+
+/* glibc entry points, so the wrappers below do not recurse */
+extern void *__libc_malloc(size_t size);
+extern void *__libc_calloc(size_t nmemb, size_t size);
+extern void *__libc_realloc(void *ptr, size_t size);
+extern void *__libc_memalign(size_t alignment, size_t size);
+extern void __libc_free(void *ptr);
+
+static uint64_t alloc_count;
+static uint64_t free_count;
+
+void *malloc(size_t size)
+{
+    __atomic_add_fetch(&alloc_count, 1, __ATOMIC_RELAXED);
+    return __libc_malloc(size);
+}
+
+void *calloc(size_t nmemb, size_t size)
+{
+    __atomic_add_fetch(&alloc_count, 1, __ATOMIC_RELAXED);
+    return __libc_calloc(nmemb, size);
+}
+
+void *realloc(void *ptr, size_t size)
+{
+    __atomic_add_fetch(&alloc_count, 1, __ATOMIC_RELAXED);
+    return __libc_realloc(ptr, size);
+}
+
+void *memalign(size_t alignment, size_t size)
+{
+    __atomic_add_fetch(&alloc_count, 1, __ATOMIC_RELAXED);
+    return __libc_memalign(alignment, size);
+}
+
+void *aligned_alloc(size_t alignment, size_t size)
+{
+    __atomic_add_fetch(&alloc_count, 1, __ATOMIC_RELAXED);
+    return __libc_memalign(alignment, size);
+}
+
+int posix_memalign(void **memptr, size_t alignment, size_t size)
+{
+    void *ptr;
+
+    if (alignment % sizeof(void *) || (alignment & (alignment - 1)))
+        return EINVAL;
+
+    __atomic_add_fetch(&alloc_count, 1, __ATOMIC_RELAXED);
+    ptr = __libc_memalign(alignment, size);
+    if (!ptr)
+        return ENOMEM;
+
+    *memptr = ptr;
+    return 0;
+}
+
+void free(void *ptr)
+{
+    if (ptr)
+        __atomic_add_fetch(&free_count, 1, __ATOMIC_RELAXED);
+    __libc_free(ptr);
+}
+
+uint64_t get_alloc_count(void)
+{
+    return __atomic_load_n(&alloc_count, __ATOMIC_RELAXED);
+}
+
+uint64_t get_free_count(void)
+{
+    return __atomic_load_n(&free_count, __ATOMIC_RELAXED);
+}
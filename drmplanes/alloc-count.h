@@ -0,0 +1,17 @@
+#ifndef ALLOC_COUNT_H
+#define ALLOC_COUNT_H
+
+#include <stdint.h>
+
+/*
+ * Number of malloc/calloc/realloc/memalign/aligned_alloc/posix_memalign
+ * calls made by the process so far, including the ones of other threads
+ * and libraries. strdup, asprintf and the like allocate through malloc
+ * and are counted; memory a driver maps with mmap or takes from its own
+ * pools is not.
+ */
+uint64_t get_alloc_count(void);
+/* free calls with a non-NULL pointer */
+uint64_t get_free_count(void);
+
+#endif /* ALLOC_COUNT_H */
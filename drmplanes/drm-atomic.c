@@ -0,0 +1,478 @@
+#include "drm-atomic.h"
+#include "kms-snapshot.h"
+
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <drm_fourcc.h>
+
+const char * const plane_prop_names[PLANE_PROP_COUNT] = {
+    [PLANE_PROP_FB_ID] = "FB_ID",
+    [PLANE_PROP_CRTC_ID] = "CRTC_ID",
+    [PLANE_PROP_SRC_X] = "SRC_X",
+    [PLANE_PROP_SRC_Y] = "SRC_Y",
+    [PLANE_PROP_SRC_W] = "SRC_W",
+    [PLANE_PROP_SRC_H] = "SRC_H",
+    [PLANE_PROP_CRTC_X] = "CRTC_X",
+    [PLANE_PROP_CRTC_Y] = "CRTC_Y",
+    [PLANE_PROP_CRTC_W] = "CRTC_W",
+    [PLANE_PROP_CRTC_H] = "CRTC_H",
+    [PLANE_PROP_IN_FENCE_FD] = "IN_FENCE_FD",
+    [PLANE_PROP_FB_DAMAGE_CLIPS] = "FB_DAMAGE_CLIPS",
+    [PLANE_PROP_ZPOS] = "zpos",
+    [PLANE_PROP_ALPHA] = "alpha",
+    [PLANE_PROP_PIXEL_BLEND_MODE] = "pixel blend mode",
+};
+
+const char * const crtc_prop_names[CRTC_PROP_COUNT] = {
+    [CRTC_PROP_MODE_ID] = "MODE_ID",
+    [CRTC_PROP_ACTIVE] = "ACTIVE",
+    [CRTC_PROP_OUT_FENCE_PTR] = "OUT_FENCE_PTR",
+};
+
+const char * const connector_prop_names[CONNECTOR_PROP_COUNT] = {
+    [CONNECTOR_PROP_CRTC_ID] = "CRTC_ID",
+    [CONNECTOR_PROP_WRITEBACK_FB_ID] = "WRITEBACK_FB_ID",
+    [CONNECTOR_PROP_WRITEBACK_OUT_FENCE_PTR] = "WRITEBACK_OUT_FENCE_PTR",
+};
+
+uint32_t find_property_id(const drmModeObjectProperties *props,
+    drmModePropertyRes **props_info, const char *name)
+{
+    uint32_t i;
+
+    for (i = 0 ; i < props->count_props ; i++) {
+        if (props_info[i] && strcmp(props_info[i]->name, name) == 0)
+            return props_info[i]->prop_id;
+    }
+
+    return 0;
+}
+
+bool get_property_value(const drmModeObjectProperties *props,
+    drmModePropertyRes **props_info, const char *name, uint64_t *value)
+{
+    uint32_t i;
+
+    for (i = 0 ; i < props->count_props ; i++) {
+        if (props_info[i] && strcmp(props_info[i]->name, name) == 0) {
+            *value = props->prop_values[i];
+            return true;
+        }
+    }
+
+    return false;
+}
+
+static drmModePropertyRes *find_property(const drmModeObjectProperties *props,
+    drmModePropertyRes **props_info, const char *name)
+{
+    uint32_t i;
+
+    for (i = 0 ; i < props->count_props ; i++) {
+        if (props_info[i] && strcmp(props_info[i]->name, name) == 0)
+            return props_info[i];
+    }
+
+    return NULL;
+}
+
+bool get_property_range(const drmModeObjectProperties *props,
+    drmModePropertyRes **props_info, const char *name,
+    uint64_t *min, uint64_t *max, bool *immutable)
+{
+    drmModePropertyRes *info = find_property(props, props_info, name);
+
+    if (!info || info->count_values < 2 ||
+        !(info->flags & (DRM_MODE_PROP_RANGE | DRM_MODE_PROP_SIGNED_RANGE)))
+        return false;
+
+    *min = info->values[0];
+    *max = info->values[1];
+    *immutable = info->flags & DRM_MODE_PROP_IMMUTABLE;
+    return true;
+}
+
+bool get_property_enum_value(const drmModeObjectProperties *props,
+    drmModePropertyRes **props_info, const char *name,
+    const char *enum_name, uint64_t *value)
+{
+    drmModePropertyRes *info = find_property(props, props_info, name);
+    int i;
+
+    for (i = 0; info && i < info->count_enums; i++) {
+        if (strcmp(info->enums[i].name, enum_name) == 0) {
+            *value = info->enums[i].value;
+            return true;
+        }
+    }
+
+    return false;
+}
+
+int add_property_by_name(drmModeAtomicReq *req, uint32_t obj_id,
+    const drmModeObjectProperties *props, drmModePropertyRes **props_info,
+    const char *name, uint64_t value)
+{
+    uint32_t prop_id = find_property_id(props, props_info, name);
+
+    if (!prop_id) {
+        printf("no property: %s\n", name);
+        return -EINVAL;
+    }
+
+    return drmModeAtomicAddProperty(req, obj_id, prop_id, value);
+}
+
+static int get_object_properties(int fd, uint32_t obj_id, uint32_t obj_type,
+    const char *type_name, drmModeObjectProperties **out_props,
+    drmModePropertyRes ***out_props_info,
+    const char * const *names, uint32_t *prop_ids, int count, int required)
+{
+    drmModeObjectProperties *props;
+    drmModePropertyRes **props_info;
+    uint32_t i;
+    int j, ret = 0;
+
+    if (kms_snapshot_get_properties(fd, obj_id, &props, &props_info)) {
+        props = drmModeObjectGetProperties(fd, obj_id, obj_type);
+        if (!props) {
+            printf("could not get %s %u properties: %s\n",
+                type_name, obj_id, strerror(errno));
+            return -1;
+        }
+
+        props_info = calloc(props->count_props, sizeof(*props_info));
+        for (i = 0; i < props->count_props; i++)
+            props_info[i] = drmModeGetProperty(fd, props->props[i]);
+    }
+
+    for (j = 0; j < count; j++) {
+        prop_ids[j] = find_property_id(props, props_info, names[j]);
+        if (!prop_ids[j] && j < required) {
+            printf("%s %u has no property %s\n", type_name, obj_id, names[j]);
+            ret = -1;
+        }
+    }
+
+    /* also on failure, for the free_atomic_* of the caller */
+    *out_props = props;
+    *out_props_info = props_info;
+    return ret;
+}
+
+int init_atomic_plane(int fd, uint32_t plane_id, struct plane *plane)
+{
+    plane->plane = kms_snapshot_get_plane(fd, plane_id);
+    if (!plane->plane)
+        plane->plane = drmModeGetPlane(fd, plane_id);
+    if (!plane->plane) {
+        printf("could not get plane %u: %s\n", plane_id, strerror(errno));
+        return -1;
+    }
+
+    return get_object_properties(fd, plane_id, DRM_MODE_OBJECT_PLANE, "plane",
+        &plane->props, &plane->props_info,
+        plane_prop_names, plane->prop_ids, PLANE_PROP_COUNT, PLANE_PROP_REQUIRED);
+}
+
+int init_atomic_crtc(int fd, uint32_t crtc_id, struct crtc *crtc)
+{
+    crtc->crtc = drmModeGetCrtc(fd, crtc_id);
+    if (!crtc->crtc) {
+        printf("could not get crtc %u: %s\n", crtc_id, strerror(errno));
+        return -1;
+    }
+
+    return get_object_properties(fd, crtc_id, DRM_MODE_OBJECT_CRTC, "crtc",
+        &crtc->props, &crtc->props_info,
+        crtc_prop_names, crtc->prop_ids, CRTC_PROP_COUNT, CRTC_PROP_REQUIRED);
+}
+
+int init_atomic_connector(int fd, uint32_t connector_id, struct connector *connector)
+{
+    connector->connector = drmModeGetConnector(fd, connector_id);
+    if (!connector->connector) {
+        printf("could not get connector %u: %s\n", connector_id, strerror(errno));
+        return -1;
+    }
+
+    return get_object_properties(fd, connector_id, DRM_MODE_OBJECT_CONNECTOR, "connector",
+        &connector->props, &connector->props_info,
+        connector_prop_names, connector->prop_ids, CONNECTOR_PROP_COUNT,
+        CONNECTOR_PROP_REQUIRED);
+}
+
+void free_atomic_plane(struct plane *plane)
+{
+    uint32_t i;
+
+    if (plane->props) {
+        for (i = 0; i < plane->props->count_props; i++)
+            drmModeFreeProperty(plane->props_info[i]);
+        free(plane->props_info);
+        drmModeFreeObjectProperties(plane->props);
+    }
+    if (plane->plane)
+        drmModeFreePlane(plane->plane);
+
+    memset(plane, 0, sizeof(*plane));
+}
+
+void free_atomic_connector(struct connector *connector)
+{
+    uint32_t i;
+
+    if (connector->props) {
+        for (i = 0; i < connector->props->count_props; i++)
+            drmModeFreeProperty(connector->props_info[i]);
+        free(connector->props_info);
+        drmModeFreeObjectProperties(connector->props);
+    }
+    if (connector->connector)
+        drmModeFreeConnector(connector->connector);
+
+    memset(connector, 0, sizeof(*connector));
+}
+
+int get_crtc_index(int fd, uint32_t crtc_id)
+{
+    drmModeRes *resources = drmModeGetResources(fd);
+    int i, index = -1;
+
+    if (!resources)
+        return -1;
+
+    for (i = 0; i < resources->count_crtcs; i++) {
+        if (resources->crtcs[i] == crtc_id) {
+            index = i;
+            break;
+        }
+    }
+
+    drmModeFreeResources(resources);
+    return index;
+}
+
+/*
+ * Collect the primary and overlay planes that can be used on crtc_id with
+ * the given format (0: any), primary first. Cursor planes are skipped.
+ */
+int init_crtc_planes(int fd, uint32_t crtc_id, uint32_t format,
+    struct plane *planes, int max_planes)
+{
+    drmModePlaneRes *plane_resources;
+    int crtc_index = get_crtc_index(fd, crtc_id);
+    int count = 0;
+    uint32_t i;
+
+    if (crtc_index < 0) {
+        printf("crtc %u not found\n", crtc_id);
+        return -1;
+    }
+
+    plane_resources = drmModeGetPlaneResources(fd);
+    if (!plane_resources) {
+        printf("drmModeGetPlaneResources failed: %s\n", strerror(errno));
+        return -1;
+    }
+
+    for (i = 0; i < plane_resources->count_planes && count < max_planes; i++) {
+        struct plane *plane = &planes[count];
+        uint64_t type = DRM_PLANE_TYPE_OVERLAY;
+
+        if (init_atomic_plane(fd, plane_resources->planes[i], plane)) {
+            free_atomic_plane(plane);
+            continue;
+        }
+
+        get_property_value(plane->props, plane->props_info, "type", &type);
+
+        if (!(plane->plane->possible_crtcs & (1 << crtc_index)) ||
+            type == DRM_PLANE_TYPE_CURSOR ||
+            !plane_supports_format(plane->plane, format)) {
+            free_atomic_plane(plane);
+            continue;
+        }
+
+        if (type == DRM_PLANE_TYPE_PRIMARY && count > 0) {
+            struct plane tmp = planes[0];
+            planes[0] = *plane;
+            *plane = tmp;
+        }
+        count++;
+    }
+
+    drmModeFreePlaneResources(plane_resources);
+    return count;
+}
+
+bool plane_supports_format(const drmModePlane *plane, uint32_t format)
+{
+    uint32_t i;
+
+    if (!format)
+        return true;
+
+    for (i = 0; i < plane->count_formats; i++) {
+        if (plane->formats[i] == format)
+            return true;
+    }
+
+    return false;
+}
+
+/*
+ * The modifiers IN_FORMATS lists for format, in the driver's order. The
+ * blob is looked up again, its ID is not kept in a cached snapshot.
+ * A plane without IN_FORMATS only takes linear buffers.
+ */
+int get_plane_modifiers(int fd, const struct plane *plane, uint32_t format,
+    uint64_t *modifiers, int max_modifiers)
+{
+    uint32_t plane_id = plane->plane->plane_id;
+    uint32_t prop_id = find_property_id(plane->props, plane->props_info, "IN_FORMATS");
+    const struct drm_format_modifier_blob *header;
+    const struct drm_format_modifier *mods;
+    const uint32_t *formats;
+    drmModeObjectProperties *props;
+    drmModePropertyBlobRes *blob;
+    uint64_t blob_id = 0;
+    uint32_t i, index;
+    int count = 0;
+
+    if (!plane_supports_format(plane->plane, format))
+        return 0;
+
+    props = prop_id ? drmModeObjectGetProperties(fd, plane_id, DRM_MODE_OBJECT_PLANE) : NULL;
+    for (i = 0; props && i < props->count_props; i++) {
+        if (props->props[i] == prop_id)
+            blob_id = props->prop_values[i];
+    }
+    if (props)
+        drmModeFreeObjectProperties(props);
+
+    blob = blob_id ? drmModeGetPropertyBlob(fd, blob_id) : NULL;
+    if (!blob) {
+        modifiers[0] = DRM_FORMAT_MOD_LINEAR;
+        return 1;
+    }
+
+    header = blob->data;
+    formats = (const uint32_t *)((const char *)header + header->formats_offset);
+    mods = (const struct drm_format_modifier *)((const char *)header + header->modifiers_offset);
+
+    for (index = 0; index < header->count_formats; index++) {
+        if (formats[index] == format)
+            break;
+    }
+
+    /* each entry covers the 64 formats from its offset on */
+    for (i = 0; index < header->count_formats && i < header->count_modifiers &&
+            count < max_modifiers; i++) {
+        if (index < mods[i].offset || index >= mods[i].offset + 64)
+            continue;
+        if (mods[i].formats & (1ull << (index - mods[i].offset)))
+            modifiers[count++] = mods[i].modifier;
+    }
+
+    drmModeFreePropertyBlob(blob);
+    return count;
+}
+
+uint64_t get_time_ns(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000ull + ts.tv_nsec;
+}
+
+void commit_stats_add(struct commit_stats *stats, uint64_t ns)
+{
+    if (stats->count == 0 || ns < stats->min_ns)
+        stats->min_ns = ns;
+    if (ns > stats->max_ns)
+        stats->max_ns = ns;
+
+    stats->total_ns += ns;
+    stats->count++;
+}
+
+void commit_stats_print(const struct commit_stats *stats)
+{
+    if (!stats->count)
+        return;
+
+    printf("%s commit: count %llu avg %.3f ms min %.3f ms max %.3f ms",
+        stats->name, (unsigned long long)stats->count,
+        stats->total_ns / 1e6 / stats->count,
+        stats->min_ns / 1e6, stats->max_ns / 1e6);
+    if (stats->count_allocs)
+        printf(" allocs %llu frees %llu", (unsigned long long)stats->allocs,
+            (unsigned long long)stats->frees);
+    printf("\n");
+}
+
+void atomic_template_init(struct atomic_template *t)
+{
+    t->count_objs = 0;
+    t->count = 0;
+}
+
+int atomic_template_add(struct atomic_template *t, uint32_t obj_id,
+    uint32_t prop_id, uint64_t value)
+{
+    if (!prop_id) {
+        printf("no property for object %u\n", obj_id);
+        return -1;
+    }
+
+    if (t->count == ATOMIC_TEMPLATE_MAX_PROPS) {
+        printf("atomic template full\n");
+        return -1;
+    }
+
+    if (!t->count_objs || t->objs[t->count_objs - 1] != obj_id) {
+        if (t->count_objs == ATOMIC_TEMPLATE_MAX_OBJS) {
+            printf("atomic template full\n");
+            return -1;
+        }
+        t->objs[t->count_objs] = obj_id;
+        t->count_props[t->count_objs] = 0;
+        t->count_objs++;
+    }
+
+    t->count_props[t->count_objs - 1]++;
+    t->props[t->count] = prop_id;
+    t->values[t->count] = value;
+    return t->count++;
+}
+
+int atomic_template_commit(int fd, const struct atomic_template *t,
+    uint32_t flags, void *user_data)
+{
+    struct drm_mode_atomic atomic = {
+        .flags = flags,
+        .count_objs = t->count_objs,
+        .objs_ptr = (uintptr_t)t->objs,
+        .count_props_ptr = (uintptr_t)t->count_props,
+        .props_ptr = (uintptr_t)t->props,
+        .prop_values_ptr = (uintptr_t)t->values,
+        .user_data = (uintptr_t)user_data,
+    };
+
+    if (drmIoctl(fd, DRM_IOCTL_MODE_ATOMIC, &atomic))
+        return -errno;
+
+    return 0;
+}
+
+void atomic_template_truncate(struct atomic_template *t, uint32_t count)
+{
+    while (t->count > count) {
+        t->count--;
+        if (--t->count_props[t->count_objs - 1] == 0)
+            t->count_objs--;
+    }
+}
@@ -0,0 +1,211 @@
+#ifndef DRM_ATOMIC_H
+#define DRM_ATOMIC_H
+
+#include <stdio.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <errno.h>
+#include <xf86drm.h>
+#include <xf86drmMode.h>
+
+/*
+ * Property IDs are resolved once per KMS object when it is initialized,
+ * so building a request per frame is only a table lookup.
+ */
+enum plane_prop {
+    PLANE_PROP_FB_ID,
+    PLANE_PROP_CRTC_ID,
+    PLANE_PROP_SRC_X,
+    PLANE_PROP_SRC_Y,
+    PLANE_PROP_SRC_W,
+    PLANE_PROP_SRC_H,
+    PLANE_PROP_CRTC_X,
+    PLANE_PROP_CRTC_Y,
+    PLANE_PROP_CRTC_W,
+    PLANE_PROP_CRTC_H,
+    /* optional, not every driver has them */
+    PLANE_PROP_IN_FENCE_FD,
+    PLANE_PROP_FB_DAMAGE_CLIPS,
+    PLANE_PROP_ZPOS,
+    PLANE_PROP_ALPHA,
+    PLANE_PROP_PIXEL_BLEND_MODE,
+    PLANE_PROP_COUNT
+};
+
+/* init fails without the properties before this one */
+#define PLANE_PROP_REQUIRED PLANE_PROP_IN_FENCE_FD
+
+enum crtc_prop {
+    CRTC_PROP_MODE_ID,
+    CRTC_PROP_ACTIVE,
+    /* optional */
+    CRTC_PROP_OUT_FENCE_PTR,
+    CRTC_PROP_COUNT
+};
+
+#define CRTC_PROP_REQUIRED CRTC_PROP_OUT_FENCE_PTR
+
+enum connector_prop {
+    CONNECTOR_PROP_CRTC_ID,
+    /* writeback connectors only */
+    CONNECTOR_PROP_WRITEBACK_FB_ID,
+    CONNECTOR_PROP_WRITEBACK_OUT_FENCE_PTR,
+    CONNECTOR_PROP_COUNT
+};
+
+#define CONNECTOR_PROP_REQUIRED CONNECTOR_PROP_WRITEBACK_FB_ID
+
+extern const char * const plane_prop_names[PLANE_PROP_COUNT];
+extern const char * const crtc_prop_names[CRTC_PROP_COUNT];
+extern const char * const connector_prop_names[CONNECTOR_PROP_COUNT];
+
+struct plane {
+    drmModePlane *plane;
+    drmModeObjectProperties *props;
+    drmModePropertyRes **props_info;
+    uint32_t prop_ids[PLANE_PROP_COUNT];
+};
+
+struct crtc {
+    drmModeCrtc *crtc;
+    drmModeObjectProperties *props;
+    drmModePropertyRes **props_info;
+    uint32_t prop_ids[CRTC_PROP_COUNT];
+};
+
+struct connector {
+    drmModeConnector *connector;
+    drmModeObjectProperties *props;
+    drmModePropertyRes **props_info;
+    uint32_t prop_ids[CONNECTOR_PROP_COUNT];
+};
+
+int init_atomic_plane(int fd, uint32_t plane_id, struct plane *plane);
+int init_atomic_crtc(int fd, uint32_t crtc_id, struct crtc *crtc);
+int init_atomic_connector(int fd, uint32_t connector_id, struct connector *connector);
+void free_atomic_plane(struct plane *plane);
+void free_atomic_connector(struct connector *connector);
+
+int get_crtc_index(int fd, uint32_t crtc_id);
+int init_crtc_planes(int fd, uint32_t crtc_id, uint32_t format,
+    struct plane *planes, int max_planes);
+bool plane_supports_format(const drmModePlane *plane, uint32_t format);
+int get_plane_modifiers(int fd, const struct plane *plane, uint32_t format,
+    uint64_t *modifiers, int max_modifiers);
+
+uint32_t find_property_id(const drmModeObjectProperties *props,
+    drmModePropertyRes **props_info, const char *name);
+int add_property_by_name(drmModeAtomicReq *req, uint32_t obj_id,
+    const drmModeObjectProperties *props, drmModePropertyRes **props_info,
+    const char *name, uint64_t value);
+bool get_property_value(const drmModeObjectProperties *props,
+    drmModePropertyRes **props_info, const char *name, uint64_t *value);
+bool get_property_range(const drmModeObjectProperties *props,
+    drmModePropertyRes **props_info, const char *name,
+    uint64_t *min, uint64_t *max, bool *immutable);
+bool get_property_enum_value(const drmModeObjectProperties *props,
+    drmModePropertyRes **props_info, const char *name,
+    const char *enum_name, uint64_t *value);
+
+uint64_t get_time_ns(void);
+
+#define COMMIT_STATS_INTERVAL 300
+
+struct commit_stats {
+    const char *name;
+    uint64_t count;
+    uint64_t total_ns;
+    uint64_t min_ns;
+    uint64_t max_ns;
+    uint64_t allocs;            /* heap allocations, when the caller counts them */
+    uint64_t frees;
+    bool count_allocs;
+};
+
+void commit_stats_add(struct commit_stats *stats, uint64_t ns);
+void commit_stats_print(const struct commit_stats *stats);
+
+static inline int add_plane_property(drmModeAtomicReq *req, const struct plane *obj,
+    enum plane_prop prop, uint64_t value)
+{
+    if (!obj->prop_ids[prop]) {
+        printf("no plane property: %s\n", plane_prop_names[prop]);
+        return -EINVAL;
+    }
+
+    return drmModeAtomicAddProperty(req, obj->plane->plane_id, obj->prop_ids[prop], value);
+}
+
+static inline int add_crtc_property(drmModeAtomicReq *req, const struct crtc *obj,
+    enum crtc_prop prop, uint64_t value)
+{
+    if (!obj->prop_ids[prop]) {
+        printf("no crtc property: %s\n", crtc_prop_names[prop]);
+        return -EINVAL;
+    }
+
+    return drmModeAtomicAddProperty(req, obj->crtc->crtc_id, obj->prop_ids[prop], value);
+}
+
+static inline int add_connector_property(drmModeAtomicReq *req, const struct connector *obj,
+    enum connector_prop prop, uint64_t value)
+{
+    if (!obj->prop_ids[prop]) {
+        printf("no connector property: %s\n", connector_prop_names[prop]);
+        return -EINVAL;
+    }
+
+    return drmModeAtomicAddProperty(req, obj->connector->connector_id, obj->prop_ids[prop], value);
+}
+
+/*
+ * A request built once and committed many times. drmModeAtomicCommit
+ * copies and sorts the request on every call, so the template keeps the
+ * object/property/value arrays the ioctl expects and frames only patch
+ * values in place. Properties of one object have to be added in a row.
+ */
+#define ATOMIC_TEMPLATE_MAX_OBJS 16
+#define ATOMIC_TEMPLATE_MAX_PROPS 128
+
+struct atomic_template {
+    uint32_t objs[ATOMIC_TEMPLATE_MAX_OBJS];
+    uint32_t count_props[ATOMIC_TEMPLATE_MAX_OBJS];
+    uint32_t count_objs;
+    uint32_t props[ATOMIC_TEMPLATE_MAX_PROPS];
+    uint64_t values[ATOMIC_TEMPLATE_MAX_PROPS];
+    uint32_t count;
+};
+
+void atomic_template_init(struct atomic_template *t);
+/* returns the slot of the value to patch, or -1 */
+int atomic_template_add(struct atomic_template *t, uint32_t obj_id,
+    uint32_t prop_id, uint64_t value);
+int atomic_template_commit(int fd, const struct atomic_template *t,
+    uint32_t flags, void *user_data);
+/* drop the properties added after the first count, for one-off additions */
+void atomic_template_truncate(struct atomic_template *t, uint32_t count);
+
+static inline void atomic_template_set(struct atomic_template *t, int slot, uint64_t value)
+{
+    t->values[slot] = value;
+}
+
+static inline int atomic_template_add_plane(struct atomic_template *t, const struct plane *obj,
+    enum plane_prop prop, uint64_t value)
+{
+    return atomic_template_add(t, obj->plane->plane_id, obj->prop_ids[prop], value);
+}
+
+static inline int atomic_template_add_crtc(struct atomic_template *t, const struct crtc *obj,
+    enum crtc_prop prop, uint64_t value)
+{
+    return atomic_template_add(t, obj->crtc->crtc_id, obj->prop_ids[prop], value);
+}
+
+static inline int atomic_template_add_connector(struct atomic_template *t,
+    const struct connector *obj, enum connector_prop prop, uint64_t value)
+{
+    return atomic_template_add(t, obj->connector->connector_id, obj->prop_ids[prop], value);
+}
+
+#endif /* DRM_ATOMIC_H */
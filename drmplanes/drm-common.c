@@ -1,9 +1,12 @@
 #include "drm-common.h"
+#include "kms-snapshot.h"
+#include "startup-profile.h"
 
 #include <stdio.h>
 #include <sys/types.h>
 #include <sys/stat.h>
 #include <fcntl.h>
+#include <unistd.h>
 #include <string.h>
 #include <errno.h>
 #include <ctype.h>
@@ -51,12 +54,30 @@ uint32_t find_crtc_for_connector(int fd, const drmModeRes *resources,
     return -1;
 }
 
-int init_drm(struct drm *drm, char *device_path, char *mode_str)
+static int choose_mode(struct drm *drm, const drmModeConnector *connector, char *mode_str)
 {
-    drmModeRes *resources;
-    drmModeConnector *connector = NULL;
-    drmModeEncoder *encoder = NULL;
-    int i, area;
+    int preferred_width = 0;
+    int preferred_height = 0;
+
+    if (mode_str && !parse_resolution(mode_str, &preferred_width, &preferred_height)) {
+        printf("failed to parse mode_str: %s\n", mode_str);
+        return -1;
+    }
+
+    drm->mode = kms_choose_mode(connector, preferred_width, preferred_height);
+    if (!drm->mode) {
+        printf("could not find mode!\n");
+        return -1;
+    }
+
+    return 0;
+}
+
+int init_drm(struct drm *drm, char *device_path, char *mode_str, bool atomic)
+{
+    const struct kms_snapshot *snapshot;
+    int preferred_width = 0;
+    int preferred_height = 0;
 
     drm->fd = open(device_path, O_RDWR);
 
@@ -65,96 +86,211 @@ int init_drm(struct drm *drm, char *device_path, char *mode_str)
         return -1;
     }
 
+    if (mode_str && !parse_resolution(mode_str, &preferred_width, &preferred_height)) {
+        printf("failed to parse mode_str: %s\n", mode_str);
+        return -1;
+    }
+
+    /* the kernel lists the atomic properties only to clients that asked for them */
+    if (atomic && (drmSetClientCap(drm->fd, DRM_CLIENT_CAP_UNIVERSAL_PLANES, 1) ||
+            drmSetClientCap(drm->fd, DRM_CLIENT_CAP_ATOMIC, 1))) {
+        printf("no atomic modesetting support: %s\n", strerror(errno));
+        return -1;
+    }
+
+    /* one probe pass, the atomic helpers read their properties from it too */
+    snapshot = kms_snapshot_init(drm->fd, atomic);
+    if (!snapshot)
+        return -1;
+
+    return kms_snapshot_pick_output(snapshot, preferred_width, preferred_height,
+        &drm->connector_id, &drm->crtc_id, &drm->mode);
+}
+
+static bool connector_can_use_crtc(int fd, const drmModeRes *resources,
+    const drmModeConnector *connector, uint32_t crtc_id)
+{
+    bool found = false;
+    int i, j;
+
+    for (i = 0; i < connector->count_encoders && !found; i++) {
+        drmModeEncoder *encoder = drmModeGetEncoder(fd, connector->encoders[i]);
+
+        if (!encoder)
+            continue;
+        for (j = 0; j < resources->count_crtcs; j++) {
+            if (resources->crtcs[j] == crtc_id && (encoder->possible_crtcs & (1 << j)))
+                found = true;
+        }
+        drmModeFreeEncoder(encoder);
+    }
+
+    return found;
+}
+
+/*
+ * Probe again after a hotplug event. Keeps drm->connector_id if it is still
+ * connected, else takes the first connected connector drm->crtc_id can
+ * drive, and picks its mode again. Returns 1 if connected, 0 if nothing is.
+ * *owner is the connector drm->mode points into, the old one is freed.
+ */
+int reprobe_drm(struct drm *drm, char *mode_str, drmModeConnector **owner)
+{
+    drmModeRes *resources;
+    drmModeConnector *connector = NULL;
+    drmModeModeInfo *mode = drm->mode;
+    int i;
+
     resources = drmModeGetResources(drm->fd);
     if (!resources) {
         printf("drmModeGetResources failed: %s\n", strerror(errno));
         return -1;
     }
 
-    /* find a connected connector: */
-    for (i = 0; i < resources->count_connectors; i++) {
-        connector = drmModeGetConnector(drm->fd, resources->connectors[i]);
-        if (connector->connection == DRM_MODE_CONNECTED) {
-            /* it's connected, let's use this! */
-            break;
-        }
+    connector = drmModeGetConnector(drm->fd, drm->connector_id);
+    if (connector && connector->connection != DRM_MODE_CONNECTED) {
         drmModeFreeConnector(connector);
         connector = NULL;
     }
 
-    if (!connector) {
-        /* we could be fancy and listen for hotplug events and wait for
-         * a connector..
-         */
-        printf("no connected connector!\n");
-        return -1;
+    for (i = 0; i < resources->count_connectors && !connector; i++) {
+        connector = drmModeGetConnector(drm->fd, resources->connectors[i]);
+        if (connector && (connector->connection != DRM_MODE_CONNECTED ||
+                !connector_can_use_crtc(drm->fd, resources, connector, drm->crtc_id))) {
+            drmModeFreeConnector(connector);
+            connector = NULL;
+        }
     }
 
-    /* find prefered mode or the highest resolution mode: */
-    for (i = 0, area = 0; i < connector->count_modes; i++) {
-        drmModeModeInfo *current_mode = &connector->modes[i];
+    drmModeFreeResources(resources);
 
-        if (current_mode->type & DRM_MODE_TYPE_PREFERRED) {
-            drm->mode = current_mode;
-        }
+    if (!connector)
+        return 0;
 
-        int current_area = current_mode->hdisplay * current_mode->vdisplay;
-        if (current_area > area) {
-            drm->mode = current_mode;
-            area = current_area;
-        }
+    if (choose_mode(drm, connector, mode_str)) {
+        drm->mode = mode;
+        drmModeFreeConnector(connector);
+        return -1;
     }
 
-    if (mode_str) {
-        int preferred_width;
-        int preferred_height;
+    drm->connector_id = connector->connector_id;
+    if (*owner)
+        drmModeFreeConnector(*owner);
+    *owner = connector;
+    return 1;
+}
 
-        if (!parse_resolution(mode_str, &preferred_width, &preferred_height)) {
-            printf("failed to parse mode_str: %s\n", mode_str);
-            return -1;
+/*
+ * A CRTC no other output has taken, the one already driving the connector
+ * if possible. used_crtcs is a bitmask of CRTC indices.
+ */
+static uint32_t find_free_crtc_for_connector(int fd, const drmModeRes *resources,
+    const drmModeConnector *connector, uint32_t *used_crtcs)
+{
+    drmModeEncoder *encoder;
+    uint32_t crtc_id = 0;
+    int i, j;
+
+    if (connector->encoder_id) {
+        encoder = drmModeGetEncoder(fd, connector->encoder_id);
+        if (encoder) {
+            for (j = 0; j < resources->count_crtcs; j++) {
+                if (resources->crtcs[j] == encoder->crtc_id && !(*used_crtcs & (1 << j))) {
+                    *used_crtcs |= 1 << j;
+                    crtc_id = encoder->crtc_id;
+                    break;
+                }
+            }
+            drmModeFreeEncoder(encoder);
+            if (crtc_id)
+                return crtc_id;
         }
+    }
 
-        for (i = 0; i < connector->count_modes; i++) {
-            drmModeModeInfo *current_mode = &connector->modes[i];
+    for (i = 0; i < connector->count_encoders; i++) {
+        encoder = drmModeGetEncoder(fd, connector->encoders[i]);
+        if (!encoder)
+            continue;
 
-            if (preferred_width == current_mode->hdisplay &&
-                preferred_height == current_mode->vdisplay) {
-                printf("override matched mode for %dx%d\n", preferred_width, preferred_height);
-                drm->mode = current_mode;
+        for (j = 0; j < resources->count_crtcs; j++) {
+            if ((encoder->possible_crtcs & (1 << j)) && !(*used_crtcs & (1 << j))) {
+                *used_crtcs |= 1 << j;
+                crtc_id = resources->crtcs[j];
                 break;
             }
         }
+        drmModeFreeEncoder(encoder);
+        if (crtc_id)
+            return crtc_id;
     }
 
-    if (!drm->mode) {
-        printf("could not find mode!\n");
+    return 0;
+}
+
+/*
+ * Like init_drm, but for every connected connector, each with a CRTC of
+ * its own. The outputs share one fd. Returns the number of outputs.
+ */
+int init_drm_outputs(struct drm *outputs, int max_outputs, char *device_path, char *mode_str)
+{
+    drmModeRes *resources;
+    drmModeConnector *connector;
+    uint32_t used_crtcs = 0;
+    int fd, i, count = 0;
+
+    fd = open(device_path, O_RDWR);
+    if (fd < 0) {
+        printf("could not open drm device\n");
         return -1;
     }
 
-    /* find encoder: */
-    for (i = 0; i < resources->count_encoders; i++) {
-        encoder = drmModeGetEncoder(drm->fd, resources->encoders[i]);
-        if (encoder->encoder_id == connector->encoder_id)
-            break;
-        drmModeFreeEncoder(encoder);
-        encoder = NULL;
+    resources = drmModeGetResources(fd);
+    if (!resources) {
+        printf("drmModeGetResources failed: %s\n", strerror(errno));
+        close(fd);
+        return -1;
     }
 
-    if (encoder) {
-        drm->crtc_id = encoder->crtc_id;
-    } else {
-        uint32_t crtc_id = find_crtc_for_connector(drm->fd, resources, connector);
-        if (crtc_id == 0) {
-            printf("no crtc found!\n");
-            return -1;
+    for (i = 0; i < resources->count_connectors && count < max_outputs; i++) {
+        struct drm *drm = &outputs[count];
+
+        connector = drmModeGetConnector(fd, resources->connectors[i]);
+        if (!connector)
+            continue;
+        if (connector->connection != DRM_MODE_CONNECTED) {
+            drmModeFreeConnector(connector);
+            continue;
+        }
+
+        memset(drm, 0, sizeof(*drm));
+        drm->fd = fd;
+
+        if (choose_mode(drm, connector, mode_str)) {
+            printf("connector %u skipped\n", connector->connector_id);
+            drmModeFreeConnector(connector);
+            continue;
         }
 
-        drm->crtc_id = crtc_id;
+        drm->crtc_id = find_free_crtc_for_connector(fd, resources, connector, &used_crtcs);
+        if (!drm->crtc_id) {
+            printf("no free crtc for connector %u\n", connector->connector_id);
+            drmModeFreeConnector(connector);
+            continue;
+        }
+
+        /* drm->mode points into the connector, so it is kept */
+        drm->connector_id = connector->connector_id;
+        count++;
     }
 
-    drm->connector_id = connector->connector_id;
+    drmModeFreeResources(resources);
 
-    return 0;
+    if (!count) {
+        printf("no connected connector!\n");
+        close(fd);
+    }
+
+    return count;
 }
 
 bool parse_resolution(char* resolution, int *w, int *h)
@@ -183,36 +319,79 @@ bool parse_resolution(char* resolution, int *w, int *h)
     return true;
 }
 
+struct gbm_surface *create_gbm_surface_with_modifier(struct gbm_device *dev, int w, int h,
+    uint32_t format, uint64_t modifier)
+{
+    struct gbm_surface *surface;
+
+    surface = gbm_surface_create_with_modifiers(dev, w, h, format, &modifier, 1);
+    if (!surface && modifier == DRM_FORMAT_MOD_LINEAR)
+        surface = gbm_surface_create(dev, w, h, format,
+            GBM_BO_USE_SCANOUT | GBM_BO_USE_RENDERING);
+
+    return surface;
+}
+
+struct gbm_surface *create_gbm_surface(struct gbm_device *dev, int w, int h, uint32_t format)
+{
+    return create_gbm_surface_with_modifier(dev, w, h, format, DRM_FORMAT_MOD_LINEAR);
+}
+
+int egl_query_modifiers(struct gbm_device *dev, uint32_t format, uint64_t *modifiers, int max_modifiers)
+{
+    PFNEGLGETPLATFORMDISPLAYEXTPROC get_platform_display;
+    PFNEGLQUERYDMABUFMODIFIERSEXTPROC query_modifiers;
+    EGLBoolean external_only[max_modifiers];
+    EGLuint64KHR mods[max_modifiers];
+    EGLDisplay display;
+    const char *exts;
+    EGLint count = 0;
+    int i, n = 0;
+
+    get_platform_display = (void *) eglGetProcAddress("eglGetPlatformDisplayEXT");
+    query_modifiers = (void *) eglGetProcAddress("eglQueryDmaBufModifiersEXT");
+    if (!get_platform_display || !query_modifiers)
+        return -1;
+
+    display = get_platform_display(EGL_PLATFORM_GBM_KHR, dev, NULL);
+    if (!eglInitialize(display, NULL, NULL))
+        return -1;
+
+    exts = eglQueryString(display, EGL_EXTENSIONS);
+    if (!exts || !strstr(exts, "EGL_EXT_image_dma_buf_import_modifiers"))
+        return -1;
+
+    if (!query_modifiers(display, format, max_modifiers, mods, external_only, &count))
+        return -1;
+
+    /* external_only ones can only be sampled, not rendered to */
+    for (i = 0; i < count; i++) {
+        if (!external_only[i])
+            modifiers[n++] = mods[i];
+    }
+
+    return n;
+}
+
 int init_gbm(struct gbm *gbm, int fd, int p_w, int p_h, int o_w, int o_h, uint32_t format)
 {
     printf("init_gbm: primary: %dx%d overlay: %dx%d\n", p_w, p_h, o_w, o_h);
 
-    gbm->dev = gbm_create_device(fd);
-
-    uint64_t modifier = DRM_FORMAT_MOD_LINEAR;
+    if (!gbm->dev)
+        gbm->dev = gbm_create_device(fd);
 
-    gbm->surface1 = gbm_surface_create_with_modifiers(gbm->dev, p_w, p_h,
-        format, &modifier, 1);
-    LOG("gbm->surface1 created by gbm_surface_create_with_modifiers\n");
+    gbm->surface1 = create_gbm_surface_with_modifier(gbm->dev, p_w, p_h, format, gbm->modifier1);
+    LOG_ARGS("gbm->surface1 created with modifier 0x%llx\n", (unsigned long long)gbm->modifier1);
     if (!gbm->surface1) {
-        gbm->surface1 = gbm_surface_create(gbm->dev, p_w, p_h, format,
-            GBM_BO_USE_SCANOUT | GBM_BO_USE_RENDERING);
-        if (!gbm->surface1) {
-            printf("failed to create gbm surface1\n");
-            return -1;
-        }
+        printf("failed to create gbm surface1\n");
+        return -1;
     }
 
-    gbm->surface2 = gbm_surface_create_with_modifiers(gbm->dev, o_w, o_h,
-        format, &modifier, 1);
-    LOG("gbm->surface2 created by gbm_surface_create_with_modifiers\n");
+    gbm->surface2 = create_gbm_surface_with_modifier(gbm->dev, o_w, o_h, format, gbm->modifier2);
+    LOG_ARGS("gbm->surface2 created with modifier 0x%llx\n", (unsigned long long)gbm->modifier2);
     if (!gbm->surface2) {
-        gbm->surface2 = gbm_surface_create(gbm->dev, o_w, o_h, format,
-            GBM_BO_USE_SCANOUT | GBM_BO_USE_RENDERING);
-        if (!gbm->surface2) {
-            printf("failed to create gbm surface2\n");
-            return -1;
-        }
+        printf("failed to create gbm surface2\n");
+        return -1;
     }
     return 0;
 }
@@ -321,6 +500,8 @@ int init_egl(struct egl *egl, const struct gbm *gbm, uint32_t format)
         EGL_NONE
     };
 
+    startup_profile_begin("init_egl");
+
     PFNEGLGETPLATFORMDISPLAYEXTPROC get_platform_display = NULL;
     get_platform_display =
             (void *) eglGetProcAddress("eglGetPlatformDisplayEXT");
@@ -345,11 +526,13 @@ int init_egl(struct egl *egl, const struct gbm *gbm, uint32_t format)
         return -1;
     }
 
+    startup_profile_begin("egl config");
     if (!egl_choose_config(egl->display, config_attribs, format,
             &egl->config)) {
         printf("failed to choose config\n");
         return -1;
     }
+    startup_profile_end("egl config");
 
     egl->context = eglCreateContext(egl->display, egl->config,
         EGL_NO_CONTEXT, context_attribs);
@@ -364,21 +547,30 @@ int init_egl(struct egl *egl, const struct gbm *gbm, uint32_t format)
         return -1;
     }
 
-    egl->surface2 = eglCreateWindowSurface(egl->display, egl->config, (EGLNativeWindowType)gbm->surface2, NULL);
-    if (egl->surface2 == EGL_NO_SURFACE) {
-        printf("failed to create egl surface 2\n");
-        return -1;
+    /* a single plane client has no second surface */
+    egl->surface2 = EGL_NO_SURFACE;
+    if (gbm->surface2) {
+        egl->surface2 = eglCreateWindowSurface(egl->display, egl->config, (EGLNativeWindowType)gbm->surface2, NULL);
+        if (egl->surface2 == EGL_NO_SURFACE) {
+            printf("failed to create egl surface 2\n");
+            return -1;
+        }
     }
 
     /* connect the context to the surface */
+    startup_profile_begin("priming swaps");
     eglMakeCurrent(egl->display, egl->surface1, egl->surface1, egl->context);
     eglSwapBuffers(egl->display, egl->surface1);
 
-    eglMakeCurrent(egl->display, egl->surface2, egl->surface2, egl->context);
-    eglSwapBuffers(egl->display, egl->surface2);
+    if (egl->surface2 != EGL_NO_SURFACE) {
+        eglMakeCurrent(egl->display, egl->surface2, egl->surface2, egl->context);
+        eglSwapBuffers(egl->display, egl->surface2);
+    }
+    startup_profile_end("priming swaps");
 
     printf("GL Extensions: \"%s\"\n", glGetString(GL_EXTENSIONS));
 
+    startup_profile_end("init_egl");
     return 0;
 }
 
@@ -399,8 +591,11 @@ drm_fb_destroy_callback(struct gbm_bo *bo, void *data)
 struct drm_fb * drm_fb_get_from_bo(int fd, struct gbm_bo *bo)
 {
     struct drm_fb *fb = gbm_bo_get_user_data(bo);
-    uint32_t width, height, stride, handle, format;
-    int ret;
+    uint32_t width, height, format;
+    uint32_t handles[4] = { 0 }, strides[4] = { 0 }, offsets[4] = { 0 };
+    uint64_t modifiers[4] = { 0 };
+    uint64_t modifier, has_modifiers = 0;
+    int i, planes, ret;
 
     if (fb)
         return fb;
@@ -411,17 +606,29 @@ struct drm_fb * drm_fb_get_from_bo(int fd, struct gbm_bo *bo)
 
     width = gbm_bo_get_width(bo);
     height = gbm_bo_get_height(bo);
-    stride = gbm_bo_get_stride(bo);
-    handle = gbm_bo_get_handle(bo).u32;
     format = gbm_bo_get_format(bo);
-
-    uint32_t handles[4] = { gbm_bo_get_handle(bo).u32 };
-    uint32_t strides[4] = { gbm_bo_get_stride(bo) };
-    uint32_t offsets[4] = { 0 };
-
-    ret = drmModeAddFB2(fd, width, height, format,
-        handles, strides, offsets, &fb->fb_id, 0);
-    LOG_ARGS("drmModeAddFB2(%d, %d) fb_id: %d\n", width, height, fb->fb_id);
+    modifier = gbm_bo_get_modifier(bo);
+    planes = gbm_bo_get_plane_count(bo);
+
+    /* compressed or tiled layouts may carry an aux plane next to the color one */
+    for (i = 0; i < planes && i < 4; i++) {
+        handles[i] = gbm_bo_get_handle_for_plane(bo, i).u32;
+        strides[i] = gbm_bo_get_stride_for_plane(bo, i);
+        offsets[i] = gbm_bo_get_offset(bo, i);
+        modifiers[i] = modifier;
+    }
+
+    drmGetCap(fd, DRM_CAP_ADDFB2_MODIFIERS, &has_modifiers);
+    startup_profile_begin("AddFB2");
+    if (has_modifiers && modifier != DRM_FORMAT_MOD_INVALID)
+        ret = drmModeAddFB2WithModifiers(fd, width, height, format,
+            handles, strides, offsets, modifiers, &fb->fb_id, DRM_MODE_FB_MODIFIERS);
+    else
+        ret = drmModeAddFB2(fd, width, height, format,
+            handles, strides, offsets, &fb->fb_id, 0);
+    startup_profile_end("AddFB2");
+    LOG_ARGS("drmModeAddFB2(%d, %d, modifier 0x%llx) fb_id: %d\n", width, height,
+        (unsigned long long)modifier, fb->fb_id);
 
     if (ret) {
         printf("failed to create fb: %s\n", strerror(errno));
@@ -511,7 +718,9 @@ bool read_png_from_file(const char* filename, png_buffer_handle *out_png_buffer_
     }
     unsigned int sig_read = 0;
     png_buffer_handle png_buffer_handle = NULL;
+    startup_profile_begin("read_png");
     bool ret = read_png(fp, sig_read, &png_buffer_handle);
+    startup_profile_end("read_png");
     if (!ret) {
         printf("failed to read_png %s\n", filename);
         fclose(fp);
@@ -596,6 +805,7 @@ int create_program(const char *vs_src, const char *fs_src)
 	GLuint vertex_shader, fragment_shader, program;
 	GLint ret;
 
+	startup_profile_begin("shader compile");
 	vertex_shader = glCreateShader(GL_VERTEX_SHADER);
 
 	glShaderSource(vertex_shader, 1, &vs_src, NULL);
@@ -639,6 +849,8 @@ int create_program(const char *vs_src, const char *fs_src)
 		return -1;
 	}
 
+	startup_profile_end("shader compile");
+
 	program = glCreateProgram();
 
 	glAttachShader(program, vertex_shader);
@@ -651,9 +863,11 @@ int link_program(unsigned program)
 {
 	GLint ret;
 
+	startup_profile_begin("shader link");
 	glLinkProgram(program);
 
 	glGetProgramiv(program, GL_LINK_STATUS, &ret);
+	startup_profile_end("shader link");
 	if (!ret) {
 		char *log;
 
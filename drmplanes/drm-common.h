@@ -29,6 +29,7 @@ struct drm {
 
 	/* only used for atomic: */
     uint32_t plane_id;
+    uint32_t mode_blob_id;
 	struct plane *primary_plane;
 	struct plane *overlay_plane;
 	struct crtc *crtc;
@@ -39,6 +40,8 @@ struct gbm {
     struct gbm_device *dev;
     struct gbm_surface *surface1;
     struct gbm_surface *surface2;
+    uint64_t modifier1;         /* for init_gbm, 0: DRM_FORMAT_MOD_LINEAR */
+    uint64_t modifier2;
 };
 
 enum type {
@@ -71,8 +74,15 @@ struct glcolor {
 
 uint32_t find_crtc_for_encoder(const drmModeRes *resources, const drmModeEncoder *encoder);
 uint32_t find_crtc_for_connector(int fd, const drmModeRes *resources, const drmModeConnector *connector);
-int init_drm(struct drm *drm, char *device_path, char *mode_str);
+/* atomic: set the universal planes and atomic client caps before the KMS probe */
+int init_drm(struct drm *drm, char *device_path, char *mode_str, bool atomic);
+int reprobe_drm(struct drm *drm, char *mode_str, drmModeConnector **owner);
+int init_drm_outputs(struct drm *outputs, int max_outputs, char *device_path, char *mode_str);
 bool parse_resolution(char* resolution, int *w, int *h);
+struct gbm_surface *create_gbm_surface(struct gbm_device *dev, int w, int h, uint32_t format);
+struct gbm_surface *create_gbm_surface_with_modifier(struct gbm_device *dev, int w, int h,
+    uint32_t format, uint64_t modifier);
+int egl_query_modifiers(struct gbm_device *dev, uint32_t format, uint64_t *modifiers, int max_modifiers);
 int init_gbm(struct gbm *gbm, int fd, int p_w, int p_h, int o_w, int o_h, uint32_t format);
 
 void log_message_with_args(const char *msg, ...);
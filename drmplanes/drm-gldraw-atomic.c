@@ -28,6 +28,15 @@
 #include <EGL/egl.h>
 #include <EGL/eglext.h>
 
+#include "drm-atomic.h"
+#include "dumb-buffer.h"
+#include "frame-scheduler.h"
+#include "kms-snapshot.h"
+#include "resolution-scaler.h"
+#include "tear-oracle.h"
+#include "vblank-timing.h"
+#include "writeback.h"
+
 bool verbose = false;
 
 struct egl {
@@ -35,6 +44,12 @@ struct egl {
     EGLConfig config;
     EGLContext context;
     EGLSurface surface;
+
+    /* EGL_ANDROID_native_fence_sync, NULL when not supported */
+    PFNEGLCREATESYNCKHRPROC eglCreateSyncKHR;
+    PFNEGLDESTROYSYNCKHRPROC eglDestroySyncKHR;
+    PFNEGLWAITSYNCKHRPROC eglWaitSyncKHR;
+    PFNEGLDUPNATIVEFENCEFDANDROIDPROC eglDupNativeFenceFDANDROID;
 };
 
 const static struct egl *egl;
@@ -46,24 +61,6 @@ struct gbm {
 
 static struct gbm gbm;
 
-struct plane {
-    drmModePlane *plane;
-    drmModeObjectProperties *props;
-    drmModePropertyRes **props_info;
-};
-
-struct crtc {
-    drmModeCrtc *crtc;
-    drmModeObjectProperties *props;
-    drmModePropertyRes **props_info;
-};
-
-struct connector {
-    drmModeConnector *connector;
-    drmModeObjectProperties *props;
-    drmModePropertyRes **props_info;
-};
-
 struct drm_fb {
     struct gbm_bo *bo;
     uint32_t fb_id;
@@ -78,6 +75,7 @@ struct drm {
 
 	/* only used for atomic: */
     uint32_t plane_id;
+    uint32_t mode_blob_id;
 	struct plane *primary_plane;
 	struct crtc *crtc;
 	struct connector *connector;
@@ -85,86 +83,28 @@ struct drm {
 
 static struct drm drm;
 
+static struct vblank_timing vblank_timing;
+
+/* -X: commits capture the scanout, the oracle checks it for mixed frames */
+static struct writeback *writeback;
+static struct tear_oracle *tear_oracle;
+
 static char *default_primary_info = "31@1920x1080";
 static char *default_location = "/usr/share/drmplanes";
 static const int default_num_triangles = 1;
 static const int default_wait_flag = 0;
 
 #define WAIT_FLAG_BEFORE_SWAPBUFFERS 1
+#define WAIT_FLAG_NATIVE_FENCE 2
 
 static int default_crtc_width = 3840;
 static int default_crtc_height = 2160;
 
-uint32_t find_crtc_for_encoder(const drmModeRes *resources,
-    const drmModeEncoder *encoder) {
-    int i;
-
-    for (i = 0; i < resources->count_crtcs; i++) {
-        const uint32_t crtc_mask = 1 << i;
-        const uint32_t crtc_id = resources->crtcs[i];
-        if (encoder->possible_crtcs & crtc_mask) {
-            return crtc_id;
-        }
-    }
-
-    /* no match found */
-    return -1;
-}
-
-uint32_t find_crtc_for_connector(int fd, const drmModeRes *resources,
-    const drmModeConnector *connector) {
-    int i;
-
-    for (i = 0; i < connector->count_encoders; i++) {
-        const uint32_t encoder_id = connector->encoders[i];
-        drmModeEncoder *encoder = drmModeGetEncoder(fd, encoder_id);
-
-        if (encoder) {
-            const uint32_t crtc_id = find_crtc_for_encoder(resources, encoder);
-
-            drmModeFreeEncoder(encoder);
-            if (crtc_id != 0) {
-                return crtc_id;
-            }
-        }
-    }
-
-    /* no match found */
-    return -1;
-}
-
 static int init_drm_atomic_plane(uint32_t primary_plane_id) {
     drm.primary_plane = calloc(1, sizeof(*drm.primary_plane));
 
-#define get_plane_resource(plane, type, Type, id) do {        \
-        drm.plane->type = drmModeGet##Type(drm.fd, id); \
-        if (!drm.plane->type) {                         \
-            printf("could not get %s %i: %s\n",         \
-                #type, id, strerror(errno));            \
-            return -1;                                  \
-        }                                               \
-    } while (0)
-
-    get_plane_resource(primary_plane, plane, Plane, primary_plane_id);
-
-#define get_plane_properties(plane, type, TYPE, id) do {                      \
-        uint32_t i;                                                     \
-        drm.plane->props = drmModeObjectGetProperties(drm.fd,           \
-            id, DRM_MODE_OBJECT_##TYPE);                                \
-        if (!drm.plane->props) {                                        \
-            printf("could not get %s %u properties: %s\n",              \
-                #type, id, strerror(errno));                            \
-            return -1;                                                  \
-        }                                                               \
-        drm.plane->props_info = calloc(drm.plane->props->count_props,   \
-            sizeof(*drm.plane->props_info));                            \
-        for (i = 0; i < drm.plane->props->count_props; i++) {           \
-            drm.plane->props_info[i] = drmModeGetProperty(drm.fd,       \
-                drm.plane->props->props[i]);                            \
-        }                                                               \
-    } while (0)
-
-    get_plane_properties(primary_plane, plane, PLANE, primary_plane_id);
+    if (init_atomic_plane(drm.fd, primary_plane_id, drm.primary_plane))
+        return -1;
 
     return 0;
 }
@@ -195,10 +135,9 @@ bool parse_resolution(char* resolution, int *w, int *h) {
 }
 
 int init_drm(struct drm *drm, char *device_path, char *mode_str) {
-    drmModeRes *resources;
-    drmModeConnector *connector = NULL;
-    drmModeEncoder *encoder = NULL;
-    int i, area;
+    const struct kms_snapshot *snapshot;
+    int preferred_width = 0;
+    int preferred_height = 0;
 
     drm->fd = open(device_path, O_RDWR);
 
@@ -207,96 +146,24 @@ int init_drm(struct drm *drm, char *device_path, char *mode_str) {
         return -1;
     }
 
-    resources = drmModeGetResources(drm->fd);
-    if (!resources) {
-        printf("drmModeGetResources failed: %s\n", strerror(errno));
+    if (mode_str && !parse_resolution(mode_str, &preferred_width, &preferred_height)) {
+        printf("failed to parse mode_str: %s\n", mode_str);
         return -1;
     }
 
-    /* find a connected connector: */
-    for (i = 0; i < resources->count_connectors; i++) {
-        connector = drmModeGetConnector(drm->fd, resources->connectors[i]);
-        if (connector->connection == DRM_MODE_CONNECTED) {
-            /* it's connected, let's use this! */
-            break;
-        }
-        drmModeFreeConnector(connector);
-        connector = NULL;
-    }
-
-    if (!connector) {
-        /* we could be fancy and listen for hotplug events and wait for
-         * a connector..
-         */
-        printf("no connected connector!\n");
+    /* before the probe, the kernel lists the atomic properties only to atomic clients */
+    if (drmSetClientCap(drm->fd, DRM_CLIENT_CAP_UNIVERSAL_PLANES, 1) ||
+            drmSetClientCap(drm->fd, DRM_CLIENT_CAP_ATOMIC, 1)) {
+        printf("no atomic modesetting support: %s\n", strerror(errno));
         return -1;
     }
 
-    /* find prefered mode or the highest resolution mode: */
-    for (i = 0, area = 0; i < connector->count_modes; i++) {
-        drmModeModeInfo *current_mode = &connector->modes[i];
-
-        if (current_mode->type & DRM_MODE_TYPE_PREFERRED) {
-            drm->mode = current_mode;
-        }
-
-        int current_area = current_mode->hdisplay * current_mode->vdisplay;
-        if (current_area > area) {
-            drm->mode = current_mode;
-            area = current_area;
-        }
-    }
-
-    if (mode_str) {
-        int preferred_width;
-        int preferred_height;
-
-        if (!parse_resolution(mode_str, &preferred_width, &preferred_height)) {
-            printf("failed to parse mode_str: %s\n", mode_str);
-            return -1;
-        }
-
-        for (i = 0; i < connector->count_modes; i++) {
-            drmModeModeInfo *current_mode = &connector->modes[i];
-
-            if (preferred_width == current_mode->hdisplay &&
-                preferred_height == current_mode->vdisplay) {
-                printf("override matched mode for %dx%d\n", preferred_width, preferred_height);
-                drm->mode = current_mode;
-                break;
-            }
-        }
-    }
-
-    if (!drm->mode) {
-        printf("could not find mode!\n");
+    snapshot = kms_snapshot_init(drm->fd, true);
+    if (!snapshot)
         return -1;
-    }
-
-    /* find encoder: */
-    for (i = 0; i < resources->count_encoders; i++) {
-        encoder = drmModeGetEncoder(drm->fd, resources->encoders[i]);
-        if (encoder->encoder_id == connector->encoder_id)
-            break;
-        drmModeFreeEncoder(encoder);
-        encoder = NULL;
-    }
-
-    if (encoder) {
-        drm->crtc_id = encoder->crtc_id;
-    } else {
-        uint32_t crtc_id = find_crtc_for_connector(drm->fd, resources, connector);
-        if (crtc_id == 0) {
-            printf("no crtc found!\n");
-            return -1;
-        }
-
-        drm->crtc_id = crtc_id;
-    }
-
-    drm->connector_id = connector->connector_id;
 
-    return 0;
+    return kms_snapshot_pick_output(snapshot, preferred_width, preferred_height,
+        &drm->connector_id, &drm->crtc_id, &drm->mode);
 }
 
 static int init_drm_atomic(char *device_path, char *mode_str) {
@@ -304,70 +171,40 @@ static int init_drm_atomic(char *device_path, char *mode_str) {
     if (ret)
         return ret;
 
-    ret = drmSetClientCap(drm.fd, DRM_CLIENT_CAP_ATOMIC, 1);
-    if (ret) {
-        printf("no atomic modesetting support: %s\n", strerror(errno));
-        return ret;
-    }
-
     drm.crtc = calloc(1, sizeof(*drm.crtc));
     drm.connector = calloc(1, sizeof(*drm.connector));
 
-#define get_resource(type, Type, id) do {               \
-        drm.type->type = drmModeGet##Type(drm.fd, id);  \
-        if (!drm.type->type) {                          \
-            printf("could not get %s %i: %s\n",         \
-                #type, id, strerror(errno));            \
-            return -1;                                  \
-        }                                               \
-    } while (0)
-
-    get_resource(connector, Connector, drm.connector_id);
-    get_resource(crtc, Crtc, drm.crtc_id);
-
-#define get_properties(type, TYPE, id) do {                         \
-        uint32_t i;                                                 \
-        drm.type->props = drmModeObjectGetProperties(drm.fd,        \
-            id, DRM_MODE_OBJECT_##TYPE);                            \
-        if (!drm.type->props) {                                     \
-            printf("could not get %s %u properties: %s\n",          \
-                #type, id, strerror(errno));                        \
-            return -1;                                              \
-        }                                                           \
-        drm.type->props_info = calloc(drm.type->props->count_props, \
-            sizeof(*drm.type->props_info));                         \
-        for (i = 0; i < drm.type->props->count_props; i++) {        \
-            drm.type->props_info[i] = drmModeGetProperty(drm.fd,    \
-                drm.type->props->props[i]);                         \
-        }                                                           \
-    } while (0)
-
-    /*
-     * get_properties(plane, PLANE, plane_id);
-     */
-    get_properties(crtc, CRTC, drm.crtc_id);
-    get_properties(connector, CONNECTOR, drm.connector_id);
+    if (init_atomic_connector(drm.fd, drm.connector_id, drm.connector))
+        return -1;
+
+    if (init_atomic_crtc(drm.fd, drm.crtc_id, drm.crtc))
+        return -1;
 
     return 0;
 }
 
+static struct gbm_surface *create_gbm_surface(struct gbm_device *dev, int w, int h, uint32_t format) {
+    uint64_t modifier = DRM_FORMAT_MOD_LINEAR;
+    struct gbm_surface *surface;
+
+    surface = gbm_surface_create_with_modifiers(dev, w, h, format, &modifier, 1);
+    printf("gbm surface %dx%d created by gbm_surface_create_with_modifiers\n", w, h);
+    if (!surface)
+        surface = gbm_surface_create(dev, w, h, format,
+            GBM_BO_USE_SCANOUT | GBM_BO_USE_RENDERING);
+
+    return surface;
+}
+
 int init_gbm(struct gbm *gbm, int fd, int p_w, int p_h, uint32_t format) {
     printf("init_gbm: primary: %dx%d", p_w, p_h);
 
     gbm->dev = gbm_create_device(fd);
 
-    uint64_t modifier = DRM_FORMAT_MOD_LINEAR;
-
-    gbm->surface = gbm_surface_create_with_modifiers(gbm->dev, p_w, p_h,
-        format, &modifier, 1);
-    printf("gbm->surface created by gbm_surface_create_with_modifiers\n");
+    gbm->surface = create_gbm_surface(gbm->dev, p_w, p_h, format);
     if (!gbm->surface) {
-        gbm->surface = gbm_surface_create(gbm->dev, p_w, p_h, format,
-            GBM_BO_USE_SCANOUT | GBM_BO_USE_RENDERING);
-        if (!gbm->surface) {
-            printf("failed to create gbm surface\n");
-            return -1;
-        }
+        printf("failed to create gbm surface\n");
+        return -1;
     }
 
     return 0;
@@ -479,6 +316,13 @@ int init_egl(struct egl *egl, const struct gbm *gbm, uint32_t format) {
     printf("EGL Vendor \"%s\"\n", eglQueryString(egl->display, EGL_VENDOR));
     printf("EGL Extensions \"%s\"\n", eglQueryString(egl->display, EGL_EXTENSIONS));
 
+    if (strstr(eglQueryString(egl->display, EGL_EXTENSIONS), "EGL_ANDROID_native_fence_sync")) {
+        egl->eglCreateSyncKHR = (void *) eglGetProcAddress("eglCreateSyncKHR");
+        egl->eglDestroySyncKHR = (void *) eglGetProcAddress("eglDestroySyncKHR");
+        egl->eglWaitSyncKHR = (void *) eglGetProcAddress("eglWaitSyncKHR");
+        egl->eglDupNativeFenceFDANDROID = (void *) eglGetProcAddress("eglDupNativeFenceFDANDROID");
+    }
+
     if (!eglBindAPI(EGL_OPENGL_ES_API)) {
         printf("failed to bind api EGL_OPENGL_ES_API\n");
         return -1;
@@ -517,116 +361,68 @@ static void print_usage(const char *progname) {
     printf("    -c CRTC resolution to be used drmModeSetPlane for primary plane (default: %dx%d)\n",
         default_crtc_width, default_crtc_height);
     printf("    -v verbose\n");
-    printf("    -w glFinish flag, 0: no glFinish, 1: add glFinish before eglSwapBuffers (default: %d)\n", default_wait_flag);
+    printf("    -w glFinish flag, 0: no glFinish, 1: add glFinish before eglSwapBuffers,\n");
+    printf("       2: explicit sync, GPU fence as IN_FENCE_FD, OUT_FENCE_PTR before reuse (default: %d)\n", default_wait_flag);
     printf("    -t number of triangles for rendering (default: %d)\n", default_num_triangles);
+    printf("    -M mailbox mode, render unthrottled and present the newest frame at each flip\n");
+    printf("    -S start rendering as late as the predicted frame cost plus <margin_us> before\n");
+    printf("       the next vblank allows, report latency and missed vblanks\n");
+    printf("    -A async (tearing) page flips, legacy or atomic, report flips/s and tear line\n");
+    printf("       from the flip event time, or from the commit return where the event falls on\n");
+    printf("       line 0, which drivers that stamp async flips with the last vblank report\n");
+    printf("    -R dynamic resolution, render at one of <levels> in percent of the plane size,\n");
+    printf("       e.g. 100,75,50, picked from the GPU time of the last frames\n");
+    printf("    -U draw with the CPU into dumb buffers, no GBM or EGL, for drivers without a GPU\n");
+    printf("    -X mark every band of a frame with its index, capture the scanout with a\n");
+    printf("       writeback connector and count the frames mixed from more than one frame\n");
     printf("    -D drm device path (default: /dev/dri/card0)\n");
     printf("    -m mode preferred (default: NULL, mode with highest resolution)\n");
     printf("    -f FOURCC format (default: AR24)\n");
     printf("    -l resource location (default: /usr/share/drmplanes)\n");
+    printf("    -K cache file for the KMS objects and properties, reused while still valid\n");
     printf("    -h help\n");
     printf("\n");
     printf("Example:\n");
     printf("    %s -p 31@3840x2160 -v -m 3840x2160 -f AR24 -c 3840x2160 -w 0 -t 1\n", progname);
 }
 
-static int add_connector_property(drmModeAtomicReq *req, uint32_t obj_id,
-                    const char *name, uint64_t value) {
-    struct connector *obj = drm.connector;
-    unsigned int i;
-    int prop_id = 0;
-
-    for (i = 0 ; i < obj->props->count_props ; i++) {
-        if (strcmp(obj->props_info[i]->name, name) == 0) {
-            prop_id = obj->props_info[i]->prop_id;
-            break;
-        }
-    }
-
-    if (prop_id < 0) {
-        printf("no connector property: %s\n", name);
-        return -EINVAL;
-    }
-
-    return drmModeAtomicAddProperty(req, obj_id, prop_id, value);
-}
-
-static int add_crtc_property(drmModeAtomicReq *req, uint32_t obj_id,
-                const char *name, uint64_t value) {
-    struct crtc *obj = drm.crtc;
-    unsigned int i;
-    int prop_id = -1;
-
-    for (i = 0 ; i < obj->props->count_props ; i++) {
-        if (strcmp(obj->props_info[i]->name, name) == 0) {
-            prop_id = obj->props_info[i]->prop_id;
-            break;
-        }
-    }
-
-    if (prop_id < 0) {
-        printf("no crtc property: %s\n", name);
-        return -EINVAL;
-    }
-
-    return drmModeAtomicAddProperty(req, obj_id, prop_id, value);
-}
-
-static int add_plane_property(drmModeAtomicReq *req, uint32_t obj_id,
-    const char *name, uint64_t value) {
-    struct plane *obj = drm.primary_plane;
-    unsigned int i;
-    int prop_id = -1;
-
-    for (i = 0 ; i < obj->props->count_props ; i++) {
-        if (strcmp(obj->props_info[i]->name, name) == 0) {
-            prop_id = obj->props_info[i]->prop_id;
-            break;
-        }
-    }
-
-    if (prop_id < 0) {
-        printf("no plane property: %s\n", name);
-        return -EINVAL;
-    }
-
-    return drmModeAtomicAddProperty(req, obj_id, prop_id, value);
-}
-
-static void drm_atomic_set_plane_properties(drmModeAtomicReq *req, uint32_t plane_id,
+static void drm_atomic_set_plane_properties(drmModeAtomicReq *req, const struct plane *plane,
     uint32_t crtc_id, uint32_t fb_id,
     uint32_t src_width, uint32_t src_height,
     uint32_t crtc_width, uint32_t crtc_height,
     uint32_t crtc_x, uint32_t crtc_y) {
-    add_plane_property(req, plane_id, "FB_ID", fb_id);
-    add_plane_property(req, plane_id, "CRTC_ID", crtc_id);
-    add_plane_property(req, plane_id, "SRC_X", 0);
-    add_plane_property(req, plane_id, "SRC_Y", 0);
-    add_plane_property(req, plane_id, "SRC_W", src_width << 16);
-    add_plane_property(req, plane_id, "SRC_H", src_height << 16);
-    add_plane_property(req, plane_id, "CRTC_X", crtc_x);
-    add_plane_property(req, plane_id, "CRTC_Y", crtc_y);
-    add_plane_property(req, plane_id, "CRTC_W", crtc_width);
-    add_plane_property(req, plane_id, "CRTC_H", crtc_height);
+    add_plane_property(req, plane, PLANE_PROP_FB_ID, fb_id);
+    add_plane_property(req, plane, PLANE_PROP_CRTC_ID, crtc_id);
+    add_plane_property(req, plane, PLANE_PROP_SRC_X, 0);
+    add_plane_property(req, plane, PLANE_PROP_SRC_Y, 0);
+    add_plane_property(req, plane, PLANE_PROP_SRC_W, src_width << 16);
+    add_plane_property(req, plane, PLANE_PROP_SRC_H, src_height << 16);
+    add_plane_property(req, plane, PLANE_PROP_CRTC_X, crtc_x);
+    add_plane_property(req, plane, PLANE_PROP_CRTC_Y, crtc_y);
+    add_plane_property(req, plane, PLANE_PROP_CRTC_W, crtc_width);
+    add_plane_property(req, plane, PLANE_PROP_CRTC_H, crtc_height);
 }
 
 static int drm_atomic_mode_set(drmModeAtomicReq *req, uint32_t flags) {
-    if (flags & DRM_MODE_ATOMIC_ALLOW_MODESET) {
-        uint32_t blob_id;
+    if (!(flags & DRM_MODE_ATOMIC_ALLOW_MODESET))
+        return 0;
 
-        if (add_connector_property(req, drm.connector_id, "CRTC_ID",
-                        drm.crtc_id) < 0)
-                return -1;
+    /* the mode never changes, so a single blob serves every modeset */
+    if (!drm.mode_blob_id &&
+        drmModeCreatePropertyBlob(drm.fd, drm.mode, sizeof(*drm.mode),
+                          &drm.mode_blob_id) != 0)
+        return -1;
 
-        if (drmModeCreatePropertyBlob(drm.fd, drm.mode, sizeof(*drm.mode),
-                          &blob_id) != 0)
-            return -1;
+    if (add_connector_property(req, drm.connector, CONNECTOR_PROP_CRTC_ID,
+                    drm.crtc_id) < 0)
+        return -1;
 
-        if (add_crtc_property(req, drm.crtc_id, "MODE_ID", blob_id) < 0)
-            return -1;
+    if (add_crtc_property(req, drm.crtc, CRTC_PROP_MODE_ID, drm.mode_blob_id) < 0)
+        return -1;
+
+    if (add_crtc_property(req, drm.crtc, CRTC_PROP_ACTIVE, 1) < 0)
+        return -1;
 
-        if (add_crtc_property(req, drm.crtc_id, "ACTIVE", 1) < 0)
-            return -1;
-    }
     return 0;
 }
 
@@ -898,13 +694,84 @@ const struct egl* init_egl_loader(int drm_fd, const struct gbm *gbm, uint32_t fo
 #define MAX_LINUX_INPUT_DEVICES 16
 struct epoll_event g_events[MAX_LINUX_INPUT_DEVICES];
 
+/*
+ * Frames on their way to the screen. The commit of a frame passes this as
+ * page flip user data, the flip event then completes the pending frame.
+ */
+struct present_queue {
+    struct gbm_bo *scanout;         /* on screen */
+    struct gbm_bo *pending;         /* committed, on screen after the flip */
+    struct gbm_bo *next;            /* newest rendered frame, not committed yet */
+    uint64_t pending_render_ns;     /* rendering of the frame started */
+    uint64_t next_render_ns;
+    uint32_t next_frame;            /* frame_idx drawn into next */
+    uint64_t flip_ns;               /* of the last completed flip */
+    bool flip_pending;
+    struct mailbox *mailbox;        /* set: the flip handler commits next right away */
+
+    uint64_t start_ns;
+    uint64_t rendered;
+    uint64_t presented;
+    uint64_t dropped;
+    uint64_t latency_total_ns;
+    uint64_t latency_max_ns;
+};
+
+static void present_queue_flip_done(struct present_queue *queue, uint64_t flip_ns) {
+    uint64_t latency_ns = flip_ns > queue->pending_render_ns ?
+        flip_ns - queue->pending_render_ns : 0;
+
+    queue->latency_total_ns += latency_ns;
+    if (latency_ns > queue->latency_max_ns)
+        queue->latency_max_ns = latency_ns;
+    queue->presented++;
+    queue->flip_ns = flip_ns;
+    queue->flip_pending = false;
+}
+
+static void present_queue_print(const struct present_queue *queue, const char *name) {
+    double elapsed_s = (get_time_ns() - queue->start_ns) / 1e9;
+
+    if (!queue->presented)
+        return;
+
+    printf("%s: rendered %llu (%.2f fps) presented %llu (%.2f fps) dropped %llu, "
+        "render to flip avg %.3f ms max %.3f ms\n", name,
+        (unsigned long long)queue->rendered, queue->rendered / elapsed_s,
+        (unsigned long long)queue->presented, queue->presented / elapsed_s,
+        (unsigned long long)queue->dropped,
+        queue->latency_total_ns / 1e6 / queue->presented, queue->latency_max_ns / 1e6);
+
+    if (writeback)
+        writeback_print(writeback);
+    if (tear_oracle)
+        tear_oracle_print(tear_oracle);
+}
+
+static void mailbox_commit(struct present_queue *queue);
+
 static void pageFlipHandler(int fd, unsigned int sequence, unsigned int tv_sec, unsigned int tv_usec, void *user_data) {
     static long long int flip_recent_time = 0;
     long long int flip_current_time;
+    uint64_t vblanks;
     flip_current_time = (tv_sec) * 1000000 +  tv_usec;
 
+    vblanks = vblank_timing_flip(&vblank_timing, sequence, tv_sec, tv_usec);
+
+    /* flip timestamps are CLOCK_MONOTONIC, same as get_time_ns() */
+    if(user_data) {
+        struct present_queue *queue = user_data;
+
+        present_queue_flip_done(queue, flip_current_time * 1000);
+        /* the newest finished frame still makes the next vblank */
+        if (queue->mailbox)
+            mailbox_commit(queue);
+    }
+
     if(flip_recent_time != 0) {
-        printf("\nThe interval of calling drmHandleEvent %lld ms\n\n", (flip_current_time - flip_recent_time)/1000);
+        printf("\nThe interval of calling drmHandleEvent %.3f ms, vblank %llu (+%llu)\n\n",
+            (flip_current_time - flip_recent_time) / 1000.0,
+            (unsigned long long)vblank_timing.flip.seq, (unsigned long long)vblanks);
     }
     else {
         printf("\ninitial calling drmHandleEvent\n\n");
@@ -912,8 +779,8 @@ static void pageFlipHandler(int fd, unsigned int sequence, unsigned int tv_sec,
     flip_recent_time = flip_current_time;
 }
 
-bool waitForDrm(int epoll_fd) {
-    int nfds = epoll_wait(epoll_fd, g_events, MAX_LINUX_INPUT_DEVICES, -1);
+bool waitForDrm(int epoll_fd, int timeout_ms) {
+    int nfds = epoll_wait(epoll_fd, g_events, MAX_LINUX_INPUT_DEVICES, timeout_ms);
     if(nfds == 0) return false;
     if(nfds < 0) {
         fprintf(stderr, "ERROR[epoll_wait]: ndfs has a negative value\n");
@@ -925,15 +792,32 @@ bool waitForDrm(int epoll_fd) {
 
             drmEventContext drmEvent;
             memset(&drmEvent, 0, sizeof(drmEvent));
-            drmEvent.version = 2;
-            drmEvent.vblank_handler = NULL;
+            drmEvent.version = DRM_EVENT_CONTEXT_VERSION;
+            drmEvent.vblank_handler = vblank_timing_vblank_handler;
             drmEvent.page_flip_handler = pageFlipHandler;
+            drmEvent.sequence_handler = vblank_timing_sequence_handler;
             drmHandleEvent(drm.fd, &drmEvent);
         }
     }
     return true;
 }
 
+/* scissored clears, in GL window coordinates from the bottom */
+static void draw_tear_markers(uint32_t frame_idx) {
+    uint32_t color = tear_oracle_color(frame_idx);
+    int band, x, y, w, h;
+
+    glEnable(GL_SCISSOR_TEST);
+    glClearColor(((color >> 16) & 0xff) / 255.0f, ((color >> 8) & 0xff) / 255.0f,
+        (color & 0xff) / 255.0f, 1.0f);
+    for (band = 0; band < TEAR_ORACLE_BANDS; band++) {
+        tear_oracle_marker(tear_oracle, band, &x, &y, &w, &h);
+        glScissor(x, tear_oracle->src_h - y - h, w, h);
+        glClear(GL_COLOR_BUFFER_BIT);
+    }
+    glDisable(GL_SCISSOR_TEST);
+}
+
 void test_draw_triangles(int frame_idx, int n){
     glUseProgram(program_triangle);
 
@@ -981,6 +865,743 @@ void test_draw_triangles(int frame_idx, int n){
     }
 
     glUseProgram(0);
+
+    if (tear_oracle)
+        draw_tear_markers(frame_idx);
+}
+
+static void present_queue_retire(struct present_queue *queue) {
+    if (queue->flip_pending || !queue->pending)
+        return;
+
+    if (queue->scanout)
+        gbm_surface_release_buffer(gbm.surface, queue->scanout);
+    queue->scanout = queue->pending;
+    queue->pending = NULL;
+}
+
+/* commit the queued frame */
+static int present_queue_commit(struct present_queue *queue, const char *name, uint32_t *flags,
+    int p_w, int p_h, int crtc_width, int crtc_height,
+    struct commit_stats *modeset_stats, struct commit_stats *flip_stats) {
+    struct drm_fb *fb = drm_fb_get_from_bo(drm.fd, queue->next);
+    drmModeAtomicReq *req;
+    uint64_t commit_start, commit_ns;
+    int ret;
+
+    if (!fb)
+        return -1;
+
+    req = drmModeAtomicAlloc();
+    if (!req) {
+        fprintf(stderr, "ERROR[drmModeAtomicAlloc]: failed to alloc\n");
+        return -1;
+    }
+
+    drm_atomic_mode_set(req, *flags);
+    drm_atomic_set_plane_properties(req, drm.primary_plane, drm.crtc_id, fb->fb_id,
+        p_w, p_h, crtc_width, crtc_height, 0, 0);
+    if (writeback)
+        writeback_attach_request(writeback, req, queue->next_frame);
+
+    commit_start = get_time_ns();
+    ret = drmModeAtomicCommit(drm.fd, req, *flags, queue);
+    commit_ns = get_time_ns() - commit_start;
+    drmModeAtomicFree(req);
+    if (writeback)
+        writeback_committed(writeback, NULL, ret, commit_ns);
+
+    if (verbose)
+        printf("drmModeAtomicCommit(%d %x) returns %d(%s)\n", drm.fd, *flags, ret, strerror(-ret));
+
+    if (ret) {
+        fprintf(stderr, "ERROR[drmModeAtomicCommit]: failed to commit\n");
+        return ret;
+    }
+
+    vblank_timing_commit(&vblank_timing);
+
+    if (*flags & DRM_MODE_ATOMIC_ALLOW_MODESET) {
+        commit_stats_add(modeset_stats, commit_ns);
+        commit_stats_print(modeset_stats);
+        *flags &= ~DRM_MODE_ATOMIC_ALLOW_MODESET;
+    } else {
+        commit_stats_add(flip_stats, commit_ns);
+        if (flip_stats->count % COMMIT_STATS_INTERVAL == 0) {
+            commit_stats_print(flip_stats);
+            present_queue_print(queue, name);
+            vblank_timing_print(&vblank_timing);
+        }
+    }
+
+    queue->pending = queue->next;
+    queue->pending_render_ns = queue->next_render_ns;
+    queue->next = NULL;
+    queue->flip_pending = true;
+    return 0;
+}
+
+/* what a mailbox commit needs, for the flip handler */
+struct mailbox {
+    uint32_t flags;
+    int p_w, p_h, crtc_width, crtc_height;
+    struct commit_stats modeset_stats;
+    struct commit_stats flip_stats;
+};
+
+/* commit the newest rendered frame if no flip is pending */
+static void mailbox_commit(struct present_queue *queue) {
+    struct mailbox *mb = queue->mailbox;
+
+    present_queue_retire(queue);
+    if (queue->flip_pending || !queue->next)
+        return;
+
+    if (present_queue_commit(queue, "mailbox", &mb->flags, mb->p_w, mb->p_h,
+            mb->crtc_width, mb->crtc_height, &mb->modeset_stats, &mb->flip_stats)) {
+        gbm_surface_release_buffer(gbm.surface, queue->next);
+        queue->next = NULL;
+    }
+}
+
+/*
+ * Latest frame wins: render without waiting for flips and commit the
+ * newest rendered frame as soon as the previous flip has completed, from
+ * the flip handler, or as soon as it is rendered if no flip is pending.
+ * DRM events are also handled while a frame renders. A frame that is
+ * overtaken before it could be committed goes back to the surface
+ * unseen. Needs a buffer on screen, one pending, one queued and one to
+ * render into.
+ */
+static int run_mailbox(int epoll_fd, int num_triangles, int wait_flag, uint32_t flags,
+    int p_w, int p_h, int crtc_width, int crtc_height) {
+    struct mailbox mailbox = {
+        .flags = flags,
+        .p_w = p_w, .p_h = p_h, .crtc_width = crtc_width, .crtc_height = crtc_height,
+        .modeset_stats = { .name = "modeset" },
+        .flip_stats = { .name = "flip" },
+    };
+    struct present_queue queue = { .start_ns = get_time_ns(), .mailbox = &mailbox };
+    uint64_t render_ns;
+    uint32_t frame_idx = 0;
+    struct gbm_bo *bo;
+
+    while (true) {
+        /* pick up flips that completed while rendering, commit what was rendered last */
+        while (waitForDrm(epoll_fd, 0))
+            ;
+
+        mailbox_commit(&queue);
+
+        if (!gbm_surface_has_free_buffers(gbm.surface)) {
+            /* every buffer is on screen or queued, only a flip frees one */
+            if (!queue.flip_pending) {
+                fprintf(stderr, "no free buffer and no flip pending\n");
+                return -1;
+            }
+            waitForDrm(epoll_fd, -1);
+            continue;
+        }
+
+        frame_idx++;
+        render_ns = get_time_ns();
+
+        eglMakeCurrent(egl->display, egl->surface, egl->surface, egl->context);
+        test_draw_triangles(frame_idx, num_triangles);
+
+        /* a flip that completed meanwhile takes the previous frame */
+        while (waitForDrm(epoll_fd, 0))
+            ;
+
+        if(wait_flag & WAIT_FLAG_BEFORE_SWAPBUFFERS) {
+            glFinish();
+        }
+
+        eglSwapBuffers(egl->display, egl->surface);
+
+        bo = gbm_surface_lock_front_buffer(gbm.surface);
+        if (!bo) {
+            fprintf(stderr, "fail to lock front buffer(%s)\n", strerror(errno));
+            return -1;
+        }
+        queue.rendered++;
+
+        if (queue.next) {
+            gbm_surface_release_buffer(gbm.surface, queue.next);
+            queue.dropped++;
+        }
+        queue.next = bo;
+        queue.next_render_ns = render_ns;
+        queue.next_frame = frame_idx;
+    }
+
+    return 0;
+}
+
+/*
+ * Wait for the previous flip, then sleep until the predicted render and
+ * commit cost plus margin_us before the next vblank and only then render.
+ */
+static int run_scheduled(int epoll_fd, int num_triangles, int wait_flag, uint32_t flags,
+    int margin_us, int p_w, int p_h, int crtc_width, int crtc_height) {
+    struct present_queue queue = { .start_ns = get_time_ns() };
+    struct commit_stats modeset_stats = { .name = "modeset" };
+    struct commit_stats flip_stats = { .name = "flip" };
+    struct frame_scheduler sched;
+    uint32_t frame_idx = 0;
+    uint64_t render_ns;
+
+    frame_scheduler_init(&sched, drm.mode, margin_us * 1000ull);
+
+    while (true) {
+        if (queue.flip_pending) {
+            while (queue.flip_pending)
+                waitForDrm(epoll_fd, -1);
+
+            frame_scheduler_flip_done(&sched, queue.flip_ns, queue.pending_render_ns);
+            if (sched.frames && sched.frames % COMMIT_STATS_INTERVAL == 0)
+                frame_scheduler_print(&sched);
+        }
+        present_queue_retire(&queue);
+
+        render_ns = frame_scheduler_wait(&sched);
+        frame_idx++;
+
+        eglMakeCurrent(egl->display, egl->surface, egl->surface, egl->context);
+        test_draw_triangles(frame_idx, num_triangles);
+
+        if(wait_flag & WAIT_FLAG_BEFORE_SWAPBUFFERS) {
+            glFinish();
+        }
+
+        eglSwapBuffers(egl->display, egl->surface);
+
+        queue.next = gbm_surface_lock_front_buffer(gbm.surface);
+        if (!queue.next) {
+            fprintf(stderr, "fail to lock front buffer(%s)\n", strerror(errno));
+            return -1;
+        }
+        queue.next_render_ns = render_ns;
+        queue.next_frame = frame_idx;
+        queue.rendered++;
+
+        if (present_queue_commit(&queue, "scheduled", &flags, p_w, p_h, crtc_width, crtc_height,
+                &modeset_stats, &flip_stats)) {
+            gbm_surface_release_buffer(gbm.surface, queue.next);
+            queue.next = NULL;
+            continue;
+        }
+        frame_scheduler_commit_done(&sched, render_ns);
+    }
+
+    return 0;
+}
+
+enum async_flip {
+    ASYNC_FLIP_NONE,
+    ASYNC_FLIP_LEGACY,              /* drmModePageFlip */
+    ASYNC_FLIP_ATOMIC,              /* DRM_CAP_ATOMIC_ASYNC_PAGE_FLIP */
+};
+
+#define TEAR_BANDS 4
+
+/* where in the scanout the buffer changed */
+struct tear_stats {
+    uint64_t flips;
+    uint64_t in_vblank;
+    uint64_t bands[TEAR_BANDS];     /* active area from top to bottom */
+    uint64_t line_total;
+    uint64_t commit_timed;          /* event on line 0, timed by the commit return */
+};
+
+static void tear_stats_add(struct tear_stats *tear, int line) {
+    tear->flips++;
+    if (line >= drm.mode->vdisplay) {
+        tear->in_vblank++;
+        return;
+    }
+    tear->bands[line * TEAR_BANDS / drm.mode->vdisplay]++;
+    tear->line_total += line;
+}
+
+static void tear_stats_print(const struct tear_stats *tear, const struct present_queue *queue) {
+    uint64_t visible = tear->flips - tear->in_vblank;
+    int k;
+
+    printf("async flip: %.2f flips/s, in vblank %llu, commit timed %llu, tear line avg %llu of %d:",
+        tear->flips * 1e9 / (get_time_ns() - queue->start_ns),
+        (unsigned long long)tear->in_vblank, (unsigned long long)tear->commit_timed,
+        (unsigned long long)(visible ? tear->line_total / visible : 0), drm.mode->vdisplay);
+    for (k = 0; k < TEAR_BANDS; k++)
+        printf(" %llu", (unsigned long long)tear->bands[k]);
+    printf("\n");
+}
+
+static int async_flip(enum async_flip mode, struct present_queue *queue, uint64_t *commit_ns) {
+    struct drm_fb *fb = drm_fb_get_from_bo(drm.fd, queue->next);
+    drmModeAtomicReq *req;
+    int ret;
+
+    if (!fb)
+        return -1;
+
+    if (mode == ASYNC_FLIP_LEGACY) {
+        ret = drmModePageFlip(drm.fd, drm.crtc_id, fb->fb_id,
+            DRM_MODE_PAGE_FLIP_EVENT | DRM_MODE_PAGE_FLIP_ASYNC, queue);
+    } else {
+        req = drmModeAtomicAlloc();
+        if (!req) {
+            fprintf(stderr, "ERROR[drmModeAtomicAlloc]: failed to alloc\n");
+            return -ENOMEM;
+        }
+        /* an async commit may change nothing but FB_ID */
+        add_plane_property(req, drm.primary_plane, PLANE_PROP_FB_ID, fb->fb_id);
+        ret = drmModeAtomicCommit(drm.fd, req, DRM_MODE_ATOMIC_NONBLOCK |
+            DRM_MODE_PAGE_FLIP_EVENT | DRM_MODE_PAGE_FLIP_ASYNC, queue);
+        drmModeAtomicFree(req);
+    }
+    *commit_ns = get_time_ns();
+
+    if (ret) {
+        fprintf(stderr, "async flip failed: %s\n", strerror(errno));
+        return ret;
+    }
+
+    queue->pending = queue->next;
+    queue->pending_render_ns = queue->next_render_ns;
+    queue->next = NULL;
+    queue->flip_pending = true;
+    return 0;
+}
+
+/*
+ * Flip without waiting for vblank. The flip timestamp tells the scanline
+ * the new buffer started at, which is where the tear line is.
+ */
+static int run_async(int epoll_fd, enum async_flip mode, int num_triangles, int wait_flag,
+    uint32_t flags, int p_w, int p_h, int crtc_width, int crtc_height) {
+    struct present_queue queue = { .start_ns = get_time_ns() };
+    struct commit_stats modeset_stats = { .name = "modeset" };
+    struct commit_stats flip_stats = { .name = "flip" };
+    struct tear_stats tear = { 0 };
+    uint64_t cap = 0, commit_ns = 0;
+    bool measure = false;
+    uint32_t frame_idx = 0;
+    int line;
+
+    if (drmGetCap(drm.fd, mode == ASYNC_FLIP_LEGACY ?
+            DRM_CAP_ASYNC_PAGE_FLIP : DRM_CAP_ATOMIC_ASYNC_PAGE_FLIP, &cap) || !cap) {
+        fprintf(stderr, "%s async page flips not supported\n",
+            mode == ASYNC_FLIP_LEGACY ? "legacy" : "atomic");
+        return -1;
+    }
+
+    while (true) {
+        while (queue.flip_pending)
+            waitForDrm(epoll_fd, -1);
+
+        if (measure) {
+            line = vblank_timing_scanline(&vblank_timing, queue.flip_ns);
+            /* some drivers stamp async flips with the last vblank, use the ioctl return */
+            if (line == 0) {
+                line = vblank_timing_scanline(&vblank_timing, commit_ns);
+                tear.commit_timed++;
+            }
+            /* -1: no vblank timestamp to measure against */
+            if (line >= 0) {
+                tear_stats_add(&tear, line);
+                if (tear.flips % COMMIT_STATS_INTERVAL == 0) {
+                    tear_stats_print(&tear, &queue);
+                    present_queue_print(&queue, "async");
+                }
+            }
+            measure = false;
+        }
+        present_queue_retire(&queue);
+
+        frame_idx++;
+        queue.next_render_ns = get_time_ns();
+        queue.next_frame = frame_idx;
+
+        eglMakeCurrent(egl->display, egl->surface, egl->surface, egl->context);
+        test_draw_triangles(frame_idx, num_triangles);
+
+        if(wait_flag & WAIT_FLAG_BEFORE_SWAPBUFFERS) {
+            glFinish();
+        }
+
+        eglSwapBuffers(egl->display, egl->surface);
+
+        queue.next = gbm_surface_lock_front_buffer(gbm.surface);
+        if (!queue.next) {
+            fprintf(stderr, "fail to lock front buffer(%s)\n", strerror(errno));
+            return -1;
+        }
+        queue.rendered++;
+
+        /* the mode is set with a regular commit, flips are async from then on */
+        if (flags & DRM_MODE_ATOMIC_ALLOW_MODESET) {
+            if (present_queue_commit(&queue, "async", &flags, p_w, p_h, crtc_width, crtc_height,
+                    &modeset_stats, &flip_stats)) {
+                gbm_surface_release_buffer(gbm.surface, queue.next);
+                queue.next = NULL;
+            }
+            continue;
+        }
+
+        if (async_flip(mode, &queue, &commit_ns)) {
+            gbm_surface_release_buffer(gbm.surface, queue.next);
+            queue.next = NULL;
+            continue;
+        }
+        measure = true;
+    }
+
+    return 0;
+}
+
+/* a fence fd that signals once the rendering submitted so far has completed */
+static int create_render_fence(EGLSyncKHR *sync) {
+    static const EGLint attribs[] = {
+        EGL_SYNC_NATIVE_FENCE_FD_ANDROID, EGL_NO_NATIVE_FENCE_FD_ANDROID,
+        EGL_NONE
+    };
+
+    *sync = egl->eglCreateSyncKHR(egl->display, EGL_SYNC_NATIVE_FENCE_ANDROID, attribs);
+    if (*sync == EGL_NO_SYNC_KHR) {
+        fprintf(stderr, "failed to create native fence sync\n");
+        return -1;
+    }
+
+    return 0;
+}
+
+/* make the GPU wait for fence_fd without blocking the CPU, takes the fd */
+static int gpu_wait_fence(int fence_fd) {
+    EGLint attribs[] = {
+        EGL_SYNC_NATIVE_FENCE_FD_ANDROID, fence_fd,
+        EGL_NONE
+    };
+    EGLSyncKHR sync = egl->eglCreateSyncKHR(egl->display, EGL_SYNC_NATIVE_FENCE_ANDROID, attribs);
+
+    if (sync == EGL_NO_SYNC_KHR) {
+        fprintf(stderr, "failed to import fence fd %d\n", fence_fd);
+        close(fence_fd);
+        return -1;
+    }
+
+    egl->eglWaitSyncKHR(egl->display, sync, 0);
+    egl->eglDestroySyncKHR(egl->display, sync);
+    return 0;
+}
+
+#define GPU_TIMER_QUERIES 8
+
+/*
+ * GPU time of each frame from GL_EXT_disjoint_timer_query. Results come a
+ * few frames late, each carries the resolution level it was rendered at.
+ * Without the extension the frame is finished with glFinish and timed on
+ * the CPU, which is close enough once the GPU is the bottleneck.
+ */
+struct gpu_timer {
+    PFNGLGENQUERIESEXTPROC glGenQueriesEXT;
+    PFNGLBEGINQUERYEXTPROC glBeginQueryEXT;
+    PFNGLENDQUERYEXTPROC glEndQueryEXT;
+    PFNGLGETQUERYOBJECTUIVEXTPROC glGetQueryObjectuivEXT;
+    PFNGLGETQUERYOBJECTUI64VEXTPROC glGetQueryObjectui64vEXT;
+
+    GLuint queries[GPU_TIMER_QUERIES];
+    int levels[GPU_TIMER_QUERIES];
+    int head, tail;                 /* queries in flight: tail .. head - 1 */
+    uint64_t cpu_start_ns, cpu_end_ns;  /* end 0: no frame to read */
+    int cpu_level;
+};
+
+static void gpu_timer_init(struct gpu_timer *timer) {
+    const char *exts = (const char *) glGetString(GL_EXTENSIONS);
+    GLint disjoint;
+
+    memset(timer, 0, sizeof(*timer));
+    if (!exts || !strstr(exts, "GL_EXT_disjoint_timer_query")) {
+        printf("no GL_EXT_disjoint_timer_query, timing frames with glFinish\n");
+        return;
+    }
+
+    timer->glGenQueriesEXT = (void *) eglGetProcAddress("glGenQueriesEXT");
+    timer->glBeginQueryEXT = (void *) eglGetProcAddress("glBeginQueryEXT");
+    timer->glEndQueryEXT = (void *) eglGetProcAddress("glEndQueryEXT");
+    timer->glGetQueryObjectuivEXT = (void *) eglGetProcAddress("glGetQueryObjectuivEXT");
+    timer->glGetQueryObjectui64vEXT = (void *) eglGetProcAddress("glGetQueryObjectui64vEXT");
+    if (!timer->glGenQueriesEXT || !timer->glBeginQueryEXT || !timer->glEndQueryEXT ||
+        !timer->glGetQueryObjectuivEXT || !timer->glGetQueryObjectui64vEXT) {
+        timer->glGenQueriesEXT = NULL;
+        return;
+    }
+
+    timer->glGenQueriesEXT(GPU_TIMER_QUERIES, timer->queries);
+    /* clear a disjoint left over from before */
+    glGetIntegerv(GL_GPU_DISJOINT_EXT, &disjoint);
+}
+
+static void gpu_timer_begin(struct gpu_timer *timer, int level) {
+    if (!timer->glGenQueriesEXT) {
+        timer->cpu_start_ns = get_time_ns();
+        timer->cpu_end_ns = 0;
+        timer->cpu_level = level;
+        return;
+    }
+
+    /* all in flight, drop the oldest rather than stall */
+    if (timer->head - timer->tail == GPU_TIMER_QUERIES)
+        timer->tail++;
+
+    timer->levels[timer->head % GPU_TIMER_QUERIES] = level;
+    timer->glBeginQueryEXT(GL_TIME_ELAPSED_EXT, timer->queries[timer->head % GPU_TIMER_QUERIES]);
+}
+
+static void gpu_timer_end(struct gpu_timer *timer) {
+    if (!timer->glGenQueriesEXT) {
+        /* the end of the draw, not of whatever runs before the read */
+        glFinish();
+        timer->cpu_end_ns = get_time_ns();
+        return;
+    }
+
+    timer->glEndQueryEXT(GL_TIME_ELAPSED_EXT);
+    timer->head++;
+}
+
+/* the oldest finished frame, false when none has finished yet */
+static bool gpu_timer_read(struct gpu_timer *timer, uint64_t *gpu_ns, int *level) {
+    GLuint available = 0;
+    GLint disjoint = 0;
+    GLuint64 elapsed;
+    GLuint query;
+
+    if (!timer->glGenQueriesEXT) {
+        if (!timer->cpu_end_ns)
+            return false;
+        *gpu_ns = timer->cpu_end_ns - timer->cpu_start_ns;
+        *level = timer->cpu_level;
+        timer->cpu_end_ns = 0;
+        return true;
+    }
+
+    while (timer->tail != timer->head) {
+        query = timer->queries[timer->tail % GPU_TIMER_QUERIES];
+        timer->glGetQueryObjectuivEXT(query, GL_QUERY_RESULT_AVAILABLE_EXT, &available);
+        if (!available)
+            return false;
+
+        timer->glGetQueryObjectui64vEXT(query, GL_QUERY_RESULT_EXT, &elapsed);
+        *level = timer->levels[timer->tail % GPU_TIMER_QUERIES];
+        timer->tail++;
+
+        /* a frequency change or similar made the result meaningless */
+        glGetIntegerv(GL_GPU_DISJOINT_EXT, &disjoint);
+        if (disjoint)
+            continue;
+
+        *gpu_ns = elapsed;
+        return true;
+    }
+
+    return false;
+}
+
+/*
+ * Dynamic resolution: render at the level the scaler picks from the GPU
+ * time of the last frames and let the plane scale it up to the CRTC
+ * rectangle. Every level has its own surface, so a switch only changes
+ * SRC_W/SRC_H and the buffer of the next commit.
+ */
+static int run_scaled(int epoll_fd, int num_triangles, uint32_t flags, const char *levels,
+    uint32_t format, int p_w, int p_h, int crtc_width, int crtc_height) {
+    struct present_queue queue = { .start_ns = get_time_ns() };
+    struct commit_stats modeset_stats = { .name = "modeset" };
+    struct commit_stats flip_stats = { .name = "flip" };
+    struct gbm_surface *surfaces[SCALER_MAX_LEVELS];
+    EGLSurface egl_surfaces[SCALER_MAX_LEVELS];
+    struct resolution_scaler scaler;
+    struct gpu_timer timer;
+    int level, scanout_level = 0;
+    uint32_t frame_idx = 0;
+    uint64_t gpu_ns;
+    int i, timed_level;
+
+    if (resolution_scaler_init(&scaler, drm.mode, levels, p_w, p_h))
+        return -1;
+
+    for (i = 0; i < scaler.count_levels; i++) {
+        if (scaler.width[i] == p_w && scaler.height[i] == p_h) {
+            surfaces[i] = gbm.surface;
+            egl_surfaces[i] = egl->surface;
+            continue;
+        }
+
+        surfaces[i] = create_gbm_surface(gbm.dev, scaler.width[i], scaler.height[i], format);
+        if (!surfaces[i]) {
+            printf("failed to create gbm surface %dx%d\n", scaler.width[i], scaler.height[i]);
+            return -1;
+        }
+        egl_surfaces[i] = eglCreateWindowSurface(egl->display, egl->config,
+            (EGLNativeWindowType)surfaces[i], NULL);
+        if (egl_surfaces[i] == EGL_NO_SURFACE) {
+            printf("failed to create egl surface %dx%d\n", scaler.width[i], scaler.height[i]);
+            return -1;
+        }
+    }
+
+    eglMakeCurrent(egl->display, egl_surfaces[0], egl_surfaces[0], egl->context);
+    gpu_timer_init(&timer);
+
+    while (true) {
+        level = scaler.level;
+        frame_idx++;
+        queue.next_render_ns = get_time_ns();
+        queue.next_frame = frame_idx;
+
+        eglMakeCurrent(egl->display, egl_surfaces[level], egl_surfaces[level], egl->context);
+        glViewport(0, 0, scaler.width[level], scaler.height[level]);
+
+        gpu_timer_begin(&timer, level);
+        test_draw_triangles(frame_idx, num_triangles);
+        gpu_timer_end(&timer);
+
+        eglSwapBuffers(egl->display, egl_surfaces[level]);
+
+        queue.next = gbm_surface_lock_front_buffer(surfaces[level]);
+        if (!queue.next) {
+            fprintf(stderr, "fail to lock front buffer(%s)\n", strerror(errno));
+            return -1;
+        }
+        queue.rendered++;
+
+        if (present_queue_commit(&queue, "scaled", &flags, scaler.width[level], scaler.height[level],
+                crtc_width, crtc_height, &modeset_stats, &flip_stats)) {
+            gbm_surface_release_buffer(surfaces[level], queue.next);
+            queue.next = NULL;
+            /* the plane cannot scale from this size, go back to the one on screen */
+            if (level != scanout_level)
+                resolution_scaler_revert(&scaler, scanout_level);
+            continue;
+        }
+
+        while (queue.flip_pending)
+            waitForDrm(epoll_fd, -1);
+
+        if (queue.scanout)
+            gbm_surface_release_buffer(surfaces[scanout_level], queue.scanout);
+        queue.scanout = queue.pending;
+        queue.pending = NULL;
+        scanout_level = level;
+
+        /* samples from before a switch say nothing about the new level */
+        while (gpu_timer_read(&timer, &gpu_ns, &timed_level)) {
+            if (timed_level == scaler.level)
+                resolution_scaler_add(&scaler, gpu_ns);
+        }
+
+        if (queue.presented % COMMIT_STATS_INTERVAL == 0)
+            resolution_scaler_print(&scaler);
+    }
+
+    return 0;
+}
+
+static void draw_dumb_tear_markers(struct dumb_buffer *buf, uint32_t frame_idx) {
+    int band, x, y, w, h;
+
+    for (band = 0; band < TEAR_ORACLE_BANDS; band++) {
+        tear_oracle_marker(tear_oracle, band, &x, &y, &w, &h);
+        dumb_fill_rect(buf, x, y, w, h, tear_oracle_color(frame_idx));
+    }
+}
+
+/*
+ * The FIFO loop with the CPU instead of GLES: the next frame is drawn into
+ * a dumb buffer while the previous flip is pending, so the chain holds one
+ * buffer on screen, one committed and one being drawn.
+ */
+static int run_dumb(int epoll_fd, uint32_t flags, uint32_t format,
+    int p_w, int p_h, int crtc_width, int crtc_height) {
+    struct present_queue queue = { .start_ns = get_time_ns() };
+    struct commit_stats modeset_stats = { .name = "modeset" };
+    struct commit_stats flip_stats = { .name = "flip" };
+    struct dumb_chain chain;
+    struct dumb_buffer *buf;
+    drmModeAtomicReq *req;
+    uint64_t commit_start, commit_ns, draw_ns = 0;
+    uint32_t frame_idx = 0;
+    int ret;
+
+    if (dumb_chain_create(drm.fd, p_w, p_h, format, &chain))
+        return -1;
+
+    while (true) {
+        frame_idx++;
+        queue.next_render_ns = get_time_ns();
+        queue.next_frame = frame_idx;
+        buf = dumb_chain_next(&chain);
+        dumb_draw_frame(&chain, buf, frame_idx, true);
+        if (tear_oracle)
+            draw_dumb_tear_markers(buf, frame_idx);
+        draw_ns += get_time_ns() - queue.next_render_ns;
+        queue.rendered++;
+
+        while (queue.flip_pending)
+            waitForDrm(epoll_fd, -1);
+
+        req = drmModeAtomicAlloc();
+        if (!req) {
+            fprintf(stderr, "ERROR[drmModeAtomicAlloc]: failed to alloc\n");
+            return -1;
+        }
+
+        drm_atomic_mode_set(req, flags);
+        drm_atomic_set_plane_properties(req, drm.primary_plane, drm.crtc_id, buf->fb_id,
+            p_w, p_h, crtc_width, crtc_height, 0, 0);
+        if (writeback)
+            writeback_attach_request(writeback, req, frame_idx);
+
+        commit_start = get_time_ns();
+        ret = drmModeAtomicCommit(drm.fd, req, flags, &queue);
+        commit_ns = get_time_ns() - commit_start;
+        drmModeAtomicFree(req);
+        if (writeback)
+            writeback_committed(writeback, NULL, ret, commit_ns);
+
+        if (verbose)
+            printf("drmModeAtomicCommit(%d %x) returns %d(%s)\n", drm.fd, flags, ret, strerror(-ret));
+
+        if (ret) {
+            fprintf(stderr, "ERROR[drmModeAtomicCommit]: failed to commit\n");
+            continue;
+        }
+
+        vblank_timing_commit(&vblank_timing);
+        queue.pending_render_ns = queue.next_render_ns;
+        queue.flip_pending = true;
+        /* a failed commit leaves buf to be drawn into again */
+        dumb_chain_advance(&chain);
+
+        if (flags & DRM_MODE_ATOMIC_ALLOW_MODESET) {
+            commit_stats_add(&modeset_stats, commit_ns);
+            commit_stats_print(&modeset_stats);
+            flags &= ~DRM_MODE_ATOMIC_ALLOW_MODESET;
+        } else {
+            commit_stats_add(&flip_stats, commit_ns);
+            if (flip_stats.count % COMMIT_STATS_INTERVAL == 0) {
+                commit_stats_print(&flip_stats);
+                present_queue_print(&queue, "dumb");
+                vblank_timing_print(&vblank_timing);
+                printf("dumb: CPU draw avg %.3f ms per frame\n", draw_ns / 1e6 / frame_idx);
+            }
+        }
+    }
+
+    dumb_chain_destroy(&chain);
+    return 0;
 }
 
 int main(int argc, char *argv[]) {
@@ -1001,8 +1622,14 @@ int main(int argc, char *argv[]) {
     char *location = default_location;
 
     int num_triangles = default_num_triangles;
-
-    while ((opt = getopt(argc, argv, "hvap:D:m:f:l:c:t:w:")) != -1) {
+    bool mailbox = false;
+    int sched_margin_us = -1;
+    enum async_flip async = ASYNC_FLIP_NONE;
+    char *scale_levels = NULL;
+    bool dumb = false;
+    bool oracle = false;
+
+    while ((opt = getopt(argc, argv, "hvaMUXp:D:m:f:l:c:t:w:S:A:K:R:")) != -1) {
         switch (opt) {
             case 'h':
                 print_usage(argv[0]);
@@ -1046,6 +1673,35 @@ int main(int argc, char *argv[]) {
             case 'w':
                 wait_flag = strtoul(optarg, NULL, 10);
                 break;
+            case 'M':
+                mailbox = true;
+                break;
+            case 'S':
+                sched_margin_us = strtoul(optarg, NULL, 10);
+                break;
+            case 'A':
+                if (strcmp(optarg, "legacy") == 0) {
+                    async = ASYNC_FLIP_LEGACY;
+                } else if (strcmp(optarg, "atomic") == 0) {
+                    async = ASYNC_FLIP_ATOMIC;
+                } else {
+                    printf("invalid async flip type: %s\n", optarg);
+                    print_usage(argv[0]);
+                    return -1;
+                }
+                break;
+            case 'K':
+                kms_cache_path = optarg;
+                break;
+            case 'R':
+                scale_levels = optarg;
+                break;
+            case 'U':
+                dumb = true;
+                break;
+            case 'X':
+                oracle = true;
+                break;
             case '?':
                 if (optopt == 'p' || optopt == 'o')
                     fprintf(stderr, "Option -%c requires an argument.\n", optopt);
@@ -1068,6 +1724,18 @@ int main(int argc, char *argv[]) {
         return ret;
     }
 
+    if (dumb && (mailbox || async != ASYNC_FLIP_NONE || scale_levels || sched_margin_us >= 0 ||
+            wait_flag)) {
+        printf("-U draws without a GPU, it runs the default loop with -w 0 only\n");
+        return -1;
+    }
+
+    /* async commits may only change FB_ID and legacy flips carry no connector */
+    if (oracle && (async != ASYNC_FLIP_NONE || scale_levels)) {
+        printf("-X needs the plane at a fixed size and commits that can carry a writeback\n");
+        return -1;
+    }
+
     ret = init_drm_atomic(device_path, mode_str);
     if (ret) {
         printf("failed to initialize DRM\n");
@@ -1076,22 +1744,30 @@ int main(int argc, char *argv[]) {
 
     printf("drm->mode: %dx%d\n", drm.mode->hdisplay, drm.mode->vdisplay);
 
-    ret = init_drm_atomic_plane(primary_plane_id);
+    ret = vblank_timing_init(&vblank_timing, drm.fd, drm.crtc_id, drm.mode);
     if (ret) {
-        printf("failed to initialize atomic planes\n");
+        printf("failed to initialize vblank timing\n");
         return ret;
     }
 
-    ret = init_gbm(&gbm, drm.fd, p_w, p_h, format);
+    ret = init_drm_atomic_plane(primary_plane_id);
     if (ret) {
-        printf("failed to initialize GBM\n");
+        printf("failed to initialize atomic planes\n");
         return ret;
     }
 
-    egl = init_egl_loader(drm.fd, &gbm, format);
-    if (!egl) {
-        printf("failed to initialize EGL\n");
-        return -1;
+    if (!dumb) {
+        ret = init_gbm(&gbm, drm.fd, p_w, p_h, format);
+        if (ret) {
+            printf("failed to initialize GBM\n");
+            return ret;
+        }
+
+        egl = init_egl_loader(drm.fd, &gbm, format);
+        if (!egl) {
+            printf("failed to initialize EGL\n");
+            return -1;
+        }
     }
 
     uint32_t plane_flags = 0;
@@ -1123,14 +1799,74 @@ int main(int argc, char *argv[]) {
         return -1;
     }
 
-    if(init_render(p_w, p_h)){
+    if(!dumb && init_render(p_w, p_h)){
         return -1;
     }
 
+    /* the first commit sets the mode, the following ones only flip the plane */
     uint32_t flags = (DRM_MODE_ATOMIC_NONBLOCK | DRM_MODE_PAGE_FLIP_EVENT | DRM_MODE_ATOMIC_ALLOW_MODESET);
+    struct commit_stats modeset_stats = { .name = "modeset" };
+    struct commit_stats flip_stats = { .name = "flip" };
+    uint64_t commit_start, commit_ns;
+    struct present_queue queue = { .start_ns = get_time_ns() };
+    uint64_t render_ns;
+    bool explicit_sync = wait_flag & WAIT_FLAG_NATIVE_FENCE;
+    EGLSyncKHR render_sync = EGL_NO_SYNC_KHR;
+    int in_fence_fd = -1;
+    int out_fence_fd = -1;
+
+    if (oracle) {
+        static struct writeback wb;
+        static struct tear_oracle to;
+        static char name[32];
+
+        if (dumb)
+            snprintf(name, sizeof(name), "dumb");
+        else
+            snprintf(name, sizeof(name), "%s -w %d",
+                mailbox ? "mailbox" : sched_margin_us >= 0 ? "scheduled" : "fifo", wait_flag);
+
+        tear_oracle_init(&to, name, p_w, p_h, crtc_width, crtc_height);
+        if (writeback_init(&wb, drm.fd, drm.crtc_id, drm.mode, tear_oracle_check, &to))
+            return -1;
+        writeback = &wb;
+        tear_oracle = &to;
+    }
+
+    if (dumb)
+        return run_dumb(epoll_fd, flags, format, p_w, p_h, crtc_width, crtc_height);
+
+    if (explicit_sync) {
+        if (!egl->eglDupNativeFenceFDANDROID) {
+            fprintf(stderr, "explicit sync needs EGL_ANDROID_native_fence_sync\n");
+            return -1;
+        }
+        if (!drm.primary_plane->prop_ids[PLANE_PROP_IN_FENCE_FD] ||
+            !drm.crtc->prop_ids[CRTC_PROP_OUT_FENCE_PTR]) {
+            fprintf(stderr, "explicit sync needs IN_FENCE_FD and OUT_FENCE_PTR\n");
+            return -1;
+        }
+    }
+
+    if (mailbox)
+        return run_mailbox(epoll_fd, num_triangles, wait_flag, flags,
+            p_w, p_h, crtc_width, crtc_height);
+
+    if (async != ASYNC_FLIP_NONE)
+        return run_async(epoll_fd, async, num_triangles, wait_flag, flags,
+            p_w, p_h, crtc_width, crtc_height);
+
+    if (scale_levels)
+        return run_scaled(epoll_fd, num_triangles, flags, scale_levels, format,
+            p_w, p_h, crtc_width, crtc_height);
+
+    if (sched_margin_us >= 0)
+        return run_scheduled(epoll_fd, num_triangles, wait_flag, flags, sched_margin_us,
+            p_w, p_h, crtc_width, crtc_height);
 
     while (true) {
         frame_idx++;
+        render_ns = get_time_ns();
 
         eglMakeCurrent(egl->display, egl->surface, egl->surface, egl->context);
 
@@ -1140,13 +1876,21 @@ int main(int argc, char *argv[]) {
                 printf("GL ERROR: %d\n", err);
             }
 
+            /* the buffer may still be on screen until the previous commit's out fence */
+            if(out_fence_fd >= 0) {
+                gpu_wait_fence(out_fence_fd);
+                out_fence_fd = -1;
+            }
+
             test_draw_triangles(frame_idx, num_triangles);
 
             while((err = glGetError()) != GL_NO_ERROR) {
                 printf("GL ERROR: %d\n", err);
             }
 
-            waitForDrm(epoll_fd);
+            /* the sequence event of the commit can arrive before the flip */
+            while(queue.flip_pending)
+                waitForDrm(epoll_fd, -1);
 
             if(bo_curr) {
                 gbm_surface_release_buffer(gbm.surface, bo_curr);
@@ -1164,8 +1908,19 @@ int main(int argc, char *argv[]) {
             glFinish();
         }
 
+        if(explicit_sync && create_render_fence(&render_sync)) {
+            return 1;
+        }
+
         eglSwapBuffers(egl->display, egl->surface);
 
+        if(explicit_sync) {
+            /* the fd is only valid once the fence has been flushed by eglSwapBuffers */
+            in_fence_fd = egl->eglDupNativeFenceFDANDROID(egl->display, render_sync);
+            egl->eglDestroySyncKHR(egl->display, render_sync);
+            render_sync = EGL_NO_SYNC_KHR;
+        }
+
         if (!lock_new_surface(drm.fd, &gbm, gbm.surface, &bo_next, &fb)) {
             fprintf(stderr, "fail to add surface 1\n");
             return 1;
@@ -1181,18 +1936,69 @@ int main(int argc, char *argv[]) {
 
             drm_atomic_mode_set(req_curr, flags);
 
-            drm_atomic_set_plane_properties(req_curr, primary_plane_id, drm.crtc_id, fb->fb_id,
+            drm_atomic_set_plane_properties(req_curr, drm.primary_plane, drm.crtc_id, fb->fb_id,
                 p_w, p_h, crtc_width, crtc_height, 0, 0);
+
+            if(explicit_sync) {
+                add_plane_property(req_curr, drm.primary_plane, PLANE_PROP_IN_FENCE_FD, in_fence_fd);
+                add_crtc_property(req_curr, drm.crtc, CRTC_PROP_OUT_FENCE_PTR,
+                    (uint64_t)(uintptr_t)&out_fence_fd);
+            }
+
+            if(writeback) {
+                writeback_attach_request(writeback, req_curr, frame_idx);
+            }
         }
 
-        ret = drmModeAtomicCommit(drm.fd, req_curr, flags, NULL);
+        commit_start = get_time_ns();
+        queue.pending_render_ns = render_ns;
+        ret = drmModeAtomicCommit(drm.fd, req_curr, flags, &queue);
+        commit_ns = get_time_ns() - commit_start;
         printf("%i: drmModeAtomicCommit(%d %p %x) returns %d(%s)\n", frame_idx, drm.fd, req_curr, flags, ret, strerror(ret));
 
+        if(writeback) {
+            writeback_committed(writeback, NULL, ret, commit_ns);
+        }
+
+        if(in_fence_fd >= 0) {
+            close(in_fence_fd);
+            in_fence_fd = -1;
+        }
+
         if(ret) {
             fprintf(stderr, "ERROR[drmModeAtomicCommit]: failed to commit\n");
+            if(explicit_sync || writeback) {
+                /* the request holds the closed in fence or a released capture, build a new one */
+                drmModeAtomicFree(req_curr);
+                req_curr = NULL;
+            }
             continue;
         }
 
+        queue.flip_pending = true;
+        vblank_timing_commit(&vblank_timing);
+
+        if(explicit_sync && bo_curr) {
+            /* replaced by this commit, rendering into it waits for its out fence */
+            gbm_surface_release_buffer(gbm.surface, bo_curr);
+            bo_curr = NULL;
+        }
+
+        if(flags & DRM_MODE_ATOMIC_ALLOW_MODESET) {
+            commit_stats_add(&modeset_stats, commit_ns);
+            commit_stats_print(&modeset_stats);
+            flags &= ~DRM_MODE_ATOMIC_ALLOW_MODESET;
+        }
+        else {
+            commit_stats_add(&flip_stats, commit_ns);
+            if(flip_stats.count % COMMIT_STATS_INTERVAL == 0) {
+                commit_stats_print(&flip_stats);
+                present_queue_print(&queue, "fifo");
+                vblank_timing_print(&vblank_timing);
+            }
+        }
+
+        queue.rendered++;
         req_prev = req_curr;
         req_curr = NULL;
     }
@@ -0,0 +1,2361 @@
+/*
+ * KMS simulator, preloaded into the test binaries to run them without a
+ * display:
+ *
+ *   LD_PRELOAD=libdrmsim.so drmplanes-atomic -U -d 10
+ *
+ * Every /dev/dri node opened in the process becomes a simulated device.
+ * The libdrm calls of the tests are answered here, dumb buffers live in
+ * plain memory and a thread runs the vblank clock of every active CRTC,
+ * so commits, flip events and buffer recycling behave like on hardware.
+ * Only the dumb buffer paths (-U) work, GBM and EGL need a real driver.
+ *
+ * Environment:
+ *   DRMSIM_MODE=<w>x<h>[@<hz>]  preferred connector mode (default: 1920x1080@60)
+ *   DRMSIM_CRTCS=<n>            CRTCs, each with one connector (default: 1)
+ *   DRMSIM_PLANES=<n>           planes of each CRTC, the first is primary (default: 3)
+ *   DRMSIM_PLANE_MAX=<w>x<h>    largest plane source and destination (default: 4096x4096)
+ *   DRMSIM_SCALE=<n>            planes scale up or down by up to n, 1: no scaling (default: 8)
+ *   DRMSIM_COMMIT_US=<us>       added to every commit that is not a test
+ *   DRMSIM_FAIL_EVERY=<n>       every nth commit fails with EINVAL
+ *   DRMSIM_VERBOSE=1            log commits and why they were rejected
+ *
+ * Plane ids are 31, 38, 45, ... and CRTC ids start at 300, so the default
+ * planes of the tests exist.
+ */
+
+/* open and mmap are defined under both names below */
+#undef _FILE_OFFSET_BITS
+#ifndef _GNU_SOURCE
+#define _GNU_SOURCE
+#endif
+
+#include <dlfcn.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <stdarg.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/eventfd.h>
+#include <sys/mman.h>
+#include <xf86drm.h>
+#include <xf86drmMode.h>
+#include <drm_fourcc.h>
+
+#define ARRAY_SIZE(a) (sizeof(a) / sizeof((a)[0]))
+
+#define SIM_MAX_CRTCS 4
+#define SIM_MAX_PLANES 8            /* per CRTC */
+#define SIM_MAX_OBJECTS (SIM_MAX_CRTCS * (SIM_MAX_PLANES + 2))
+#define SIM_MAX_FILES 8
+#define SIM_MAX_EVENTS 64           /* per file, not yet read */
+#define SIM_MAX_WAITS 64            /* queued vblank and sequence events */
+#define SIM_MAX_BLOBS 256
+#define SIM_MAX_FBS 256
+#define SIM_MAX_DUMBS 256
+#define SIM_MAX_SIZE 8192
+
+#define PLANE_ID_BASE 31
+#define PLANE_ID_STEP 7
+#define CRTC_ID_BASE 300
+#define CONNECTOR_ID_BASE 400
+#define ENCODER_ID_BASE 500
+#define FB_ID_BASE 1000
+#define BLOB_ID_BASE 2000
+
+/* mmap offset of a dumb buffer is its handle shifted by this */
+#define DUMB_OFFSET_SHIFT 20
+
+/* the next library in the lookup order, i.e. libc or libdrm */
+#define REAL(name) ((__typeof__(&name))real_symbol(#name))
+
+enum sim_prop {
+    PROP_TYPE,
+    PROP_FB_ID,
+    PROP_CRTC_ID,
+    PROP_SRC_X,
+    PROP_SRC_Y,
+    PROP_SRC_W,
+    PROP_SRC_H,
+    PROP_CRTC_X,
+    PROP_CRTC_Y,
+    PROP_CRTC_W,
+    PROP_CRTC_H,
+    PROP_ZPOS,
+    PROP_ALPHA,
+    PROP_BLEND,
+    PROP_DAMAGE_CLIPS,
+    PROP_ACTIVE,
+    PROP_MODE_ID,
+    PROP_COUNT
+};
+
+/* property ids are the enum plus one */
+#define PROP_ID(prop) ((uint32_t)(prop) + 1)
+
+struct sim_prop_info {
+    const char *name;
+    uint32_t flags;
+    uint64_t min, max;          /* ranges, the object type for objects */
+    const struct drm_mode_property_enum *enums;
+    int count_enums;
+};
+
+static const struct drm_mode_property_enum plane_types[] = {
+    { DRM_PLANE_TYPE_OVERLAY, "Overlay" },
+    { DRM_PLANE_TYPE_PRIMARY, "Primary" },
+    { DRM_PLANE_TYPE_CURSOR, "Cursor" },
+};
+
+static const struct drm_mode_property_enum blend_modes[] = {
+    { DRM_MODE_BLEND_PIXEL_NONE, "None" },
+    { DRM_MODE_BLEND_PREMULTI, "Pre-multiplied" },
+    { DRM_MODE_BLEND_COVERAGE, "Coverage" },
+};
+
+static const struct sim_prop_info prop_info[PROP_COUNT] = {
+    [PROP_TYPE] = { "type", DRM_MODE_PROP_ENUM | DRM_MODE_PROP_IMMUTABLE,
+        .enums = plane_types, .count_enums = ARRAY_SIZE(plane_types) },
+    [PROP_FB_ID] = { "FB_ID", DRM_MODE_PROP_OBJECT, DRM_MODE_OBJECT_FB },
+    [PROP_CRTC_ID] = { "CRTC_ID", DRM_MODE_PROP_OBJECT, DRM_MODE_OBJECT_CRTC },
+    [PROP_SRC_X] = { "SRC_X", DRM_MODE_PROP_RANGE, 0, UINT32_MAX },
+    [PROP_SRC_Y] = { "SRC_Y", DRM_MODE_PROP_RANGE, 0, UINT32_MAX },
+    [PROP_SRC_W] = { "SRC_W", DRM_MODE_PROP_RANGE, 0, UINT32_MAX },
+    [PROP_SRC_H] = { "SRC_H", DRM_MODE_PROP_RANGE, 0, UINT32_MAX },
+    [PROP_CRTC_X] = { "CRTC_X", DRM_MODE_PROP_SIGNED_RANGE, (uint64_t)INT32_MIN, INT32_MAX },
+    [PROP_CRTC_Y] = { "CRTC_Y", DRM_MODE_PROP_SIGNED_RANGE, (uint64_t)INT32_MIN, INT32_MAX },
+    [PROP_CRTC_W] = { "CRTC_W", DRM_MODE_PROP_RANGE, 0, INT32_MAX },
+    [PROP_CRTC_H] = { "CRTC_H", DRM_MODE_PROP_RANGE, 0, INT32_MAX },
+    [PROP_ZPOS] = { "zpos", DRM_MODE_PROP_RANGE, 0, 0 },   /* up to the planes of a CRTC */
+    [PROP_ALPHA] = { "alpha", DRM_MODE_PROP_RANGE, 0, 0xffff },
+    [PROP_BLEND] = { "pixel blend mode", DRM_MODE_PROP_ENUM,
+        .enums = blend_modes, .count_enums = ARRAY_SIZE(blend_modes) },
+    [PROP_DAMAGE_CLIPS] = { "FB_DAMAGE_CLIPS", DRM_MODE_PROP_BLOB },
+    [PROP_ACTIVE] = { "ACTIVE", DRM_MODE_PROP_RANGE, 0, 1 },
+    [PROP_MODE_ID] = { "MODE_ID", DRM_MODE_PROP_BLOB },
+};
+
+static const enum sim_prop plane_props[] = {
+    PROP_TYPE, PROP_FB_ID, PROP_CRTC_ID,
+    PROP_SRC_X, PROP_SRC_Y, PROP_SRC_W, PROP_SRC_H,
+    PROP_CRTC_X, PROP_CRTC_Y, PROP_CRTC_W, PROP_CRTC_H,
+    PROP_ZPOS, PROP_ALPHA, PROP_BLEND, PROP_DAMAGE_CLIPS,
+};
+
+static const enum sim_prop crtc_props[] = { PROP_ACTIVE, PROP_MODE_ID };
+static const enum sim_prop connector_props[] = { PROP_CRTC_ID };
+
+static const uint32_t plane_formats[] = {
+    DRM_FORMAT_XRGB8888, DRM_FORMAT_ARGB8888, DRM_FORMAT_XBGR8888, DRM_FORMAT_ABGR8888,
+    DRM_FORMAT_RGB565,
+};
+
+struct sim_object {
+    uint32_t id;
+    uint32_t type;              /* DRM_MODE_OBJECT_* */
+    int crtc;                   /* index of the CRTC it belongs to */
+    const enum sim_prop *props;
+    int count_props;
+    uint64_t values[PROP_COUNT];
+};
+
+struct sim_crtc {
+    uint64_t period_ns;
+    uint64_t seq;
+    uint64_t vblank_ns;         /* of the last vblank */
+    uint64_t next_ns;
+
+    /* the commit waiting for the next vblank */
+    bool flip_pending;
+    bool flip_event;
+    int flip_fd;
+    uint64_t flip_user_data;
+};
+
+struct sim_event {
+    uint32_t type;              /* DRM_EVENT_* */
+    uint32_t crtc_id;
+    uint64_t seq;
+    uint64_t ns;
+    uint64_t user_data;
+};
+
+struct sim_file {
+    bool used;
+    int fd;                     /* an eventfd, readable while events are queued */
+    struct sim_event events[SIM_MAX_EVENTS];
+    int head, count;
+};
+
+/* a drmWaitVBlank() or drmCrtcQueueSequence() event not due yet */
+struct sim_wait {
+    bool used;
+    int fd;
+    int crtc;
+    uint32_t type;
+    uint64_t target;
+    uint64_t user_data;
+};
+
+struct sim_blob {
+    bool used;
+    bool destroyed;             /* kept while the state still points at it */
+    uint32_t length;
+    void *data;
+};
+
+struct sim_fb {
+    bool used;
+    uint32_t width, height;
+    uint32_t format;
+    uint32_t handle;
+};
+
+struct sim_dumb {
+    void *map;                  /* NULL: free */
+    uint32_t pitch;
+    uint64_t size;
+};
+
+struct _drmModeAtomicReq {
+    uint32_t cursor;
+    uint32_t size_items;
+    struct sim_item {
+        uint32_t object_id;
+        uint32_t property_id;
+        uint64_t value;
+    } *items;
+};
+
+static struct {
+    pthread_once_t once;
+    pthread_mutex_t lock;
+    pthread_cond_t wake;        /* the vblank thread, a CRTC was enabled */
+    pthread_cond_t vblank;      /* blocking callers, on every vblank */
+
+    drmModeModeInfo mode;
+    int count_crtcs, count_planes;
+    uint32_t plane_max_w, plane_max_h;
+    uint32_t scale;
+    uint32_t commit_us;
+    uint32_t fail_every;
+    bool verbose;
+
+    int count_objects;
+    struct sim_object objects[SIM_MAX_OBJECTS];
+    struct sim_crtc crtcs[SIM_MAX_CRTCS];
+    struct sim_file files[SIM_MAX_FILES];
+    struct sim_wait waits[SIM_MAX_WAITS];
+    struct sim_blob blobs[SIM_MAX_BLOBS];
+    struct sim_fb fbs[SIM_MAX_FBS];
+    struct sim_dumb dumbs[SIM_MAX_DUMBS];
+
+    /* the state a commit is checked on before it replaces the values */
+    uint64_t staged[SIM_MAX_OBJECTS][PROP_COUNT];
+
+    uint64_t commits, rejected, injected, dropped_events;
+} sim = {
+    .once = PTHREAD_ONCE_INIT,
+    .lock = PTHREAD_MUTEX_INITIALIZER,
+};
+
+static void *real_symbol(const char *name)
+{
+    void *sym = dlsym(RTLD_NEXT, name);
+
+    if (!sym) {
+        fprintf(stderr, "drmsim: no %s to forward to\n", name);
+        abort();
+    }
+    return sym;
+}
+
+static uint64_t sim_time_ns(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+static void sim_log(const char *fmt, ...)
+{
+    va_list ap;
+
+    if (!sim.verbose)
+        return;
+
+    va_start(ap, fmt);
+    fprintf(stderr, "drmsim: ");
+    vfprintf(stderr, fmt, ap);
+    fprintf(stderr, "\n");
+    va_end(ap);
+}
+
+/* -err, with the reason in the verbose log */
+static int reject(int err, const char *fmt, ...)
+{
+    va_list ap;
+
+    sim.rejected++;
+    if (sim.verbose) {
+        va_start(ap, fmt);
+        fprintf(stderr, "drmsim: ");
+        vfprintf(stderr, fmt, ap);
+        fprintf(stderr, ": %s\n", strerror(err));
+        va_end(ap);
+    }
+    return -err;
+}
+
+/* libdrm ioctl wrappers return -1 and set errno */
+static int ioctl_result(int ret)
+{
+    if (ret >= 0)
+        return 0;
+
+    errno = -ret;
+    return -1;
+}
+
+/* the drmModeXxx() ones return -errno and set errno as well */
+static int mode_result(int ret)
+{
+    if (ret < 0)
+        errno = -ret;
+    return ret;
+}
+
+static uint32_t env_uint(const char *name, uint32_t def, uint32_t min, uint32_t max)
+{
+    const char *s = getenv(name);
+    unsigned long value;
+    char *end;
+
+    if (!s || !*s)
+        return def;
+
+    value = strtoul(s, &end, 0);
+    if (*end || value < min || value > max) {
+        fprintf(stderr, "drmsim: ignoring %s=%s, not in %u..%u\n", name, s, min, max);
+        return def;
+    }
+    return value;
+}
+
+static void env_size(const char *name, uint32_t *width, uint32_t *height, uint32_t *refresh)
+{
+    const char *s = getenv(name);
+    unsigned int w, h, hz = refresh ? *refresh : 0;
+
+    if (!s || !*s)
+        return;
+
+    if ((sscanf(s, "%ux%u@%u", &w, &h, &hz) < 2) || !w || !h || w > SIM_MAX_SIZE ||
+            h > SIM_MAX_SIZE || !hz || hz > 240) {
+        fprintf(stderr, "drmsim: ignoring %s=%s\n", name, s);
+        return;
+    }
+
+    *width = w;
+    *height = h;
+    if (refresh)
+        *refresh = hz;
+}
+
+/* CEA-861 like blanking, 2200x1125 for 1080p */
+static void make_mode(drmModeModeInfo *mode, int width, int height, int refresh, uint32_t type)
+{
+    memset(mode, 0, sizeof(*mode));
+    mode->hdisplay = width;
+    mode->hsync_start = width + 88;
+    mode->hsync_end = width + 132;
+    mode->htotal = width + 280;
+    mode->vdisplay = height;
+    mode->vsync_start = height + 4;
+    mode->vsync_end = height + 9;
+    mode->vtotal = height + 45;
+    mode->vrefresh = refresh;
+    mode->clock = (uint64_t)mode->htotal * mode->vtotal * refresh / 1000;
+    mode->flags = DRM_MODE_FLAG_PHSYNC | DRM_MODE_FLAG_PVSYNC;
+    mode->type = type;
+    snprintf(mode->name, sizeof(mode->name), "%dx%d", width, height);
+}
+
+static uint64_t mode_period_ns(const drmModeModeInfo *mode)
+{
+    if (!mode->clock)
+        return 1000000000 / 60;
+
+    return (uint64_t)mode->htotal * mode->vtotal * 1000000 / mode->clock;
+}
+
+static struct sim_object *crtc_object(int crtc)
+{
+    return &sim.objects[crtc];
+}
+
+static struct sim_object *connector_object(int crtc)
+{
+    return &sim.objects[sim.count_crtcs + crtc];
+}
+
+static struct sim_object *plane_object(int crtc, int plane)
+{
+    return &sim.objects[2 * sim.count_crtcs + crtc * sim.count_planes + plane];
+}
+
+static bool crtc_active(int crtc)
+{
+    return crtc_object(crtc)->values[PROP_ACTIVE];
+}
+
+static struct sim_object *find_object(uint32_t id, uint32_t type)
+{
+    int i;
+
+    for (i = 0; i < sim.count_objects; i++) {
+        if (sim.objects[i].id == id && (!type || sim.objects[i].type == type))
+            return &sim.objects[i];
+    }
+    return NULL;
+}
+
+static bool has_prop(const struct sim_object *obj, enum sim_prop prop)
+{
+    int k;
+
+    for (k = 0; k < obj->count_props; k++) {
+        if (obj->props[k] == prop)
+            return true;
+    }
+    return false;
+}
+
+static struct sim_file *find_file(int fd)
+{
+    int i;
+
+    for (i = 0; i < SIM_MAX_FILES; i++) {
+        if (sim.files[i].used && sim.files[i].fd == fd)
+            return &sim.files[i];
+    }
+    return NULL;
+}
+
+static bool is_sim_fd(int fd)
+{
+    bool found;
+
+    if (fd < 0)
+        return false;
+
+    pthread_mutex_lock(&sim.lock);
+    found = find_file(fd) != NULL;
+    pthread_mutex_unlock(&sim.lock);
+
+    return found;
+}
+
+static struct sim_blob *find_blob(uint64_t id)
+{
+    struct sim_blob *blob;
+
+    if (id < BLOB_ID_BASE || id >= BLOB_ID_BASE + SIM_MAX_BLOBS)
+        return NULL;
+
+    blob = &sim.blobs[id - BLOB_ID_BASE];
+    return blob->used && !blob->destroyed ? blob : NULL;
+}
+
+static struct sim_fb *find_fb(uint64_t id)
+{
+    if (id < FB_ID_BASE || id >= FB_ID_BASE + SIM_MAX_FBS || !sim.fbs[id - FB_ID_BASE].used)
+        return NULL;
+
+    return &sim.fbs[id - FB_ID_BASE];
+}
+
+static struct sim_dumb *find_dumb(uint64_t handle)
+{
+    if (handle < 1 || handle > SIM_MAX_DUMBS || !sim.dumbs[handle - 1].map)
+        return NULL;
+
+    return &sim.dumbs[handle - 1];
+}
+
+/* the mode of a MODE_ID value, NULL for none */
+static const drmModeModeInfo *blob_mode(uint64_t id)
+{
+    if (!id)
+        return NULL;
+
+    /* a destroyed blob still in use by the state */
+    return sim.blobs[id - BLOB_ID_BASE].data;
+}
+
+static int create_blob(const void *data, size_t length, uint32_t *id)
+{
+    int i;
+
+    if (!length || length > (1 << 20))
+        return -EINVAL;
+
+    for (i = 0; i < SIM_MAX_BLOBS; i++) {
+        if (!sim.blobs[i].used)
+            break;
+    }
+    if (i == SIM_MAX_BLOBS)
+        return -ENOSPC;
+
+    sim.blobs[i].data = malloc(length);
+    if (!sim.blobs[i].data)
+        return -ENOMEM;
+
+    memcpy(sim.blobs[i].data, data, length);
+    sim.blobs[i].length = length;
+    sim.blobs[i].destroyed = false;
+    sim.blobs[i].used = true;
+    *id = BLOB_ID_BASE + i;
+    return 0;
+}
+
+static bool blob_in_use(uint32_t id)
+{
+    const struct sim_object *obj;
+    int i;
+
+    for (i = 0; i < sim.count_objects; i++) {
+        obj = &sim.objects[i];
+        if ((has_prop(obj, PROP_MODE_ID) && obj->values[PROP_MODE_ID] == id) ||
+                (has_prop(obj, PROP_DAMAGE_CLIPS) && obj->values[PROP_DAMAGE_CLIPS] == id))
+            return true;
+    }
+    return false;
+}
+
+/* free destroyed blobs the state no longer points at */
+static void collect_blobs(void)
+{
+    int i;
+
+    for (i = 0; i < SIM_MAX_BLOBS; i++) {
+        if (sim.blobs[i].used && sim.blobs[i].destroyed && !blob_in_use(BLOB_ID_BASE + i)) {
+            free(sim.blobs[i].data);
+            memset(&sim.blobs[i], 0, sizeof(sim.blobs[i]));
+        }
+    }
+}
+
+static void queue_event(int fd, uint32_t type, int crtc, uint64_t user_data)
+{
+    struct sim_file *file = find_file(fd);
+    struct sim_event *event;
+    uint64_t one = 1;
+
+    /* closed before the event came */
+    if (!file)
+        return;
+
+    if (file->count == SIM_MAX_EVENTS) {
+        sim.dropped_events++;
+        sim_log("events of fd %d are not read, dropping one", fd);
+        return;
+    }
+
+    event = &file->events[(file->head + file->count++) % SIM_MAX_EVENTS];
+    event->type = type;
+    event->crtc_id = crtc_object(crtc)->id;
+    event->seq = sim.crtcs[crtc].seq;
+    event->ns = sim.crtcs[crtc].vblank_ns;
+    event->user_data = user_data;
+
+    if (write(fd, &one, sizeof(one)) != sizeof(one))
+        sim_log("failed to signal fd %d: %s", fd, strerror(errno));
+}
+
+/* send the vblank events due on crtc, all of them when it is turned off */
+static void complete_waits(int crtc, bool all)
+{
+    struct sim_wait *wait;
+    int k;
+
+    for (k = 0; k < SIM_MAX_WAITS; k++) {
+        wait = &sim.waits[k];
+        if (!wait->used || wait->crtc != crtc || (!all && wait->target > sim.crtcs[crtc].seq))
+            continue;
+
+        queue_event(wait->fd, wait->type, crtc, wait->user_data);
+        wait->used = false;
+    }
+}
+
+static int add_wait(int fd, int crtc, uint32_t type, uint64_t target, uint64_t user_data)
+{
+    int k;
+
+    if (target <= sim.crtcs[crtc].seq) {
+        queue_event(fd, type, crtc, user_data);
+        return 0;
+    }
+
+    for (k = 0; k < SIM_MAX_WAITS; k++) {
+        if (!sim.waits[k].used)
+            break;
+    }
+    if (k == SIM_MAX_WAITS)
+        return -ENOMEM;
+
+    sim.waits[k].used = true;
+    sim.waits[k].fd = fd;
+    sim.waits[k].crtc = crtc;
+    sim.waits[k].type = type;
+    sim.waits[k].target = target;
+    sim.waits[k].user_data = user_data;
+    return 0;
+}
+
+static void crtc_vblank(int crtc, uint64_t ns)
+{
+    struct sim_crtc *c = &sim.crtcs[crtc];
+
+    c->seq++;
+    c->vblank_ns = ns;
+
+    if (c->flip_pending) {
+        c->flip_pending = false;
+        if (c->flip_event)
+            queue_event(c->flip_fd, DRM_EVENT_FLIP_COMPLETE, crtc, c->flip_user_data);
+    }
+
+    complete_waits(crtc, false);
+}
+
+static void *vblank_thread(void *data)
+{
+    struct sim_crtc *c;
+    struct timespec ts;
+    uint64_t now, next;
+    int i;
+
+    pthread_mutex_lock(&sim.lock);
+    while (true) {
+        next = 0;
+        for (i = 0; i < sim.count_crtcs; i++) {
+            if (crtc_active(i) && (!next || sim.crtcs[i].next_ns < next))
+                next = sim.crtcs[i].next_ns;
+        }
+
+        if (!next) {
+            pthread_cond_wait(&sim.wake, &sim.lock);
+            continue;
+        }
+
+        now = sim_time_ns();
+        if (now < next) {
+            ts.tv_sec = next / 1000000000;
+            ts.tv_nsec = next % 1000000000;
+            pthread_cond_timedwait(&sim.wake, &sim.lock, &ts);
+            continue;
+        }
+
+        for (i = 0; i < sim.count_crtcs; i++) {
+            c = &sim.crtcs[i];
+            if (!crtc_active(i) || c->next_ns > now)
+                continue;
+
+            /* vblanks the thread slept through still count */
+            while (c->next_ns + c->period_ns <= now) {
+                c->seq++;
+                c->next_ns += c->period_ns;
+            }
+            crtc_vblank(i, c->next_ns);
+            c->next_ns += c->period_ns;
+        }
+        pthread_cond_broadcast(&sim.vblank);
+    }
+
+    return NULL;
+}
+
+static void sim_print_stats(void)
+{
+    if (!sim.count_objects)
+        return;
+
+    fprintf(stderr, "drmsim: %llu commits, %llu rejected, %llu failed on purpose, "
+        "%llu events dropped\n", (unsigned long long)sim.commits,
+        (unsigned long long)sim.rejected, (unsigned long long)sim.injected,
+        (unsigned long long)sim.dropped_events);
+}
+
+static void sim_init(void)
+{
+    pthread_condattr_t attr;
+    pthread_t thread;
+    struct sim_object *obj;
+    uint32_t width = 1920, height = 1080, refresh = 60;
+    int i, j;
+
+    env_size("DRMSIM_MODE", &width, &height, &refresh);
+    sim.count_crtcs = env_uint("DRMSIM_CRTCS", 1, 1, SIM_MAX_CRTCS);
+    sim.count_planes = env_uint("DRMSIM_PLANES", 3, 1, SIM_MAX_PLANES);
+    sim.plane_max_w = sim.plane_max_h = 4096;
+    env_size("DRMSIM_PLANE_MAX", &sim.plane_max_w, &sim.plane_max_h, NULL);
+    sim.scale = env_uint("DRMSIM_SCALE", 8, 1, 64);
+    sim.commit_us = env_uint("DRMSIM_COMMIT_US", 0, 0, 1000000);
+    sim.fail_every = env_uint("DRMSIM_FAIL_EVERY", 0, 0, UINT32_MAX);
+    sim.verbose = env_uint("DRMSIM_VERBOSE", 0, 0, 1);
+    make_mode(&sim.mode, width, height, refresh, DRM_MODE_TYPE_PREFERRED | DRM_MODE_TYPE_DRIVER);
+
+    sim.count_objects = sim.count_crtcs * (sim.count_planes + 2);
+    for (i = 0; i < sim.count_crtcs; i++) {
+        obj = crtc_object(i);
+        obj->id = CRTC_ID_BASE + i;
+        obj->type = DRM_MODE_OBJECT_CRTC;
+        obj->crtc = i;
+        obj->props = crtc_props;
+        obj->count_props = ARRAY_SIZE(crtc_props);
+
+        obj = connector_object(i);
+        obj->id = CONNECTOR_ID_BASE + i;
+        obj->type = DRM_MODE_OBJECT_CONNECTOR;
+        obj->crtc = i;
+        obj->props = connector_props;
+        obj->count_props = ARRAY_SIZE(connector_props);
+
+        for (j = 0; j < sim.count_planes; j++) {
+            obj = plane_object(i, j);
+            obj->id = PLANE_ID_BASE + PLANE_ID_STEP * (i * sim.count_planes + j);
+            obj->type = DRM_MODE_OBJECT_PLANE;
+            obj->crtc = i;
+            obj->props = plane_props;
+            obj->count_props = ARRAY_SIZE(plane_props);
+            obj->values[PROP_TYPE] = j ? DRM_PLANE_TYPE_OVERLAY : DRM_PLANE_TYPE_PRIMARY;
+            obj->values[PROP_ZPOS] = j;
+            obj->values[PROP_ALPHA] = 0xffff;
+            obj->values[PROP_BLEND] = DRM_MODE_BLEND_PREMULTI;
+        }
+    }
+
+    pthread_condattr_init(&attr);
+    pthread_condattr_setclock(&attr, CLOCK_MONOTONIC);
+    pthread_cond_init(&sim.wake, &attr);
+    pthread_cond_init(&sim.vblank, &attr);
+    pthread_condattr_destroy(&attr);
+
+    if (pthread_create(&thread, NULL, vblank_thread, NULL)) {
+        fprintf(stderr, "drmsim: failed to start the vblank thread\n");
+        abort();
+    }
+    pthread_detach(thread);
+    atexit(sim_print_stats);
+
+    fprintf(stderr, "drmsim: %d CRTC(s) at %s@%u, %d planes each up to %ux%u, scaling %ux, "
+        "commit +%u us, failing every %u commits\n",
+        sim.count_crtcs, sim.mode.name, sim.mode.vrefresh, sim.count_planes,
+        sim.plane_max_w, sim.plane_max_h, sim.scale, sim.commit_us, sim.fail_every);
+}
+
+/*
+ * Device nodes and their memory
+ */
+
+static int open_device(const char *path, int flags)
+{
+    int fd, i;
+
+    pthread_once(&sim.once, sim_init);
+
+    fd = eventfd(0, EFD_NONBLOCK | ((flags & O_CLOEXEC) ? EFD_CLOEXEC : 0));
+    if (fd < 0)
+        return -1;
+
+    pthread_mutex_lock(&sim.lock);
+    for (i = 0; i < SIM_MAX_FILES; i++) {
+        if (!sim.files[i].used)
+            break;
+    }
+    if (i < SIM_MAX_FILES) {
+        memset(&sim.files[i], 0, sizeof(sim.files[i]));
+        sim.files[i].used = true;
+        sim.files[i].fd = fd;
+    }
+    pthread_mutex_unlock(&sim.lock);
+
+    if (i == SIM_MAX_FILES) {
+        REAL(close)(fd);
+        errno = EMFILE;
+        return -1;
+    }
+
+    sim_log("%s opened as fd %d", path, fd);
+    return fd;
+}
+
+static bool is_device(const char *path)
+{
+    return path && !strncmp(path, "/dev/dri/", strlen("/dev/dri/"));
+}
+
+int open(const char *path, int flags, ...)
+{
+    mode_t mode = 0;
+    va_list ap;
+
+    if (is_device(path))
+        return open_device(path, flags);
+
+    if ((flags & O_CREAT) || (flags & O_TMPFILE) == O_TMPFILE) {
+        va_start(ap, flags);
+        mode = va_arg(ap, mode_t);
+        va_end(ap);
+    }
+    return REAL(open)(path, flags, mode);
+}
+
+int open64(const char *path, int flags, ...)
+{
+    mode_t mode = 0;
+    va_list ap;
+
+    if (is_device(path))
+        return open_device(path, flags);
+
+    if ((flags & O_CREAT) || (flags & O_TMPFILE) == O_TMPFILE) {
+        va_start(ap, flags);
+        mode = va_arg(ap, mode_t);
+        va_end(ap);
+    }
+    return REAL(open64)(path, flags, mode);
+}
+
+int close(int fd)
+{
+    struct sim_file *file;
+    int k;
+
+    if (fd >= 0) {
+        pthread_mutex_lock(&sim.lock);
+        file = find_file(fd);
+        if (file) {
+            file->used = false;
+            for (k = 0; k < SIM_MAX_WAITS; k++) {
+                if (sim.waits[k].fd == fd)
+                    sim.waits[k].used = false;
+            }
+            for (k = 0; k < sim.count_crtcs; k++) {
+                if (sim.crtcs[k].flip_fd == fd)
+                    sim.crtcs[k].flip_event = false;
+            }
+        }
+        pthread_mutex_unlock(&sim.lock);
+    }
+
+    return REAL(close)(fd);
+}
+
+static void *map_dumb(size_t length, uint64_t offset)
+{
+    struct sim_dumb *dumb;
+    void *map = MAP_FAILED;
+
+    pthread_mutex_lock(&sim.lock);
+    dumb = find_dumb(offset >> DUMB_OFFSET_SHIFT);
+    if (dumb && !(offset & ((1 << DUMB_OFFSET_SHIFT) - 1)) && length <= dumb->size)
+        map = dumb->map;
+    pthread_mutex_unlock(&sim.lock);
+
+    if (map == MAP_FAILED)
+        errno = EINVAL;
+    return map;
+}
+
+void *mmap(void *addr, size_t length, int prot, int flags, int fd, off_t offset)
+{
+    if (!is_sim_fd(fd))
+        return REAL(mmap)(addr, length, prot, flags, fd, offset);
+
+    return map_dumb(length, offset);
+}
+
+void *mmap64(void *addr, size_t length, int prot, int flags, int fd, off64_t offset)
+{
+    if (!is_sim_fd(fd))
+        return REAL(mmap64)(addr, length, prot, flags, fd, offset);
+
+    return map_dumb(length, offset);
+}
+
+int munmap(void *addr, size_t length)
+{
+    bool dumb = false;
+    int k;
+
+    pthread_mutex_lock(&sim.lock);
+    for (k = 0; k < SIM_MAX_DUMBS && !dumb; k++)
+        dumb = addr && sim.dumbs[k].map == addr;
+    pthread_mutex_unlock(&sim.lock);
+
+    /* the memory goes with the buffer */
+    if (dumb)
+        return 0;
+
+    return REAL(munmap)(addr, length);
+}
+
+/*
+ * Commits
+ */
+
+static bool scale_ok(uint64_t src, uint64_t dst)
+{
+    return src <= dst * sim.scale && dst <= src * sim.scale;
+}
+
+static int check_value(const struct sim_object *obj, enum sim_prop prop, uint64_t value)
+{
+    const struct sim_prop_info *info = &prop_info[prop];
+    const struct sim_blob *blob;
+    int k;
+
+    switch (prop) {
+    case PROP_TYPE:
+        if (value != obj->values[prop])
+            return reject(EINVAL, "%s of %u is immutable", info->name, obj->id);
+        break;
+    case PROP_FB_ID:
+        if (value && !find_fb(value))
+            return reject(EINVAL, "%u: no fb %llu", obj->id, (unsigned long long)value);
+        break;
+    case PROP_CRTC_ID:
+        if (value && value != crtc_object(obj->crtc)->id)
+            return reject(EINVAL, "%u cannot be on CRTC %llu", obj->id, (unsigned long long)value);
+        break;
+    case PROP_MODE_ID:
+    case PROP_DAMAGE_CLIPS:
+        blob = find_blob(value);
+        if (value && (!blob || (prop == PROP_MODE_ID && blob->length != sizeof(drmModeModeInfo))))
+            return reject(EINVAL, "%u: no %s blob %llu", obj->id, info->name,
+                (unsigned long long)value);
+        break;
+    case PROP_CRTC_X:
+    case PROP_CRTC_Y:
+        if ((int64_t)value < (int64_t)info->min || (int64_t)value > (int64_t)info->max)
+            return reject(EINVAL, "%s %lld of %u out of range", info->name, (long long)value, obj->id);
+        break;
+    case PROP_ZPOS:
+        if (value >= (uint64_t)sim.count_planes)
+            return reject(EINVAL, "zpos %llu of %u out of range", (unsigned long long)value, obj->id);
+        break;
+    case PROP_BLEND:
+        for (k = 0; k < info->count_enums && info->enums[k].value != value; k++)
+            ;
+        if (k == info->count_enums)
+            return reject(EINVAL, "%s %llu of %u", info->name, (unsigned long long)value, obj->id);
+        break;
+    default:
+        if (value < info->min || value > info->max)
+            return reject(EINVAL, "%s %llu of %u out of range", info->name,
+                (unsigned long long)value, obj->id);
+        break;
+    }
+
+    return 0;
+}
+
+/* apply the items to a copy of the state, noting the CRTCs they touch */
+static int stage_items(const struct sim_item *items, int count, bool *touched)
+{
+    const struct sim_item *item;
+    struct sim_object *obj;
+    enum sim_prop prop;
+    int i, ret;
+
+    for (i = 0; i < sim.count_objects; i++)
+        memcpy(sim.staged[i], sim.objects[i].values, sizeof(sim.staged[i]));
+    memset(touched, 0, SIM_MAX_CRTCS * sizeof(*touched));
+
+    for (i = 0; i < count; i++) {
+        item = &items[i];
+        obj = find_object(item->object_id, DRM_MODE_OBJECT_ANY);
+        if (!obj)
+            return reject(ENOENT, "no object %u", item->object_id);
+
+        prop = item->property_id - 1;
+        if (!item->property_id || prop >= PROP_COUNT || !has_prop(obj, prop))
+            return reject(EINVAL, "object %u has no property %u", obj->id, item->property_id);
+
+        ret = check_value(obj, prop, item->value);
+        if (ret)
+            return ret;
+
+        sim.staged[obj - sim.objects][prop] = item->value;
+        touched[obj->crtc] = true;
+    }
+
+    return 0;
+}
+
+static bool mode_changed(uint64_t old_id, uint64_t new_id)
+{
+    const drmModeModeInfo *old_mode = blob_mode(old_id), *new_mode = blob_mode(new_id);
+
+    if (!old_mode || !new_mode)
+        return old_mode != new_mode;
+
+    return memcmp(old_mode, new_mode, sizeof(*old_mode)) != 0;
+}
+
+static int check_plane(const struct sim_object *obj)
+{
+    const uint64_t *v = sim.staged[obj - sim.objects];
+    const struct sim_fb *fb;
+    uint64_t src_w, src_h;
+
+    if (!v[PROP_FB_ID] && !v[PROP_CRTC_ID])
+        return 0;
+    if (!v[PROP_FB_ID] || !v[PROP_CRTC_ID])
+        return reject(EINVAL, "plane %u needs both FB_ID and CRTC_ID", obj->id);
+    if (!sim.staged[obj->crtc][PROP_ACTIVE])
+        return reject(EINVAL, "plane %u is on disabled CRTC %u", obj->id, crtc_object(obj->crtc)->id);
+
+    fb = find_fb(v[PROP_FB_ID]);
+    if (v[PROP_SRC_X] + v[PROP_SRC_W] > (uint64_t)fb->width << 16 ||
+            v[PROP_SRC_Y] + v[PROP_SRC_H] > (uint64_t)fb->height << 16)
+        return reject(ENOSPC, "plane %u source is outside of fb %llu", obj->id,
+            (unsigned long long)v[PROP_FB_ID]);
+
+    src_w = v[PROP_SRC_W] >> 16;
+    src_h = v[PROP_SRC_H] >> 16;
+    if (!src_w || !src_h || !v[PROP_CRTC_W] || !v[PROP_CRTC_H])
+        return reject(EINVAL, "plane %u is empty", obj->id);
+
+    if (src_w > sim.plane_max_w || src_h > sim.plane_max_h ||
+            v[PROP_CRTC_W] > sim.plane_max_w || v[PROP_CRTC_H] > sim.plane_max_h)
+        return reject(EINVAL, "plane %u is larger than %ux%u", obj->id,
+            sim.plane_max_w, sim.plane_max_h);
+
+    if (!scale_ok(src_w, v[PROP_CRTC_W]) || !scale_ok(src_h, v[PROP_CRTC_H]))
+        return reject(ERANGE, "plane %u cannot scale %llux%llu to %llux%llu", obj->id,
+            (unsigned long long)src_w, (unsigned long long)src_h,
+            (unsigned long long)v[PROP_CRTC_W], (unsigned long long)v[PROP_CRTC_H]);
+
+    return 0;
+}
+
+static int check_commit(uint32_t flags, const bool *touched, bool *modeset)
+{
+    const struct sim_object *crtc, *connector;
+    bool active, routed, any = false;
+    int i, j, ret;
+
+    for (i = 0; i < sim.count_crtcs; i++) {
+        modeset[i] = false;
+        if (!touched[i])
+            continue;
+
+        any = true;
+        crtc = crtc_object(i);
+        connector = connector_object(i);
+        active = sim.staged[i][PROP_ACTIVE];
+        routed = sim.staged[connector - sim.objects][PROP_CRTC_ID] == crtc->id;
+
+        modeset[i] = active != crtc->values[PROP_ACTIVE] ||
+            mode_changed(crtc->values[PROP_MODE_ID], sim.staged[i][PROP_MODE_ID]) ||
+            routed != (connector->values[PROP_CRTC_ID] == crtc->id);
+        if (modeset[i] && !(flags & DRM_MODE_ATOMIC_ALLOW_MODESET))
+            return reject(EINVAL, "CRTC %u needs a modeset", crtc->id);
+
+        if (active && !sim.staged[i][PROP_MODE_ID])
+            return reject(EINVAL, "CRTC %u is active without a mode", crtc->id);
+        if (active && !routed)
+            return reject(EINVAL, "CRTC %u is active without a connector", crtc->id);
+        if ((flags & DRM_MODE_PAGE_FLIP_EVENT) && !active && !crtc->values[PROP_ACTIVE])
+            return reject(EINVAL, "event on disabled CRTC %u", crtc->id);
+        if ((flags & DRM_MODE_ATOMIC_NONBLOCK) && !(flags & DRM_MODE_ATOMIC_TEST_ONLY) &&
+                sim.crtcs[i].flip_pending)
+            return reject(EBUSY, "CRTC %u still has a commit pending", crtc->id);
+
+        for (j = 0; j < sim.count_planes; j++) {
+            ret = check_plane(plane_object(i, j));
+            if (ret)
+                return ret;
+        }
+    }
+
+    if ((flags & DRM_MODE_PAGE_FLIP_EVENT) && !any)
+        return reject(EINVAL, "event without a CRTC");
+
+    return 0;
+}
+
+static void apply_commit(int fd, uint32_t flags, uint64_t user_data,
+    const bool *touched, const bool *modeset)
+{
+    bool was_active[SIM_MAX_CRTCS];
+    struct sim_crtc *c;
+    int i;
+
+    for (i = 0; i < sim.count_crtcs; i++)
+        was_active[i] = crtc_active(i);
+
+    for (i = 0; i < sim.count_objects; i++) {
+        memcpy(sim.objects[i].values, sim.staged[i], sizeof(sim.staged[i]));
+        /* damage is only for the commit that carries it */
+        if (sim.objects[i].type == DRM_MODE_OBJECT_PLANE)
+            sim.objects[i].values[PROP_DAMAGE_CLIPS] = 0;
+    }
+
+    for (i = 0; i < sim.count_crtcs; i++) {
+        if (!touched[i])
+            continue;
+
+        c = &sim.crtcs[i];
+        if (crtc_active(i)) {
+            if (modeset[i]) {
+                c->period_ns = mode_period_ns(blob_mode(crtc_object(i)->values[PROP_MODE_ID]));
+                if (!was_active[i]) {
+                    c->next_ns = sim_time_ns() + c->period_ns;
+                    pthread_cond_signal(&sim.wake);
+                }
+            }
+            c->flip_pending = true;
+            c->flip_event = flags & DRM_MODE_PAGE_FLIP_EVENT;
+            c->flip_fd = fd;
+            c->flip_user_data = user_data;
+        } else {
+            /* turning a CRTC off sends what was waiting for its vblanks */
+            if (was_active[i])
+                complete_waits(i, true);
+            if (flags & DRM_MODE_PAGE_FLIP_EVENT)
+                queue_event(fd, DRM_EVENT_FLIP_COMPLETE, i, user_data);
+        }
+    }
+
+    collect_blobs();
+}
+
+static bool flips_pending(const bool *touched)
+{
+    int i;
+
+    for (i = 0; i < sim.count_crtcs; i++) {
+        if (touched[i] && sim.crtcs[i].flip_pending)
+            return true;
+    }
+    return false;
+}
+
+static int sim_commit(int fd, const struct sim_item *items, int count,
+    uint32_t flags, uint64_t user_data)
+{
+    bool touched[SIM_MAX_CRTCS], modeset[SIM_MAX_CRTCS];
+    bool test_only = flags & DRM_MODE_ATOMIC_TEST_ONLY;
+    struct timespec ts;
+    int ret;
+
+    if (flags & ~(DRM_MODE_PAGE_FLIP_EVENT | DRM_MODE_ATOMIC_TEST_ONLY |
+            DRM_MODE_ATOMIC_NONBLOCK | DRM_MODE_ATOMIC_ALLOW_MODESET))
+        return reject(EINVAL, "unsupported commit flags 0x%x", flags);
+    if (test_only && (flags & DRM_MODE_PAGE_FLIP_EVENT))
+        return reject(EINVAL, "event on a test commit");
+
+    if (!test_only && sim.commit_us) {
+        ts.tv_sec = sim.commit_us / 1000000;
+        ts.tv_nsec = sim.commit_us % 1000000 * 1000;
+        clock_nanosleep(CLOCK_MONOTONIC, 0, &ts, NULL);
+    }
+
+    pthread_mutex_lock(&sim.lock);
+    while (true) {
+        ret = stage_items(items, count, touched);
+        if (ret)
+            goto out;
+
+        /* a blocking commit waits for the previous one, then checks again */
+        if (test_only || (flags & DRM_MODE_ATOMIC_NONBLOCK) || !flips_pending(touched))
+            break;
+        pthread_cond_wait(&sim.vblank, &sim.lock);
+    }
+
+    ret = check_commit(flags, touched, modeset);
+    if (ret || test_only)
+        goto out;
+
+    sim.commits++;
+    if (sim.fail_every && sim.commits % sim.fail_every == 0) {
+        sim.injected++;
+        ret = reject(EINVAL, "commit %llu fails on purpose", (unsigned long long)sim.commits);
+        goto out;
+    }
+
+    apply_commit(fd, flags, user_data, touched, modeset);
+    sim_log("commit %llu: %d properties, flags 0x%x", (unsigned long long)sim.commits, count, flags);
+
+    if (!(flags & DRM_MODE_ATOMIC_NONBLOCK)) {
+        while (flips_pending(touched))
+            pthread_cond_wait(&sim.vblank, &sim.lock);
+    }
+
+out:
+    pthread_mutex_unlock(&sim.lock);
+    return ret;
+}
+
+/* DRM_IOCTL_MODE_ATOMIC as the kernel gets it, objects with their properties */
+static int sim_atomic_ioctl(int fd, const struct drm_mode_atomic *atomic)
+{
+    const uint32_t *objs = (const uint32_t *)(uintptr_t)atomic->objs_ptr;
+    const uint32_t *count_props = (const uint32_t *)(uintptr_t)atomic->count_props_ptr;
+    const uint32_t *props = (const uint32_t *)(uintptr_t)atomic->props_ptr;
+    const uint64_t *values = (const uint64_t *)(uintptr_t)atomic->prop_values_ptr;
+    struct sim_item *items;
+    uint32_t i, j, count = 0;
+    int ret;
+
+    for (i = 0; i < atomic->count_objs; i++)
+        count += count_props[i];
+
+    items = malloc((count ? count : 1) * sizeof(*items));
+    if (!items)
+        return -ENOMEM;
+
+    count = 0;
+    for (i = 0; i < atomic->count_objs; i++) {
+        for (j = 0; j < count_props[i]; j++, count++) {
+            items[count].object_id = objs[i];
+            items[count].property_id = props[count];
+            items[count].value = values[count];
+        }
+    }
+
+    ret = sim_commit(fd, items, count, atomic->flags, atomic->user_data);
+    free(items);
+    return ret;
+}
+
+/* a request for a real device, grouped by object the way libdrm sends it */
+static int forward_commit(int fd, const drmModeAtomicReq *req, uint32_t flags, void *user_data)
+{
+    struct drm_mode_atomic atomic;
+    uint32_t *objs, *count_props, *props;
+    uint64_t *values;
+    uint32_t i, j, count_objs = 0, count = 0;
+    int ret = -ENOMEM;
+
+    objs = calloc(req->cursor, sizeof(*objs));
+    count_props = calloc(req->cursor, sizeof(*count_props));
+    props = calloc(req->cursor, sizeof(*props));
+    values = calloc(req->cursor, sizeof(*values));
+    if (!objs || !count_props || !props || !values)
+        goto out;
+
+    for (i = 0; i < req->cursor; i++) {
+        for (j = 0; j < count_objs && objs[j] != req->items[i].object_id; j++)
+            ;
+        if (j == count_objs)
+            objs[count_objs++] = req->items[i].object_id;
+    }
+
+    for (j = 0; j < count_objs; j++) {
+        for (i = 0; i < req->cursor; i++) {
+            if (req->items[i].object_id != objs[j])
+                continue;
+            props[count] = req->items[i].property_id;
+            values[count++] = req->items[i].value;
+            count_props[j]++;
+        }
+    }
+
+    memset(&atomic, 0, sizeof(atomic));
+    atomic.flags = flags;
+    atomic.count_objs = count_objs;
+    atomic.objs_ptr = (uintptr_t)objs;
+    atomic.count_props_ptr = (uintptr_t)count_props;
+    atomic.props_ptr = (uintptr_t)props;
+    atomic.prop_values_ptr = (uintptr_t)values;
+    atomic.user_data = (uintptr_t)user_data;
+    ret = REAL(drmIoctl)(fd, DRM_IOCTL_MODE_ATOMIC, &atomic) ? -errno : 0;
+
+out:
+    free(objs);
+    free(count_props);
+    free(props);
+    free(values);
+    return ret;
+}
+
+/*
+ * Atomic requests, ours for every device
+ */
+
+drmModeAtomicReqPtr drmModeAtomicAlloc(void)
+{
+    return calloc(1, sizeof(drmModeAtomicReq));
+}
+
+drmModeAtomicReqPtr drmModeAtomicDuplicate(const drmModeAtomicReqPtr old)
+{
+    drmModeAtomicReqPtr req;
+
+    if (!old)
+        return NULL;
+
+    req = drmModeAtomicAlloc();
+    if (!req)
+        return NULL;
+
+    if (old->cursor) {
+        req->items = malloc(old->size_items * sizeof(*req->items));
+        if (!req->items) {
+            free(req);
+            return NULL;
+        }
+        memcpy(req->items, old->items, old->cursor * sizeof(*req->items));
+        req->size_items = old->size_items;
+        req->cursor = old->cursor;
+    }
+    return req;
+}
+
+static int reserve_items(drmModeAtomicReqPtr req, uint32_t count)
+{
+    struct sim_item *items;
+    uint32_t size = req->size_items ? req->size_items : 16;
+
+    if (count <= req->size_items)
+        return 0;
+
+    while (size < count)
+        size *= 2;
+
+    items = realloc(req->items, size * sizeof(*items));
+    if (!items)
+        return -ENOMEM;
+
+    req->items = items;
+    req->size_items = size;
+    return 0;
+}
+
+int drmModeAtomicMerge(drmModeAtomicReqPtr base, const drmModeAtomicReqPtr augment)
+{
+    if (!base)
+        return -EINVAL;
+    if (!augment || !augment->cursor)
+        return 0;
+
+    if (reserve_items(base, base->cursor + augment->cursor))
+        return -ENOMEM;
+
+    memcpy(base->items + base->cursor, augment->items, augment->cursor * sizeof(*base->items));
+    base->cursor += augment->cursor;
+    return 0;
+}
+
+void drmModeAtomicFree(drmModeAtomicReqPtr req)
+{
+    if (!req)
+        return;
+
+    free(req->items);
+    free(req);
+}
+
+int drmModeAtomicGetCursor(const drmModeAtomicReqPtr req)
+{
+    return req ? (int)req->cursor : -EINVAL;
+}
+
+void drmModeAtomicSetCursor(drmModeAtomicReqPtr req, int cursor)
+{
+    if (req)
+        req->cursor = cursor;
+}
+
+int drmModeAtomicAddProperty(drmModeAtomicReqPtr req, uint32_t object_id,
+    uint32_t property_id, uint64_t value)
+{
+    if (!req)
+        return -EINVAL;
+
+    if (reserve_items(req, req->cursor + 1))
+        return -ENOMEM;
+
+    req->items[req->cursor].object_id = object_id;
+    req->items[req->cursor].property_id = property_id;
+    req->items[req->cursor].value = value;
+    return ++req->cursor;
+}
+
+int drmModeAtomicCommit(int fd, const drmModeAtomicReqPtr req, uint32_t flags, void *user_data)
+{
+    if (!req)
+        return mode_result(-EINVAL);
+    if (!req->cursor)
+        return 0;
+
+    if (!is_sim_fd(fd))
+        return mode_result(forward_commit(fd, req, flags, user_data));
+
+    return mode_result(sim_commit(fd, req->items, req->cursor, flags, (uintptr_t)user_data));
+}
+
+/*
+ * Legacy calls, turned into commits the way the atomic helpers do
+ */
+
+static int crtc_index(uint32_t crtc_id)
+{
+    const struct sim_object *crtc = find_object(crtc_id, DRM_MODE_OBJECT_CRTC);
+
+    return crtc ? crtc->crtc : -1;
+}
+
+static int add_item(struct sim_item *items, int count, uint32_t object_id,
+    enum sim_prop prop, uint64_t value)
+{
+    items[count].object_id = object_id;
+    items[count].property_id = PROP_ID(prop);
+    items[count].value = value;
+    return count + 1;
+}
+
+int drmModeSetCrtc(int fd, uint32_t crtc_id, uint32_t fb_id, uint32_t x, uint32_t y,
+    uint32_t *connectors, int count_connectors, drmModeModeInfoPtr mode)
+{
+    struct sim_item items[SIM_MAX_CRTCS + SIM_MAX_PLANES * 2 + 16];
+    uint32_t primary_id, mode_id = 0;
+    int crtc, i, n = 0, ret;
+
+    if (!is_sim_fd(fd))
+        return REAL(drmModeSetCrtc)(fd, crtc_id, fb_id, x, y, connectors, count_connectors, mode);
+
+    pthread_mutex_lock(&sim.lock);
+    crtc = crtc_index(crtc_id);
+    if (crtc < 0 || count_connectors > SIM_MAX_CRTCS) {
+        pthread_mutex_unlock(&sim.lock);
+        return mode_result(-ENOENT);
+    }
+    primary_id = plane_object(crtc, 0)->id;
+
+    if (mode) {
+        ret = create_blob(mode, sizeof(*mode), &mode_id);
+        if (ret) {
+            pthread_mutex_unlock(&sim.lock);
+            return mode_result(ret);
+        }
+        n = add_item(items, n, crtc_id, PROP_MODE_ID, mode_id);
+        n = add_item(items, n, crtc_id, PROP_ACTIVE, 1);
+        for (i = 0; i < count_connectors; i++)
+            n = add_item(items, n, connectors[i], PROP_CRTC_ID, crtc_id);
+        n = add_item(items, n, primary_id, PROP_FB_ID, fb_id);
+        n = add_item(items, n, primary_id, PROP_CRTC_ID, fb_id ? crtc_id : 0);
+        n = add_item(items, n, primary_id, PROP_SRC_X, (uint64_t)x << 16);
+        n = add_item(items, n, primary_id, PROP_SRC_Y, (uint64_t)y << 16);
+        n = add_item(items, n, primary_id, PROP_SRC_W, (uint64_t)mode->hdisplay << 16);
+        n = add_item(items, n, primary_id, PROP_SRC_H, (uint64_t)mode->vdisplay << 16);
+        n = add_item(items, n, primary_id, PROP_CRTC_X, 0);
+        n = add_item(items, n, primary_id, PROP_CRTC_Y, 0);
+        n = add_item(items, n, primary_id, PROP_CRTC_W, mode->hdisplay);
+        n = add_item(items, n, primary_id, PROP_CRTC_H, mode->vdisplay);
+    } else {
+        /* off, with every plane on it */
+        n = add_item(items, n, crtc_id, PROP_MODE_ID, 0);
+        n = add_item(items, n, crtc_id, PROP_ACTIVE, 0);
+        n = add_item(items, n, connector_object(crtc)->id, PROP_CRTC_ID, 0);
+        for (i = 0; i < sim.count_planes; i++) {
+            n = add_item(items, n, plane_object(crtc, i)->id, PROP_FB_ID, 0);
+            n = add_item(items, n, plane_object(crtc, i)->id, PROP_CRTC_ID, 0);
+        }
+    }
+    pthread_mutex_unlock(&sim.lock);
+
+    ret = sim_commit(fd, items, n, DRM_MODE_ATOMIC_ALLOW_MODESET, 0);
+
+    /* freed once the CRTC moves on to another mode */
+    if (mode_id) {
+        pthread_mutex_lock(&sim.lock);
+        sim.blobs[mode_id - BLOB_ID_BASE].destroyed = true;
+        collect_blobs();
+        pthread_mutex_unlock(&sim.lock);
+    }
+    return mode_result(ret);
+}
+
+int drmModeSetPlane(int fd, uint32_t plane_id, uint32_t crtc_id, uint32_t fb_id,
+    uint32_t flags, int32_t crtc_x, int32_t crtc_y, uint32_t crtc_w, uint32_t crtc_h,
+    uint32_t src_x, uint32_t src_y, uint32_t src_w, uint32_t src_h)
+{
+    struct sim_item items[10];
+    int n = 0;
+
+    if (!is_sim_fd(fd))
+        return REAL(drmModeSetPlane)(fd, plane_id, crtc_id, fb_id, flags,
+            crtc_x, crtc_y, crtc_w, crtc_h, src_x, src_y, src_w, src_h);
+
+    n = add_item(items, n, plane_id, PROP_FB_ID, fb_id);
+    n = add_item(items, n, plane_id, PROP_CRTC_ID, fb_id ? crtc_id : 0);
+    if (fb_id) {
+        n = add_item(items, n, plane_id, PROP_CRTC_X, (int64_t)crtc_x);
+        n = add_item(items, n, plane_id, PROP_CRTC_Y, (int64_t)crtc_y);
+        n = add_item(items, n, plane_id, PROP_CRTC_W, crtc_w);
+        n = add_item(items, n, plane_id, PROP_CRTC_H, crtc_h);
+        n = add_item(items, n, plane_id, PROP_SRC_X, src_x);
+        n = add_item(items, n, plane_id, PROP_SRC_Y, src_y);
+        n = add_item(items, n, plane_id, PROP_SRC_W, src_w);
+        n = add_item(items, n, plane_id, PROP_SRC_H, src_h);
+    }
+
+    return mode_result(sim_commit(fd, items, n, 0, 0));
+}
+
+int drmModePageFlip(int fd, uint32_t crtc_id, uint32_t fb_id, uint32_t flags, void *user_data)
+{
+    struct sim_item item;
+    int crtc;
+
+    if (!is_sim_fd(fd))
+        return REAL(drmModePageFlip)(fd, crtc_id, fb_id, flags, user_data);
+
+    if (flags & ~DRM_MODE_PAGE_FLIP_EVENT)
+        return mode_result(reject(EINVAL, "unsupported page flip flags 0x%x", flags));
+
+    pthread_mutex_lock(&sim.lock);
+    crtc = crtc_index(crtc_id);
+    if (crtc >= 0 && !crtc_active(crtc))
+        crtc = -1;
+    if (crtc >= 0)
+        add_item(&item, 0, plane_object(crtc, 0)->id, PROP_FB_ID, fb_id);
+    pthread_mutex_unlock(&sim.lock);
+
+    if (crtc < 0)
+        return mode_result(reject(EINVAL, "page flip on CRTC %u that is off", crtc_id));
+
+    return mode_result(sim_commit(fd, &item, 1, DRM_MODE_ATOMIC_NONBLOCK | flags,
+        (uintptr_t)user_data));
+}
+
+/*
+ * Events and vblanks
+ */
+
+int drmHandleEvent(int fd, drmEventContextPtr ctx)
+{
+    struct sim_event events[SIM_MAX_EVENTS], *event;
+    struct sim_file *file;
+    uint64_t counter;
+    unsigned int sec, usec;
+    int i, count = 0;
+
+    if (!is_sim_fd(fd))
+        return REAL(drmHandleEvent)(fd, ctx);
+
+    /* events queued after this read signal the fd again */
+    if (read(fd, &counter, sizeof(counter)) < 0 && errno != EAGAIN)
+        return -1;
+
+    pthread_mutex_lock(&sim.lock);
+    file = find_file(fd);
+    if (file) {
+        for (count = 0; count < file->count; count++)
+            events[count] = file->events[(file->head + count) % SIM_MAX_EVENTS];
+        file->head = 0;
+        file->count = 0;
+    }
+    pthread_mutex_unlock(&sim.lock);
+
+    for (i = 0; i < count; i++) {
+        event = &events[i];
+        sec = event->ns / 1000000000;
+        usec = event->ns % 1000000000 / 1000;
+
+        switch (event->type) {
+        case DRM_EVENT_VBLANK:
+            if (ctx->vblank_handler)
+                ctx->vblank_handler(fd, event->seq, sec, usec,
+                    (void *)(uintptr_t)event->user_data);
+            break;
+        case DRM_EVENT_FLIP_COMPLETE:
+            if (ctx->version >= 3 && ctx->page_flip_handler2)
+                ctx->page_flip_handler2(fd, event->seq, sec, usec, event->crtc_id,
+                    (void *)(uintptr_t)event->user_data);
+            else if (ctx->version >= 2 && ctx->page_flip_handler)
+                ctx->page_flip_handler(fd, event->seq, sec, usec,
+                    (void *)(uintptr_t)event->user_data);
+            break;
+        case DRM_EVENT_CRTC_SEQUENCE:
+            if (ctx->version >= 4 && ctx->sequence_handler)
+                ctx->sequence_handler(fd, event->seq, event->ns, event->user_data);
+            break;
+        }
+    }
+
+    return 0;
+}
+
+int drmWaitVBlank(int fd, drmVBlankPtr vbl)
+{
+    uint32_t type, sequence;
+    uint64_t target;
+    struct sim_crtc *c;
+    int crtc, ret = 0;
+
+    if (!is_sim_fd(fd))
+        return REAL(drmWaitVBlank)(fd, vbl);
+
+    type = vbl->request.type;
+    sequence = vbl->request.sequence;
+    if (type & DRM_VBLANK_SECONDARY)
+        crtc = 1;
+    else
+        crtc = (type & DRM_VBLANK_HIGH_CRTC_MASK) >> DRM_VBLANK_HIGH_CRTC_SHIFT;
+
+    pthread_mutex_lock(&sim.lock);
+    if (crtc >= sim.count_crtcs || !crtc_active(crtc)) {
+        pthread_mutex_unlock(&sim.lock);
+        return ioctl_result(reject(EINVAL, "vblank wait on CRTC %d that is off", crtc));
+    }
+
+    c = &sim.crtcs[crtc];
+    if (type & DRM_VBLANK_RELATIVE)
+        target = c->seq + sequence;
+    else
+        target = c->seq + (int32_t)(sequence - (uint32_t)c->seq);
+    if ((type & DRM_VBLANK_NEXTONMISS) && target <= c->seq)
+        target = c->seq + 1;
+
+    if (type & DRM_VBLANK_EVENT) {
+        ret = add_wait(fd, crtc, DRM_EVENT_VBLANK, target, vbl->request.signal);
+        vbl->reply.sequence = target;
+    } else {
+        while (c->seq < target && crtc_active(crtc))
+            pthread_cond_wait(&sim.vblank, &sim.lock);
+        vbl->reply.sequence = c->seq;
+        vbl->reply.tval_sec = c->vblank_ns / 1000000000;
+        vbl->reply.tval_usec = c->vblank_ns % 1000000000 / 1000;
+    }
+    pthread_mutex_unlock(&sim.lock);
+
+    return ioctl_result(ret);
+}
+
+int drmCrtcGetSequence(int fd, uint32_t crtc_id, uint64_t *sequence, uint64_t *ns)
+{
+    int crtc;
+
+    if (!is_sim_fd(fd))
+        return REAL(drmCrtcGetSequence)(fd, crtc_id, sequence, ns);
+
+    pthread_mutex_lock(&sim.lock);
+    crtc = crtc_index(crtc_id);
+    if (crtc >= 0) {
+        *sequence = sim.crtcs[crtc].seq;
+        *ns = sim.crtcs[crtc].vblank_ns;
+    }
+    pthread_mutex_unlock(&sim.lock);
+
+    return ioctl_result(crtc < 0 ? -ENOENT : 0);
+}
+
+int drmCrtcQueueSequence(int fd, uint32_t crtc_id, uint32_t flags, uint64_t sequence,
+    uint64_t *sequence_queued, uint64_t user_data)
+{
+    uint64_t target;
+    int crtc, ret;
+
+    if (!is_sim_fd(fd))
+        return REAL(drmCrtcQueueSequence)(fd, crtc_id, flags, sequence, sequence_queued, user_data);
+
+    pthread_mutex_lock(&sim.lock);
+    crtc = crtc_index(crtc_id);
+    if (crtc < 0 || !crtc_active(crtc)) {
+        pthread_mutex_unlock(&sim.lock);
+        return ioctl_result(reject(EINVAL, "sequence on CRTC %u that is off", crtc_id));
+    }
+
+    target = sequence;
+    if (flags & DRM_CRTC_SEQUENCE_RELATIVE)
+        target += sim.crtcs[crtc].seq;
+    if ((flags & DRM_CRTC_SEQUENCE_NEXT_ON_MISS) && target <= sim.crtcs[crtc].seq)
+        target = sim.crtcs[crtc].seq + 1;
+
+    ret = add_wait(fd, crtc, DRM_EVENT_CRTC_SEQUENCE, target, user_data);
+    if (!ret && sequence_queued)
+        *sequence_queued = target;
+    pthread_mutex_unlock(&sim.lock);
+
+    return ioctl_result(ret);
+}
+
+/*
+ * Caps and version
+ */
+
+int drmGetCap(int fd, uint64_t capability, uint64_t *value)
+{
+    if (!is_sim_fd(fd))
+        return REAL(drmGetCap)(fd, capability, value);
+
+    switch (capability) {
+    case DRM_CAP_DUMB_BUFFER:
+    case DRM_CAP_VBLANK_HIGH_CRTC:
+    case DRM_CAP_TIMESTAMP_MONOTONIC:
+    case DRM_CAP_CRTC_IN_VBLANK_EVENT:
+        *value = 1;
+        return 0;
+    case DRM_CAP_DUMB_PREFERRED_DEPTH:
+        *value = 24;
+        return 0;
+    case DRM_CAP_ASYNC_PAGE_FLIP:
+    case DRM_CAP_ADDFB2_MODIFIERS:
+        *value = 0;
+        return 0;
+    }
+
+    return ioctl_result(-EINVAL);
+}
+
+int drmSetClientCap(int fd, uint64_t capability, uint64_t value)
+{
+    if (!is_sim_fd(fd))
+        return REAL(drmSetClientCap)(fd, capability, value);
+
+    switch (capability) {
+    case DRM_CLIENT_CAP_UNIVERSAL_PLANES:
+    case DRM_CLIENT_CAP_ATOMIC:
+        return 0;
+    }
+
+    /* no writeback connectors among the rest */
+    return ioctl_result(-EINVAL);
+}
+
+drmVersionPtr drmGetVersion(int fd)
+{
+    drmVersionPtr version;
+
+    if (!is_sim_fd(fd))
+        return REAL(drmGetVersion)(fd);
+
+    /* malloc'ed like libdrm does, so drmFreeVersion() takes it */
+    version = calloc(1, sizeof(*version));
+    if (!version)
+        return NULL;
+
+    version->version_major = 1;
+    version->name = strdup("drmsim");
+    version->name_len = strlen("drmsim");
+    version->date = strdup("20261016");
+    version->date_len = strlen("20261016");
+    version->desc = strdup("KMS simulator");
+    version->desc_len = strlen("KMS simulator");
+    return version;
+}
+
+/*
+ * Objects and properties, all allocated the way libdrm does so that its
+ * drmModeFree*() release them
+ */
+
+drmModeResPtr drmModeGetResources(int fd)
+{
+    drmModeResPtr res;
+    int i, k;
+
+    if (!is_sim_fd(fd))
+        return REAL(drmModeGetResources)(fd);
+
+    res = calloc(1, sizeof(*res));
+    if (!res)
+        return NULL;
+
+    pthread_mutex_lock(&sim.lock);
+    for (k = 0; k < SIM_MAX_FBS; k++)
+        res->count_fbs += sim.fbs[k].used;
+    res->count_crtcs = res->count_connectors = res->count_encoders = sim.count_crtcs;
+
+    res->fbs = calloc(res->count_fbs + 1, sizeof(*res->fbs));
+    res->crtcs = calloc(sim.count_crtcs, sizeof(*res->crtcs));
+    res->connectors = calloc(sim.count_crtcs, sizeof(*res->connectors));
+    res->encoders = calloc(sim.count_crtcs, sizeof(*res->encoders));
+    if (res->fbs && res->crtcs && res->connectors && res->encoders) {
+        for (i = 0, k = 0; k < SIM_MAX_FBS; k++) {
+            if (sim.fbs[k].used)
+                res->fbs[i++] = FB_ID_BASE + k;
+        }
+        for (i = 0; i < sim.count_crtcs; i++) {
+            res->crtcs[i] = crtc_object(i)->id;
+            res->connectors[i] = connector_object(i)->id;
+            res->encoders[i] = ENCODER_ID_BASE + i;
+        }
+    }
+    pthread_mutex_unlock(&sim.lock);
+
+    res->max_width = res->max_height = SIM_MAX_SIZE;
+    if (!res->fbs || !res->crtcs || !res->connectors || !res->encoders) {
+        free(res->fbs);
+        free(res->crtcs);
+        free(res->connectors);
+        free(res->encoders);
+        free(res);
+        return NULL;
+    }
+    return res;
+}
+
+drmModePlaneResPtr drmModeGetPlaneResources(int fd)
+{
+    drmModePlaneResPtr res;
+    int i, j;
+
+    if (!is_sim_fd(fd))
+        return REAL(drmModeGetPlaneResources)(fd);
+
+    res = calloc(1, sizeof(*res));
+    if (!res)
+        return NULL;
+
+    res->count_planes = sim.count_crtcs * sim.count_planes;
+    res->planes = calloc(res->count_planes, sizeof(*res->planes));
+    if (!res->planes) {
+        free(res);
+        return NULL;
+    }
+
+    for (i = 0; i < sim.count_crtcs; i++) {
+        for (j = 0; j < sim.count_planes; j++)
+            res->planes[i * sim.count_planes + j] = plane_object(i, j)->id;
+    }
+    return res;
+}
+
+drmModePlanePtr drmModeGetPlane(int fd, uint32_t plane_id)
+{
+    const struct sim_object *obj;
+    drmModePlanePtr plane;
+
+    if (!is_sim_fd(fd))
+        return REAL(drmModeGetPlane)(fd, plane_id);
+
+    obj = find_object(plane_id, DRM_MODE_OBJECT_PLANE);
+    if (!obj) {
+        errno = ENOENT;
+        return NULL;
+    }
+
+    plane = calloc(1, sizeof(*plane));
+    if (!plane)
+        return NULL;
+
+    plane->formats = malloc(sizeof(plane_formats));
+    if (!plane->formats) {
+        free(plane);
+        return NULL;
+    }
+    memcpy(plane->formats, plane_formats, sizeof(plane_formats));
+    plane->count_formats = ARRAY_SIZE(plane_formats);
+
+    pthread_mutex_lock(&sim.lock);
+    plane->plane_id = obj->id;
+    plane->crtc_id = obj->values[PROP_CRTC_ID];
+    plane->fb_id = obj->values[PROP_FB_ID];
+    plane->crtc_x = obj->values[PROP_CRTC_X];
+    plane->crtc_y = obj->values[PROP_CRTC_Y];
+    plane->x = obj->values[PROP_SRC_X] >> 16;
+    plane->y = obj->values[PROP_SRC_Y] >> 16;
+    plane->possible_crtcs = 1 << obj->crtc;
+    pthread_mutex_unlock(&sim.lock);
+
+    return plane;
+}
+
+drmModeCrtcPtr drmModeGetCrtc(int fd, uint32_t crtc_id)
+{
+    const struct sim_object *obj, *primary;
+    const drmModeModeInfo *mode;
+    drmModeCrtcPtr crtc;
+
+    if (!is_sim_fd(fd))
+        return REAL(drmModeGetCrtc)(fd, crtc_id);
+
+    obj = find_object(crtc_id, DRM_MODE_OBJECT_CRTC);
+    if (!obj) {
+        errno = ENOENT;
+        return NULL;
+    }
+
+    crtc = calloc(1, sizeof(*crtc));
+    if (!crtc)
+        return NULL;
+
+    pthread_mutex_lock(&sim.lock);
+    primary = plane_object(obj->crtc, 0);
+    mode = blob_mode(obj->values[PROP_MODE_ID]);
+    crtc->crtc_id = obj->id;
+    crtc->buffer_id = primary->values[PROP_FB_ID];
+    crtc->x = primary->values[PROP_SRC_X] >> 16;
+    crtc->y = primary->values[PROP_SRC_Y] >> 16;
+    if (mode) {
+        crtc->mode = *mode;
+        crtc->mode_valid = 1;
+        crtc->width = mode->hdisplay;
+        crtc->height = mode->vdisplay;
+    }
+    pthread_mutex_unlock(&sim.lock);
+
+    return crtc;
+}
+
+drmModeEncoderPtr drmModeGetEncoder(int fd, uint32_t encoder_id)
+{
+    drmModeEncoderPtr encoder;
+    int crtc = encoder_id - ENCODER_ID_BASE;
+
+    if (!is_sim_fd(fd))
+        return REAL(drmModeGetEncoder)(fd, encoder_id);
+
+    if (encoder_id < ENCODER_ID_BASE || crtc >= sim.count_crtcs) {
+        errno = ENOENT;
+        return NULL;
+    }
+
+    encoder = calloc(1, sizeof(*encoder));
+    if (!encoder)
+        return NULL;
+
+    pthread_mutex_lock(&sim.lock);
+    encoder->encoder_id = encoder_id;
+    encoder->encoder_type = DRM_MODE_ENCODER_TMDS;
+    encoder->crtc_id = connector_object(crtc)->values[PROP_CRTC_ID];
+    encoder->possible_crtcs = 1 << crtc;
+    pthread_mutex_unlock(&sim.lock);
+
+    return encoder;
+}
+
+static drmModeConnectorPtr get_connector(uint32_t connector_id)
+{
+    static const int other_modes[][2] = { { 1280, 720 }, { 720, 480 } };
+    const struct sim_object *obj;
+    drmModeConnectorPtr connector;
+    int k;
+
+    obj = find_object(connector_id, DRM_MODE_OBJECT_CONNECTOR);
+    if (!obj) {
+        errno = ENOENT;
+        return NULL;
+    }
+
+    connector = calloc(1, sizeof(*connector));
+    if (!connector)
+        return NULL;
+
+    connector->modes = calloc(1 + ARRAY_SIZE(other_modes), sizeof(*connector->modes));
+    connector->props = calloc(1, sizeof(*connector->props));
+    connector->prop_values = calloc(1, sizeof(*connector->prop_values));
+    connector->encoders = calloc(1, sizeof(*connector->encoders));
+    if (!connector->modes || !connector->props || !connector->prop_values || !connector->encoders) {
+        free(connector->modes);
+        free(connector->props);
+        free(connector->prop_values);
+        free(connector->encoders);
+        free(connector);
+        return NULL;
+    }
+
+    connector->connector_id = obj->id;
+    connector->connector_type = DRM_MODE_CONNECTOR_HDMIA;
+    connector->connector_type_id = obj->crtc + 1;
+    connector->connection = DRM_MODE_CONNECTED;
+    connector->subpixel = DRM_MODE_SUBPIXEL_UNKNOWN;
+    connector->mmWidth = sim.mode.hdisplay * 275 / 1000;
+    connector->mmHeight = sim.mode.vdisplay * 275 / 1000;
+
+    connector->modes[connector->count_modes++] = sim.mode;
+    for (k = 0; k < (int)ARRAY_SIZE(other_modes); k++) {
+        if (other_modes[k][0] < sim.mode.hdisplay && other_modes[k][1] < sim.mode.vdisplay)
+            make_mode(&connector->modes[connector->count_modes++],
+                other_modes[k][0], other_modes[k][1], 60, DRM_MODE_TYPE_DRIVER);
+    }
+
+    connector->count_encoders = 1;
+    connector->encoders[0] = ENCODER_ID_BASE + obj->crtc;
+
+    pthread_mutex_lock(&sim.lock);
+    connector->count_props = 1;
+    connector->props[0] = PROP_ID(PROP_CRTC_ID);
+    connector->prop_values[0] = obj->values[PROP_CRTC_ID];
+    if (obj->values[PROP_CRTC_ID])
+        connector->encoder_id = ENCODER_ID_BASE + obj->crtc;
+    pthread_mutex_unlock(&sim.lock);
+
+    return connector;
+}
+
+drmModeConnectorPtr drmModeGetConnector(int fd, uint32_t connector_id)
+{
+    if (!is_sim_fd(fd))
+        return REAL(drmModeGetConnector)(fd, connector_id);
+
+    return get_connector(connector_id);
+}
+
+drmModeConnectorPtr drmModeGetConnectorCurrent(int fd, uint32_t connector_id)
+{
+    if (!is_sim_fd(fd))
+        return REAL(drmModeGetConnectorCurrent)(fd, connector_id);
+
+    return get_connector(connector_id);
+}
+
+drmModeObjectPropertiesPtr drmModeObjectGetProperties(int fd, uint32_t object_id, uint32_t object_type)
+{
+    const struct sim_object *obj;
+    drmModeObjectPropertiesPtr props;
+    int k;
+
+    if (!is_sim_fd(fd))
+        return REAL(drmModeObjectGetProperties)(fd, object_id, object_type);
+
+    obj = find_object(object_id, object_type);
+    if (!obj) {
+        errno = ENOENT;
+        return NULL;
+    }
+
+    props = calloc(1, sizeof(*props));
+    if (!props)
+        return NULL;
+
+    props->props = calloc(obj->count_props, sizeof(*props->props));
+    props->prop_values = calloc(obj->count_props, sizeof(*props->prop_values));
+    if (!props->props || !props->prop_values) {
+        free(props->props);
+        free(props->prop_values);
+        free(props);
+        return NULL;
+    }
+
+    pthread_mutex_lock(&sim.lock);
+    props->count_props = obj->count_props;
+    for (k = 0; k < obj->count_props; k++) {
+        props->props[k] = PROP_ID(obj->props[k]);
+        props->prop_values[k] = obj->values[obj->props[k]];
+    }
+    pthread_mutex_unlock(&sim.lock);
+
+    return props;
+}
+
+drmModePropertyPtr drmModeGetProperty(int fd, uint32_t prop_id)
+{
+    const struct sim_prop_info *info;
+    drmModePropertyPtr prop;
+    int k;
+
+    if (!is_sim_fd(fd))
+        return REAL(drmModeGetProperty)(fd, prop_id);
+
+    if (!prop_id || prop_id > PROP_COUNT) {
+        errno = ENOENT;
+        return NULL;
+    }
+    info = &prop_info[prop_id - 1];
+
+    prop = calloc(1, sizeof(*prop));
+    if (!prop)
+        return NULL;
+
+    prop->prop_id = prop_id;
+    prop->flags = info->flags;
+    snprintf(prop->name, sizeof(prop->name), "%s", info->name);
+
+    if (info->flags & DRM_MODE_PROP_ENUM) {
+        prop->count_values = prop->count_enums = info->count_enums;
+        prop->values = calloc(info->count_enums, sizeof(*prop->values));
+        prop->enums = calloc(info->count_enums, sizeof(*prop->enums));
+        if (!prop->values || !prop->enums) {
+            free(prop->values);
+            free(prop->enums);
+            free(prop);
+            return NULL;
+        }
+        for (k = 0; k < info->count_enums; k++) {
+            prop->values[k] = info->enums[k].value;
+            prop->enums[k] = info->enums[k];
+        }
+    } else if (!(info->flags & DRM_MODE_PROP_BLOB)) {
+        /* min and max of ranges, the object type of objects */
+        prop->count_values = (info->flags & DRM_MODE_PROP_OBJECT) ? 1 : 2;
+        prop->values = calloc(2, sizeof(*prop->values));
+        if (!prop->values) {
+            free(prop->values);
+            free(prop->enums);
+            free(prop);
+            return NULL;
+        }
+        prop->values[0] = info->min;
+        prop->values[1] = prop_id == PROP_ID(PROP_ZPOS) ? (uint64_t)sim.count_planes - 1 : info->max;
+    }
+
+    return prop;
+}
+
+drmModePropertyBlobPtr drmModeGetPropertyBlob(int fd, uint32_t blob_id)
+{
+    const struct sim_blob *blob;
+    drmModePropertyBlobPtr res;
+
+    if (!is_sim_fd(fd))
+        return REAL(drmModeGetPropertyBlob)(fd, blob_id);
+
+    res = calloc(1, sizeof(*res));
+    if (!res)
+        return NULL;
+
+    pthread_mutex_lock(&sim.lock);
+    blob = blob_id >= BLOB_ID_BASE && blob_id < BLOB_ID_BASE + SIM_MAX_BLOBS ?
+        &sim.blobs[blob_id - BLOB_ID_BASE] : NULL;
+    if (blob && blob->used) {
+        res->id = blob_id;
+        res->length = blob->length;
+        res->data = malloc(blob->length);
+        if (res->data)
+            memcpy(res->data, blob->data, blob->length);
+    }
+    pthread_mutex_unlock(&sim.lock);
+
+    if (!res->data) {
+        errno = res->id ? ENOMEM : ENOENT;
+        free(res);
+        return NULL;
+    }
+    return res;
+}
+
+int drmModeCreatePropertyBlob(int fd, const void *data, size_t length, uint32_t *id)
+{
+    int ret;
+
+    if (!is_sim_fd(fd))
+        return REAL(drmModeCreatePropertyBlob)(fd, data, length, id);
+
+    pthread_mutex_lock(&sim.lock);
+    ret = create_blob(data, length, id);
+    pthread_mutex_unlock(&sim.lock);
+
+    return mode_result(ret);
+}
+
+int drmModeDestroyPropertyBlob(int fd, uint32_t id)
+{
+    struct sim_blob *blob;
+
+    if (!is_sim_fd(fd))
+        return REAL(drmModeDestroyPropertyBlob)(fd, id);
+
+    pthread_mutex_lock(&sim.lock);
+    blob = find_blob(id);
+    if (blob) {
+        blob->destroyed = true;
+        collect_blobs();
+    }
+    pthread_mutex_unlock(&sim.lock);
+
+    return mode_result(blob ? 0 : -EINVAL);
+}
+
+/*
+ * Buffers
+ */
+
+int drmModeCreateDumbBuffer(int fd, uint32_t width, uint32_t height, uint32_t bpp,
+    uint32_t flags, uint32_t *handle, uint32_t *pitch, uint64_t *size)
+{
+    struct sim_dumb *dumb = NULL;
+    void *map;
+    int k;
+
+    if (!is_sim_fd(fd))
+        return REAL(drmModeCreateDumbBuffer)(fd, width, height, bpp, flags, handle, pitch, size);
+
+    if (!width || !height || width > SIM_MAX_SIZE || height > SIM_MAX_SIZE ||
+            !bpp || bpp > 32 || bpp % 8 || flags)
+        return mode_result(-EINVAL);
+
+    pthread_mutex_lock(&sim.lock);
+    for (k = 0; k < SIM_MAX_DUMBS && !dumb; k++) {
+        if (!sim.dumbs[k].map)
+            dumb = &sim.dumbs[k];
+    }
+    if (!dumb) {
+        pthread_mutex_unlock(&sim.lock);
+        return mode_result(-ENOSPC);
+    }
+
+    dumb->pitch = (width * bpp / 8 + 63) & ~63;
+    dumb->size = ((uint64_t)dumb->pitch * height + 4095) & ~4095ULL;
+    if (posix_memalign(&map, 4096, dumb->size)) {
+        pthread_mutex_unlock(&sim.lock);
+        return mode_result(-ENOMEM);
+    }
+    memset(map, 0, dumb->size);
+    dumb->map = map;
+
+    *handle = dumb - sim.dumbs + 1;
+    *pitch = dumb->pitch;
+    *size = dumb->size;
+    pthread_mutex_unlock(&sim.lock);
+
+    return 0;
+}
+
+int drmModeMapDumbBuffer(int fd, uint32_t handle, uint64_t *offset)
+{
+    bool found;
+
+    if (!is_sim_fd(fd))
+        return REAL(drmModeMapDumbBuffer)(fd, handle, offset);
+
+    pthread_mutex_lock(&sim.lock);
+    found = find_dumb(handle) != NULL;
+    pthread_mutex_unlock(&sim.lock);
+
+    if (!found)
+        return mode_result(-ENOENT);
+
+    *offset = (uint64_t)handle << DUMB_OFFSET_SHIFT;
+    return 0;
+}
+
+int drmModeDestroyDumbBuffer(int fd, uint32_t handle)
+{
+    struct sim_dumb *dumb;
+
+    if (!is_sim_fd(fd))
+        return REAL(drmModeDestroyDumbBuffer)(fd, handle);
+
+    pthread_mutex_lock(&sim.lock);
+    dumb = find_dumb(handle);
+    if (dumb) {
+        free(dumb->map);
+        memset(dumb, 0, sizeof(*dumb));
+    }
+    pthread_mutex_unlock(&sim.lock);
+
+    return mode_result(dumb ? 0 : -ENOENT);
+}
+
+static int format_cpp(uint32_t format)
+{
+    int k;
+
+    for (k = 0; k < (int)ARRAY_SIZE(plane_formats); k++) {
+        if (plane_formats[k] == format)
+            return format == DRM_FORMAT_RGB565 ? 2 : 4;
+    }
+    return 0;
+}
+
+int drmModeAddFB2WithModifiers(int fd, uint32_t width, uint32_t height, uint32_t pixel_format,
+    const uint32_t bo_handles[4], const uint32_t pitches[4], const uint32_t offsets[4],
+    const uint64_t modifier[4], uint32_t *buf_id, uint32_t flags)
+{
+    const struct sim_dumb *dumb;
+    int cpp = format_cpp(pixel_format), k, ret = 0;
+
+    if (!is_sim_fd(fd))
+        return REAL(drmModeAddFB2WithModifiers)(fd, width, height, pixel_format,
+            bo_handles, pitches, offsets, modifier, buf_id, flags);
+
+    if (!cpp)
+        return mode_result(reject(EINVAL, "fb format %.4s", (const char *)&pixel_format));
+    if ((flags & ~DRM_MODE_FB_MODIFIERS) ||
+            ((flags & DRM_MODE_FB_MODIFIERS) && modifier[0] != DRM_FORMAT_MOD_LINEAR))
+        return mode_result(reject(EINVAL, "fb modifiers, only linear is supported"));
+    if (!width || !height || width > SIM_MAX_SIZE || height > SIM_MAX_SIZE)
+        return mode_result(reject(EINVAL, "fb size %ux%u", width, height));
+
+    pthread_mutex_lock(&sim.lock);
+    dumb = find_dumb(bo_handles[0]);
+    if (!dumb)
+        ret = reject(ENOENT, "fb handle %u", bo_handles[0]);
+    else if (pitches[0] < width * cpp || (uint64_t)offsets[0] + (uint64_t)pitches[0] * height > dumb->size)
+        ret = reject(EINVAL, "fb %ux%u pitch %u does not fit in buffer %u", width, height,
+            pitches[0], bo_handles[0]);
+
+    for (k = 0; k < SIM_MAX_FBS && !ret; k++) {
+        if (!sim.fbs[k].used)
+            break;
+    }
+    if (!ret && k == SIM_MAX_FBS)
+        ret = -ENOSPC;
+
+    if (!ret) {
+        sim.fbs[k].used = true;
+        sim.fbs[k].width = width;
+        sim.fbs[k].height = height;
+        sim.fbs[k].format = pixel_format;
+        sim.fbs[k].handle = bo_handles[0];
+        *buf_id = FB_ID_BASE + k;
+    }
+    pthread_mutex_unlock(&sim.lock);
+
+    return mode_result(ret);
+}
+
+int drmModeAddFB2(int fd, uint32_t width, uint32_t height, uint32_t pixel_format,
+    const uint32_t bo_handles[4], const uint32_t pitches[4], const uint32_t offsets[4],
+    uint32_t *buf_id, uint32_t flags)
+{
+    if (!is_sim_fd(fd))
+        return REAL(drmModeAddFB2)(fd, width, height, pixel_format,
+            bo_handles, pitches, offsets, buf_id, flags);
+
+    return drmModeAddFB2WithModifiers(fd, width, height, pixel_format,
+        bo_handles, pitches, offsets, NULL, buf_id, flags);
+}
+
+int drmModeRmFB(int fd, uint32_t fb_id)
+{
+    struct sim_object *obj;
+    struct sim_fb *fb;
+    int i;
+
+    if (!is_sim_fd(fd))
+        return REAL(drmModeRmFB)(fd, fb_id);
+
+    pthread_mutex_lock(&sim.lock);
+    fb = find_fb(fb_id);
+    if (fb) {
+        /* planes still scanning it out are turned off */
+        for (i = 0; i < sim.count_objects; i++) {
+            obj = &sim.objects[i];
+            if (obj->type == DRM_MODE_OBJECT_PLANE && obj->values[PROP_FB_ID] == fb_id) {
+                obj->values[PROP_FB_ID] = 0;
+                obj->values[PROP_CRTC_ID] = 0;
+                sim_log("fb %u removed while on plane %u", fb_id, obj->id);
+            }
+        }
+        memset(fb, 0, sizeof(*fb));
+    }
+    pthread_mutex_unlock(&sim.lock);
+
+    return mode_result(fb ? 0 : -ENOENT);
+}
+
+int drmIoctl(int fd, unsigned long request, void *arg)
+{
+    if (request != DRM_IOCTL_MODE_ATOMIC || !is_sim_fd(fd))
+        return REAL(drmIoctl)(fd, request, arg);
+
+    return ioctl_result(sim_atomic_ioctl(fd, arg));
+}
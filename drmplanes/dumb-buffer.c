@@ -0,0 +1,241 @@
+#include "dumb-buffer.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <sys/mman.h>
+#include <xf86drm.h>
+#include <xf86drmMode.h>
+#include <drm_fourcc.h>
+
+/*
+ * Generic vectors, the compiler turns them into SSE2 or NEON stores. Dumb
+ * buffers are mapped write-combined, where full aligned 16 byte writes
+ * are what keeps the fill at memory speed.
+ */
+typedef uint32_t vec4u __attribute__((vector_size(16)));
+
+static void fill_row(uint32_t *dst, int n, uint32_t color)
+{
+    vec4u v = { color, color, color, color };
+    int i = 0;
+
+    while (i < n && ((uintptr_t)(dst + i) & 15))
+        dst[i++] = color;
+
+    for (; i + 16 <= n; i += 16) {
+        *(vec4u *)(dst + i) = v;
+        *(vec4u *)(dst + i + 4) = v;
+        *(vec4u *)(dst + i + 8) = v;
+        *(vec4u *)(dst + i + 12) = v;
+    }
+    for (; i + 4 <= n; i += 4)
+        *(vec4u *)(dst + i) = v;
+
+    while (i < n)
+        dst[i++] = color;
+}
+
+/* src is cached memory and may be unaligned, dst gets aligned stores */
+static void copy_row(uint32_t *dst, const uint32_t *src, int n)
+{
+    vec4u v;
+    int i = 0;
+
+    while (i < n && ((uintptr_t)(dst + i) & 15)) {
+        dst[i] = src[i];
+        i++;
+    }
+
+    for (; i + 4 <= n; i += 4) {
+        memcpy(&v, src + i, sizeof(v));
+        *(vec4u *)(dst + i) = v;
+    }
+
+    while (i < n) {
+        dst[i] = src[i];
+        i++;
+    }
+}
+
+int dumb_buffer_create(int fd, int width, int height, uint32_t format, struct dumb_buffer *buf)
+{
+    uint32_t handles[4] = { 0 }, pitches[4] = { 0 }, offsets[4] = { 0 };
+    uint64_t offset;
+    void *map;
+
+    if (format != DRM_FORMAT_ARGB8888 && format != DRM_FORMAT_XRGB8888) {
+        printf("dumb buffers only support AR24 and XR24, not %.4s\n", (char *)&format);
+        return -1;
+    }
+
+    memset(buf, 0, sizeof(*buf));
+    buf->fd = fd;
+    buf->width = width;
+    buf->height = height;
+
+    if (drmModeCreateDumbBuffer(fd, width, height, 32, 0,
+            &buf->handle, &buf->pitch, &buf->size)) {
+        printf("failed to create %dx%d dumb buffer: %s\n", width, height, strerror(errno));
+        return -1;
+    }
+
+    if (drmModeMapDumbBuffer(fd, buf->handle, &offset)) {
+        printf("failed to map dumb buffer: %s\n", strerror(errno));
+        goto err_destroy;
+    }
+
+    map = mmap(NULL, buf->size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, offset);
+    if (map == MAP_FAILED) {
+        printf("failed to mmap dumb buffer: %s\n", strerror(errno));
+        goto err_destroy;
+    }
+    buf->map = map;
+
+    handles[0] = buf->handle;
+    pitches[0] = buf->pitch;
+    if (drmModeAddFB2(fd, width, height, format, handles, pitches, offsets, &buf->fb_id, 0)) {
+        printf("failed to create fb for dumb buffer: %s\n", strerror(errno));
+        munmap(buf->map, buf->size);
+        goto err_destroy;
+    }
+
+    return 0;
+
+err_destroy:
+    drmModeDestroyDumbBuffer(fd, buf->handle);
+    memset(buf, 0, sizeof(*buf));
+    return -1;
+}
+
+void dumb_buffer_destroy(struct dumb_buffer *buf)
+{
+    if (!buf->handle)
+        return;
+
+    drmModeRmFB(buf->fd, buf->fb_id);
+    munmap(buf->map, buf->size);
+    drmModeDestroyDumbBuffer(buf->fd, buf->handle);
+    memset(buf, 0, sizeof(*buf));
+}
+
+int dumb_chain_create(int fd, int width, int height, uint32_t format, struct dumb_chain *chain)
+{
+    int i;
+
+    memset(chain, 0, sizeof(*chain));
+
+    chain->line = malloc(width * sizeof(*chain->line));
+    if (!chain->line) {
+        printf("failed to allocate the dumb chain row\n");
+        return -1;
+    }
+
+    for (i = 0; i < DUMB_CHAIN_LENGTH; i++) {
+        if (dumb_buffer_create(fd, width, height, format, &chain->buffers[i])) {
+            dumb_chain_destroy(chain);
+            return -1;
+        }
+    }
+
+    return 0;
+}
+
+void dumb_chain_destroy(struct dumb_chain *chain)
+{
+    int i;
+
+    for (i = 0; i < DUMB_CHAIN_LENGTH; i++)
+        dumb_buffer_destroy(&chain->buffers[i]);
+    free(chain->line);
+    chain->line = NULL;
+}
+
+struct dumb_buffer *dumb_chain_next(struct dumb_chain *chain)
+{
+    return &chain->buffers[chain->next];
+}
+
+void dumb_chain_advance(struct dumb_chain *chain)
+{
+    chain->next = (chain->next + 1) % DUMB_CHAIN_LENGTH;
+}
+
+static uint32_t *dumb_row(struct dumb_buffer *buf, int y)
+{
+    return (uint32_t *)((uint8_t *)buf->map + (size_t)y * buf->pitch);
+}
+
+void dumb_fill_rect(struct dumb_buffer *buf, int x, int y, int w, int h, uint32_t color)
+{
+    int row;
+
+    if (x < 0) {
+        w += x;
+        x = 0;
+    }
+    if (y < 0) {
+        h += y;
+        y = 0;
+    }
+    if (x + w > (int)buf->width)
+        w = buf->width - x;
+    if (y + h > (int)buf->height)
+        h = buf->height - y;
+    if (w <= 0 || h <= 0)
+        return;
+
+    for (row = y; row < y + h; row++)
+        fill_row(dumb_row(buf, row) + x, w, color);
+}
+
+void dumb_blit(struct dumb_buffer *buf, const void *src, int width, int height, int stride)
+{
+    int row;
+
+    if (width > (int)buf->width)
+        width = buf->width;
+    if (height > (int)buf->height)
+        height = buf->height;
+
+    for (row = 0; row < height; row++)
+        copy_row(dumb_row(buf, row), (const uint32_t *)((const uint8_t *)src + (size_t)row * stride),
+            width);
+}
+
+static const uint32_t primary_bars[] = {
+    0xffc0c0c0, 0xffc0c000, 0xff00c0c0, 0xff00c000,
+    0xffc000c0, 0xffc00000, 0xff0000c0, 0xff000000,
+};
+
+static const uint32_t overlay_bars[] = {
+    0xff202060, 0xff2040a0, 0xff2060e0, 0xff4080ff,
+};
+
+void dumb_draw_frame(struct dumb_chain *chain, struct dumb_buffer *buf, uint32_t frame, bool is_primary)
+{
+    const uint32_t *bars = is_primary ? primary_bars : overlay_bars;
+    int count = is_primary ? 8 : 4;
+    int width = buf->width, height = buf->height;
+    int bar_w = (width + count - 1) / count;
+    int shift = (frame * 8) % width;
+    int box = height / 4;
+    /* the mapping is write-combined, so the row is built in cached memory */
+    uint32_t *line = chain->line;
+    int x, w, pos, row;
+
+    for (x = 0; x < width; x += w) {
+        pos = x + shift;
+        w = bar_w - pos % bar_w;
+        if (x + w > width)
+            w = width - x;
+        fill_row(line + x, w, bars[(pos / bar_w) % count]);
+    }
+
+    for (row = 0; row < height; row++)
+        copy_row(dumb_row(buf, row), line, width);
+
+    if (width > box)
+        dumb_fill_rect(buf, (frame * 16) % (width - box), (height - box) / 2, box, box, 0xffffffff);
+}
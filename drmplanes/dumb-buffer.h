@@ -0,0 +1,46 @@
+#ifndef DUMB_BUFFER_H
+#define DUMB_BUFFER_H
+
+#include <stdint.h>
+#include <stdbool.h>
+
+/*
+ * Scanout buffers allocated with DRM_IOCTL_MODE_CREATE_DUMB and drawn by
+ * the CPU, for drivers without a GPU such as vkms. 32 bpp RGB formats.
+ */
+struct dumb_buffer {
+    int fd;
+    uint32_t width, height;
+    uint32_t pitch;             /* in bytes */
+    uint32_t handle;
+    uint32_t fb_id;
+    uint64_t size;
+    uint32_t *map;
+};
+
+#define DUMB_CHAIN_LENGTH 3
+
+/* one buffer on screen, one committed and one to draw into */
+struct dumb_chain {
+    struct dumb_buffer buffers[DUMB_CHAIN_LENGTH];
+    int next;
+    uint32_t *line;             /* cached memory a row is built in */
+};
+
+int dumb_buffer_create(int fd, int width, int height, uint32_t format, struct dumb_buffer *buf);
+void dumb_buffer_destroy(struct dumb_buffer *buf);
+int dumb_chain_create(int fd, int width, int height, uint32_t format, struct dumb_chain *chain);
+void dumb_chain_destroy(struct dumb_chain *chain);
+/* the buffer the next frame is drawn into, the same one until dumb_chain_advance() */
+struct dumb_buffer *dumb_chain_next(struct dumb_chain *chain);
+/* after the commit of that buffer succeeded */
+void dumb_chain_advance(struct dumb_chain *chain);
+
+/* color is 0xAARRGGBB, the rectangle is clipped to the buffer */
+void dumb_fill_rect(struct dumb_buffer *buf, int x, int y, int w, int h, uint32_t color);
+/* copy width x height pixels of 4 bytes from src, clipped to the buffer */
+void dumb_blit(struct dumb_buffer *buf, const void *src, int width, int height, int stride);
+/* scrolling color bars and a moving box, what the GL back end draws as a cube */
+void dumb_draw_frame(struct dumb_chain *chain, struct dumb_buffer *buf, uint32_t frame, bool is_primary);
+
+#endif /* DUMB_BUFFER_H */
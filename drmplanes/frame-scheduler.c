@@ -0,0 +1,107 @@
+#include "frame-scheduler.h"
+#include "drm-atomic.h"
+
+#include <string.h>
+#include <time.h>
+
+static uint64_t predicted_cost(const struct frame_scheduler *sched)
+{
+    return sched->cost_avg_ns + 2 * sched->cost_dev_ns;
+}
+
+void frame_scheduler_init(struct frame_scheduler *sched, const drmModeModeInfo *mode,
+    uint64_t margin_ns)
+{
+    memset(sched, 0, sizeof(*sched));
+    sched->margin_ns = margin_ns;
+
+    /* clock is in kHz */
+    sched->period_ns = (uint64_t)mode->htotal * mode->vtotal * 1000000 / mode->clock;
+    printf("frame scheduler: vblank period %.3f ms, margin %.3f ms\n",
+        sched->period_ns / 1e6, margin_ns / 1e6);
+}
+
+uint64_t frame_scheduler_wait(struct frame_scheduler *sched)
+{
+    uint64_t now = get_time_ns();
+    uint64_t lead = predicted_cost(sched) + sched->margin_ns;
+    uint64_t target, wake;
+    struct timespec ts;
+
+    /* no flip seen yet, nothing to predict from */
+    if (!sched->last_vblank_ns) {
+        sched->target_vblank_ns = 0;
+        return now;
+    }
+
+    /* the first vblank that can still be made */
+    target = sched->last_vblank_ns + sched->period_ns;
+    if (target < now + lead)
+        target += (now + lead - target + sched->period_ns - 1) / sched->period_ns * sched->period_ns;
+
+    sched->target_vblank_ns = target;
+    wake = target - lead;
+    if (wake <= now)
+        return now;
+
+    ts.tv_sec = wake / 1000000000ull;
+    ts.tv_nsec = wake % 1000000000ull;
+    while (clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &ts, NULL) == EINTR)
+        ;
+
+    return get_time_ns();
+}
+
+void frame_scheduler_commit_done(struct frame_scheduler *sched, uint64_t render_ns)
+{
+    int64_t cost = get_time_ns() - render_ns;
+    int64_t error = cost - sched->cost_avg_ns;
+
+    if (!sched->cost_avg_ns) {
+        sched->cost_avg_ns = cost;
+        sched->cost_dev_ns = cost / 2;
+        return;
+    }
+
+    sched->cost_avg_ns += error / 8;
+    sched->cost_dev_ns += ((error < 0 ? -error : error) - sched->cost_dev_ns) / 4;
+}
+
+void frame_scheduler_flip_done(struct frame_scheduler *sched, uint64_t flip_ns,
+    uint64_t render_ns)
+{
+    uint64_t latency_ns = flip_ns - render_ns;
+
+    if (sched->last_vblank_ns && flip_ns > sched->last_vblank_ns) {
+        uint64_t delta = flip_ns - sched->last_vblank_ns;
+        uint64_t periods = (delta + sched->period_ns / 2) / sched->period_ns;
+
+        /* follow the actual refresh rate of the display */
+        if (periods)
+            sched->period_ns = (7 * sched->period_ns + delta / periods) / 8;
+    }
+    sched->last_vblank_ns = flip_ns;
+
+    if (!sched->target_vblank_ns)
+        return;
+
+    sched->frames++;
+    if (flip_ns > sched->target_vblank_ns + sched->period_ns / 2)
+        sched->missed++;
+
+    sched->latency_total_ns += latency_ns;
+    if (latency_ns > sched->latency_max_ns)
+        sched->latency_max_ns = latency_ns;
+}
+
+void frame_scheduler_print(const struct frame_scheduler *sched)
+{
+    if (!sched->frames)
+        return;
+
+    printf("scheduled: frames %llu missed %llu, render to flip avg %.3f ms max %.3f ms, "
+        "predicted cost %.3f ms, period %.3f ms\n",
+        (unsigned long long)sched->frames, (unsigned long long)sched->missed,
+        sched->latency_total_ns / 1e6 / sched->frames, sched->latency_max_ns / 1e6,
+        predicted_cost(sched) / 1e6, sched->period_ns / 1e6);
+}
@@ -0,0 +1,35 @@
+#ifndef FRAME_SCHEDULER_H
+#define FRAME_SCHEDULER_H
+
+#include <stdint.h>
+#include <xf86drmMode.h>
+
+/*
+ * Starts rendering as late as the predicted render + commit cost allows
+ * to still make the next vblank. The vblank period comes from the mode
+ * and is refined with flip timestamps.
+ */
+struct frame_scheduler {
+    uint64_t period_ns;
+    uint64_t last_vblank_ns;
+    uint64_t margin_ns;
+    int64_t cost_avg_ns;            /* render + commit, moving average */
+    int64_t cost_dev_ns;            /* and its mean deviation */
+    uint64_t target_vblank_ns;      /* the frame being rendered should flip here */
+
+    uint64_t frames;
+    uint64_t missed;
+    uint64_t latency_total_ns;
+    uint64_t latency_max_ns;
+};
+
+void frame_scheduler_init(struct frame_scheduler *sched, const drmModeModeInfo *mode,
+    uint64_t margin_ns);
+/* sleep until the next frame should start rendering, returns that time */
+uint64_t frame_scheduler_wait(struct frame_scheduler *sched);
+void frame_scheduler_commit_done(struct frame_scheduler *sched, uint64_t render_ns);
+void frame_scheduler_flip_done(struct frame_scheduler *sched, uint64_t flip_ns,
+    uint64_t render_ns);
+void frame_scheduler_print(const struct frame_scheduler *sched);
+
+#endif /* FRAME_SCHEDULER_H */
@@ -0,0 +1,78 @@
+#include "hotplug.h"
+#include "drm-atomic.h"
+
+#include <stdio.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <poll.h>
+#include <sys/socket.h>
+#include <linux/netlink.h>
+
+int hotplug_init(struct hotplug *hp)
+{
+    struct sockaddr_nl addr = {
+        .nl_family = AF_NETLINK,
+        .nl_groups = 1,         /* kernel uevents, not the ones udev re-broadcasts */
+    };
+
+    hp->event_ns = 0;
+    hp->sock = socket(AF_NETLINK, SOCK_DGRAM | SOCK_CLOEXEC | SOCK_NONBLOCK,
+        NETLINK_KOBJECT_UEVENT);
+    if (hp->sock < 0) {
+        printf("failed to open uevent socket: %s\n", strerror(errno));
+        return -1;
+    }
+
+    if (bind(hp->sock, (struct sockaddr *)&addr, sizeof(addr))) {
+        printf("failed to bind uevent socket: %s\n", strerror(errno));
+        close(hp->sock);
+        hp->sock = -1;
+        return -1;
+    }
+
+    return 0;
+}
+
+/* "action@devpath" followed by NUL separated KEY=value pairs */
+static bool is_drm_hotplug(const char *buf, int len)
+{
+    bool drm = false, hotplug = false;
+    int off = strnlen(buf, len) + 1;
+
+    while (off < len) {
+        const char *key = buf + off;
+
+        if (strcmp(key, "SUBSYSTEM=drm") == 0)
+            drm = true;
+        else if (strcmp(key, "HOTPLUG=1") == 0)
+            hotplug = true;
+        off += strnlen(key, len - off) + 1;
+    }
+
+    return drm && hotplug;
+}
+
+bool hotplug_poll(struct hotplug *hp, int timeout_ms)
+{
+    struct pollfd pfd = { .fd = hp->sock, .events = POLLIN };
+    char buf[4096];
+    bool found = false;
+    int len;
+
+    if (hp->sock < 0)
+        return false;
+
+    if (poll(&pfd, 1, timeout_ms) <= 0)
+        return false;
+
+    while ((len = recv(hp->sock, buf, sizeof(buf) - 1, 0)) > 0) {
+        buf[len] = '\0';
+        if (is_drm_hotplug(buf, len)) {
+            hp->event_ns = get_time_ns();
+            found = true;
+        }
+    }
+
+    return found;
+}
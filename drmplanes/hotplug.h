@@ -0,0 +1,23 @@
+#ifndef HOTPLUG_H
+#define HOTPLUG_H
+
+#include <stdint.h>
+#include <stdbool.h>
+
+/*
+ * DRM hotplug events read from the kernel's kobject uevent netlink
+ * socket, so no udev daemon is needed.
+ */
+struct hotplug {
+    int sock;
+    uint64_t event_ns;          /* when the last hotplug event was read */
+};
+
+int hotplug_init(struct hotplug *hp);
+/*
+ * Read the pending uevents, waiting up to timeout_ms (-1: forever) for the
+ * first one. True if one of them was a DRM hotplug event.
+ */
+bool hotplug_poll(struct hotplug *hp, int timeout_ms);
+
+#endif /* HOTPLUG_H */
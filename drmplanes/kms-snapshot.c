@@ -0,0 +1,604 @@
+#include "kms-snapshot.h"
+#include "startup-profile.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <time.h>
+#include <sys/stat.h>
+#include <sys/utsname.h>
+
+#define KMS_CACHE_MAGIC "KMSSNAP2"
+
+struct kms_cache_header {
+    char magic[8];
+    uint32_t size;              /* sizeof(struct kms_snapshot), changes with the layout */
+};
+
+const char *kms_cache_path = NULL;
+
+static struct kms_snapshot snapshot;
+static int snapshot_fd = -1;
+
+static void make_key(int fd, bool atomic, char *key, size_t size)
+{
+    drmVersionPtr version = drmGetVersion(fd);
+    struct utsname uts;
+    struct stat st;
+
+    memset(key, 0, size);
+    if (fstat(fd, &st))
+        st.st_rdev = 0;
+    if (uname(&uts))
+        memset(&uts, 0, sizeof(uts));
+
+    snprintf(key, size, "%s %d.%d.%d %s dev %llx%s %s %s",
+        version ? version->name : "?",
+        version ? version->version_major : 0,
+        version ? version->version_minor : 0,
+        version ? version->version_patchlevel : 0,
+        version ? version->date : "?",
+        (unsigned long long)st.st_rdev, atomic ? " atomic" : "", uts.release, uts.version);
+
+    if (version)
+        drmFreeVersion(version);
+}
+
+static int add_object(struct kms_snapshot *s, int fd, uint32_t obj_id, uint32_t obj_type)
+{
+    drmModeObjectProperties *props;
+    struct kms_object *obj;
+    uint32_t i;
+
+    if (s->count_objects == KMS_MAX_OBJECTS) {
+        printf("kms snapshot: too many objects\n");
+        return -1;
+    }
+
+    props = drmModeObjectGetProperties(fd, obj_id, obj_type);
+    if (!props) {
+        printf("could not get object %u properties: %s\n", obj_id, strerror(errno));
+        return -1;
+    }
+
+    obj = &s->objects[s->count_objects++];
+    obj->id = obj_id;
+    obj->type = obj_type;
+    obj->first_prop = s->count_props;
+
+    for (i = 0; i < props->count_props && s->count_props < KMS_MAX_PROPS; i++) {
+        drmModePropertyRes *info = drmModeGetProperty(fd, props->props[i]);
+        struct kms_prop *prop = &s->props[s->count_props];
+
+        if (!info)
+            continue;
+
+        prop->id = info->prop_id;
+        prop->flags = info->flags;
+        memcpy(prop->name, info->name, sizeof(prop->name));
+        if ((info->flags & (DRM_MODE_PROP_RANGE | DRM_MODE_PROP_SIGNED_RANGE)) &&
+                info->count_values == 2)
+            memcpy(prop->range, info->values, sizeof(prop->range));
+        prop->first_enum = s->count_enums;
+        if (s->count_enums + info->count_enums <= KMS_MAX_ENUMS) {
+            memcpy(&s->enums[s->count_enums], info->enums,
+                info->count_enums * sizeof(*info->enums));
+            prop->count_enums = info->count_enums;
+            s->count_enums += info->count_enums;
+        }
+        s->count_props++;
+        drmModeFreeProperty(info);
+    }
+
+    obj->count_props = s->count_props - obj->first_prop;
+    drmModeFreeObjectProperties(props);
+    return 0;
+}
+
+static int add_ids(struct kms_snapshot *s, const uint32_t *ids, int count)
+{
+    int first = s->count_ids;
+
+    if (s->count_ids + count > KMS_MAX_IDS) {
+        printf("kms snapshot: too many IDs\n");
+        return -1;
+    }
+
+    memcpy(&s->ids[first], ids, count * sizeof(*ids));
+    s->count_ids += count;
+    return first;
+}
+
+static int set_connector_state(struct kms_snapshot *s, struct kms_connector *c,
+    const drmModeConnector *connector)
+{
+    c->encoder_id = connector->encoder_id;
+    c->connection = connector->connection;
+    c->first_mode = s->count_modes;
+    c->count_modes = connector->count_modes;
+
+    if (s->count_modes + connector->count_modes > KMS_MAX_MODES) {
+        printf("kms snapshot: too many modes\n");
+        return -1;
+    }
+
+    memcpy(&s->modes[s->count_modes], connector->modes,
+        connector->count_modes * sizeof(*connector->modes));
+    s->count_modes += connector->count_modes;
+    return 0;
+}
+
+static int probe(struct kms_snapshot *s, int fd, bool atomic)
+{
+    drmModeRes *resources;
+    drmModePlaneRes *plane_resources;
+    int i, ret = -1;
+
+    memset(s, 0, sizeof(*s));
+    make_key(fd, atomic, s->key, sizeof(s->key));
+
+    resources = drmModeGetResources(fd);
+    if (!resources) {
+        printf("drmModeGetResources failed: %s\n", strerror(errno));
+        return -1;
+    }
+
+    plane_resources = drmModeGetPlaneResources(fd);
+    if (!plane_resources) {
+        printf("drmModeGetPlaneResources failed: %s\n", strerror(errno));
+        drmModeFreeResources(resources);
+        return -1;
+    }
+
+    if (resources->count_crtcs > KMS_MAX_CRTCS ||
+        resources->count_connectors > KMS_MAX_CONNECTORS ||
+        resources->count_encoders > KMS_MAX_ENCODERS ||
+        plane_resources->count_planes > KMS_MAX_PLANES) {
+        printf("kms snapshot: too many objects\n");
+        goto out;
+    }
+
+    for (i = 0; i < resources->count_crtcs; i++) {
+        s->crtcs[s->count_crtcs++] = resources->crtcs[i];
+        if (add_object(s, fd, resources->crtcs[i], DRM_MODE_OBJECT_CRTC))
+            goto out;
+    }
+
+    for (i = 0; i < resources->count_encoders; i++) {
+        drmModeEncoder *encoder = drmModeGetEncoder(fd, resources->encoders[i]);
+        struct kms_encoder *e = &s->encoders[s->count_encoders++];
+
+        e->id = resources->encoders[i];
+        if (encoder) {
+            e->crtc_id = encoder->crtc_id;
+            e->possible_crtcs = encoder->possible_crtcs;
+            drmModeFreeEncoder(encoder);
+        }
+    }
+
+    for (i = 0; i < resources->count_connectors; i++) {
+        drmModeConnector *connector = drmModeGetConnector(fd, resources->connectors[i]);
+        struct kms_connector *c = &s->connectors[s->count_connectors++];
+
+        c->id = resources->connectors[i];
+        c->connection = DRM_MODE_UNKNOWNCONNECTION;
+        if (!connector)
+            continue;
+
+        c->type = connector->connector_type;
+        c->type_id = connector->connector_type_id;
+        c->count_encoders = connector->count_encoders;
+        c->first_encoder = add_ids(s, connector->encoders, connector->count_encoders);
+        ret = c->first_encoder < 0 ? -1 : set_connector_state(s, c, connector);
+        drmModeFreeConnector(connector);
+        if (ret || add_object(s, fd, c->id, DRM_MODE_OBJECT_CONNECTOR))
+            goto out;
+    }
+
+    for (i = 0; i < (int)plane_resources->count_planes; i++) {
+        drmModePlane *plane = drmModeGetPlane(fd, plane_resources->planes[i]);
+        struct kms_plane *p = &s->planes[s->count_planes++];
+
+        p->id = plane_resources->planes[i];
+        if (plane) {
+            p->possible_crtcs = plane->possible_crtcs;
+            p->count_formats = plane->count_formats;
+            p->first_format = add_ids(s, plane->formats, plane->count_formats);
+            drmModeFreePlane(plane);
+            if (p->first_format < 0)
+                goto out;
+        }
+        if (add_object(s, fd, p->id, DRM_MODE_OBJECT_PLANE))
+            goto out;
+    }
+
+    ret = 0;
+out:
+    drmModeFreePlaneResources(plane_resources);
+    drmModeFreeResources(resources);
+    return ret;
+}
+
+static bool same_ids(const uint32_t *ids, int count, const uint32_t *cached, int cached_count)
+{
+    return count == cached_count && memcmp(ids, cached, count * sizeof(*ids)) == 0;
+}
+
+/*
+ * The cache is only trusted if it was written for the same device, driver
+ * and kernel and the object IDs did not change. The connection state,
+ * modes and encoder routing can change at any time, so they are read
+ * again without forcing a connector probe (no EDID read), unless the
+ * kernel has nothing to report yet, as after a boot nothing probed in.
+ */
+static int load(struct kms_snapshot *s, int fd, bool atomic, const char *path)
+{
+    struct kms_cache_header header;
+    char key[sizeof(s->key)];
+    drmModeRes *resources = NULL;
+    drmModePlaneRes *plane_resources = NULL;
+    FILE *fp;
+    int i, ret = -1;
+
+    fp = fopen(path, "rb");
+    if (!fp)
+        return -1;
+
+    if (fread(&header, sizeof(header), 1, fp) != 1 ||
+        memcmp(header.magic, KMS_CACHE_MAGIC, sizeof(header.magic)) != 0 ||
+        header.size != sizeof(*s) ||
+        fread(s, sizeof(*s), 1, fp) != 1) {
+        printf("kms cache %s: invalid\n", path);
+        fclose(fp);
+        return -1;
+    }
+    fclose(fp);
+
+    make_key(fd, atomic, key, sizeof(key));
+    if (strcmp(key, s->key) != 0) {
+        printf("kms cache %s: written for another device or kernel\n", path);
+        return -1;
+    }
+
+    resources = drmModeGetResources(fd);
+    plane_resources = drmModeGetPlaneResources(fd);
+    if (!resources || !plane_resources)
+        goto out;
+
+    if (!same_ids(resources->crtcs, resources->count_crtcs, s->crtcs, s->count_crtcs))
+        goto stale;
+
+    if (resources->count_connectors != s->count_connectors)
+        goto stale;
+    for (i = 0; i < s->count_connectors; i++) {
+        if (resources->connectors[i] != s->connectors[i].id)
+            goto stale;
+    }
+
+    if (resources->count_encoders != s->count_encoders)
+        goto stale;
+    for (i = 0; i < s->count_encoders; i++) {
+        if (resources->encoders[i] != s->encoders[i].id)
+            goto stale;
+    }
+
+    if ((int)plane_resources->count_planes != s->count_planes)
+        goto stale;
+    for (i = 0; i < s->count_planes; i++) {
+        if (plane_resources->planes[i] != s->planes[i].id)
+            goto stale;
+    }
+
+    s->count_modes = 0;
+    for (i = 0; i < s->count_connectors; i++) {
+        struct kms_connector *c = &s->connectors[i];
+        drmModeConnector *connector = drmModeGetConnectorCurrent(fd, c->id);
+
+        if (connector && (!connector->count_modes ||
+                connector->connection == DRM_MODE_UNKNOWNCONNECTION)) {
+            drmModeFreeConnector(connector);
+            connector = drmModeGetConnector(fd, c->id);
+        }
+        if (!connector)
+            goto out;
+        ret = set_connector_state(s, c, connector);
+        drmModeFreeConnector(connector);
+        if (ret)
+            goto out;
+        ret = -1;
+    }
+
+    for (i = 0; i < s->count_encoders; i++) {
+        drmModeEncoder *encoder = drmModeGetEncoder(fd, s->encoders[i].id);
+
+        if (!encoder)
+            goto out;
+        s->encoders[i].crtc_id = encoder->crtc_id;
+        drmModeFreeEncoder(encoder);
+    }
+
+    ret = 0;
+    goto out;
+
+stale:
+    printf("kms cache %s: objects changed\n", path);
+out:
+    if (plane_resources)
+        drmModeFreePlaneResources(plane_resources);
+    if (resources)
+        drmModeFreeResources(resources);
+    return ret;
+}
+
+static int save(const struct kms_snapshot *s, const char *path)
+{
+    struct kms_cache_header header = { .size = sizeof(*s) };
+    FILE *fp;
+    int ret = 0;
+
+    memcpy(header.magic, KMS_CACHE_MAGIC, sizeof(header.magic));
+
+    fp = fopen(path, "wb");
+    if (!fp) {
+        printf("failed to write kms cache %s: %s\n", path, strerror(errno));
+        return -1;
+    }
+
+    if (fwrite(&header, sizeof(header), 1, fp) != 1 ||
+        fwrite(s, sizeof(*s), 1, fp) != 1)
+        ret = -1;
+    if (fclose(fp))
+        ret = -1;
+    if (ret)
+        printf("failed to write kms cache %s\n", path);
+
+    return ret;
+}
+
+static double now_ms(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1e3 + ts.tv_nsec / 1e6;
+}
+
+const struct kms_snapshot *kms_snapshot_init(int fd, bool atomic)
+{
+    double start = now_ms();
+    bool cached = false;
+
+    startup_profile_begin("kms snapshot");
+
+    snapshot_fd = -1;
+    if (kms_cache_path && load(&snapshot, fd, atomic, kms_cache_path) == 0) {
+        cached = true;
+    } else {
+        if (probe(&snapshot, fd, atomic)) {
+            startup_profile_end("kms snapshot");
+            return NULL;
+        }
+        if (kms_cache_path)
+            save(&snapshot, kms_cache_path);
+    }
+    snapshot_fd = fd;
+    startup_profile_end("kms snapshot");
+
+    printf("kms snapshot: %s in %.3f ms, %d objects %d properties\n",
+        cached ? "loaded from cache" : "probed", now_ms() - start,
+        snapshot.count_objects, snapshot.count_props);
+
+    return &snapshot;
+}
+
+int kms_snapshot_get_properties(int fd, uint32_t obj_id,
+    drmModeObjectProperties **out_props, drmModePropertyRes ***out_props_info)
+{
+    const struct kms_object *obj = NULL;
+    drmModeObjectProperties *props, *current;
+    drmModePropertyRes **props_info;
+    uint32_t k;
+    int i, j;
+
+    if (fd != snapshot_fd)
+        return -1;
+
+    for (i = 0; i < snapshot.count_objects && !obj; i++) {
+        if (snapshot.objects[i].id == obj_id)
+            obj = &snapshot.objects[i];
+    }
+    if (!obj)
+        return -1;
+
+    /*
+     * FB_ID, CRTC_ID, zpos and the like change with every commit, and blob
+     * IDs like the EDID's with every boot. One ioctl reads them all.
+     */
+    current = drmModeObjectGetProperties(fd, obj_id, obj->type);
+    if (!current)
+        return -1;
+
+    /* laid out like libdrm's, so drmModeFreeObjectProperties/drmModeFreeProperty work */
+    props = calloc(1, sizeof(*props));
+    props->count_props = obj->count_props;
+    props->props = calloc(obj->count_props, sizeof(*props->props));
+    props->prop_values = calloc(obj->count_props, sizeof(*props->prop_values));
+    props_info = calloc(obj->count_props, sizeof(*props_info));
+
+    for (i = 0; i < obj->count_props; i++) {
+        const struct kms_prop *prop = &snapshot.props[obj->first_prop + i];
+
+        props->props[i] = prop->id;
+        for (k = 0; k < current->count_props; k++) {
+            if (current->props[k] == prop->id)
+                props->prop_values[i] = current->prop_values[k];
+        }
+        props_info[i] = calloc(1, sizeof(**props_info));
+        props_info[i]->prop_id = prop->id;
+        props_info[i]->flags = prop->flags;
+        memcpy(props_info[i]->name, prop->name, sizeof(prop->name));
+
+        if (prop->flags & (DRM_MODE_PROP_RANGE | DRM_MODE_PROP_SIGNED_RANGE)) {
+            props_info[i]->count_values = 2;
+            props_info[i]->values = calloc(2, sizeof(uint64_t));
+            memcpy(props_info[i]->values, prop->range, sizeof(prop->range));
+        } else if (prop->count_enums) {
+            /* libdrm lists the enum values as values too */
+            props_info[i]->count_enums = prop->count_enums;
+            props_info[i]->enums = calloc(prop->count_enums, sizeof(*props_info[i]->enums));
+            memcpy(props_info[i]->enums, &snapshot.enums[prop->first_enum],
+                prop->count_enums * sizeof(*props_info[i]->enums));
+            props_info[i]->count_values = prop->count_enums;
+            props_info[i]->values = calloc(prop->count_enums, sizeof(uint64_t));
+            for (j = 0; j < prop->count_enums; j++)
+                props_info[i]->values[j] = props_info[i]->enums[j].value;
+        }
+    }
+
+    drmModeFreeObjectProperties(current);
+
+    *out_props = props;
+    *out_props_info = props_info;
+    return 0;
+}
+
+drmModePlane *kms_snapshot_get_plane(int fd, uint32_t plane_id)
+{
+    const struct kms_plane *p = NULL;
+    drmModePlane *plane;
+    int i;
+
+    if (fd != snapshot_fd)
+        return NULL;
+
+    for (i = 0; i < snapshot.count_planes && !p; i++) {
+        if (snapshot.planes[i].id == plane_id)
+            p = &snapshot.planes[i];
+    }
+    if (!p)
+        return NULL;
+
+    /* laid out like libdrm's, so drmModeFreePlane works */
+    plane = calloc(1, sizeof(*plane));
+    plane->plane_id = p->id;
+    plane->possible_crtcs = p->possible_crtcs;
+    plane->count_formats = p->count_formats;
+    plane->formats = calloc(p->count_formats ? p->count_formats : 1, sizeof(*plane->formats));
+    memcpy(plane->formats, &snapshot.ids[p->first_format], p->count_formats * sizeof(*plane->formats));
+    return plane;
+}
+
+void kms_snapshot_connector(const struct kms_snapshot *s,
+    const struct kms_connector *connector, drmModeConnector *view)
+{
+    memset(view, 0, sizeof(*view));
+    view->connector_id = connector->id;
+    view->encoder_id = connector->encoder_id;
+    view->connector_type = connector->type;
+    view->connector_type_id = connector->type_id;
+    view->connection = connector->connection;
+    view->count_modes = connector->count_modes;
+    view->modes = (drmModeModeInfo *)&s->modes[connector->first_mode];
+    view->count_encoders = connector->count_encoders;
+    view->encoders = (uint32_t *)&s->ids[connector->first_encoder];
+}
+
+drmModeModeInfo *kms_choose_mode(const drmModeConnector *connector,
+    int preferred_width, int preferred_height)
+{
+    drmModeModeInfo *mode = NULL;
+    int i, area;
+
+    /* find prefered mode or the highest resolution mode: */
+    for (i = 0, area = 0; i < connector->count_modes; i++) {
+        drmModeModeInfo *current_mode = &connector->modes[i];
+
+        if (current_mode->type & DRM_MODE_TYPE_PREFERRED) {
+            mode = current_mode;
+        }
+
+        int current_area = current_mode->hdisplay * current_mode->vdisplay;
+        if (current_area > area) {
+            mode = current_mode;
+            area = current_area;
+        }
+    }
+
+    if (preferred_width && preferred_height) {
+        for (i = 0; i < connector->count_modes; i++) {
+            drmModeModeInfo *current_mode = &connector->modes[i];
+
+            if (preferred_width == current_mode->hdisplay &&
+                preferred_height == current_mode->vdisplay) {
+                printf("override matched mode for %dx%d\n", preferred_width, preferred_height);
+                mode = current_mode;
+                break;
+            }
+        }
+    }
+
+    return mode;
+}
+
+static const struct kms_encoder *find_encoder(const struct kms_snapshot *s, uint32_t encoder_id)
+{
+    int i;
+
+    for (i = 0; i < s->count_encoders; i++) {
+        if (s->encoders[i].id == encoder_id)
+            return &s->encoders[i];
+    }
+
+    return NULL;
+}
+
+int kms_snapshot_pick_output(const struct kms_snapshot *s,
+    int preferred_width, int preferred_height,
+    uint32_t *connector_id, uint32_t *crtc_id, drmModeModeInfo **mode)
+{
+    const struct kms_connector *connector = NULL;
+    const struct kms_encoder *encoder;
+    drmModeConnector view;
+    int i, j;
+
+    /* find a connected connector: */
+    for (i = 0; i < s->count_connectors && !connector; i++) {
+        if (s->connectors[i].connection == DRM_MODE_CONNECTED)
+            connector = &s->connectors[i];
+    }
+
+    if (!connector) {
+        printf("no connected connector!\n");
+        return -1;
+    }
+
+    kms_snapshot_connector(s, connector, &view);
+    *mode = kms_choose_mode(&view, preferred_width, preferred_height);
+    if (!*mode) {
+        printf("could not find mode!\n");
+        return -1;
+    }
+
+    /* the CRTC already driving it, else the first one an encoder can use */
+    *crtc_id = 0;
+    encoder = find_encoder(s, connector->encoder_id);
+    if (encoder)
+        *crtc_id = encoder->crtc_id;
+
+    for (i = 0; i < view.count_encoders && !*crtc_id; i++) {
+        encoder = find_encoder(s, view.encoders[i]);
+        for (j = 0; encoder && j < s->count_crtcs && !*crtc_id; j++) {
+            if (encoder->possible_crtcs & (1 << j))
+                *crtc_id = s->crtcs[j];
+        }
+    }
+
+    if (!*crtc_id) {
+        printf("no crtc found!\n");
+        return -1;
+    }
+
+    *connector_id = connector->id;
+    return 0;
+}
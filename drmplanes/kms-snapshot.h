@@ -0,0 +1,119 @@
+#ifndef KMS_SNAPSHOT_H
+#define KMS_SNAPSHOT_H
+
+#include <stdint.h>
+#include <stdbool.h>
+#include <xf86drm.h>
+#include <xf86drmMode.h>
+
+#define KMS_MAX_CRTCS 32
+#define KMS_MAX_CONNECTORS 32
+#define KMS_MAX_ENCODERS 32
+#define KMS_MAX_PLANES 64
+#define KMS_MAX_OBJECTS (KMS_MAX_CRTCS + KMS_MAX_CONNECTORS + KMS_MAX_PLANES)
+#define KMS_MAX_PROPS 4096
+#define KMS_MAX_MODES 512
+#define KMS_MAX_IDS 4096
+#define KMS_MAX_ENUMS 1024
+
+struct kms_prop {
+    uint32_t id;
+    uint32_t flags;
+    uint64_t range[2];          /* min and max of range properties */
+    int first_enum, count_enums;
+    char name[DRM_PROP_NAME_LEN];
+};
+
+struct kms_object {
+    uint32_t id;
+    uint32_t type;
+    int first_prop, count_props;
+};
+
+struct kms_connector {
+    uint32_t id;
+    uint32_t encoder_id;
+    uint32_t type, type_id;
+    drmModeConnection connection;
+    int first_mode, count_modes;
+    int first_encoder, count_encoders;  /* into ids */
+};
+
+struct kms_encoder {
+    uint32_t id;
+    uint32_t crtc_id;
+    uint32_t possible_crtcs;
+};
+
+struct kms_plane {
+    uint32_t id;
+    uint32_t possible_crtcs;
+    int first_format, count_formats;    /* into ids */
+};
+
+/*
+ * Everything init_drm and the atomic helpers read from the kernel, taken
+ * in one pass. It is a flat struct so it can be written to a cache file
+ * as is. The key names the device, driver and kernel it was probed on.
+ */
+struct kms_snapshot {
+    char key[256];
+
+    int count_crtcs;
+    uint32_t crtcs[KMS_MAX_CRTCS];
+    int count_connectors;
+    struct kms_connector connectors[KMS_MAX_CONNECTORS];
+    int count_encoders;
+    struct kms_encoder encoders[KMS_MAX_ENCODERS];
+    int count_planes;
+    struct kms_plane planes[KMS_MAX_PLANES];
+
+    int count_objects;
+    struct kms_object objects[KMS_MAX_OBJECTS];
+    int count_props;
+    struct kms_prop props[KMS_MAX_PROPS];
+    int count_modes;
+    drmModeModeInfo modes[KMS_MAX_MODES];
+    int count_ids;
+    uint32_t ids[KMS_MAX_IDS];
+    int count_enums;
+    struct drm_mode_property_enum enums[KMS_MAX_ENUMS];
+};
+
+/* cache file for kms_snapshot_init, NULL: probe every time */
+extern const char *kms_cache_path;
+
+/*
+ * Probe fd, or load kms_cache_path if it was written for the same device,
+ * driver and kernel and the object IDs still match. Connectors and
+ * encoders are refreshed without a forced probe when loaded from the cache.
+ * Later lookups of fd's properties are served from the snapshot. The
+ * caller sets the client caps first; atomic says whether it set
+ * DRM_CLIENT_CAP_ATOMIC, which changes the properties the kernel lists.
+ */
+const struct kms_snapshot *kms_snapshot_init(int fd, bool atomic);
+
+/*
+ * drmModeObjectGetProperties + drmModeGetProperty from the snapshot, -1: not
+ * in it. The property values are always read from the kernel again.
+ */
+int kms_snapshot_get_properties(int fd, uint32_t obj_id,
+    drmModeObjectProperties **out_props, drmModePropertyRes ***out_props_info);
+
+/* drmModeGetPlane from the snapshot, NULL: not in it. Only the static fields are set. */
+drmModePlane *kms_snapshot_get_plane(int fd, uint32_t plane_id);
+
+/* a drmModeConnector pointing into the snapshot, for code written for libdrm */
+void kms_snapshot_connector(const struct kms_snapshot *snapshot,
+    const struct kms_connector *connector, drmModeConnector *view);
+
+/* preferred or largest mode, or the one of preferred_width x preferred_height if any */
+drmModeModeInfo *kms_choose_mode(const drmModeConnector *connector,
+    int preferred_width, int preferred_height);
+
+/* first connected connector, its mode and the CRTC to drive it with */
+int kms_snapshot_pick_output(const struct kms_snapshot *snapshot,
+    int preferred_width, int preferred_height,
+    uint32_t *connector_id, uint32_t *crtc_id, drmModeModeInfo **mode);
+
+#endif /* KMS_SNAPSHOT_H */
@@ -34,33 +34,25 @@
 #include <string.h>
 #include <drm_fourcc.h>
 #include <errno.h>
+#include <pthread.h>
 
 #include "readpng.h"
 #include "drm-common.h"
+#include "drm-atomic.h"
+#include "plane-solver.h"
+#include "alloc-count.h"
+#include "hotplug.h"
+#include "kms-snapshot.h"
+#include "startup-profile.h"
+#include "timeline.h"
+#include "dumb-buffer.h"
+#include "writeback.h"
 
 bool verbose = false;
 
 static struct gbm gbm;
 const static struct egl *egl;
 
-struct plane {
-    drmModePlane *plane;
-    drmModeObjectProperties *props;
-    drmModePropertyRes **props_info;
-};
-
-struct crtc {
-    drmModeCrtc *crtc;
-    drmModeObjectProperties *props;
-    drmModePropertyRes **props_info;
-};
-
-struct connector {
-    drmModeConnector *connector;
-    drmModeObjectProperties *props;
-    drmModePropertyRes **props_info;
-};
-
 static struct drm drm;
 
 static struct glcolor red = {1.0f, 0.0f, 0.0f, 1.0f};
@@ -78,230 +70,1769 @@ static const char *secondary_file_name = "secondary_512x2160.png";
 static int default_crtc_width = 3840;
 static int default_crtc_height = 2160;
 
+/* rejected commits in a row before a test loop gives up */
+static const int max_commit_failures = 10;
+
 static int init_drm_atomic_planes(uint32_t primary_plane_id, uint32_t overlay_plane_id)
 {
     drm.primary_plane = calloc(1, sizeof(*drm.primary_plane));
     drm.overlay_plane = calloc(1, sizeof(*drm.overlay_plane));
 
-#define get_plane_resource(plane, type, Type, id) do {        \
-        drm.plane->type = drmModeGet##Type(drm.fd, id); \
-        if (!drm.plane->type) {                         \
-            printf("could not get %s %i: %s\n",         \
-                #type, id, strerror(errno));            \
-            return -1;                                  \
-        }                                               \
-    } while (0)
-
-    get_plane_resource(primary_plane, plane, Plane, primary_plane_id);
-    get_plane_resource(overlay_plane, plane, Plane, overlay_plane_id);
-
-#define get_plane_properties(plane, type, TYPE, id) do {                      \
-        uint32_t i;                                                     \
-        drm.plane->props = drmModeObjectGetProperties(drm.fd,           \
-            id, DRM_MODE_OBJECT_##TYPE);                                \
-        if (!drm.plane->props) {                                        \
-            printf("could not get %s %u properties: %s\n",              \
-                #type, id, strerror(errno));                            \
-            return -1;                                                  \
-        }                                                               \
-        drm.plane->props_info = calloc(drm.plane->props->count_props,   \
-            sizeof(*drm.plane->props_info));                            \
-        for (i = 0; i < drm.plane->props->count_props; i++) {           \
-            drm.plane->props_info[i] = drmModeGetProperty(drm.fd,       \
-                drm.plane->props->props[i]);                            \
-        }                                                               \
-    } while (0)
-
-    get_plane_properties(primary_plane, plane, PLANE, primary_plane_id);
-    get_plane_properties(overlay_plane, plane, PLANE, overlay_plane_id);
+    if (init_atomic_plane(drm.fd, primary_plane_id, drm.primary_plane))
+        return -1;
+
+    if (init_atomic_plane(drm.fd, overlay_plane_id, drm.overlay_plane))
+        return -1;
+
+    return 0;
+}
+
+#define MAX_MODIFIERS 64
+
+static bool modifier_in(uint64_t modifier, const uint64_t *modifiers, int count)
+{
+    int i;
+
+    for (i = 0; i < count; i++) {
+        if (modifiers[i] == modifier)
+            return true;
+    }
+
+    return false;
+}
+
+static int init_drm_atomic(char *device_path, char *mode_str)
+{
+    startup_profile_begin("init_drm");
+    int ret = init_drm(&drm, device_path, mode_str, true);
+    startup_profile_end("init_drm");
+    if (ret)
+        return ret;
+
+    drm.crtc = calloc(1, sizeof(*drm.crtc));
+    drm.connector = calloc(1, sizeof(*drm.connector));
+
+    startup_profile_begin("atomic properties");
+    if (init_atomic_connector(drm.fd, drm.connector_id, drm.connector))
+        return -1;
+
+    if (init_atomic_crtc(drm.fd, drm.crtc_id, drm.crtc))
+        return -1;
+    startup_profile_end("atomic properties");
+
+    return 0;
+}
+
+static void print_usage(const char *progname)
+{
+    printf("Usage:\n");
+    printf("    %s -p <plane_id>@<width>x<height> -o <plane_id>@<width>x<height> -v -d <duration> -D <device_path> -m <mode_str>\n", progname);
+    printf("\n");
+    printf("    -p primary plane info (default: %s)\n", default_primary_info);
+    printf("    -o overlay plane info (default: %s)\n", default_overlay_info);
+    printf("    -c CRTC resolution to be used drmModeSetPlane for primary plane (default: %dx%d)\n",
+        default_crtc_width, default_crtc_height);
+    printf("    -v verbose\n");
+    printf("    -d duration (default: %d)\n", default_duration);
+    printf("    -D drm device path (default: /dev/dri/card0)\n");
+    printf("    -m mode preferred (default: NULL, mode with highest resolution)\n");
+    printf("    -f FOURCC format (default: AR24)\n");
+    printf("    -l resource location (default: /usr/share/drmplanes)\n");
+    printf("    -t render type, one of:\n");
+    printf("       smooth    -  smooth shaded cube (default)\n");
+    printf("       png       -  PNG still image\n");
+    printf("    -n non-blocking commit, render the next frame while the previous one is flipped\n");
+    printf("    -N drive up to <count> planes of the CRTC (0: all), stepping the number of\n");
+    printf("       active planes from 1 every <duration> frames, then print a summary\n");
+    printf("    -L add a layer <w>x<h>[@<x>,<y>][/<crtc_w>x<crtc_h>][:<fourcc>], bottom to top;\n");
+    printf("       find the plane assignment with TEST_ONLY commits and exit\n");
+    printf("    -r draw <count> moving rects of <w>x<h> over a static background,\n");
+    printf("       <w>x<h>[,<count>], and pass what changed as FB_DAMAGE_CLIPS\n");
+    printf("    -R with -r, draw the same rects but commit without damage clips\n");
+    printf("    -O drive every connected output, each with its own CRTC, plane and\n");
+    printf("       render thread, in the mode of -m if it has one\n");
+    printf("    -H follow hotplug events, set the mode again when the output comes back\n");
+    printf("       and report the time from the event to the first frame\n");
+    printf("    -B stack up to <count> (0: all) overlays semi-transparent over the primary plane,\n");
+    printf("       change their zpos order and alpha every frame, once per pixel blend\n");
+    printf("       mode, and report commit cost and the GPU composition traffic saved\n");
+    printf("    -T play the plane motion of a timeline scenario file, a plane per layer,\n");
+    printf("       timed on the expected presentation of each frame\n");
+    printf("    -b benchmark atomic request build for <iterations> and exit\n");
+    printf("    -K cache file for the KMS objects and properties, reused while still valid\n");
+    printf("    -P time the startup phases up to the first frame, print them and\n");
+    printf("       write them as JSON to <file>\n");
+    printf("    -M scan out with the modifier of <index> in the printed candidate list\n");
+    printf("       instead of the first one the plane and EGL agree on\n");
+    printf("    -U draw into dumb buffers with the CPU instead of GBM and EGL, for\n");
+    printf("       drivers without a GPU; the default test and -b only\n");
+    printf("    -W capture every <interval>th frame of the default test with a writeback\n");
+    printf("       connector, report capture throughput and the commit time it adds\n");
+    printf("    -h help\n");
+    printf("\n");
+    printf("Example:\n");
+    printf("    %s -p 31@1920x1080 -o 38@512x2160 -v -d 100 -m 1920x1080 -f AR24 -c 3840x2160\n", progname);
+}
+
+static void drm_atomic_set_plane_properties(drmModeAtomicReq *req, const struct plane *plane,
+    uint32_t crtc_id, uint32_t fb_id,
+    uint32_t src_width, uint32_t src_height,
+    uint32_t crtc_width, uint32_t crtc_height,
+    uint32_t crtc_x)
+{
+    add_plane_property(req, plane, PLANE_PROP_FB_ID, fb_id);
+    add_plane_property(req, plane, PLANE_PROP_CRTC_ID, crtc_id);
+    add_plane_property(req, plane, PLANE_PROP_SRC_X, 0);
+    add_plane_property(req, plane, PLANE_PROP_SRC_Y, 0);
+    add_plane_property(req, plane, PLANE_PROP_SRC_W, src_width << 16);
+    add_plane_property(req, plane, PLANE_PROP_SRC_H, src_height << 16);
+    add_plane_property(req, plane, PLANE_PROP_CRTC_X, crtc_x);
+    add_plane_property(req, plane, PLANE_PROP_CRTC_Y, 0);
+    add_plane_property(req, plane, PLANE_PROP_CRTC_W, crtc_width);
+    add_plane_property(req, plane, PLANE_PROP_CRTC_H, crtc_height);
+}
+
+/* the lookup every frame used to do, kept for the request build benchmark */
+static void drm_atomic_set_plane_properties_by_name(drmModeAtomicReq *req, const struct plane *plane,
+    uint32_t crtc_id, uint32_t fb_id,
+    uint32_t src_width, uint32_t src_height,
+    uint32_t crtc_width, uint32_t crtc_height,
+    uint32_t crtc_x)
+{
+    uint32_t plane_id = plane->plane->plane_id;
+
+#define add_by_name(name, value) \
+    add_property_by_name(req, plane_id, plane->props, plane->props_info, name, value)
+
+    add_by_name("FB_ID", fb_id);
+    add_by_name("CRTC_ID", crtc_id);
+    add_by_name("SRC_X", 0);
+    add_by_name("SRC_Y", 0);
+    add_by_name("SRC_W", src_width << 16);
+    add_by_name("SRC_H", src_height << 16);
+    add_by_name("CRTC_X", crtc_x);
+    add_by_name("CRTC_Y", 0);
+    add_by_name("CRTC_W", crtc_width);
+    add_by_name("CRTC_H", crtc_height);
+
+#undef add_by_name
+}
+
+static int template_set_plane_properties(struct atomic_template *t, const struct plane *plane,
+    uint32_t crtc_id, uint32_t fb_id,
+    uint32_t src_width, uint32_t src_height,
+    uint32_t crtc_width, uint32_t crtc_height,
+    uint32_t crtc_x, int *fb_slot, int *x_slot)
+{
+    int slots[PLANE_PROP_COUNT];
+    int k;
+
+    slots[PLANE_PROP_FB_ID] = atomic_template_add_plane(t, plane, PLANE_PROP_FB_ID, fb_id);
+    slots[PLANE_PROP_CRTC_ID] = atomic_template_add_plane(t, plane, PLANE_PROP_CRTC_ID, crtc_id);
+    slots[PLANE_PROP_SRC_X] = atomic_template_add_plane(t, plane, PLANE_PROP_SRC_X, 0);
+    slots[PLANE_PROP_SRC_Y] = atomic_template_add_plane(t, plane, PLANE_PROP_SRC_Y, 0);
+    slots[PLANE_PROP_SRC_W] = atomic_template_add_plane(t, plane, PLANE_PROP_SRC_W, src_width << 16);
+    slots[PLANE_PROP_SRC_H] = atomic_template_add_plane(t, plane, PLANE_PROP_SRC_H, src_height << 16);
+    slots[PLANE_PROP_CRTC_X] = atomic_template_add_plane(t, plane, PLANE_PROP_CRTC_X, crtc_x);
+    slots[PLANE_PROP_CRTC_Y] = atomic_template_add_plane(t, plane, PLANE_PROP_CRTC_Y, 0);
+    slots[PLANE_PROP_CRTC_W] = atomic_template_add_plane(t, plane, PLANE_PROP_CRTC_W, crtc_width);
+    slots[PLANE_PROP_CRTC_H] = atomic_template_add_plane(t, plane, PLANE_PROP_CRTC_H, crtc_height);
+
+    for (k = 0; k < PLANE_PROP_REQUIRED; k++) {
+        if (slots[k] < 0)
+            return -1;
+    }
+
+    if (fb_slot)
+        *fb_slot = slots[PLANE_PROP_FB_ID];
+    if (x_slot)
+        *x_slot = slots[PLANE_PROP_CRTC_X];
+    return 0;
+}
+
+static void run_request_build_bench(int iterations, uint32_t fb_id, uint32_t fb2_id,
+    int p_w, int p_h, int o_w, int o_h, int crtc_width, int crtc_height)
+{
+    drmModeAtomicReq *req = drmModeAtomicAlloc();
+    static struct atomic_template t;
+    uint64_t start, by_name_ns, by_table_ns, by_template_ns;
+    uint64_t allocs, by_name_allocs, by_table_allocs, by_template_allocs;
+    int fb_slot, fb2_slot, x_slot;
+    int n;
+
+    allocs = get_alloc_count();
+    start = get_time_ns();
+    for (n = 0; n < iterations; n++) {
+        drmModeAtomicSetCursor(req, 0);
+        drm_atomic_set_plane_properties_by_name(req, drm.primary_plane, drm.crtc_id, fb_id,
+            p_w, p_h, crtc_width, crtc_height, 0);
+        drm_atomic_set_plane_properties_by_name(req, drm.overlay_plane, drm.crtc_id, fb2_id,
+            o_w, o_h, o_w, o_h, n % crtc_width);
+    }
+    by_name_ns = get_time_ns() - start;
+    by_name_allocs = get_alloc_count() - allocs;
+
+    allocs = get_alloc_count();
+    start = get_time_ns();
+    for (n = 0; n < iterations; n++) {
+        drmModeAtomicSetCursor(req, 0);
+        drm_atomic_set_plane_properties(req, drm.primary_plane, drm.crtc_id, fb_id,
+            p_w, p_h, crtc_width, crtc_height, 0);
+        drm_atomic_set_plane_properties(req, drm.overlay_plane, drm.crtc_id, fb2_id,
+            o_w, o_h, o_w, o_h, n % crtc_width);
+    }
+    by_table_ns = get_time_ns() - start;
+    by_table_allocs = get_alloc_count() - allocs;
+
+    drmModeAtomicFree(req);
+
+    atomic_template_init(&t);
+    if (template_set_plane_properties(&t, drm.primary_plane, drm.crtc_id, fb_id,
+            p_w, p_h, crtc_width, crtc_height, 0, &fb_slot, NULL) ||
+        template_set_plane_properties(&t, drm.overlay_plane, drm.crtc_id, fb2_id,
+            o_w, o_h, o_w, o_h, 0, &fb2_slot, &x_slot))
+        return;
+
+    allocs = get_alloc_count();
+    start = get_time_ns();
+    for (n = 0; n < iterations; n++) {
+        atomic_template_set(&t, fb_slot, fb_id);
+        atomic_template_set(&t, fb2_slot, fb2_id);
+        atomic_template_set(&t, x_slot, n % crtc_width);
+    }
+    by_template_ns = get_time_ns() - start;
+    by_template_allocs = get_alloc_count() - allocs;
+
+    printf("request build (2 planes, %d iterations):\n", iterations);
+    printf("    strcmp lookup:  %.1f ns/request, %llu allocs\n",
+        (double)by_name_ns / iterations, (unsigned long long)by_name_allocs);
+    printf("    prop table:     %.1f ns/request, %llu allocs\n",
+        (double)by_table_ns / iterations, (unsigned long long)by_table_allocs);
+    printf("    template patch: %.1f ns/request, %llu allocs\n",
+        (double)by_template_ns / iterations, (unsigned long long)by_template_allocs);
+}
+
+static int get_mode_blob(void)
+{
+    /* the mode never changes, so a single blob serves every modeset */
+    if (!drm.mode_blob_id &&
+        drmModeCreatePropertyBlob(drm.fd, drm.mode, sizeof(*drm.mode),
+                          &drm.mode_blob_id) != 0)
+        return -1;
+
+    return 0;
+}
+
+static int drm_atomic_mode_set(drmModeAtomicReq *req, uint32_t flags)
+{
+    if (!(flags & DRM_MODE_ATOMIC_ALLOW_MODESET))
+        return 0;
+
+    if (get_mode_blob())
+        return -1;
+
+    if (add_connector_property(req, drm.connector, CONNECTOR_PROP_CRTC_ID,
+                    drm.crtc_id) < 0)
+        return -1;
+
+    if (add_crtc_property(req, drm.crtc, CRTC_PROP_MODE_ID, drm.mode_blob_id) < 0)
+        return -1;
+
+    if (add_crtc_property(req, drm.crtc, CRTC_PROP_ACTIVE, 1) < 0)
+        return -1;
+
+    return 0;
+}
+
+/*
+ * TEST_ONLY commit of base with plane scanning out a w x h buffer laid out
+ * with modifier, cropped to the mode so scaling cannot fail it. A plane
+ * that passes is added to base, so the next plane is tested on top of it;
+ * its buffer is returned in *test_bo and has to live as long as base.
+ */
+static int test_modifier(const struct plane *plane, uint32_t format, uint64_t modifier,
+    int w, int h, drmModeAtomicReq *base, struct gbm_bo **test_bo)
+{
+    uint32_t flags = DRM_MODE_ATOMIC_TEST_ONLY | DRM_MODE_ATOMIC_ALLOW_MODESET;
+    drmModeAtomicReq *req;
+    struct gbm_bo *bo;
+    struct drm_fb *fb;
+    int ret = -1;
+
+    if (w > drm.mode->hdisplay)
+        w = drm.mode->hdisplay;
+    if (h > drm.mode->vdisplay)
+        h = drm.mode->vdisplay;
+
+    bo = gbm_bo_create_with_modifiers(gbm.dev, w, h, format, &modifier, 1);
+    if (!bo)
+        return -1;
+
+    fb = drm_fb_get_from_bo(drm.fd, bo);
+    req = drmModeAtomicDuplicate(base);
+    if (fb && req) {
+        drm_atomic_set_plane_properties(req, plane, drm.crtc_id, fb->fb_id, w, h, w, h, 0);
+        ret = drmModeAtomicCommit(drm.fd, req, flags, NULL);
+    }
+    drmModeAtomicFree(req);
+
+    if (ret) {
+        gbm_bo_destroy(bo);
+        return -1;
+    }
+
+    drm_atomic_set_plane_properties(base, plane, drm.crtc_id, fb->fb_id, w, h, w, h, 0);
+    *test_bo = bo;
+    return 0;
+}
+
+/*
+ * Pick the modifier a plane scans out format with: the ones IN_FORMATS
+ * lists that EGL can also render to, in the driver's order, which puts the
+ * compressed and tiled layouts first. Linear is kept last, and only if
+ * IN_FORMATS lists it or the plane has no IN_FORMATS at all. The first
+ * candidate that passes a TEST_ONLY commit on top of base is taken;
+ * force_index tries only that one of the printed list, -1: all in order.
+ */
+static int negotiate_modifier(const struct plane *plane, const char *name, uint32_t format,
+    int force_index, int w, int h, drmModeAtomicReq *base, struct gbm_bo **test_bo,
+    uint64_t *out_modifier)
+{
+    uint64_t plane_mods[MAX_MODIFIERS], egl_mods[MAX_MODIFIERS];
+    uint64_t candidates[MAX_MODIFIERS];
+    int plane_count, egl_count, count = 0;
+    int i, chosen = -1;
+    bool tried, passed;
+
+    if (!plane_supports_format(plane->plane, format)) {
+        printf("%s plane %d does not support format %.4s\n", name,
+            plane->plane->plane_id, (char *)&format);
+        return -1;
+    }
+
+    plane_count = get_plane_modifiers(drm.fd, plane, format, plane_mods, MAX_MODIFIERS);
+    egl_count = egl_query_modifiers(gbm.dev, format, egl_mods, MAX_MODIFIERS);
+
+    for (i = 0; i < plane_count; i++) {
+        if (plane_mods[i] == DRM_FORMAT_MOD_LINEAR)
+            continue;
+        /* without the EGL extension only linear is known to render */
+        if (egl_count >= 0 && modifier_in(plane_mods[i], egl_mods, egl_count))
+            candidates[count++] = plane_mods[i];
+    }
+    /* get_plane_modifiers() reports linear for a plane without IN_FORMATS */
+    if (modifier_in(DRM_FORMAT_MOD_LINEAR, plane_mods, plane_count))
+        candidates[count++] = DRM_FORMAT_MOD_LINEAR;
+
+    if (!count) {
+        printf("%s plane %d, format %.4s: no modifier both IN_FORMATS and EGL support\n",
+            name, plane->plane->plane_id, (char *)&format);
+        return -1;
+    }
+
+    if (force_index >= count) {
+        printf("modifier index %d out of range, %s plane has %d candidates\n",
+            force_index, name, count);
+        return -1;
+    }
+
+    if (egl_count < 0)
+        printf("%s plane %d, format %.4s: %d modifiers from IN_FORMATS, EGL cannot list any\n",
+            name, plane->plane->plane_id, (char *)&format, plane_count);
+    else
+        printf("%s plane %d, format %.4s: %d modifiers from IN_FORMATS, %d from EGL\n",
+            name, plane->plane->plane_id, (char *)&format, plane_count, egl_count);
+    for (i = 0; i < count; i++) {
+        tried = chosen < 0 && (force_index < 0 || i == force_index);
+        passed = tried && test_modifier(plane, format, candidates[i], w, h, base, test_bo) == 0;
+        if (passed)
+            chosen = i;
+        printf("  %c %2d: 0x%016llx%s\n", passed ? '*' : ' ', i,
+            (unsigned long long)candidates[i], tried && !passed ? " TEST_ONLY failed" : "");
+    }
+
+    if (chosen < 0) {
+        printf("%s plane %d: no modifier passed a TEST_ONLY commit\n", name, plane->plane->plane_id);
+        return -1;
+    }
+
+    *out_modifier = candidates[chosen];
+    return 0;
+}
+
+/*
+ * A plane's buffer may only go back to its gbm_surface once the commit
+ * that replaced it on screen has completed.
+ */
+struct plane_buffers {
+    struct gbm_surface *surface;
+    struct gbm_bo *scanout;     /* on screen */
+    struct gbm_bo *pending;     /* committed, on screen after the next flip */
+    bool replaced;              /* the pending commit changes this plane */
+};
+
+enum plane_update {
+    PLANE_KEEP,                 /* not part of the commit */
+    PLANE_FLIP,                 /* new buffer committed */
+    PLANE_OFF,                  /* plane disabled */
+};
+
+static void plane_buffers_queue(struct plane_buffers *pb, struct gbm_bo *bo,
+    enum plane_update update)
+{
+    if (update == PLANE_FLIP) {
+        pb->pending = bo;
+    } else {
+        /* never reached the screen, so it can go back right away */
+        release_gbm_bo(&gbm, pb->surface, bo);
+        pb->pending = NULL;
+    }
+    pb->replaced = update != PLANE_KEEP;
+}
+
+static void plane_buffers_flip_done(struct plane_buffers *pb)
+{
+    if (!pb->replaced)
+        return;
+
+    release_gbm_bo(&gbm, pb->surface, pb->scanout);
+    pb->scanout = pb->pending;
+    pb->pending = NULL;
+    pb->replaced = false;
+}
+
+/*
+ * -U: a chain of dumb buffers per plane stands in for the GBM surface.
+ * The PNG content is copied in once, the pattern is drawn every frame.
+ */
+struct dumb_plane {
+    struct dumb_chain chain;
+    struct drm_fb fb;           /* no bo, fb_id of the buffer drawn last */
+    bool is_primary;
+    png_buffer_handle png;
+};
+
+static int dumb_plane_init(struct dumb_plane *dp, int width, int height, uint32_t format,
+    bool is_primary, const char *png_path)
+{
+    uint32_t png_w, png_h, png_stride;
+    const void *pixels;
+    int k;
+
+    if (dumb_chain_create(drm.fd, width, height, format, &dp->chain))
+        return -1;
+    dp->fb.drm_fd = drm.fd;
+    dp->is_primary = is_primary;
+    dp->png = NULL;
+
+    if (png_path) {
+        if (!read_png_from_file(png_path, &dp->png)) {
+            printf("failed to read %s\n", png_path);
+            return -1;
+        }
+        pixels = png_buffer_pixels(dp->png, &png_w, &png_h, &png_stride);
+        for (k = 0; k < DUMB_CHAIN_LENGTH; k++)
+            dumb_blit(&dp->chain.buffers[k], pixels, png_w, png_h, png_stride);
+    }
+
+    return 0;
+}
+
+static struct drm_fb *dumb_plane_draw(struct dumb_plane *dp, uint32_t frame)
+{
+    struct dumb_buffer *buf = dumb_chain_next(&dp->chain);
+
+    if (!dp->png)
+        dumb_draw_frame(&dp->chain, buf, frame, dp->is_primary);
+    dp->fb.fb_id = buf->fb_id;
+    return &dp->fb;
+}
+
+#define MAX_DAMAGE_RECTS 16
+
+/*
+ * -r: rects move over a static background, so only the rects at their
+ * previous and their new position differ from the buffer on screen.
+ */
+struct damage_pattern {
+    int w, h;
+    int count;
+};
+
+struct plane_damage {
+    struct drm_mode_rect prev[MAX_DAMAGE_RECTS];
+    bool has_prev;              /* else the whole plane is damaged */
+    struct drm_mode_rect clips[2 * MAX_DAMAGE_RECTS];
+    int clip_count;
+    double area;                /* damaged fraction of the plane, summed over frames */
+    uint64_t frames;
+};
+
+static bool parse_damage_pattern(const char *spec, struct damage_pattern *pattern)
+{
+    char *end;
+
+    pattern->count = 1;
+    pattern->w = strtol(spec, &end, 10);
+    if (*end++ != 'x')
+        return false;
+    pattern->h = strtol(end, &end, 10);
+    if (*end == ',')
+        pattern->count = strtol(end + 1, &end, 10);
+
+    return *end == '\0' && pattern->w > 0 && pattern->h > 0 &&
+        pattern->count > 0 && pattern->count <= MAX_DAMAGE_RECTS;
+}
+
+static void draw_damage_pattern(const struct damage_pattern *pattern,
+    struct plane_damage *damage, uint32_t i, int width, int height)
+{
+    int w = pattern->w < width ? pattern->w : width;
+    int h = pattern->h < height ? pattern->h : height;
+    double area = 0;
+    int k;
+
+    glClearColor(black.r, black.g, black.b, black.a);
+    glClear(GL_COLOR_BUFFER_BIT);
+
+    glEnable(GL_SCISSOR_TEST);
+    damage->clip_count = 0;
+    for (k = 0; k < pattern->count; k++) {
+        const struct glcolor *color = k % 2 ? &blue : &red;
+        int x = (i * 10 + k * width / pattern->count) % (width - w + 1);
+        int y = pattern->count > 1 ? k * (height - h) / (pattern->count - 1) : 0;
+        struct drm_mode_rect rect = { x, y, x + w, y + h };
+
+        /* GL origin is bottom left */
+        glScissor(x, height - y - h, w, h);
+        glClearColor(color->r, color->g, color->b, color->a);
+        glClear(GL_COLOR_BUFFER_BIT);
+
+        if (damage->has_prev)
+            damage->clips[damage->clip_count++] = damage->prev[k];
+        damage->clips[damage->clip_count++] = rect;
+        damage->prev[k] = rect;
+    }
+    glDisable(GL_SCISSOR_TEST);
+
+    if (!damage->has_prev) {
+        damage->clip_count = 0;
+        area = 1;
+    }
+    for (k = 0; k < damage->clip_count; k++) {
+        const struct drm_mode_rect *clip = &damage->clips[k];
+        area += (double)(clip->x2 - clip->x1) * (clip->y2 - clip->y1) / width / height;
+    }
+
+    damage->has_prev = true;
+    damage->area += area < 1 ? area : 1;
+    damage->frames++;
+}
+
+/* 0: no clips, the whole plane is damaged */
+static uint32_t create_damage_blob(const struct plane_damage *damage)
+{
+    uint32_t blob_id = 0;
+
+    if (!damage->clip_count)
+        return 0;
+
+    if (drmModeCreatePropertyBlob(drm.fd, damage->clips,
+            damage->clip_count * sizeof(damage->clips[0]), &blob_id)) {
+        printf("failed to create damage blob: %s\n", strerror(errno));
+        return 0;
+    }
+
+    return blob_id;
+}
+
+struct frame_geometry {
+    int p_w, p_h;
+    int o_w, o_h;
+    int crtc_w, crtc_h;
+};
+
+/*
+ * One prebuilt request per combination of modeset and plane updates the
+ * main loop commits. Per frame only the FB IDs and the overlay position
+ * are patched, so a steady-state frame does not touch the heap.
+ */
+struct frame_template {
+    struct atomic_template req;
+    bool built;
+    int primary_fb;             /* value slots, -1: not in the request */
+    int overlay_fb;
+    int overlay_x;
+    int primary_damage;
+    int overlay_damage;
+};
+
+static int build_frame_template(struct frame_template *ft, bool modeset,
+    enum plane_update primary, enum plane_update overlay,
+    const struct frame_geometry *geo, bool damage)
+{
+    struct atomic_template *t = &ft->req;
+
+    atomic_template_init(t);
+    ft->primary_fb = ft->overlay_fb = ft->overlay_x = -1;
+    ft->primary_damage = ft->overlay_damage = -1;
+
+    if (modeset) {
+        if (get_mode_blob())
+            return -1;
+        if (atomic_template_add_connector(t, drm.connector, CONNECTOR_PROP_CRTC_ID,
+                drm.crtc_id) < 0 ||
+            atomic_template_add_crtc(t, drm.crtc, CRTC_PROP_MODE_ID, drm.mode_blob_id) < 0 ||
+            atomic_template_add_crtc(t, drm.crtc, CRTC_PROP_ACTIVE, 1) < 0)
+            return -1;
+    }
+
+    if (primary == PLANE_FLIP &&
+        template_set_plane_properties(t, drm.primary_plane, drm.crtc_id, 0,
+            geo->p_w, geo->p_h, geo->crtc_w, geo->crtc_h, 0, &ft->primary_fb, NULL))
+        return -1;
+
+    /* properties of a plane have to stay together */
+    if (primary == PLANE_FLIP && damage &&
+        drm.primary_plane->prop_ids[PLANE_PROP_FB_DAMAGE_CLIPS])
+        ft->primary_damage = atomic_template_add_plane(t, drm.primary_plane,
+            PLANE_PROP_FB_DAMAGE_CLIPS, 0);
+
+    if (primary == PLANE_OFF &&
+        template_set_plane_properties(t, drm.primary_plane, 0, 0,
+            0, 0, 0, 0, 0, NULL, NULL))
+        return -1;
+
+    if (overlay == PLANE_FLIP &&
+        template_set_plane_properties(t, drm.overlay_plane, drm.crtc_id, 0,
+            geo->o_w, geo->o_h, geo->o_w, geo->o_h, 0, &ft->overlay_fb, &ft->overlay_x))
+        return -1;
+
+    if (overlay == PLANE_FLIP && damage &&
+        drm.overlay_plane->prop_ids[PLANE_PROP_FB_DAMAGE_CLIPS])
+        ft->overlay_damage = atomic_template_add_plane(t, drm.overlay_plane,
+            PLANE_PROP_FB_DAMAGE_CLIPS, 0);
+
+    if (overlay == PLANE_OFF &&
+        template_set_plane_properties(t, drm.overlay_plane, 0, 0,
+            0, 0, 0, 0, 0, NULL, NULL))
+        return -1;
+
+    ft->built = true;
+    return 0;
+}
+
+/* CLOCK_MONOTONIC time of the last flip event */
+static uint64_t last_flip_ns;
+
+static void page_flip_handler(int fd, unsigned int frame,
+    unsigned int sec, unsigned int usec, void *data)
+{
+    int *waiting_for_flip = data;
+    *waiting_for_flip = 0;
+    last_flip_ns = sec * 1000000000ull + usec * 1000ull;
+}
+
+static int wait_for_flip(int *waiting_for_flip)
+{
+    drmEventContext evctx = {
+        .version = DRM_EVENT_CONTEXT_VERSION,
+        .page_flip_handler = page_flip_handler,
+    };
+    fd_set fds;
+    int ret;
+
+    while (*waiting_for_flip) {
+        FD_ZERO(&fds);
+        FD_SET(drm.fd, &fds);
+
+        ret = select(drm.fd + 1, &fds, NULL, NULL, NULL);
+        if (ret < 0) {
+            printf("select err: %s\n", strerror(errno));
+            return ret;
+        }
+        drmHandleEvent(drm.fd, &evctx);
+    }
+    return 0;
+}
+
+#define MAX_PLANES 16
+
+struct layer {
+    struct plane *plane;
+    struct gbm_surface *gbm_surface;
+    EGLSurface egl_surface;
+    struct plane_buffers buffers;
+    struct gbm_bo *bo;          /* last locked, handed to egl->draw() */
+    struct drm_fb *fb;
+    int src_w, src_h;
+    int crtc_w, crtc_h;
+};
+
+static int init_layer(struct layer *layer, struct plane *plane,
+    struct gbm_surface *gbm_surface, EGLSurface egl_surface, struct gbm_bo *bo,
+    int src_w, int src_h, int crtc_w, int crtc_h, uint32_t format)
+{
+    layer->plane = plane;
+    layer->src_w = src_w;
+    layer->src_h = src_h;
+    layer->crtc_w = crtc_w;
+    layer->crtc_h = crtc_h;
+
+    if (!gbm_surface) {
+        gbm_surface = create_gbm_surface(gbm.dev, src_w, src_h, format);
+        if (!gbm_surface) {
+            printf("failed to create gbm surface for plane %u\n", plane->plane->plane_id);
+            return -1;
+        }
+
+        egl_surface = eglCreateWindowSurface(egl->display, egl->config,
+            (EGLNativeWindowType)gbm_surface, NULL);
+        if (egl_surface == EGL_NO_SURFACE) {
+            printf("failed to create egl surface for plane %u\n", plane->plane->plane_id);
+            return -1;
+        }
+
+        eglMakeCurrent(egl->display, egl_surface, egl_surface, egl->context);
+        eglSwapBuffers(egl->display, egl_surface);
+
+        if (!lock_new_surface(drm.fd, &gbm, gbm_surface, &bo, &layer->fb))
+            return -1;
+    }
+
+    layer->gbm_surface = gbm_surface;
+    layer->egl_surface = egl_surface;
+    layer->bo = bo;
+    layer->buffers.surface = gbm_surface;
+    layer->buffers.scanout = bo;
+    return 0;
+}
+
+/*
+ * Drive the primary plane plus every overlay plane the CRTC exposes, each
+ * with its own surface and content. The number of active planes steps
+ * from 1 up to max_planes, duration frames per step.
+ */
+static int run_multi_plane(int max_planes, int duration, uint32_t flags, uint32_t format,
+    struct gbm_bo *bo, struct gbm_bo *bo2,
+    int p_w, int p_h, int o_w, int o_h, int crtc_width, int crtc_height)
+{
+    static struct plane planes[MAX_PLANES];
+    static struct layer layers[MAX_PLANES];
+    struct commit_stats stats[MAX_PLANES];
+    char names[MAX_PLANES][16];
+    double fps[MAX_PLANES];
+    int waiting_for_flip = 0;
+    int count, active, k, ret;
+    uint32_t i = 0;
+
+    if (max_planes <= 0 || max_planes > MAX_PLANES)
+        max_planes = MAX_PLANES;
+
+    count = init_crtc_planes(drm.fd, drm.crtc_id, format, planes, max_planes);
+    if (count <= 0) {
+        printf("no plane usable on crtc %u\n", drm.crtc_id);
+        return -1;
+    }
+    printf("%d planes usable on crtc %u\n", count, drm.crtc_id);
+
+    for (k = 0; k < count; k++) {
+        ret = init_layer(&layers[k], &planes[k],
+            k == 0 ? gbm.surface1 : k == 1 ? gbm.surface2 : NULL,
+            k == 0 ? egl->surface1 : k == 1 ? egl->surface2 : EGL_NO_SURFACE,
+            k == 0 ? bo : k == 1 ? bo2 : NULL,
+            k == 0 ? p_w : o_w, k == 0 ? p_h : o_h,
+            k == 0 ? crtc_width : o_w, k == 0 ? crtc_height : o_h,
+            format);
+        if (ret)
+            return ret;
+        LOG_ARGS("layer %d: plane %u %dx%d\n", k, planes[k].plane->plane_id,
+            layers[k].src_w, layers[k].src_h);
+    }
+
+    for (active = 1; active <= count; active++) {
+        uint64_t step_start = get_time_ns();
+        int frame;
+
+        snprintf(names[active - 1], sizeof(names[0]), "%d plane%s", active, active > 1 ? "s" : "");
+        memset(&stats[active - 1], 0, sizeof(stats[0]));
+        stats[active - 1].name = names[active - 1];
+
+        for (frame = 0; frame < duration; frame++) {
+            enum plane_update updates[MAX_PLANES];
+            struct gbm_bo *next[MAX_PLANES];
+            uint64_t commit_start, commit_ns;
+
+            i++;
+
+            for (k = 0; k < active; k++) {
+                struct layer *layer = &layers[k];
+
+                eglMakeCurrent(egl->display, layer->egl_surface, layer->egl_surface, egl->context);
+                egl->draw(i + k * 30, layer->bo, k == 0);
+                eglSwapBuffers(egl->display, layer->egl_surface);
+
+                if (!lock_new_surface(drm.fd, &gbm, layer->gbm_surface, &next[k], &layer->fb)) {
+                    fprintf(stderr, "fail to lock surface of plane %u\n",
+                        layer->plane->plane->plane_id);
+                    return -1;
+                }
+            }
+
+            if (waiting_for_flip) {
+                ret = wait_for_flip(&waiting_for_flip);
+                if (ret)
+                    return ret;
+                for (k = 0; k < count; k++)
+                    plane_buffers_flip_done(&layers[k].buffers);
+                startup_profile_first_frame();
+            }
+
+            drmModeAtomicReq *req = drmModeAtomicAlloc();
+
+            drm_atomic_mode_set(req, flags);
+
+            for (k = 0; k < count; k++) {
+                struct layer *layer = &layers[k];
+
+                if (k < active) {
+                    int x = k == 0 ? 0 :
+                        (i * 10 + (k - 1) * crtc_width / count) % crtc_width;
+
+                    drm_atomic_set_plane_properties(req, layer->plane, drm.crtc_id,
+                        layer->fb->fb_id, layer->src_w, layer->src_h,
+                        layer->crtc_w, layer->crtc_h, x);
+                    updates[k] = PLANE_FLIP;
+                } else if (flags & DRM_MODE_ATOMIC_ALLOW_MODESET) {
+                    /* planes of later steps start disabled */
+                    drm_atomic_set_plane_properties(req, layer->plane, 0, 0,
+                        0, 0, 0, 0, 0);
+                    updates[k] = PLANE_OFF;
+                } else {
+                    updates[k] = PLANE_KEEP;
+                }
+            }
+
+            commit_start = get_time_ns();
+            ret = drmModeAtomicCommit(drm.fd, req, flags, &waiting_for_flip);
+            commit_ns = get_time_ns() - commit_start;
+            LOG_ARGS("%i: drmModeAtomicCommit(%d %p %x) returns %d(%s)\n", i, drm.fd, req, flags, ret, strerror(-ret));
+
+            drmModeAtomicFree(req);
+
+            if (ret) {
+                for (k = 0; k < count; k++)
+                    updates[k] = PLANE_KEEP;
+            } else {
+                commit_stats_add(&stats[active - 1], commit_ns);
+                flags &= ~DRM_MODE_ATOMIC_ALLOW_MODESET;
+            }
+
+            for (k = 0; k < count; k++) {
+                if (k < active) {
+                    plane_buffers_queue(&layers[k].buffers, next[k], updates[k]);
+                    /* a rejected buffer went back to the surface already */
+                    if (!ret)
+                        layers[k].bo = next[k];
+                } else if (updates[k] == PLANE_OFF) {
+                    plane_buffers_queue(&layers[k].buffers, NULL, PLANE_OFF);
+                }
+            }
+
+            if (ret || !(flags & DRM_MODE_ATOMIC_NONBLOCK)) {
+                /* a blocking commit has already completed when it returns */
+                for (k = 0; k < count; k++)
+                    plane_buffers_flip_done(&layers[k].buffers);
+                if (!ret)
+                    startup_profile_first_frame();
+            } else {
+                waiting_for_flip = 1;
+            }
+        }
+
+        fps[active - 1] = duration * 1e9 / (get_time_ns() - step_start);
+        commit_stats_print(&stats[active - 1]);
+        printf("%s: %.2f fps\n", names[active - 1], fps[active - 1]);
+    }
+
+    printf("\nplanes  commit avg(ms)  commit max(ms)  fps\n");
+    for (k = 0; k < count; k++) {
+        printf("%6d  %14.3f  %14.3f  %5.2f\n", k + 1,
+            stats[k].count ? stats[k].total_ns / 1e6 / stats[k].count : 0.0,
+            stats[k].max_ns / 1e6, fps[k]);
+    }
+
+    return 0;
+}
+
+#define BLEND_MODES 3
+
+static const char * const blend_mode_names[BLEND_MODES] = {
+    "None", "Pre-multiplied", "Coverage"
+};
+
+/* zpos, alpha and pixel blend mode of a layer, as far as its plane has them */
+struct layer_blend {
+    bool has_zpos;              /* mutable, in zpos_min..zpos_max */
+    bool fixed_zpos;            /* immutable, at zpos_min */
+    uint64_t zpos_min, zpos_max;
+    bool has_mode[BLEND_MODES];
+    uint64_t mode_value[BLEND_MODES];
+};
+
+static void get_layer_blend(const struct plane *plane, struct layer_blend *blend)
+{
+    bool immutable = true;
+    uint64_t value;
+    int m;
+
+    memset(blend, 0, sizeof(*blend));
+    if (get_property_range(plane->props, plane->props_info, "zpos",
+            &blend->zpos_min, &blend->zpos_max, &immutable)) {
+        blend->has_zpos = !immutable;
+        if (immutable && get_property_value(plane->props, plane->props_info, "zpos", &value)) {
+            blend->fixed_zpos = true;
+            blend->zpos_min = blend->zpos_max = value;
+        }
+    }
+
+    for (m = 0; m < BLEND_MODES; m++)
+        blend->has_mode[m] = get_property_enum_value(plane->props, plane->props_info,
+            "pixel blend mode", blend_mode_names[m], &blend->mode_value[m]);
+}
+
+/*
+ * Stack semi-transparent overlays over the primary plane and let the
+ * display engine blend them. Every frame changes the order of the
+ * overlays through zpos and their plane alpha, for duration frames per
+ * pixel blend mode. Prints the commit cost and the memory traffic the
+ * GPU would have spent on composing the same stack.
+ */
+static int run_blend(int overlays, int duration, uint32_t flags, uint32_t format,
+    struct gbm_bo *bo, struct gbm_bo *bo2,
+    int p_w, int p_h, int o_w, int o_h, int crtc_width, int crtc_height)
+{
+    static struct plane planes[MAX_PLANES];
+    static struct layer layers[MAX_PLANES];
+    struct layer_blend blend[MAX_PLANES];
+    struct commit_stats stats[BLEND_MODES + 1];
+    uint64_t rejected[BLEND_MODES + 1] = { 0 };
+    double fps[BLEND_MODES + 1];
+    bool run_mode[BLEND_MODES + 1] = { false };
+    uint64_t zpos_base = 0, zpos_limit = UINT64_MAX;
+    bool reorder = true;
+    uint64_t primary_bytes, overlay_bytes, gpu_bytes, display_bytes;
+    int refresh = drm.mode->vrefresh ? drm.mode->vrefresh : 60;
+    int waiting_for_flip = 0;
+    int count, k, m, ret;
+    uint32_t i = 0;
+
+    if (overlays <= 0 || overlays >= MAX_PLANES)
+        overlays = MAX_PLANES - 1;
+
+    count = init_crtc_planes(drm.fd, drm.crtc_id, format, planes, overlays + 1);
+    if (count < 2) {
+        printf("no overlay plane usable on crtc %u\n", drm.crtc_id);
+        return -1;
+    }
+    printf("%d overlays over the primary plane on crtc %u\n", count - 1, drm.crtc_id);
+
+    for (k = 0; k < count; k++) {
+        ret = init_layer(&layers[k], &planes[k],
+            k == 0 ? gbm.surface1 : k == 1 ? gbm.surface2 : NULL,
+            k == 0 ? egl->surface1 : k == 1 ? egl->surface2 : EGL_NO_SURFACE,
+            k == 0 ? bo : k == 1 ? bo2 : NULL,
+            k == 0 ? p_w : o_w, k == 0 ? p_h : o_h,
+            k == 0 ? crtc_width : o_w, k == 0 ? crtc_height : o_h,
+            format);
+        if (ret)
+            return ret;
+
+        /* content stays, only the blending changes from frame to frame */
+        if (k > 1) {
+            eglMakeCurrent(egl->display, layers[k].egl_surface, layers[k].egl_surface, egl->context);
+            egl->draw(k * 30, layers[k].bo, false);
+            eglSwapBuffers(egl->display, layers[k].egl_surface);
+            if (!lock_new_surface(drm.fd, &gbm, layers[k].gbm_surface, &layers[k].bo, &layers[k].fb))
+                return -1;
+        }
+
+        get_layer_blend(&planes[k], &blend[k]);
+        printf("plane %u: zpos %s", planes[k].plane->plane_id,
+            blend[k].has_zpos ? "" : "fixed");
+        if (blend[k].has_zpos)
+            printf("%llu..%llu", (unsigned long long)blend[k].zpos_min,
+                (unsigned long long)blend[k].zpos_max);
+        else if (blend[k].fixed_zpos)
+            printf(" %llu", (unsigned long long)blend[k].zpos_min);
+        printf(", alpha %s, blend modes", planes[k].prop_ids[PLANE_PROP_ALPHA] ? "yes" : "no");
+        for (m = 0; m < BLEND_MODES; m++) {
+            if (blend[k].has_mode[m])
+                printf(" %s", blend_mode_names[m]);
+        }
+        printf("\n");
+
+        if (k > 0) {
+            if (!blend[k].has_zpos)
+                reorder = false;
+            else if (blend[k].zpos_min > zpos_base)
+                zpos_base = blend[k].zpos_min;
+            if (blend[k].has_zpos && blend[k].zpos_max < zpos_limit)
+                zpos_limit = blend[k].zpos_max;
+        }
+    }
+
+    /* overlays share one zpos range above the primary plane, mutable or not */
+    if ((blend[0].has_zpos || blend[0].fixed_zpos) && zpos_base <= blend[0].zpos_min)
+        zpos_base = blend[0].zpos_min + 1;
+    if (reorder && zpos_base + count - 2 > zpos_limit)
+        reorder = false;
+    if (!reorder)
+        printf("zpos not mutable on every overlay, keeping the order fixed\n");
+
+    /* a mode every overlay has, or once with the driver default if none */
+    for (m = 0; m < BLEND_MODES; m++) {
+        run_mode[m] = true;
+        for (k = 1; k < count; k++)
+            run_mode[m] = run_mode[m] && blend[k].has_mode[m];
+    }
+    run_mode[BLEND_MODES] = !run_mode[0] && !run_mode[1] && !run_mode[2];
+
+    for (m = 0; m <= BLEND_MODES; m++) {
+        const char *name = m < BLEND_MODES ? blend_mode_names[m] : "driver default";
+        uint64_t step_start = get_time_ns();
+        int frame;
+
+        if (!run_mode[m])
+            continue;
+
+        memset(&stats[m], 0, sizeof(stats[0]));
+        stats[m].name = name;
+
+        for (frame = 0; frame < duration; frame++) {
+            drmModeAtomicReq *req;
+            uint64_t commit_start, commit_ns;
+            int n = count - 1;
+
+            i++;
+
+            if (waiting_for_flip) {
+                ret = wait_for_flip(&waiting_for_flip);
+                if (ret)
+                    return ret;
+                startup_profile_first_frame();
+            }
+
+            req = drmModeAtomicAlloc();
+            drm_atomic_mode_set(req, flags);
+
+            for (k = 0; k < count; k++) {
+                struct layer *layer = &layers[k];
+                /* overlays overlap by half their width */
+                int x = k == 0 ? 0 : ((k - 1) * o_w / 2) % crtc_width;
+                /* rotate the stack every frame, turn it over every n frames */
+                int slot = (k - 1 + i) % n;
+
+                if ((i / n) % 2)
+                    slot = n - 1 - slot;
+
+                drm_atomic_set_plane_properties(req, layer->plane, drm.crtc_id,
+                    layer->fb->fb_id, layer->src_w, layer->src_h,
+                    layer->crtc_w, layer->crtc_h, x);
+
+                if (k == 0) {
+                    if (blend[0].has_zpos)
+                        add_plane_property(req, layer->plane, PLANE_PROP_ZPOS, blend[0].zpos_min);
+                    continue;
+                }
+
+                if (reorder)
+                    add_plane_property(req, layer->plane, PLANE_PROP_ZPOS, zpos_base + slot);
+                /* 25% to 75% opaque */
+                if (layer->plane->prop_ids[PLANE_PROP_ALPHA])
+                    add_plane_property(req, layer->plane, PLANE_PROP_ALPHA,
+                        0x4000 + (i * 512 + k * 0x3000) % 0x8000);
+                if (m < BLEND_MODES)
+                    add_plane_property(req, layer->plane, PLANE_PROP_PIXEL_BLEND_MODE,
+                        blend[k].mode_value[m]);
+            }
+
+            commit_start = get_time_ns();
+            ret = drmModeAtomicCommit(drm.fd, req, flags, &waiting_for_flip);
+            commit_ns = get_time_ns() - commit_start;
+            LOG_ARGS("%i: drmModeAtomicCommit(%d %p %x) returns %d(%s)\n", i, drm.fd, req, flags, ret, strerror(-ret));
+            drmModeAtomicFree(req);
+
+            if (ret) {
+                rejected[m]++;
+                continue;
+            }
+
+            commit_stats_add(&stats[m], commit_ns);
+            flags &= ~DRM_MODE_ATOMIC_ALLOW_MODESET;
+            if (flags & DRM_MODE_ATOMIC_NONBLOCK)
+                waiting_for_flip = 1;
+            else
+                startup_profile_first_frame();
+        }
+
+        fps[m] = duration * 1e9 / (get_time_ns() - step_start);
+        commit_stats_print(&stats[m]);
+        printf("%s: %.2f fps, %llu commits rejected\n", name, fps[m],
+            (unsigned long long)rejected[m]);
+    }
+
+    printf("\nblend mode      commit avg(ms)  commit max(ms)  rejected  fps\n");
+    for (m = 0; m <= BLEND_MODES; m++) {
+        if (!run_mode[m])
+            continue;
+        printf("%-14s  %14.3f  %14.3f  %8llu  %5.2f\n",
+            m < BLEND_MODES ? blend_mode_names[m] : "driver default",
+            stats[m].count ? stats[m].total_ns / 1e6 / stats[m].count : 0.0,
+            stats[m].max_ns / 1e6, (unsigned long long)rejected[m], fps[m]);
+    }
+
+    /*
+     * Composing on the GPU reads every layer, reads the target again under
+     * each overlay to blend, writes the target and the display then scans
+     * it out. Blending in the display engine only scans out every layer.
+     * 32 bpp formats assumed.
+     */
+    primary_bytes = (uint64_t)p_w * p_h * 4;
+    overlay_bytes = (uint64_t)(count - 1) * o_w * o_h * 4;
+    gpu_bytes = primary_bytes + 2 * overlay_bytes + 2 * primary_bytes;
+    display_bytes = primary_bytes + overlay_bytes;
+
+    printf("\nmemory traffic per frame: GPU composition %.1f MB, display blending %.1f MB, "
+        "saved %.1f MB/frame, %.1f MB/s at %d Hz\n",
+        gpu_bytes / 1e6, display_bytes / 1e6, (gpu_bytes - display_bytes) / 1e6,
+        (gpu_bytes - display_bytes) * refresh / 1e6, refresh);
+
+    return 0;
+}
+
+static void timeline_set_plane(drmModeAtomicReq *req, const struct layer *layer,
+    const struct timeline_state *state)
+{
+    add_plane_property(req, layer->plane, PLANE_PROP_FB_ID, layer->fb->fb_id);
+    add_plane_property(req, layer->plane, PLANE_PROP_CRTC_ID, drm.crtc_id);
+    add_plane_property(req, layer->plane, PLANE_PROP_SRC_X, 0);
+    add_plane_property(req, layer->plane, PLANE_PROP_SRC_Y, 0);
+    add_plane_property(req, layer->plane, PLANE_PROP_SRC_W, layer->src_w << 16);
+    add_plane_property(req, layer->plane, PLANE_PROP_SRC_H, layer->src_h << 16);
+    /* signed, slides start and end off screen */
+    add_plane_property(req, layer->plane, PLANE_PROP_CRTC_X, (uint64_t)(int64_t)state->x);
+    add_plane_property(req, layer->plane, PLANE_PROP_CRTC_Y, (uint64_t)(int64_t)state->y);
+    add_plane_property(req, layer->plane, PLANE_PROP_CRTC_W, state->w);
+    add_plane_property(req, layer->plane, PLANE_PROP_CRTC_H, state->h);
+}
+
+/*
+ * Play a scenario file: each layer of the timeline gets a plane of the
+ * CRTC, and every frame takes its position, size, visibility and content
+ * from the timeline at the time the frame is expected on screen, the last
+ * flip plus one refresh period. A frame that flips later than that is
+ * counted as late.
+ */
+static int run_timeline(const char *path, uint32_t format)
+{
+    static struct plane planes[MAX_PLANES];
+    static struct layer layers[TIMELINE_MAX_LAYERS];
+    static struct timeline timeline;
+    bool visible[TIMELINE_MAX_LAYERS] = { false };
+    struct commit_stats stats = { .name = "timeline" };
+    uint32_t flags = DRM_MODE_ATOMIC_ALLOW_MODESET | DRM_MODE_ATOMIC_NONBLOCK |
+        DRM_MODE_PAGE_FLIP_EVENT;
+    uint64_t period_ns, start_ns = 0, present_ns = 0, late_ns, late_max_ns = 0;
+    uint64_t frames = 0, late = 0, loops = 0, rejected = 0;
+    int waiting_for_flip = 0, failures = 0;
+    int count, k, ret;
+
+    if (timeline_load(&timeline, path))
+        return -1;
+
+    count = init_crtc_planes(drm.fd, drm.crtc_id, format, planes, timeline.count_layers);
+    if (count < timeline.count_layers) {
+        printf("timeline needs %d planes, crtc %u has %d\n",
+            timeline.count_layers, drm.crtc_id, count);
+        return -1;
+    }
+
+    for (k = 0; k < count; k++) {
+        ret = init_layer(&layers[k], &planes[k], NULL, EGL_NO_SURFACE, NULL,
+            timeline.layers[k].src_w, timeline.layers[k].src_h,
+            timeline.layers[k].src_w, timeline.layers[k].src_h, format);
+        if (ret)
+            return ret;
+    }
+
+    /* clock is in kHz */
+    period_ns = (uint64_t)drm.mode->htotal * drm.mode->vtotal * 1000000 / drm.mode->clock;
+
+    while (true) {
+        enum plane_update updates[TIMELINE_MAX_LAYERS];
+        struct gbm_bo *next[TIMELINE_MAX_LAYERS];
+        struct timeline_state state;
+        uint64_t commit_start, commit_ns, t_ns;
+        drmModeAtomicReq *req;
+
+        if (waiting_for_flip) {
+            ret = wait_for_flip(&waiting_for_flip);
+            if (ret)
+                return ret;
+            for (k = 0; k < count; k++)
+                plane_buffers_flip_done(&layers[k].buffers);
+            startup_profile_first_frame();
+
+            if (last_flip_ns > present_ns + period_ns / 2) {
+                late++;
+                late_ns = last_flip_ns - present_ns;
+                if (late_ns > late_max_ns)
+                    late_max_ns = late_ns;
+            }
+        }
+
+        /*
+         * The first frame is the one the timeline starts at. After a rejected
+         * commit time goes on from now, so the same state is not retried.
+         */
+        present_ns = last_flip_ns && start_ns && !failures ?
+            last_flip_ns + period_ns : get_time_ns();
+        if (!start_ns)
+            start_ns = present_ns;
+        t_ns = present_ns - start_ns;
+
+        if (timeline_done(&timeline, t_ns))
+            break;
+        if (timeline.loop_ns && t_ns / timeline.loop_ns > loops) {
+            loops = t_ns / timeline.loop_ns;
+            commit_stats_print(&stats);
+            printf("timeline loop %llu: %llu frames, %llu late, %llu rejected, late max %.3f ms\n",
+                (unsigned long long)loops, (unsigned long long)frames,
+                (unsigned long long)late, (unsigned long long)rejected, late_max_ns / 1e6);
+        }
+
+        req = drmModeAtomicAlloc();
+        drm_atomic_mode_set(req, flags);
+
+        for (k = 0; k < count; k++) {
+            struct layer *layer = &layers[k];
+
+            timeline_eval(&timeline, k, t_ns, &state);
+
+            if (state.visible) {
+                eglMakeCurrent(egl->display, layer->egl_surface, layer->egl_surface, egl->context);
+                egl->draw(state.content, layer->bo, k == 0);
+                eglSwapBuffers(egl->display, layer->egl_surface);
+
+                if (!lock_new_surface(drm.fd, &gbm, layer->gbm_surface, &next[k], &layer->fb)) {
+                    fprintf(stderr, "fail to lock surface of plane %u\n",
+                        layer->plane->plane->plane_id);
+                    drmModeAtomicFree(req);
+                    return -1;
+                }
+                timeline_set_plane(req, layer, &state);
+                updates[k] = PLANE_FLIP;
+            } else if (visible[k] || (flags & DRM_MODE_ATOMIC_ALLOW_MODESET)) {
+                drm_atomic_set_plane_properties(req, layer->plane, 0, 0,
+                    0, 0, 0, 0, 0);
+                updates[k] = PLANE_OFF;
+            } else {
+                updates[k] = PLANE_KEEP;
+            }
+        }
+
+        commit_start = get_time_ns();
+        ret = drmModeAtomicCommit(drm.fd, req, flags, &waiting_for_flip);
+        commit_ns = get_time_ns() - commit_start;
+        LOG_ARGS("%.3f s: drmModeAtomicCommit(%d %p %x) returns %d(%s)\n", t_ns / 1e9,
+            drm.fd, req, flags, ret, strerror(-ret));
+        drmModeAtomicFree(req);
+
+        for (k = 0; k < count; k++) {
+            if (ret && updates[k] == PLANE_FLIP)
+                release_gbm_bo(&gbm, layers[k].gbm_surface, next[k]);
+            else if (updates[k] == PLANE_FLIP)
+                plane_buffers_queue(&layers[k].buffers, next[k], PLANE_FLIP);
+            else if (!ret && updates[k] == PLANE_OFF)
+                plane_buffers_queue(&layers[k].buffers, NULL, PLANE_OFF);
+
+            if (!ret && updates[k] != PLANE_KEEP) {
+                visible[k] = updates[k] == PLANE_FLIP;
+                if (visible[k])
+                    layers[k].bo = next[k];
+            }
+        }
+
+        if (ret) {
+            fprintf(stderr, "timeline commit failed at %.3f s: %s\n", t_ns / 1e9, strerror(-ret));
+            rejected++;
+            if (++failures == max_commit_failures) {
+                printf("timeline: %d commits in a row rejected, giving up\n", failures);
+                break;
+            }
+            continue;
+        }
+
+        failures = 0;
+        frames++;
+        waiting_for_flip = 1;
+        if (flags & DRM_MODE_ATOMIC_ALLOW_MODESET)
+            flags &= ~DRM_MODE_ATOMIC_ALLOW_MODESET;
+        else
+            commit_stats_add(&stats, commit_ns);
+    }
+
+    if (waiting_for_flip)
+        wait_for_flip(&waiting_for_flip);
+
+    commit_stats_print(&stats);
+    printf("timeline done: %llu frames, %llu late, %llu rejected, late max %.3f ms\n",
+        (unsigned long long)frames, (unsigned long long)late, (unsigned long long)rejected,
+        late_max_ns / 1e6);
+    return failures ? -1 : 0;
+}
+
+static struct drm_fb *create_fb(int w, int h, uint32_t format)
+{
+    struct gbm_bo *bo = gbm_bo_create(gbm.dev, w, h, format,
+        GBM_BO_USE_SCANOUT | GBM_BO_USE_RENDERING);
+
+    if (!bo) {
+        printf("failed to create %dx%d bo: %s\n", w, h, strerror(errno));
+        return NULL;
+    }
+
+    return drm_fb_get_from_bo(drm.fd, bo);
+}
+
+/*
+ * Find the assignment of the -L layers to the planes of the CRTC that
+ * leaves the fewest layers to the GPU, once per search strategy.
+ */
+static int run_plane_solver(struct solver_layer *layers, int layer_count, uint32_t format)
+{
+    static struct plane planes[MAX_SOLVER_PLANES];
+    struct plane_solver solver = {
+        .fd = drm.fd,
+        .crtc_id = drm.crtc_id,
+        .planes = planes,
+        .base_flags = DRM_MODE_ATOMIC_ALLOW_MODESET,
+        .target_format = format,
+        .target_w = drm.mode->hdisplay,
+        .target_h = drm.mode->vdisplay,
+    };
+    struct solver_result result;
+    struct drm_fb *fb;
+    int k, ret;
+
+    /* any format, the solver checks each layer's format per plane */
+    solver.plane_count = init_crtc_planes(drm.fd, drm.crtc_id, 0, planes, MAX_SOLVER_PLANES);
+    if (solver.plane_count <= 0) {
+        printf("no plane usable on crtc %u\n", drm.crtc_id);
+        return -1;
+    }
+
+    for (k = 0; k < layer_count; k++) {
+        fb = create_fb(layers[k].w, layers[k].h, layers[k].format);
+        if (!fb)
+            return -1;
+        layers[k].fb_id = fb->fb_id;
+    }
+
+    fb = create_fb(solver.target_w, solver.target_h, solver.target_format);
+    if (!fb)
+        return -1;
+    solver.target_fb_id = fb->fb_id;
+
+    solver.base_req = drmModeAtomicAlloc();
+    if (drm_atomic_mode_set(solver.base_req, solver.base_flags))
+        return -1;
+
+    printf("%d layers, %d planes on crtc %u\n", layer_count, solver.plane_count, drm.crtc_id);
+
+    ret = solve_plane_assignment(&solver, layers, layer_count, SOLVER_EXHAUSTIVE, &result);
+    print_solver_result(&solver, "exhaustive", layer_count, &result);
+
+    ret |= solve_plane_assignment(&solver, layers, layer_count, SOLVER_INCREMENTAL, &result);
+    print_solver_result(&solver, "incremental", layer_count, &result);
+
+    drmModeAtomicFree(solver.base_req);
+    return ret;
+}
+
+/* take the pipe down while its connector is gone */
+static int disable_output(void)
+{
+    drmModeAtomicReq *req = drmModeAtomicAlloc();
+    int ret;
+
+    add_connector_property(req, drm.connector, CONNECTOR_PROP_CRTC_ID, 0);
+    add_crtc_property(req, drm.crtc, CRTC_PROP_MODE_ID, 0);
+    add_crtc_property(req, drm.crtc, CRTC_PROP_ACTIVE, 0);
+    drm_atomic_set_plane_properties(req, drm.primary_plane, 0, 0, 0, 0, 0, 0, 0);
+    drm_atomic_set_plane_properties(req, drm.overlay_plane, 0, 0, 0, 0, 0, 0, 0);
+
+    ret = drmModeAtomicCommit(drm.fd, req, DRM_MODE_ATOMIC_ALLOW_MODESET, NULL);
+    drmModeAtomicFree(req);
+    if (ret)
+        printf("failed to disable crtc %u: %s\n", drm.crtc_id, strerror(errno));
 
-    return 0;
+    return ret;
 }
 
-static int init_drm_atomic(char *device_path, char *mode_str)
+/*
+ * On a hotplug event, wait until a connector the CRTC can drive is
+ * connected. Returns 1 if the mode has to be set again, 0 if nothing
+ * changed. *disabled is set if the planes were turned off meanwhile.
+ * The caller resizes what depends on the size of the mode.
+ */
+static int handle_hotplug(struct hotplug *hp, char *mode_str,
+    drmModeConnector **owner, bool *disabled)
 {
-    int ret = init_drm(&drm, device_path, mode_str);
-    if (ret)
-        return ret;
+    uint32_t connector_id = drm.connector_id;
+    drmModeModeInfo mode = *drm.mode;
+    int ret;
 
-    ret = drmSetClientCap(drm.fd, DRM_CLIENT_CAP_ATOMIC, 1);
-    if (ret) {
-        printf("no atomic modesetting support: %s\n", strerror(errno));
+    *disabled = false;
+    while ((ret = reprobe_drm(&drm, mode_str, owner)) == 0) {
+        if (!*disabled) {
+            printf("connector %u disconnected, waiting for a connector\n", connector_id);
+            if (disable_output())
+                return -1;
+            *disabled = true;
+        }
+        while (!hotplug_poll(hp, -1))
+            ;
+    }
+    if (ret < 0)
         return ret;
+
+    if (!*disabled && connector_id == drm.connector_id &&
+        memcmp(&mode, drm.mode, sizeof(mode)) == 0)
+        return 0;
+
+    if (connector_id != drm.connector_id) {
+        /* the old connector still holds the CRTC */
+        if (!*disabled && disable_output())
+            return -1;
+        *disabled = true;
+
+        free_atomic_connector(drm.connector);
+        if (init_atomic_connector(drm.fd, drm.connector_id, drm.connector))
+            return -1;
     }
 
-    drm.crtc = calloc(1, sizeof(*drm.crtc));
-    drm.connector = calloc(1, sizeof(*drm.connector));
+    if (drm.mode_blob_id) {
+        drmModeDestroyPropertyBlob(drm.fd, drm.mode_blob_id);
+        drm.mode_blob_id = 0;
+    }
 
-#define get_resource(type, Type, id) do {               \
-        drm.type->type = drmModeGet##Type(drm.fd, id);  \
-        if (!drm.type->type) {                          \
-            printf("could not get %s %i: %s\n",         \
-                #type, id, strerror(errno));            \
-            return -1;                                  \
-        }                                               \
-    } while (0)
-
-    get_resource(connector, Connector, drm.connector_id);
-    get_resource(crtc, Crtc, drm.crtc_id);
-
-#define get_properties(type, TYPE, id) do {                         \
-        uint32_t i;                                                 \
-        drm.type->props = drmModeObjectGetProperties(drm.fd,        \
-            id, DRM_MODE_OBJECT_##TYPE);                            \
-        if (!drm.type->props) {                                     \
-            printf("could not get %s %u properties: %s\n",          \
-                #type, id, strerror(errno));                        \
-            return -1;                                              \
-        }                                                           \
-        drm.type->props_info = calloc(drm.type->props->count_props, \
-            sizeof(*drm.type->props_info));                         \
-        for (i = 0; i < drm.type->props->count_props; i++) {        \
-            drm.type->props_info[i] = drmModeGetProperty(drm.fd,    \
-                drm.type->props->props[i]);                         \
-        }                                                           \
-    } while (0)
+    printf("connector %u connected, mode %dx%d@%d\n", drm.connector_id,
+        drm.mode->hdisplay, drm.mode->vdisplay, drm.mode->vrefresh);
+    return 1;
+}
 
-    /*
-     * get_properties(plane, PLANE, plane_id);
-     */
-    get_properties(crtc, CRTC, drm.crtc_id);
-    get_properties(connector, CONNECTOR, drm.connector_id);
+static void report_reconnect(struct commit_stats *stats, uint64_t *reconnect_start)
+{
+    uint64_t ns = get_time_ns() - *reconnect_start;
 
-    return 0;
+    commit_stats_add(stats, ns);
+    printf("reconnect to first frame: %.3f ms (count %llu avg %.3f ms max %.3f ms)\n",
+        ns / 1e6, (unsigned long long)stats->count,
+        stats->total_ns / 1e6 / stats->count, stats->max_ns / 1e6);
+    *reconnect_start = 0;
 }
 
-static void print_usage(const char *progname)
+/* size scaled by to / from, kept even and at least 2 for the buffers */
+static int scale_size(int size, int to, int from)
 {
-    printf("Usage:\n");
-    printf("    %s -p <plane_id>@<width>x<height> -o <plane_id>@<width>x<height> -v -d <duration> -D <device_path> -m <mode_str>\n", progname);
-    printf("\n");
-    printf("    -p primary plane info (default: %s)\n", default_primary_info);
-    printf("    -o overlay plane info (default: %s)\n", default_overlay_info);
-    printf("    -c CRTC resolution to be used drmModeSetPlane for primary plane (default: %dx%d)\n",
-        default_crtc_width, default_crtc_height);
-    printf("    -v verbose\n");
-    printf("    -d duration (default: %d)\n", default_duration);
-    printf("    -D drm device path (default: /dev/dri/card0)\n");
-    printf("    -m mode preferred (default: NULL, mode with highest resolution)\n");
-    printf("    -f FOURCC format (default: AR24)\n");
-    printf("    -l resource location (default: /usr/share/drmplanes)\n");
-    printf("    -t render type, one of:\n");
-    printf("       smooth    -  smooth shaded cube (default)\n");
-    printf("       png       -  PNG still image\n");
-    printf("    -h help\n");
-    printf("\n");
-    printf("Example:\n");
-    printf("    %s -p 31@1920x1080 -o 38@512x2160 -v -d 100 -m 1920x1080 -f AR24 -c 3840x2160\n", progname);
+    size = (int)((int64_t)size * to / from) & ~1;
+    return size < 2 ? 2 : size;
 }
 
-static int add_connector_property(drmModeAtomicReq *req, uint32_t obj_id,
-                    const char *name, uint64_t value)
+/*
+ * The mode changed size: new GBM and EGL surfaces for the planes, with a
+ * cleared buffer locked on each. Every buffer of the old surfaces has to be
+ * released before.
+ */
+static int resize_surfaces(int p_w, int p_h, int o_w, int o_h, uint32_t format,
+    struct gbm_bo **bo, struct drm_fb **fb, struct gbm_bo **bo2, struct drm_fb **fb2)
 {
-    struct connector *obj = drm.connector;
-    unsigned int i;
-    int prop_id = 0;
+    /* only the surfaces of the renderer change */
+    struct egl *gl = (struct egl *)egl;
 
-    for (i = 0 ; i < obj->props->count_props ; i++) {
-        if (strcmp(obj->props_info[i]->name, name) == 0) {
-            prop_id = obj->props_info[i]->prop_id;
-            break;
-        }
+    eglMakeCurrent(gl->display, EGL_NO_SURFACE, EGL_NO_SURFACE, gl->context);
+    eglDestroySurface(gl->display, gl->surface1);
+    eglDestroySurface(gl->display, gl->surface2);
+    gbm_surface_destroy(gbm.surface1);
+    gbm_surface_destroy(gbm.surface2);
+
+    if (init_gbm(&gbm, drm.fd, p_w, p_h, o_w, o_h, format))
+        return -1;
+
+    gl->surface1 = eglCreateWindowSurface(gl->display, gl->config,
+        (EGLNativeWindowType)gbm.surface1, NULL);
+    gl->surface2 = eglCreateWindowSurface(gl->display, gl->config,
+        (EGLNativeWindowType)gbm.surface2, NULL);
+    if (gl->surface1 == EGL_NO_SURFACE || gl->surface2 == EGL_NO_SURFACE) {
+        printf("failed to create egl surfaces\n");
+        return -1;
     }
 
-    if (prop_id < 0) {
-        printf("no connector property: %s\n", name);
-        return -EINVAL;
+    /* egl->draw() takes the size from the buffer it is given */
+    eglMakeCurrent(gl->display, gl->surface1, gl->surface1, gl->context);
+    glClear(GL_COLOR_BUFFER_BIT);
+    eglSwapBuffers(gl->display, gl->surface1);
+    eglMakeCurrent(gl->display, gl->surface2, gl->surface2, gl->context);
+    glClear(GL_COLOR_BUFFER_BIT);
+    eglSwapBuffers(gl->display, gl->surface2);
+
+    if (!lock_new_surface(drm.fd, &gbm, gbm.surface1, bo, fb) ||
+            !lock_new_surface(drm.fd, &gbm, gbm.surface2, bo2, fb2)) {
+        printf("failed to lock the resized surfaces\n");
+        return -1;
     }
 
-    return drmModeAtomicAddProperty(req, obj_id, prop_id, value);
+    return 0;
 }
 
-static int add_crtc_property(drmModeAtomicReq *req, uint32_t obj_id,
-                const char *name, uint64_t value)
+#define MAX_OUTPUTS 8
+
+struct output {
+    struct drm drm;
+    struct crtc crtc;
+    struct connector connector;
+    struct plane plane;
+    struct gbm gbm;
+    struct egl egl;
+    struct gbm_bo *scanout;
+    struct drm_fb *fb;
+    char name[48];
+    int index;
+    pthread_t thread;
+};
+
+static const struct glcolor *output_colors[] = { &red, &blue };
+
+static void draw_output(const struct output *output, uint32_t i)
 {
-    struct crtc *obj = drm.crtc;
-    unsigned int i;
-    int prop_id = -1;
+    int width = output->drm.mode->hdisplay;
+    int height = output->drm.mode->vdisplay;
+    const struct glcolor *color = output_colors[output->index % 2];
+    int w = width / 8;
+
+    glClearColor(black.r, black.g, black.b, black.a);
+    glClear(GL_COLOR_BUFFER_BIT);
+
+    glEnable(GL_SCISSOR_TEST);
+    glScissor((i * 10) % (width - w + 1), 0, w, height);
+    glClearColor(color->r, color->g, color->b, color->a);
+    glClear(GL_COLOR_BUFFER_BIT);
+    glDisable(GL_SCISSOR_TEST);
+}
 
-    for (i = 0 ; i < obj->props->count_props ; i++) {
-        if (strcmp(obj->props_info[i]->name, name) == 0) {
-            prop_id = obj->props_info[i]->prop_id;
-            break;
+static void output_set_plane(drmModeAtomicReq *req, const struct output *output, uint32_t fb_id)
+{
+    drm_atomic_set_plane_properties(req, &output->plane, output->drm.crtc_id, fb_id,
+        output->drm.mode->hdisplay, output->drm.mode->vdisplay,
+        output->drm.mode->hdisplay, output->drm.mode->vdisplay, 0);
+}
+
+static int init_output(struct output *output, struct plane *planes, uint32_t *used_planes,
+    int *used_count, uint32_t format)
+{
+    struct drm *out = &output->drm;
+    int count, k, u;
+
+    out->crtc = &output->crtc;
+    out->connector = &output->connector;
+    out->primary_plane = &output->plane;
+
+    if (init_atomic_connector(out->fd, out->connector_id, out->connector) ||
+        init_atomic_crtc(out->fd, out->crtc_id, out->crtc))
+        return -1;
+
+    if (drmModeCreatePropertyBlob(out->fd, out->mode, sizeof(*out->mode),
+            &out->mode_blob_id)) {
+        printf("failed to create mode blob: %s\n", strerror(errno));
+        return -1;
+    }
+
+    /* primary first, a plane another output already uses is skipped */
+    count = init_crtc_planes(out->fd, out->crtc_id, format, planes, MAX_PLANES);
+    for (k = 0; k < count; k++) {
+        for (u = 0; u < *used_count; u++) {
+            if (used_planes[u] == planes[k].plane->plane_id)
+                break;
         }
+        if (u == *used_count && !output->plane.plane) {
+            output->plane = planes[k];
+            used_planes[(*used_count)++] = planes[k].plane->plane_id;
+        } else {
+            free_atomic_plane(&planes[k]);
+        }
+    }
+    if (!output->plane.plane) {
+        printf("no plane left for crtc %u\n", out->crtc_id);
+        return -1;
     }
 
-    if (prop_id < 0) {
-        printf("no crtc property: %s\n", name);
-        return -EINVAL;
+    output->gbm.dev = gbm_create_device(out->fd);
+    output->gbm.surface1 = create_gbm_surface(output->gbm.dev,
+        out->mode->hdisplay, out->mode->vdisplay, format);
+    if (!output->gbm.surface1) {
+        printf("failed to create gbm surface for %s\n", output->name);
+        return -1;
     }
 
-    return drmModeAtomicAddProperty(req, obj_id, prop_id, value);
+    if (init_egl(&output->egl, &output->gbm, format))
+        return -1;
+
+    if (!lock_new_surface(out->fd, &output->gbm, output->gbm.surface1,
+            &output->scanout, &output->fb))
+        return -1;
+
+    /* the render thread makes the context current on its own */
+    eglMakeCurrent(output->egl.display, EGL_NO_SURFACE, EGL_NO_SURFACE, EGL_NO_CONTEXT);
+
+    printf("%s: %dx%d plane %u\n", output->name, out->mode->hdisplay, out->mode->vdisplay,
+        output->plane.plane->plane_id);
+    return 0;
 }
 
-static int add_plane_property(drmModeAtomicReq *req, uint32_t obj_id,
-    const char *name, uint64_t value)
+/*
+ * One render/commit loop per output. Commits are blocking, each on its own
+ * CRTC, so the outputs only wait for their own vblank.
+ */
+static void *run_output(void *data)
 {
-    struct plane *obj = drm.primary_plane;
-    unsigned int i;
-    int prop_id = -1;
+    struct output *output = data;
+    struct drm *out = &output->drm;
+    struct commit_stats flip_stats = { .name = output->name };
+    struct gbm_bo *next;
+    uint64_t commit_start, commit_ns, interval_start;
+    uint32_t i = 0;
+    int ret, failures = 0;
+
+    eglMakeCurrent(output->egl.display, output->egl.surface1, output->egl.surface1,
+        output->egl.context);
 
-    for (i = 0 ; i < obj->props->count_props ; i++) {
-        if (strcmp(obj->props_info[i]->name, name) == 0) {
-            prop_id = obj->props_info[i]->prop_id;
+    interval_start = get_time_ns();
+    while (true) {
+        i++;
+
+        draw_output(output, i);
+        eglSwapBuffers(output->egl.display, output->egl.surface1);
+
+        if (!lock_new_surface(out->fd, &output->gbm, output->gbm.surface1, &next, &output->fb)) {
+            fprintf(stderr, "%s: fail to lock surface\n", output->name);
             break;
         }
-    }
 
-    if (prop_id < 0) {
-        printf("no plane property: %s\n", name);
-        return -EINVAL;
-    }
+        drmModeAtomicReq *req = drmModeAtomicAlloc();
+        output_set_plane(req, output, output->fb->fb_id);
 
-    return drmModeAtomicAddProperty(req, obj_id, prop_id, value);
-}
+        commit_start = get_time_ns();
+        ret = drmModeAtomicCommit(out->fd, req, 0, NULL);
+        commit_ns = get_time_ns() - commit_start;
+        drmModeAtomicFree(req);
+        LOG_ARGS("%s %u: drmModeAtomicCommit returns %d(%s)\n", output->name, i, ret, strerror(-ret));
 
-static void drm_atomic_set_plane_properties(drmModeAtomicReq *req, uint32_t plane_id,
-    uint32_t crtc_id, uint32_t fb_id,
-    uint32_t src_width, uint32_t src_height,
-    uint32_t crtc_width, uint32_t crtc_height,
-    uint32_t crtc_x)
-{
-    add_plane_property(req, plane_id, "FB_ID", fb_id);
-    add_plane_property(req, plane_id, "CRTC_ID", crtc_id);
-    add_plane_property(req, plane_id, "SRC_X", 0);
-    add_plane_property(req, plane_id, "SRC_Y", 0);
-    add_plane_property(req, plane_id, "SRC_W", src_width << 16);
-    add_plane_property(req, plane_id, "SRC_H", src_height << 16);
-    add_plane_property(req, plane_id, "CRTC_X", crtc_x);
-    add_plane_property(req, plane_id, "CRTC_Y", 0);
-    add_plane_property(req, plane_id, "CRTC_W", crtc_width);
-    add_plane_property(req, plane_id, "CRTC_H", crtc_height);
+        if (ret) {
+            release_gbm_bo(&output->gbm, output->gbm.surface1, next);
+            if (++failures == max_commit_failures) {
+                fprintf(stderr, "%s: %d commits in a row rejected, stopping\n",
+                    output->name, failures);
+                break;
+            }
+            continue;
+        }
+        failures = 0;
+
+        release_gbm_bo(&output->gbm, output->gbm.surface1, output->scanout);
+        output->scanout = next;
+
+        commit_stats_add(&flip_stats, commit_ns);
+        if (flip_stats.count % COMMIT_STATS_INTERVAL == 0) {
+            uint64_t now = get_time_ns();
+
+            commit_stats_print(&flip_stats);
+            printf("%s: %.2f fps\n", output->name,
+                COMMIT_STATS_INTERVAL * 1e9 / (now - interval_start));
+            interval_start = now;
+        }
+    }
+
+    return NULL;
 }
 
-static int drm_atomic_mode_set(drmModeAtomicReq *req, uint32_t flags)
+/*
+ * Drive every connected connector with a CRTC and a plane of its own,
+ * one render/commit thread per output, with separate frame statistics.
+ */
+static int run_multi_output(char *device_path, char *mode_str, uint32_t format)
 {
-    if (flags & DRM_MODE_ATOMIC_ALLOW_MODESET) {
-        uint32_t blob_id;
+    static struct output outputs[MAX_OUTPUTS];
+    static struct plane planes[MAX_PLANES];
+    struct drm drms[MAX_OUTPUTS];
+    uint32_t used_planes[MAX_OUTPUTS];
+    int used_count = 0;
+    drmModeAtomicReq *req;
+    int count, k, ret;
+
+    count = init_drm_outputs(drms, MAX_OUTPUTS, device_path, mode_str);
+    if (count <= 0)
+        return -1;
 
-        if (add_connector_property(req, drm.connector_id, "CRTC_ID",
-                        drm.crtc_id) < 0)
-                return -1;
+    ret = drmSetClientCap(drms[0].fd, DRM_CLIENT_CAP_ATOMIC, 1);
+    if (ret) {
+        printf("no atomic modesetting support: %s\n", strerror(errno));
+        return ret;
+    }
 
-        if (drmModeCreatePropertyBlob(drm.fd, drm.mode, sizeof(*drm.mode),
-                          &blob_id) != 0)
+    for (k = 0; k < count; k++) {
+        outputs[k].drm = drms[k];
+        outputs[k].index = k;
+        snprintf(outputs[k].name, sizeof(outputs[k].name), "output %d (connector %u crtc %u)",
+            k, drms[k].connector_id, drms[k].crtc_id);
+        if (init_output(&outputs[k], planes, used_planes, &used_count, format))
             return -1;
+    }
 
-        if (add_crtc_property(req, drm.crtc_id, "MODE_ID", blob_id) < 0)
-            return -1;
+    /* one modeset lights up every output at once */
+    req = drmModeAtomicAlloc();
+    for (k = 0; k < count; k++) {
+        struct drm *out = &outputs[k].drm;
+
+        add_connector_property(req, out->connector, CONNECTOR_PROP_CRTC_ID, out->crtc_id);
+        add_crtc_property(req, out->crtc, CRTC_PROP_MODE_ID, out->mode_blob_id);
+        add_crtc_property(req, out->crtc, CRTC_PROP_ACTIVE, 1);
+        output_set_plane(req, &outputs[k], outputs[k].fb->fb_id);
+    }
+    ret = drmModeAtomicCommit(drms[0].fd, req, DRM_MODE_ATOMIC_ALLOW_MODESET, NULL);
+    drmModeAtomicFree(req);
+    if (ret) {
+        printf("failed to set mode on %d outputs: %s\n", count, strerror(errno));
+        return ret;
+    }
+    startup_profile_first_frame();
 
-        if (add_crtc_property(req, drm.crtc_id, "ACTIVE", 1) < 0)
+    for (k = 0; k < count; k++) {
+        ret = pthread_create(&outputs[k].thread, NULL, run_output, &outputs[k]);
+        if (ret) {
+            printf("failed to start thread for %s: %s\n", outputs[k].name, strerror(ret));
             return -1;
+        }
     }
+
+    for (k = 0; k < count; k++)
+        pthread_join(outputs[k].thread, NULL);
+
     return 0;
 }
 
-int main(int argc, char *argv[])
+static int run(int argc, char *argv[])
 {
     struct gbm_bo *bo = NULL, *bo_next = NULL;
     struct drm_fb *fb = NULL;
@@ -320,8 +1851,27 @@ int main(int argc, char *argv[])
     uint32_t format = GBM_FORMAT_ARGB8888;
     char *location = default_location;
     enum type type = SMOOTH;
-
-    while ((opt = getopt(argc, argv, "hvad:p:o:D:m:f:l:c:t:")) != -1) {
+    int bench_iterations = 0;
+    bool nonblock = false;
+    int max_planes = -1;
+    char *layer_specs[MAX_SOLVER_LAYERS];
+    int layer_count = 0;
+    struct damage_pattern damage_pattern;
+    bool damage_mode = false;
+    bool damage_clips = true;
+    bool multi_output = false;
+    bool hotplug_mode = false;
+    char *profile_path = NULL;
+    int modifier_index = -1;
+    int blend_overlays = -1;
+    char *timeline_path = NULL;
+    bool use_dumb = false;
+    static struct dumb_plane dumb_primary, dumb_overlay;
+    uint64_t draw_start, draw_ns = 0;
+    int wb_interval = 0;
+    static struct writeback wb;
+
+    while ((opt = getopt(argc, argv, "hvanOHUd:p:o:D:m:f:l:c:t:b:B:N:L:r:RK:P:M:T:W:")) != -1) {
         switch (opt) {
             case 'h':
                 print_usage(argv[0]);
@@ -338,6 +1888,44 @@ int main(int argc, char *argv[])
             case 'd':
                 duration = strtoul(optarg, NULL, 10);
                 break;
+            case 'b':
+                bench_iterations = strtoul(optarg, NULL, 10);
+                break;
+            case 'n':
+                nonblock = true;
+                break;
+            case 'N':
+                max_planes = strtoul(optarg, NULL, 10);
+                break;
+            case 'B':
+                blend_overlays = strtoul(optarg, NULL, 10);
+                break;
+            case 'T':
+                timeline_path = optarg;
+                break;
+            case 'L':
+                if (layer_count == MAX_SOLVER_LAYERS) {
+                    printf("too many layers, at most %d\n", MAX_SOLVER_LAYERS);
+                    return -1;
+                }
+                layer_specs[layer_count++] = optarg;
+                break;
+            case 'r':
+                if (!parse_damage_pattern(optarg, &damage_pattern)) {
+                    printf("invalid damage pattern: %s\n", optarg);
+                    return -1;
+                }
+                damage_mode = true;
+                break;
+            case 'R':
+                damage_clips = false;
+                break;
+            case 'O':
+                multi_output = true;
+                break;
+            case 'H':
+                hotplug_mode = true;
+                break;
             case 'v':
                 verbose = true;
                 break;
@@ -377,6 +1965,21 @@ int main(int argc, char *argv[])
                 }
                 break;
             }
+            case 'K':
+                kms_cache_path = optarg;
+                break;
+            case 'P':
+                profile_path = optarg;
+                break;
+            case 'M':
+                modifier_index = strtoul(optarg, NULL, 10);
+                break;
+            case 'U':
+                use_dumb = true;
+                break;
+            case 'W':
+                wb_interval = strtoul(optarg, NULL, 10);
+                break;
             case '?':
                 if (optopt == 'p' || optopt == 'o')
                     fprintf(stderr, "Option -%c requires an argument.\n", optopt);
@@ -392,6 +1995,21 @@ int main(int argc, char *argv[])
         }
     }
 
+    if (use_dumb && (multi_output || max_planes >= 0 || blend_overlays >= 0 ||
+            timeline_path || layer_count || damage_mode)) {
+        printf("-U runs the default test and -b only\n");
+        return -1;
+    }
+
+    if (wb_interval > 0 && (multi_output || max_planes >= 0 || blend_overlays >= 0 ||
+            timeline_path || layer_count || bench_iterations > 0)) {
+        printf("-W captures the default test only\n");
+        return -1;
+    }
+
+    if (profile_path)
+        startup_profile_start(profile_path);
+
     int p_w, p_h;
     int o_w, o_h;
 
@@ -405,6 +2023,9 @@ int main(int argc, char *argv[])
         return ret;
     }
 
+    if (multi_output)
+        return run_multi_output(device_path, mode_str, format);
+
     ret = init_drm_atomic(device_path, mode_str);
     if (ret) {
         printf("failed to initialize DRM\n");
@@ -413,40 +2034,57 @@ int main(int argc, char *argv[])
 
     LOG_ARGS("drm->mode: %dx%d\n", drm.mode->hdisplay, drm.mode->vdisplay);
 
-    ret = init_drm_atomic_planes(primary_plane_id, overlay_plane_id);
+    /* -N, -B, -T and -L pick the planes of the CRTC by themselves */
+    startup_profile_begin("atomic planes");
+    if ((max_planes < 0 && blend_overlays < 0 && !timeline_path && !layer_count) ||
+            bench_iterations > 0)
+        ret = init_drm_atomic_planes(primary_plane_id, overlay_plane_id);
+    startup_profile_end("atomic planes");
     if (ret) {
         printf("failed to initialize atomic planes\n");
         return ret;
     }
 
-    ret = init_gbm(&gbm, drm.fd, p_w, p_h, o_w, o_h, format);
-    if (ret) {
-        printf("failed to initialize GBM\n");
-        return ret;
+    if (!use_dumb) {
+        startup_profile_begin("init_gbm");
+        if (drm.primary_plane) {
+            struct gbm_bo *primary_test = NULL, *overlay_test = NULL;
+            drmModeAtomicReq *base = drmModeAtomicAlloc();
+
+            gbm.dev = gbm_create_device(drm.fd);
+            /* the overlay is tested on top of the primary the kernel accepted */
+            ret = !base || drm_atomic_mode_set(base, DRM_MODE_ATOMIC_ALLOW_MODESET) ||
+                negotiate_modifier(drm.primary_plane, "primary", format, modifier_index,
+                    p_w, p_h, base, &primary_test, &gbm.modifier1) ||
+                negotiate_modifier(drm.overlay_plane, "overlay", format, modifier_index,
+                    o_w, o_h, base, &overlay_test, &gbm.modifier2);
+            drmModeAtomicFree(base);
+            if (overlay_test)
+                gbm_bo_destroy(overlay_test);
+            if (primary_test)
+                gbm_bo_destroy(primary_test);
+            if (ret)
+                return -1;
+        }
+        ret = init_gbm(&gbm, drm.fd, p_w, p_h, o_w, o_h, format);
+        startup_profile_end("init_gbm");
+        if (ret) {
+            printf("failed to initialize GBM\n");
+            return ret;
+        }
     }
 
-    switch (type) {
-        case SMOOTH:
-            egl = init_cube_smooth(&gbm, format, 4);
-            break;
-        case PNG: {
-            char primary_path[1024];
-            memset(primary_path, '\0', sizeof primary_path);
-
-            char secondary_path[1024];
-            memset(secondary_path, '\0', sizeof secondary_path);
+    if (layer_count) {
+        struct solver_layer layers[MAX_SOLVER_LAYERS];
+        int k;
 
-            get_resource_path(primary_path, location, primary_file_name);
-            get_resource_path(secondary_path, location, secondary_file_name);
-            egl = init_png_image(drm.fd, &gbm, format, primary_path, secondary_path);
-            break;
+        for (k = 0; k < layer_count; k++) {
+            if (!parse_solver_layer(layer_specs[k], format, &layers[k])) {
+                printf("failed to parse layer %s\n", layer_specs[k]);
+                return -1;
+            }
         }
-        default:
-            break;
-    }
-    if (!egl) {
-        printf("failed to initialize EGL\n");
-        return -1;
+        return run_plane_solver(layers, layer_count, format);
     }
 
     uint32_t plane_flags = 0;
@@ -454,13 +2092,58 @@ int main(int argc, char *argv[])
     struct gbm_bo *bo2 = NULL, *bo2_next = NULL;
     struct drm_fb *fb2 = NULL;
 
-    if (!lock_new_surface(drm.fd, &gbm, gbm.surface1, &bo, &fb)) {
-        fprintf(stderr, "fail to add surface 1\n");
-        return -1;
-    }
-    if (!lock_new_surface(drm.fd, &gbm, gbm.surface2, &bo2, &fb2)) {
-        fprintf(stderr, "fail to add surface 2\n");
-        return -1;
+    startup_profile_begin("init content");
+    if (use_dumb) {
+        char primary_path[1024];
+        char secondary_path[1024];
+
+        get_resource_path(primary_path, location, primary_file_name);
+        get_resource_path(secondary_path, location, secondary_file_name);
+        ret = dumb_plane_init(&dumb_primary, p_w, p_h, format, true,
+                type == PNG ? primary_path : NULL) ||
+            dumb_plane_init(&dumb_overlay, o_w, o_h, format, false,
+                type == PNG ? secondary_path : NULL);
+        startup_profile_end("init content");
+        if (ret) {
+            printf("failed to initialize dumb buffers\n");
+            return -1;
+        }
+        fb = dumb_plane_draw(&dumb_primary, 0);
+        fb2 = dumb_plane_draw(&dumb_overlay, 0);
+    } else {
+        switch (type) {
+            case SMOOTH:
+                egl = init_cube_smooth(&gbm, format, 4);
+                break;
+            case PNG: {
+                char primary_path[1024];
+                memset(primary_path, '\0', sizeof primary_path);
+
+                char secondary_path[1024];
+                memset(secondary_path, '\0', sizeof secondary_path);
+
+                get_resource_path(primary_path, location, primary_file_name);
+                get_resource_path(secondary_path, location, secondary_file_name);
+                egl = init_png_image(drm.fd, &gbm, format, primary_path, secondary_path);
+                break;
+            }
+            default:
+                break;
+        }
+        startup_profile_end("init content");
+        if (!egl) {
+            printf("failed to initialize EGL\n");
+            return -1;
+        }
+
+        if (!lock_new_surface(drm.fd, &gbm, gbm.surface1, &bo, &fb)) {
+            fprintf(stderr, "fail to add surface 1\n");
+            return -1;
+        }
+        if (!lock_new_surface(drm.fd, &gbm, gbm.surface2, &bo2, &fb2)) {
+            fprintf(stderr, "fail to add surface 2\n");
+            return -1;
+        }
     }
 
     int crtc_width = default_crtc_width;
@@ -474,26 +2157,73 @@ int main(int argc, char *argv[])
     }
     printf("CRTC width: %d height: %d\n", crtc_width, crtc_height);
 
+    if (bench_iterations > 0) {
+        run_request_build_bench(bench_iterations, fb->fb_id, fb2->fb_id,
+            p_w, p_h, o_w, o_h, crtc_width, crtc_height);
+        return 0;
+    }
+
     bool turn_overlay_on = false;
     bool turn_primary_on = false;
 
     int j = 0;
 
+    /* the first commit sets the mode, the following ones only flip planes */
     uint32_t flags = 0;
     flags |= DRM_MODE_ATOMIC_ALLOW_MODESET;
-    /* TODO: Support non-blocking commit */
-    /*
-     * flags |= DRM_MODE_ATOMIC_NONBLOCK;
-     */
+    struct commit_stats modeset_stats = { .name = "modeset" };
+    struct commit_stats flip_stats = { .name = "flip", .count_allocs = true };
+    uint64_t commit_start, commit_ns, alloc_start, free_start;
+    bool count_allocs;
+    static struct frame_template templates[2][3][3];
+    struct frame_geometry geo = { p_w, p_h, o_w, o_h, crtc_width, crtc_height };
+    struct plane_damage primary_damage = { 0 }, overlay_damage = { 0 };
+    uint32_t primary_blob, overlay_blob;
+
+    if (nonblock)
+        flags |= DRM_MODE_ATOMIC_NONBLOCK | DRM_MODE_PAGE_FLIP_EVENT;
+
+    if (max_planes >= 0)
+        return run_multi_plane(max_planes, duration, flags, format, bo, bo2,
+            p_w, p_h, o_w, o_h, crtc_width, crtc_height);
+
+    if (blend_overlays >= 0)
+        return run_blend(blend_overlays, duration, flags, format, bo, bo2,
+            p_w, p_h, o_w, o_h, crtc_width, crtc_height);
+
+    if (timeline_path)
+        return run_timeline(timeline_path, format);
+
+    struct plane_buffers primary = { .surface = gbm.surface1, .scanout = bo };
+    struct plane_buffers overlay = { .surface = gbm.surface2, .scanout = bo2 };
+    int waiting_for_flip = 0;
+    struct hotplug hotplug = { .sock = -1 };
+    drmModeConnector *connector_owner = NULL;
+    struct commit_stats reconnect_stats = { .name = "reconnect" };
+    uint64_t reconnect_start = 0;
+    bool reconnect_committed = false;
+
+    if (hotplug_mode && hotplug_init(&hotplug))
+        return -1;
+
+    /* the first frame captures too, its modeset binds the writeback connector */
+    if (wb_interval > 0 && writeback_init(&wb, drm.fd, drm.crtc_id, drm.mode, NULL, NULL))
+        return -1;
 
     while (true) {
         int x_offset = (j * 10) % crtc_width;
-        int waiting_for_flip = 1;
         bool overlay_visible = false;
         bool prev_cond = false;
+        enum plane_update primary_update = PLANE_KEEP;
+        enum plane_update overlay_update = PLANE_KEEP;
 
         i++;
 
+        /* the whole frame, rendering and buffer handling included */
+        alloc_start = get_alloc_count();
+        free_start = get_free_count();
+        count_allocs = false;
+
         /*
          * xor primary and overlay for duration
          * primary => 1..duration/2
@@ -505,61 +2235,262 @@ int main(int argc, char *argv[])
         turn_overlay_on = !prev_cond && overlay_visible;
         turn_primary_on = (prev_cond && !overlay_visible) || i == 1;
 
-        eglMakeCurrent(egl->display, egl->surface1, egl->surface1, egl->context);
-        egl->draw(i, bo, true);
-        eglSwapBuffers(egl->display, egl->surface1);
-
-        eglMakeCurrent(egl->display, egl->surface2, egl->surface2, egl->context);
-        egl->draw(i, bo2, false);
-        eglSwapBuffers(egl->display, egl->surface2);
+        /* in non-blocking mode this overlaps scanout of the previous commit */
+        startup_profile_begin("render");
+        if (use_dumb) {
+            /* the chain is long enough to draw while one buffer is on screen and one queued */
+            draw_start = get_time_ns();
+            fb = dumb_plane_draw(&dumb_primary, i);
+            fb2 = dumb_plane_draw(&dumb_overlay, i);
+            draw_ns += get_time_ns() - draw_start;
+        } else {
+            eglMakeCurrent(egl->display, egl->surface1, egl->surface1, egl->context);
+            if (damage_mode)
+                draw_damage_pattern(&damage_pattern, &primary_damage, i, p_w, p_h);
+            else
+                egl->draw(i, bo, true);
+            eglSwapBuffers(egl->display, egl->surface1);
+
+            eglMakeCurrent(egl->display, egl->surface2, egl->surface2, egl->context);
+            if (damage_mode)
+                draw_damage_pattern(&damage_pattern, &overlay_damage, i, o_w, o_h);
+            else
+                egl->draw(i, bo2, false);
+            eglSwapBuffers(egl->display, egl->surface2);
+
+            if (!lock_new_surface(drm.fd, &gbm, gbm.surface1, &bo_next, &fb)) {
+                fprintf(stderr, "fail to add surface 1\n");
+                return 1;
+            }
 
-        if (!lock_new_surface(drm.fd, &gbm, gbm.surface1, &bo_next, &fb)) {
-            fprintf(stderr, "fail to add surface 1\n");
-            return 1;
+            if (!lock_new_surface(drm.fd, &gbm, gbm.surface2, &bo2_next, &fb2)) {
+                fprintf(stderr, "fail to add surface 2\n");
+                return 1;
+            }
         }
-
-        if (!lock_new_surface(drm.fd, &gbm, gbm.surface2, &bo2_next, &fb2)) {
-            fprintf(stderr, "fail to add surface 2\n");
-            return 1;
+        startup_profile_end("render");
+
+        if (waiting_for_flip) {
+            ret = wait_for_flip(&waiting_for_flip);
+            if (ret)
+                return ret;
+            plane_buffers_flip_done(&primary);
+            plane_buffers_flip_done(&overlay);
+            if (reconnect_committed) {
+                report_reconnect(&reconnect_stats, &reconnect_start);
+                reconnect_committed = false;
+            }
+            startup_profile_end("flip");
+            startup_profile_first_frame();
         }
 
-        drmModeAtomicReq *req;
-        req = drmModeAtomicAlloc();
+        if (hotplug_poll(&hotplug, 0)) {
+            int old_w = drm.mode->hdisplay, old_h = drm.mode->vdisplay;
+            bool disabled, resized;
+            int k, l;
 
-        drm_atomic_mode_set(req, flags);
+            ret = handle_hotplug(&hotplug, mode_str, &connector_owner, &disabled);
+            if (ret < 0)
+                return ret;
+
+            /* the buffers of the old size are freed while nothing scans them out */
+            resized = ret && (drm.mode->hdisplay != old_w || drm.mode->vdisplay != old_h);
+            if (resized && !disabled) {
+                if (disable_output())
+                    return -1;
+                disabled = true;
+            }
+
+            if (disabled) {
+                plane_buffers_queue(&primary, NULL, PLANE_OFF);
+                plane_buffers_queue(&overlay, NULL, PLANE_OFF);
+                plane_buffers_flip_done(&primary);
+                plane_buffers_flip_done(&overlay);
+            }
+
+            if (ret) {
+                /* the modeset requests carry the connector and the mode blob */
+                for (k = 0; k < 3; k++) {
+                    for (l = 0; l < 3; l++)
+                        templates[1][k][l].built = false;
+                }
+                flags |= DRM_MODE_ATOMIC_ALLOW_MODESET;
+                reconnect_start = hotplug.event_ns;
+            }
+
+            if (resized) {
+                /* the planes cover the same part of the new mode as of the old one */
+                crtc_width = (int64_t)crtc_width * drm.mode->hdisplay / old_w;
+                crtc_height = (int64_t)crtc_height * drm.mode->vdisplay / old_h;
+
+                /* dumb buffers keep their size, the planes scale them */
+                if (!use_dumb) {
+                    p_w = scale_size(p_w, drm.mode->hdisplay, old_w);
+                    p_h = scale_size(p_h, drm.mode->vdisplay, old_h);
+                    o_w = scale_size(o_w, drm.mode->hdisplay, old_w);
+                    o_h = scale_size(o_h, drm.mode->vdisplay, old_h);
+
+                    release_gbm_bo(&gbm, gbm.surface1, bo_next);
+                    release_gbm_bo(&gbm, gbm.surface2, bo2_next);
+                    if (resize_surfaces(p_w, p_h, o_w, o_h, format, &bo_next, &fb, &bo2_next, &fb2))
+                        return -1;
+                    primary.surface = gbm.surface1;
+                    overlay.surface = gbm.surface2;
+                }
+
+                geo = (struct frame_geometry){ p_w, p_h, o_w, o_h, crtc_width, crtc_height };
+                for (k = 0; k < 3; k++) {
+                    for (l = 0; l < 3; l++)
+                        templates[0][k][l].built = false;
+                }
+                primary_damage.has_prev = false;
+                overlay_damage.has_prev = false;
 
-        if (turn_primary_on) {
-            drm_atomic_set_plane_properties(req, primary_plane_id, drm.crtc_id, fb->fb_id,
-                p_w, p_h, crtc_width, crtc_height, 0);
-            drm_atomic_set_plane_properties(req, overlay_plane_id, 0, 0,
-                0, 0, 0, 0, 0);
+                printf("CRTC width: %d height: %d, primary %dx%d overlay %dx%d\n",
+                    crtc_width, crtc_height, p_w, p_h, o_w, o_h);
+            }
         }
 
         if (turn_overlay_on)
-            drm_atomic_set_plane_properties(req, primary_plane_id, 0, 0,
-                0, 0, 0, 0, 0);
+            primary_update = PLANE_OFF;
+
+        if (!overlay_visible)
+            primary_update = PLANE_FLIP;
+
+        if (turn_primary_on)
+            overlay_update = PLANE_OFF;
 
         if (overlay_visible) {
-            drm_atomic_set_plane_properties(req, overlay_plane_id, drm.crtc_id, fb2->fb_id,
-                o_w, o_h, o_w, o_h, x_offset);
+            overlay_update = PLANE_FLIP;
             j++;
         }
 
-        ret = drmModeAtomicCommit(drm.fd, req, flags, NULL);
-        LOG_ARGS("%i: drmModeAtomicCommit(%d %p %x) returns %d(%s)\n", i, drm.fd, req, flags, ret, strerror(ret));
+        struct frame_template *ft = &templates[!!(flags & DRM_MODE_ATOMIC_ALLOW_MODESET)]
+            [primary_update][overlay_update];
 
-        drmModeAtomicFree(req);
+        if (!ft->built && build_frame_template(ft, flags & DRM_MODE_ATOMIC_ALLOW_MODESET,
+                primary_update, overlay_update, &geo, damage_mode && damage_clips)) {
+            fprintf(stderr, "fail to build atomic request\n");
+            return 1;
+        }
+
+        if (ft->primary_fb >= 0)
+            atomic_template_set(&ft->req, ft->primary_fb, fb->fb_id);
+        if (ft->overlay_fb >= 0)
+            atomic_template_set(&ft->req, ft->overlay_fb, fb2->fb_id);
+        if (ft->overlay_x >= 0)
+            atomic_template_set(&ft->req, ft->overlay_x, x_offset);
+
+        primary_blob = overlay_blob = 0;
+        if (ft->primary_damage >= 0) {
+            primary_blob = create_damage_blob(&primary_damage);
+            atomic_template_set(&ft->req, ft->primary_damage, primary_blob);
+        }
+        if (ft->overlay_damage >= 0) {
+            overlay_blob = create_damage_blob(&overlay_damage);
+            atomic_template_set(&ft->req, ft->overlay_damage, overlay_blob);
+        }
+
+        if (wb_interval > 0 && (i - 1) % wb_interval == 0)
+            writeback_attach(&wb, &ft->req, i);
+
+        startup_profile_begin("flip");
+        startup_profile_begin("commit");
+        commit_start = get_time_ns();
+        ret = atomic_template_commit(drm.fd, &ft->req, flags, &waiting_for_flip);
+        commit_ns = get_time_ns() - commit_start;
+        startup_profile_end("commit");
+        LOG_ARGS("%i: atomic commit(%d %p %x) returns %d(%s)\n", i, drm.fd, ft, flags, ret, strerror(-ret));
+
+        if (wb_interval > 0)
+            writeback_committed(&wb, &ft->req, ret, commit_ns);
+
+        /* a buffer that did not make it to the screen is drawn into again */
+        if (use_dumb && !ret) {
+            if (ft->primary_fb >= 0)
+                dumb_chain_advance(&dumb_primary.chain);
+            if (ft->overlay_fb >= 0)
+                dumb_chain_advance(&dumb_overlay.chain);
+        }
+
+        /* the committed state keeps its own reference */
+        if (primary_blob)
+            drmModeDestroyPropertyBlob(drm.fd, primary_blob);
+        if (overlay_blob)
+            drmModeDestroyPropertyBlob(drm.fd, overlay_blob);
+
+        /* a plane that was off shows the whole buffer again */
+        if (primary_update != PLANE_FLIP || ret)
+            primary_damage.has_prev = false;
+        if (overlay_update != PLANE_FLIP || ret)
+            overlay_damage.has_prev = false;
+
+        if (!ret && (flags & DRM_MODE_ATOMIC_ALLOW_MODESET)) {
+            commit_stats_add(&modeset_stats, commit_ns);
+            commit_stats_print(&modeset_stats);
+            flags &= ~DRM_MODE_ATOMIC_ALLOW_MODESET;
+            reconnect_committed = reconnect_start != 0;
+        } else if (!ret) {
+            commit_stats_add(&flip_stats, commit_ns);
+            count_allocs = true;
+            if (flip_stats.count % COMMIT_STATS_INTERVAL == 0) {
+                commit_stats_print(&flip_stats);
+                if (use_dumb)
+                    printf("dumb: CPU draw avg %.3f ms per frame\n", draw_ns / 1e6 / i);
+                if (wb_interval > 0)
+                    writeback_print(&wb);
+                if (damage_mode)
+                    printf("damage%s: primary %.1f%% overlay %.1f%% of the plane\n",
+                        damage_clips ? "" : " (not committed)",
+                        primary_damage.frames ? 100 * primary_damage.area / primary_damage.frames : 0.0,
+                        overlay_damage.frames ? 100 * overlay_damage.area / overlay_damage.frames : 0.0);
+            }
+        }
+
+        if (ret) {
+            primary_update = PLANE_KEEP;
+            overlay_update = PLANE_KEEP;
+        }
+
+        plane_buffers_queue(&primary, bo_next, primary_update);
+        plane_buffers_queue(&overlay, bo2_next, overlay_update);
+
+        if (ret || !nonblock) {
+            /* a blocking commit has already completed when it returns */
+            plane_buffers_flip_done(&primary);
+            plane_buffers_flip_done(&overlay);
+            if (reconnect_committed) {
+                report_reconnect(&reconnect_stats, &reconnect_start);
+                reconnect_committed = false;
+            }
+            if (!ret) {
+                startup_profile_end("flip");
+                startup_profile_first_frame();
+            }
+        } else {
+            waiting_for_flip = 1;
+        }
 
-        if (bo)
-            release_gbm_bo(&gbm, gbm.surface1, bo);
         bo = bo_next;
         bo_next = NULL;
 
-        if (bo2)
-            release_gbm_bo(&gbm, gbm.surface2, bo2);
         bo2 = bo2_next;
         bo2_next = NULL;
+
+        if (count_allocs) {
+            flip_stats.allocs += get_alloc_count() - alloc_start;
+            flip_stats.frees += get_free_count() - free_start;
+        }
     }
 
     return 0;
 }
+
+int main(int argc, char *argv[])
+{
+    int ret = run(argc, argv);
+
+    /* every test returns through here, also the ones that never got a frame out */
+    startup_profile_report();
+    return ret;
+}
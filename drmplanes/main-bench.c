@@ -0,0 +1,645 @@
+/*
+ * Runs the primary/overlay XOR scenario of drmplanes and drmplanes-atomic
+ * through the legacy (drmModeSetPlane + drmModePageFlip) and the atomic
+ * KMS API with the same content and frame count, and compares the cost.
+ */
+
+#include <ctype.h>
+#include <stdarg.h>
+#include <unistd.h>
+#include <string.h>
+#include <drm_fourcc.h>
+#include <errno.h>
+#include <sys/select.h>
+
+#include "drm-common.h"
+#include "drm-atomic.h"
+#include "vblank-timing.h"
+
+bool verbose = false;
+
+static struct gbm gbm;
+const static struct egl *egl;
+
+static struct drm drm;
+
+static struct vblank_timing vblank_timing;
+
+static const int default_duration = 50;
+static const int default_frames = 600;
+static char *default_primary_info = "31@1920x1080";
+static char *default_overlay_info = "38@512x2160";
+
+static int default_crtc_width = 3840;
+static int default_crtc_height = 2160;
+
+enum backend {
+    BACKEND_LEGACY,
+    BACKEND_ATOMIC,
+    BACKEND_COUNT
+};
+
+static const char * const backend_names[BACKEND_COUNT] = {
+    [BACKEND_LEGACY] = "legacy",
+    [BACKEND_ATOMIC] = "atomic",
+};
+
+struct bench_result {
+    struct commit_stats ioctl;
+    uint64_t frames;
+    uint64_t missed;            /* vblanks a frame took beyond the first */
+    uint64_t errors;
+    uint64_t elapsed_ns;
+};
+
+struct bench_scene {
+    int p_w, p_h;
+    int o_w, o_h;
+    int crtc_w, crtc_h;
+    int duration;
+    int frames;
+    FILE *csv;
+};
+
+/* what the XOR scenario does with each plane in frame i */
+struct frame_step {
+    bool overlay_visible;
+    bool turn_overlay_on;
+    bool turn_primary_on;
+    int x_offset;
+};
+
+static void print_usage(const char *progname)
+{
+    printf("Usage:\n");
+    printf("    %s -p <plane_id>@<width>x<height> -o <plane_id>@<width>x<height> -F <frames> -B <backend>\n", progname);
+    printf("\n");
+    printf("    -p primary plane info (default: %s)\n", default_primary_info);
+    printf("    -o overlay plane info (default: %s)\n", default_overlay_info);
+    printf("    -c CRTC resolution of the primary plane (default: %dx%d)\n",
+        default_crtc_width, default_crtc_height);
+    printf("    -d duration of a primary/overlay cycle in frames (default: %d)\n", default_duration);
+    printf("    -F frames per back end (default: %d)\n", default_frames);
+    printf("    -B back end to run, legacy, atomic or both (default: both)\n");
+    printf("    -C write per-frame ioctl latency and vblanks to a CSV file\n");
+    printf("    -v verbose\n");
+    printf("    -D drm device path (default: /dev/dri/card0)\n");
+    printf("    -m mode preferred (default: NULL, mode with highest resolution)\n");
+    printf("    -f FOURCC format (default: AR24)\n");
+    printf("    -h help\n");
+    printf("\n");
+    printf("Example:\n");
+    printf("    %s -p 31@1920x1080 -o 38@512x2160 -m 1920x1080 -F 1200 -C /tmp/bench.csv\n", progname);
+}
+
+static void get_frame_step(uint32_t i, int duration, int *j, int crtc_width,
+    struct frame_step *step)
+{
+    bool prev_cond;
+
+    /*
+     * xor primary and overlay for duration
+     * primary => 1..duration/2
+     * overlay => duration/2..duration
+     */
+    step->overlay_visible = (i % duration) > (duration / 2);
+    prev_cond = ((i - 1) % duration) > (duration / 2);
+
+    step->turn_overlay_on = !prev_cond && step->overlay_visible;
+    step->turn_primary_on = (prev_cond && !step->overlay_visible) || i == 1;
+    step->x_offset = (*j * 10) % crtc_width;
+
+    if (step->overlay_visible)
+        (*j)++;
+}
+
+static void drm_atomic_set_plane_properties(drmModeAtomicReq *req, const struct plane *plane,
+    uint32_t crtc_id, uint32_t fb_id,
+    uint32_t src_width, uint32_t src_height,
+    uint32_t crtc_width, uint32_t crtc_height,
+    uint32_t crtc_x)
+{
+    add_plane_property(req, plane, PLANE_PROP_FB_ID, fb_id);
+    add_plane_property(req, plane, PLANE_PROP_CRTC_ID, crtc_id);
+    add_plane_property(req, plane, PLANE_PROP_SRC_X, 0);
+    add_plane_property(req, plane, PLANE_PROP_SRC_Y, 0);
+    add_plane_property(req, plane, PLANE_PROP_SRC_W, src_width << 16);
+    add_plane_property(req, plane, PLANE_PROP_SRC_H, src_height << 16);
+    add_plane_property(req, plane, PLANE_PROP_CRTC_X, crtc_x);
+    add_plane_property(req, plane, PLANE_PROP_CRTC_Y, 0);
+    add_plane_property(req, plane, PLANE_PROP_CRTC_W, crtc_width);
+    add_plane_property(req, plane, PLANE_PROP_CRTC_H, crtc_height);
+}
+
+static void page_flip_handler(int fd, unsigned int frame,
+    unsigned int sec, unsigned int usec, void *data)
+{
+    int *waiting_for_flip = data;
+    *waiting_for_flip = 0;
+}
+
+static int wait_for_flip(int *waiting_for_flip)
+{
+    drmEventContext evctx = {
+        .version = DRM_EVENT_CONTEXT_VERSION,
+        .page_flip_handler = page_flip_handler,
+    };
+    fd_set fds;
+    int ret;
+
+    while (*waiting_for_flip) {
+        FD_ZERO(&fds);
+        FD_SET(drm.fd, &fds);
+
+        ret = select(drm.fd + 1, &fds, NULL, NULL, NULL);
+        if (ret < 0) {
+            printf("select err: %s\n", strerror(errno));
+            return ret;
+        }
+        drmHandleEvent(drm.fd, &evctx);
+    }
+    return 0;
+}
+
+/*
+ * The primary plane is flipped with drmModePageFlip while it is visible.
+ * It cannot be flipped while disabled, so the overlay frames only move
+ * the overlay with drmModeSetPlane. That blocks for the vblank on some
+ * drivers only, so those frames wait for it, paced like a flip.
+ */
+static int submit_legacy(const struct bench_scene *scene, const struct frame_step *step,
+    uint32_t fb_id, uint32_t fb2_id, bool *primary_shown, bool *overlay_shown,
+    uint64_t *ioctl_ns)
+{
+    uint32_t primary_id = drm.primary_plane->plane->plane_id;
+    uint32_t overlay_id = drm.overlay_plane->plane->plane_id;
+    int waiting_for_flip = 1;
+    struct vblank_time before;
+    uint64_t start = get_time_ns();
+    int ret = 0;
+
+    *primary_shown = false;
+    *overlay_shown = false;
+
+    if (step->turn_overlay_on)
+        ret |= drmModeSetPlane(drm.fd, primary_id, drm.crtc_id, 0,
+            0, 0, 0, 0, 0, 0, 0, 0, 0);
+
+    if (step->overlay_visible) {
+        vblank_timing_now(&vblank_timing, &before);
+        ret |= drmModeSetPlane(drm.fd, overlay_id, drm.crtc_id, fb2_id,
+            0, step->x_offset, 0, scene->o_w, scene->o_h,
+            0, 0, scene->o_w << 16, scene->o_h << 16);
+        *ioctl_ns = get_time_ns() - start;
+        if (ret)
+            return ret;
+
+        *overlay_shown = true;
+        return vblank_timing_wait_after(&vblank_timing, before.seq);
+    }
+
+    if (step->turn_primary_on) {
+        ret |= drmModeSetPlane(drm.fd, primary_id, drm.crtc_id, fb_id,
+            0, 0, 0, scene->crtc_w, scene->crtc_h,
+            0, 0, scene->p_w << 16, scene->p_h << 16);
+        ret |= drmModeSetPlane(drm.fd, overlay_id, drm.crtc_id, 0,
+            0, 0, 0, 0, 0, 0, 0, 0, 0);
+    }
+
+    ret |= drmModePageFlip(drm.fd, drm.crtc_id, fb_id,
+        DRM_MODE_PAGE_FLIP_EVENT, &waiting_for_flip);
+    *ioctl_ns = get_time_ns() - start;
+    if (ret)
+        return ret;
+
+    *primary_shown = true;
+    return wait_for_flip(&waiting_for_flip);
+}
+
+static int submit_atomic(const struct bench_scene *scene, const struct frame_step *step,
+    uint32_t fb_id, uint32_t fb2_id, bool *primary_shown, bool *overlay_shown,
+    uint64_t *ioctl_ns)
+{
+    drmModeAtomicReq *req = drmModeAtomicAlloc();
+    int waiting_for_flip = 1;
+    uint64_t start;
+    int ret;
+
+    if (!req)
+        return -ENOMEM;
+
+    *primary_shown = !step->overlay_visible;
+    *overlay_shown = step->overlay_visible;
+
+    if (step->turn_overlay_on)
+        drm_atomic_set_plane_properties(req, drm.primary_plane, 0, 0,
+            0, 0, 0, 0, 0);
+
+    if (!step->overlay_visible)
+        drm_atomic_set_plane_properties(req, drm.primary_plane, drm.crtc_id, fb_id,
+            scene->p_w, scene->p_h, scene->crtc_w, scene->crtc_h, 0);
+
+    if (step->turn_primary_on)
+        drm_atomic_set_plane_properties(req, drm.overlay_plane, 0, 0,
+            0, 0, 0, 0, 0);
+
+    if (step->overlay_visible)
+        drm_atomic_set_plane_properties(req, drm.overlay_plane, drm.crtc_id, fb2_id,
+            scene->o_w, scene->o_h, scene->o_w, scene->o_h, step->x_offset);
+
+    /* only the ioctl is timed, the flip is waited for after it like the legacy one */
+    start = get_time_ns();
+    ret = drmModeAtomicCommit(drm.fd, req,
+        DRM_MODE_ATOMIC_NONBLOCK | DRM_MODE_PAGE_FLIP_EVENT, &waiting_for_flip);
+    *ioctl_ns = get_time_ns() - start;
+    drmModeAtomicFree(req);
+
+    if (ret) {
+        *primary_shown = false;
+        *overlay_shown = false;
+        return ret;
+    }
+    return wait_for_flip(&waiting_for_flip);
+}
+
+/* both back ends start from the mode set with only the primary plane on */
+static int set_mode(enum backend backend, uint32_t fb_id, const struct bench_scene *scene)
+{
+    drmModeAtomicReq *req;
+    int ret;
+
+    if (backend == BACKEND_LEGACY) {
+        ret = drmModeSetCrtc(drm.fd, drm.crtc_id, fb_id, 0, 0,
+            &drm.connector_id, 1, drm.mode);
+        if (!ret)
+            ret = drmModeSetPlane(drm.fd, drm.overlay_plane->plane->plane_id, drm.crtc_id, 0,
+                0, 0, 0, 0, 0, 0, 0, 0, 0);
+        return ret;
+    }
+
+    if (!drm.mode_blob_id &&
+        drmModeCreatePropertyBlob(drm.fd, drm.mode, sizeof(*drm.mode),
+                          &drm.mode_blob_id) != 0)
+        return -1;
+
+    req = drmModeAtomicAlloc();
+    if (!req)
+        return -ENOMEM;
+    add_connector_property(req, drm.connector, CONNECTOR_PROP_CRTC_ID, drm.crtc_id);
+    add_crtc_property(req, drm.crtc, CRTC_PROP_MODE_ID, drm.mode_blob_id);
+    add_crtc_property(req, drm.crtc, CRTC_PROP_ACTIVE, 1);
+    drm_atomic_set_plane_properties(req, drm.primary_plane, drm.crtc_id, fb_id,
+        scene->p_w, scene->p_h, scene->crtc_w, scene->crtc_h, 0);
+    drm_atomic_set_plane_properties(req, drm.overlay_plane, 0, 0, 0, 0, 0, 0, 0);
+    ret = drmModeAtomicCommit(drm.fd, req, DRM_MODE_ATOMIC_ALLOW_MODESET, NULL);
+    drmModeAtomicFree(req);
+    return ret;
+}
+
+/* a buffer that never reached the screen can go back right away */
+static void complete_plane(struct gbm_surface *surface, struct gbm_bo **scanout,
+    struct gbm_bo *next, bool shown)
+{
+    if (!shown) {
+        release_gbm_bo(&gbm, surface, next);
+        return;
+    }
+
+    if (*scanout)
+        release_gbm_bo(&gbm, surface, *scanout);
+    *scanout = next;
+}
+
+/* nothing is locked yet to size a draw from, so the first buffers are only cleared */
+static bool lock_cleared(EGLSurface egl_surface, struct gbm_surface *surface,
+    struct gbm_bo **bo, struct drm_fb **fb)
+{
+    eglMakeCurrent(egl->display, egl_surface, egl_surface, egl->context);
+    glClearColor(0.5, 0.5, 0.5, 1.0);
+    glClear(GL_COLOR_BUFFER_BIT);
+    eglSwapBuffers(egl->display, egl_surface);
+    return lock_new_surface(drm.fd, &gbm, surface, bo, fb);
+}
+
+/* the next back end starts from the mode set again, without buffers of this one on screen */
+static void disable_planes(enum backend backend)
+{
+    drmModeAtomicReq *req;
+
+    if (backend == BACKEND_LEGACY) {
+        drmModeSetPlane(drm.fd, drm.overlay_plane->plane->plane_id, drm.crtc_id, 0,
+            0, 0, 0, 0, 0, 0, 0, 0, 0);
+        drmModeSetPlane(drm.fd, drm.primary_plane->plane->plane_id, drm.crtc_id, 0,
+            0, 0, 0, 0, 0, 0, 0, 0, 0);
+        return;
+    }
+
+    req = drmModeAtomicAlloc();
+    if (!req)
+        return;
+    drm_atomic_set_plane_properties(req, drm.primary_plane, 0, 0, 0, 0, 0, 0, 0);
+    drm_atomic_set_plane_properties(req, drm.overlay_plane, 0, 0, 0, 0, 0, 0, 0);
+    drmModeAtomicCommit(drm.fd, req, 0, NULL);
+    drmModeAtomicFree(req);
+}
+
+static int run_backend(enum backend backend, const struct bench_scene *scene,
+    struct bench_result *result)
+{
+    struct gbm_bo *bo = NULL, *bo2 = NULL, *bo_next, *bo2_next;
+    struct drm_fb *fb, *fb2;
+    struct vblank_time prev, now;
+    uint64_t start, ioctl_ns;
+    bool primary_shown, overlay_shown;
+    uint32_t i;
+    int j = 0, ret = -1;
+
+    memset(result, 0, sizeof(*result));
+    result->ioctl.name = backend_names[backend];
+
+    if (!lock_cleared(egl->surface1, gbm.surface1, &bo, &fb) ||
+        !lock_cleared(egl->surface2, gbm.surface2, &bo2, &fb2))
+        goto out;
+
+    ret = set_mode(backend, fb->fb_id, scene);
+    if (ret) {
+        printf("%s: failed to set mode: %s\n", backend_names[backend], strerror(errno));
+        goto out;
+    }
+
+    ret = vblank_timing_now(&vblank_timing, &prev);
+    if (ret) {
+        printf("failed to get vblank: %s\n", strerror(errno));
+        goto out;
+    }
+
+    start = get_time_ns();
+    for (i = 1; i <= scene->frames; i++) {
+        struct frame_step step;
+
+        get_frame_step(i, scene->duration, &j, scene->crtc_w, &step);
+
+        eglMakeCurrent(egl->display, egl->surface1, egl->surface1, egl->context);
+        egl->draw(i, bo, true);
+        eglSwapBuffers(egl->display, egl->surface1);
+
+        eglMakeCurrent(egl->display, egl->surface2, egl->surface2, egl->context);
+        egl->draw(i, bo2, false);
+        eglSwapBuffers(egl->display, egl->surface2);
+
+        if (!lock_new_surface(drm.fd, &gbm, gbm.surface1, &bo_next, &fb)) {
+            ret = -1;
+            goto out;
+        }
+        if (!lock_new_surface(drm.fd, &gbm, gbm.surface2, &bo2_next, &fb2)) {
+            release_gbm_bo(&gbm, gbm.surface1, bo_next);
+            ret = -1;
+            goto out;
+        }
+
+        if (backend == BACKEND_LEGACY)
+            ret = submit_legacy(scene, &step, fb->fb_id, fb2->fb_id,
+                &primary_shown, &overlay_shown, &ioctl_ns);
+        else
+            ret = submit_atomic(scene, &step, fb->fb_id, fb2->fb_id,
+                &primary_shown, &overlay_shown, &ioctl_ns);
+
+        complete_plane(gbm.surface1, &bo, bo_next, primary_shown);
+        complete_plane(gbm.surface2, &bo2, bo2_next, overlay_shown);
+
+        if (ret) {
+            LOG_ARGS("%s %u: submit failed: %s\n", backend_names[backend], i, strerror(errno));
+            result->errors++;
+            continue;
+        }
+
+        vblank_timing_now(&vblank_timing, &now);
+        if (now.seq > prev.seq + 1)
+            result->missed += now.seq - prev.seq - 1;
+
+        commit_stats_add(&result->ioctl, ioctl_ns);
+        result->frames++;
+
+        LOG_ARGS("%s %u: ioctl %.3f ms, %llu vblanks\n", backend_names[backend], i,
+            ioctl_ns / 1e6, (unsigned long long)(now.seq - prev.seq));
+        if (scene->csv)
+            fprintf(scene->csv, "%s,%u,%llu,%llu\n", backend_names[backend], i,
+                (unsigned long long)ioctl_ns, (unsigned long long)(now.seq - prev.seq));
+
+        prev = now;
+    }
+    result->elapsed_ns = get_time_ns() - start;
+    ret = 0;
+
+out:
+    disable_planes(backend);
+    release_gbm_bo(&gbm, gbm.surface1, bo);
+    release_gbm_bo(&gbm, gbm.surface2, bo2);
+    return ret;
+}
+
+static void print_results(const struct bench_result *results, const bool *ran)
+{
+    int b;
+
+#define ROW(label, fmt, expr) \
+    do { \
+        printf("%-16s", label); \
+        for (b = 0; b < BACKEND_COUNT; b++) { \
+            const struct bench_result *r = &results[b]; \
+            if (ran[b]) \
+                printf(fmt, expr); \
+            else \
+                printf("%12s", "-"); \
+        } \
+        printf("\n"); \
+    } while (0)
+
+    printf("\n%-16s%12s%12s\n", "", backend_names[BACKEND_LEGACY], backend_names[BACKEND_ATOMIC]);
+    ROW("frames", "%12llu", (unsigned long long)r->frames);
+    ROW("errors", "%12llu", (unsigned long long)r->errors);
+    ROW("ioctl avg (ms)", "%12.3f", r->ioctl.count ? r->ioctl.total_ns / 1e6 / r->ioctl.count : 0.0);
+    ROW("ioctl min (ms)", "%12.3f", r->ioctl.min_ns / 1e6);
+    ROW("ioctl max (ms)", "%12.3f", r->ioctl.max_ns / 1e6);
+    ROW("flips/s", "%12.2f", r->elapsed_ns ? r->frames * 1e9 / r->elapsed_ns : 0.0);
+    ROW("missed vblanks", "%12llu", (unsigned long long)r->missed);
+
+#undef ROW
+}
+
+int main(int argc, char *argv[])
+{
+    struct bench_scene scene = {
+        .duration = default_duration,
+        .frames = default_frames,
+        .crtc_w = default_crtc_width,
+        .crtc_h = default_crtc_height,
+    };
+    struct bench_result results[BACKEND_COUNT];
+    bool ran[BACKEND_COUNT] = { false };
+    bool run[BACKEND_COUNT] = { true, true };
+    int primary_plane_id, overlay_plane_id;
+    char *primary_plane_info = default_primary_info;
+    char *overlay_plane_info = default_overlay_info;
+    char *device_path = "/dev/dri/card0";
+    char *mode_str = NULL;
+    char *crtc_str = NULL;
+    char *csv_path = NULL;
+    uint32_t format = GBM_FORMAT_ARGB8888;
+    int opt, ret, b;
+
+    while ((opt = getopt(argc, argv, "hvp:o:c:d:F:B:C:D:m:f:")) != -1) {
+        switch (opt) {
+            case 'h':
+                print_usage(argv[0]);
+                return 0;
+            case 'v':
+                verbose = true;
+                break;
+            case 'p':
+                primary_plane_info = optarg;
+                break;
+            case 'o':
+                overlay_plane_info = optarg;
+                break;
+            case 'c':
+                crtc_str = optarg;
+                break;
+            case 'd':
+                scene.duration = strtoul(optarg, NULL, 10);
+                break;
+            case 'F':
+                scene.frames = strtoul(optarg, NULL, 10);
+                break;
+            case 'B':
+                if (strcmp(optarg, "legacy") == 0) {
+                    run[BACKEND_ATOMIC] = false;
+                } else if (strcmp(optarg, "atomic") == 0) {
+                    run[BACKEND_LEGACY] = false;
+                } else if (strcmp(optarg, "both") != 0) {
+                    printf("invalid back end: %s\n", optarg);
+                    print_usage(argv[0]);
+                    return -1;
+                }
+                break;
+            case 'C':
+                csv_path = optarg;
+                break;
+            case 'D':
+                device_path = optarg;
+                break;
+            case 'm':
+                mode_str = optarg;
+                break;
+            case 'f': {
+                char fourcc[4] = "    ";
+                int length = strlen(optarg);
+                if (length > 0)
+                    fourcc[0] = optarg[0];
+                if (length > 1)
+                    fourcc[1] = optarg[1];
+                if (length > 2)
+                    fourcc[2] = optarg[2];
+                if (length > 3)
+                    fourcc[3] = optarg[3];
+                format = fourcc_code(fourcc[0], fourcc[1],
+                    fourcc[2], fourcc[3]);
+                break;
+            }
+            case '?':
+                if (isprint(optopt))
+                    fprintf(stderr, "Unknown option `-%c'.\n", optopt);
+                else
+                    fprintf(stderr, "Unknown option character `\\x%x'.\n", optopt);
+                return 1;
+            default:
+                abort();
+        }
+    }
+
+    if (!parse_plane(primary_plane_info, &primary_plane_id, &scene.p_w, &scene.p_h)) {
+        printf("failed to parse primary resolution %s\n", primary_plane_info);
+        return -1;
+    }
+
+    if (!parse_plane(overlay_plane_info, &overlay_plane_id, &scene.o_w, &scene.o_h)) {
+        printf("failed to parse overlay resolution %s\n", overlay_plane_info);
+        return -1;
+    }
+
+    if (crtc_str && !parse_resolution(crtc_str, &scene.crtc_w, &scene.crtc_h)) {
+        fprintf(stderr, "failed to parse crtc_str: %s\n", crtc_str);
+        return -1;
+    }
+
+    if (scene.duration <= 0 || scene.frames <= 0) {
+        printf("duration and frames have to be positive\n");
+        return -1;
+    }
+
+    /* legacy calls keep working with the atomic cap set */
+    ret = init_drm(&drm, device_path, mode_str, true);
+    if (ret) {
+        printf("failed to initialize DRM\n");
+        return ret;
+    }
+
+    drm.crtc = calloc(1, sizeof(*drm.crtc));
+    drm.connector = calloc(1, sizeof(*drm.connector));
+    drm.primary_plane = calloc(1, sizeof(*drm.primary_plane));
+    drm.overlay_plane = calloc(1, sizeof(*drm.overlay_plane));
+
+    if (init_atomic_connector(drm.fd, drm.connector_id, drm.connector) ||
+        init_atomic_crtc(drm.fd, drm.crtc_id, drm.crtc) ||
+        init_atomic_plane(drm.fd, primary_plane_id, drm.primary_plane) ||
+        init_atomic_plane(drm.fd, overlay_plane_id, drm.overlay_plane)) {
+        printf("failed to initialize atomic objects\n");
+        return -1;
+    }
+
+    ret = vblank_timing_init(&vblank_timing, drm.fd, drm.crtc_id, drm.mode);
+    if (ret)
+        return ret;
+
+    ret = init_gbm(&gbm, drm.fd, scene.p_w, scene.p_h, scene.o_w, scene.o_h, format);
+    if (ret) {
+        printf("failed to initialize GBM\n");
+        return ret;
+    }
+
+    egl = init_cube_smooth(&gbm, format, 4);
+    if (!egl) {
+        printf("failed to initialize EGL\n");
+        return -1;
+    }
+
+    if (csv_path) {
+        scene.csv = fopen(csv_path, "w");
+        if (!scene.csv) {
+            printf("failed to open %s: %s\n", csv_path, strerror(errno));
+            return -1;
+        }
+        fprintf(scene.csv, "backend,frame,ioctl_ns,vblanks\n");
+    }
+
+    printf("%d frames per back end, %dx%d mode, cycle of %d frames\n", scene.frames,
+        drm.mode->hdisplay, drm.mode->vdisplay, scene.duration);
+
+    for (b = 0; b < BACKEND_COUNT; b++) {
+        if (!run[b])
+            continue;
+
+        printf("running %s\n", backend_names[b]);
+        if (run_backend(b, &scene, &results[b]))
+            printf("%s back end failed\n", backend_names[b]);
+        else
+            ran[b] = true;
+    }
+
+    print_results(results, ran);
+
+    if (scene.csv)
+        fclose(scene.csv);
+
+    return 0;
+}
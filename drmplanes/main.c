@@ -37,6 +37,7 @@
 
 #include "readpng.h"
 #include "drm-common.h"
+#include "dumb-buffer.h"
 
 bool verbose = false;
 
@@ -59,6 +60,31 @@ static const char *secondary_file_name = "secondary_512x2160.png";
 static int default_crtc_width = 3840;
 static int default_crtc_height = 2160;
 
+/* -U: dumb buffers filled by the CPU, no GBM or EGL */
+static bool use_dumb = false;
+static struct dumb_chain dumb_primary, dumb_overlay;
+static struct dumb_buffer dumb_black;
+static struct drm_fb dumb_fb1, dumb_fb2, dumb_black_fb;
+
+static void fill_dumb_chain(struct dumb_chain *chain, png_buffer_handle png_handle)
+{
+    uint32_t width, height, stride;
+    const void *pixels = png_buffer_pixels(png_handle, &width, &height, &stride);
+    int n;
+
+    for (n = 0; n < DUMB_CHAIN_LENGTH; n++)
+        dumb_blit(&chain->buffers[n], pixels, width, height, stride);
+}
+
+/* every buffer of the chain already holds the plane's image */
+static struct drm_fb *next_dumb_fb(struct dumb_chain *chain, struct drm_fb *fb)
+{
+    fb->drm_fd = drm.fd;
+    fb->fb_id = dumb_chain_next(chain)->fb_id;
+    dumb_chain_advance(chain);
+    return fb;
+}
+
 static char* color_name(struct glcolor *c)
 {
     if (c == &red)
@@ -111,6 +137,7 @@ static void print_usage(const char *progname)
     printf("    -m mode preferred (default: NULL, mode with highest resolution)\n");
     printf("    -f FOURCC format (default: AR24)\n");
     printf("    -l resource location (default: /usr/share/drmplanes)\n");
+    printf("    -U dumb buffers drawn by the CPU instead of GBM and EGL\n");
     printf("    -h help\n");
     printf("\n");
     printf("Example:\n");
@@ -143,7 +170,7 @@ int main(int argc, char *argv[])
 
     bool fill_black_workaround = false;
 
-    while ((opt = getopt(argc, argv, "whvd:p:o:D:m:f:l:c:")) != -1) {
+    while ((opt = getopt(argc, argv, "whvUd:p:o:D:m:f:l:c:")) != -1) {
         switch (opt) {
             case 'h':
                 print_usage(argv[0]);
@@ -160,6 +187,9 @@ int main(int argc, char *argv[])
             case 'w':
                 fill_black_workaround = true;
                 break;
+            case 'U':
+                use_dumb = true;
+                break;
             case 'd':
                 duration = strtoul(optarg, NULL, 10);
                 break;
@@ -205,7 +235,7 @@ int main(int argc, char *argv[])
         }
     }
 
-    ret = init_drm(&drm, device_path, mode_str);
+    ret = init_drm(&drm, device_path, mode_str, false);
     if (ret) {
         printf("failed to initialize DRM\n");
         return ret;
@@ -229,22 +259,36 @@ int main(int argc, char *argv[])
         return ret;
     }
 
-    ret = init_gbm(&gbm, drm.fd, p_w, p_h, o_w, o_h, format);
-    if (ret) {
-        printf("failed to initialize GBM\n");
-        return ret;
-    }
+    if (use_dumb) {
+        if (dumb_chain_create(drm.fd, p_w, p_h, format, &dumb_primary) ||
+                dumb_chain_create(drm.fd, o_w, o_h, format, &dumb_overlay) ||
+                dumb_buffer_create(drm.fd, p_w, p_h, format, &dumb_black)) {
+            printf("failed to create dumb buffers\n");
+            return -1;
+        }
+        dumb_fill_rect(&dumb_black, 0, 0, p_w, p_h, 0xff000000);
+        dumb_black_fb.drm_fd = drm.fd;
+        dumb_black_fb.fb_id = dumb_black.fb_id;
+    } else {
+        ret = init_gbm(&gbm, drm.fd, p_w, p_h, o_w, o_h, format);
+        if (ret) {
+            printf("failed to initialize GBM\n");
+            return ret;
+        }
 
-    ret = init_egl(&egl, &gbm, format);
-    if (ret) {
-        printf("failed to initialize EGL\n");
-        return ret;
+        ret = init_egl(&egl, &gbm, format);
+        if (ret) {
+            printf("failed to initialize EGL\n");
+            return ret;
+        }
     }
 
     uint32_t plane_flags = 0;
 
     /* surface1 */
-    if (!lock_new_surface(drm.fd, &gbm, gbm.surface1, &bo, &fb)) {
+    if (use_dumb) {
+        fb = next_dumb_fb(&dumb_primary, &dumb_fb1);
+    } else if (!lock_new_surface(drm.fd, &gbm, gbm.surface1, &bo, &fb)) {
         fprintf(stderr, "fail to add surface 1\n");
         return 1;
     }
@@ -258,7 +302,9 @@ int main(int argc, char *argv[])
         fprintf(stderr, "fail to read_png_from_file %s\n", primary_file_name);
         return 1;
     }
-    if (!fill_gbm_buffer(bo, png_handle_primary)) {
+    if (use_dumb) {
+        fill_dumb_chain(&dumb_primary, png_handle_primary);
+    } else if (!fill_gbm_buffer(bo, png_handle_primary)) {
         fprintf(stderr, "fail to fill primary bo\n");
         return 1;
     }
@@ -269,6 +315,8 @@ int main(int argc, char *argv[])
         fprintf(stderr, "fail to read_png_from_file %s\n", secondary_file_name);
         return 1;
     }
+    if (use_dumb)
+        fill_dumb_chain(&dumb_overlay, png_handle_secondary);
 
     /* set mode: */
     ret = drmModeSetCrtc(drm.fd, drm.crtc_id, fb->fb_id, 0, 0,
@@ -329,7 +377,9 @@ int main(int argc, char *argv[])
 
         if (turn_overlay_on) {
             LOG_ARGS("%3d: turn_overlay_on\n", i);
-            if (!fb2) {
+            if (use_dumb) {
+                fb2 = next_dumb_fb(&dumb_overlay, &dumb_fb2);
+            } else if (!fb2) {
                 if (!lock_new_surface(drm.fd, &gbm, gbm.surface2, &bo2, &fb2)) {
                     fprintf(stderr, "fail to add surface 2\n");
                     return 1;
@@ -359,7 +409,10 @@ int main(int argc, char *argv[])
              * TODO: If we disable the plane of primary id, then page flip fails.
              * Hence, fill black instead
              */
-            if (fill_black_workaround) {
+            if (fill_black_workaround && use_dumb) {
+                LOG_ARGS("%3d: flip primary to black\n", i);
+                fb = &dumb_black_fb;
+            } else if (fill_black_workaround) {
                 eglMakeCurrent(egl.display, egl.surface1, egl.surface1, egl.context);
                 draw_gl(i, &black, egl.surface1);
                 eglSwapBuffers(egl.display, egl.surface1);
@@ -387,20 +440,24 @@ int main(int argc, char *argv[])
 
         if (turn_primary_on) {
             LOG_ARGS("%3d: turn_primary_on\n", i);
-            eglMakeCurrent(egl.display, egl.surface1, egl.surface1, egl.context);
-            /*
-             * draw_gl(i, &red, egl.surface1);
-             */
-            eglSwapBuffers(egl.display, egl.surface1);
+            if (use_dumb) {
+                fb = next_dumb_fb(&dumb_primary, &dumb_fb1);
+            } else {
+                eglMakeCurrent(egl.display, egl.surface1, egl.surface1, egl.context);
+                /*
+                 * draw_gl(i, &red, egl.surface1);
+                 */
+                eglSwapBuffers(egl.display, egl.surface1);
 
-            if (!lock_new_surface(drm.fd, &gbm, gbm.surface1, &bo_next, &fb)) {
-                fprintf(stderr, "fail to lock surface 1\n");
-                return 1;
-            }
+                if (!lock_new_surface(drm.fd, &gbm, gbm.surface1, &bo_next, &fb)) {
+                    fprintf(stderr, "fail to lock surface 1\n");
+                    return 1;
+                }
 
-            if (!fill_gbm_buffer(bo_next, png_handle_primary)) {
-                fprintf(stderr, "fail to fill primary bo\n");
-                return 1;
+                if (!fill_gbm_buffer(bo_next, png_handle_primary)) {
+                    fprintf(stderr, "fail to fill primary bo\n");
+                    return 1;
+                }
             }
 
             LOG_ARGS("%3d: drmModeSetPlane(%d, %d, %d, %d, ..., %d, %d, ..., %d << 16, %d << 16)\n",
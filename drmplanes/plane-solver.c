@@ -0,0 +1,361 @@
+#include "plane-solver.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <drm_fourcc.h>
+
+/*
+ * Layers are offloaded to planes in z-order: a layer may only go on a
+ * plane that can take a higher zpos than the plane of the layer below it.
+ * Each layer gets the lowest zpos its plane allows above the one below, so
+ * the ranges of the planes above are left as wide as possible. Planes
+ * without a zpos property stack in the order the driver lists them, when
+ * none of the CRTC's planes has one. Layers that cannot be
+ * offloaded are composited by the GPU into one target buffer, which needs
+ * a plane of its own, so they have to be a contiguous run in z-order.
+ * The search tries runs of 0, 1, 2, ... composited layers and stops at the
+ * first one for which the driver accepts an assignment.
+ */
+
+struct solver_state {
+    const struct plane_solver *solver;
+    const struct solver_layer *list[MAX_SOLVER_LAYERS];
+    int count;
+    int assignment[MAX_SOLVER_LAYERS];
+    uint64_t zpos[MAX_SOLVER_LAYERS];
+    bool used[MAX_SOLVER_PLANES];
+    enum solver_strategy strategy;
+    int tests;
+
+    /* the zpos each plane can take, min > max: none */
+    uint64_t zpos_min[MAX_SOLVER_PLANES];
+    uint64_t zpos_max[MAX_SOLVER_PLANES];
+    bool zpos_mutable[MAX_SOLVER_PLANES];
+};
+
+static bool parse_int(const char **p, int *value)
+{
+    char *end;
+    long v = strtol(*p, &end, 10);
+
+    if (end == *p)
+        return false;
+
+    *value = v;
+    *p = end;
+    return true;
+}
+
+/* <w>x<h>[@<x>,<y>][/<crtc_w>x<crtc_h>][:<fourcc>] */
+bool parse_solver_layer(const char *spec, uint32_t default_format, struct solver_layer *layer)
+{
+    const char *p = spec;
+
+    memset(layer, 0, sizeof(*layer));
+    layer->format = default_format;
+
+    if (!parse_int(&p, &layer->w) || *p++ != 'x' || !parse_int(&p, &layer->h))
+        return false;
+
+    layer->crtc_w = layer->w;
+    layer->crtc_h = layer->h;
+
+    if (*p == '@') {
+        p++;
+        if (!parse_int(&p, &layer->x) || *p++ != ',' || !parse_int(&p, &layer->y))
+            return false;
+    }
+
+    if (*p == '/') {
+        p++;
+        if (!parse_int(&p, &layer->crtc_w) || *p++ != 'x' || !parse_int(&p, &layer->crtc_h))
+            return false;
+    }
+
+    if (*p == ':') {
+        char fourcc[4] = "    ";
+        int length;
+
+        p++;
+        length = strlen(p);
+        if (length < 1 || length > 4)
+            return false;
+        memcpy(fourcc, p, length);
+        layer->format = fourcc_code(fourcc[0], fourcc[1], fourcc[2], fourcc[3]);
+        p += length;
+    }
+
+    return *p == '\0' && layer->w > 0 && layer->h > 0;
+}
+
+static bool plane_has_format(const struct plane *plane, uint32_t format)
+{
+    uint32_t i;
+
+    for (i = 0; i < plane->plane->count_formats; i++) {
+        if (plane->plane->formats[i] == format)
+            return true;
+    }
+
+    return false;
+}
+
+static void init_zpos(struct solver_state *state)
+{
+    const struct plane_solver *solver = state->solver;
+    bool any = false, immutable;
+    uint64_t min, max, value;
+    int k;
+
+    for (k = 0; k < solver->plane_count; k++) {
+        const struct plane *plane = &solver->planes[k];
+
+        state->zpos_mutable[k] = false;
+        state->zpos_min[k] = 1;
+        state->zpos_max[k] = 0;
+
+        if (!get_property_range(plane->props, plane->props_info, "zpos", &min, &max, &immutable))
+            continue;
+        any = true;
+
+        /* an immutable zpos is the plane's fixed position */
+        if (immutable && get_property_value(plane->props, plane->props_info, "zpos", &value))
+            min = max = value;
+        state->zpos_min[k] = min;
+        state->zpos_max[k] = max;
+        state->zpos_mutable[k] = !immutable;
+    }
+
+    /* a plane without zpos next to ones with it has no known place in the stack */
+    if (any)
+        return;
+
+    for (k = 0; k < solver->plane_count; k++)
+        state->zpos_min[k] = state->zpos_max[k] = k;
+}
+
+static void add_layer_properties(drmModeAtomicReq *req, const struct plane *plane,
+    uint32_t crtc_id, const struct solver_layer *layer)
+{
+    add_plane_property(req, plane, PLANE_PROP_FB_ID, layer ? layer->fb_id : 0);
+    add_plane_property(req, plane, PLANE_PROP_CRTC_ID, layer ? crtc_id : 0);
+    if (!layer)
+        return;
+
+    add_plane_property(req, plane, PLANE_PROP_SRC_X, (uint64_t)layer->src_x << 16);
+    add_plane_property(req, plane, PLANE_PROP_SRC_Y, (uint64_t)layer->src_y << 16);
+    add_plane_property(req, plane, PLANE_PROP_SRC_W, (uint64_t)layer->w << 16);
+    add_plane_property(req, plane, PLANE_PROP_SRC_H, (uint64_t)layer->h << 16);
+    add_plane_property(req, plane, PLANE_PROP_CRTC_X, (uint64_t)(int64_t)layer->x);
+    add_plane_property(req, plane, PLANE_PROP_CRTC_Y, (uint64_t)(int64_t)layer->y);
+    add_plane_property(req, plane, PLANE_PROP_CRTC_W, layer->crtc_w);
+    add_plane_property(req, plane, PLANE_PROP_CRTC_H, layer->crtc_h);
+}
+
+/* TEST_ONLY the first assigned entries of the list, every other plane disabled */
+static bool test_assignment(struct solver_state *state, int assigned)
+{
+    const struct plane_solver *solver = state->solver;
+    const struct solver_layer *on_plane[MAX_SOLVER_PLANES] = { NULL };
+    uint64_t zpos[MAX_SOLVER_PLANES];
+    drmModeAtomicReq *req;
+    int k, ret;
+
+    for (k = 0; k < assigned; k++) {
+        on_plane[state->assignment[k]] = state->list[k];
+        zpos[state->assignment[k]] = state->zpos[k];
+    }
+
+    req = drmModeAtomicDuplicate(solver->base_req);
+    if (!req)
+        return false;
+
+    for (k = 0; k < solver->plane_count; k++) {
+        add_layer_properties(req, &solver->planes[k], solver->crtc_id, on_plane[k]);
+        if (on_plane[k] && state->zpos_mutable[k])
+            add_plane_property(req, &solver->planes[k], PLANE_PROP_ZPOS, zpos[k]);
+    }
+
+    ret = drmModeAtomicCommit(solver->fd, req,
+        solver->base_flags | DRM_MODE_ATOMIC_TEST_ONLY, NULL);
+    drmModeAtomicFree(req);
+
+    state->tests++;
+    return ret == 0;
+}
+
+/* min_zpos: one above the zpos of the layer below */
+static bool assign(struct solver_state *state, int idx, uint64_t min_zpos)
+{
+    const struct plane_solver *solver = state->solver;
+    uint64_t zpos;
+    bool found;
+    int p;
+
+    if (idx == state->count)
+        return state->strategy == SOLVER_INCREMENTAL || test_assignment(state, idx);
+
+    for (p = 0; p < solver->plane_count; p++) {
+        if (state->used[p] || !plane_has_format(&solver->planes[p], state->list[idx]->format))
+            continue;
+
+        zpos = state->zpos_min[p] > min_zpos ? state->zpos_min[p] : min_zpos;
+        if (zpos > state->zpos_max[p])
+            continue;
+
+        state->assignment[idx] = p;
+        state->zpos[idx] = zpos;
+
+        if (state->strategy == SOLVER_INCREMENTAL && !test_assignment(state, idx + 1))
+            continue;
+
+        state->used[p] = true;
+        found = assign(state, idx + 1, zpos + 1);
+        state->used[p] = false;
+        if (found)
+            return true;
+    }
+
+    return false;
+}
+
+static void composition_target(const struct plane_solver *solver,
+    const struct solver_layer *layers, int first, int count, struct solver_layer *target)
+{
+    int x1 = solver->target_w, y1 = solver->target_h, x2 = 0, y2 = 0;
+    int k;
+
+    for (k = first; k < first + count; k++) {
+        const struct solver_layer *layer = &layers[k];
+
+        if (layer->x < x1)
+            x1 = layer->x;
+        if (layer->y < y1)
+            y1 = layer->y;
+        if (layer->x + layer->crtc_w > x2)
+            x2 = layer->x + layer->crtc_w;
+        if (layer->y + layer->crtc_h > y2)
+            y2 = layer->y + layer->crtc_h;
+    }
+
+    if (x1 < 0)
+        x1 = 0;
+    if (y1 < 0)
+        y1 = 0;
+    if (x2 > solver->target_w)
+        x2 = solver->target_w;
+    if (y2 > solver->target_h)
+        y2 = solver->target_h;
+    if (x2 <= x1 || y2 <= y1) {
+        x1 = y1 = 0;
+        x2 = solver->target_w;
+        y2 = solver->target_h;
+    }
+
+    /* only the bounding box of the composited layers is scanned out */
+    memset(target, 0, sizeof(*target));
+    target->fb_id = solver->target_fb_id;
+    target->format = solver->target_format;
+    target->src_x = target->x = x1;
+    target->src_y = target->y = y1;
+    target->w = target->crtc_w = x2 - x1;
+    target->h = target->crtc_h = y2 - y1;
+}
+
+int solve_plane_assignment(const struct plane_solver *solver,
+    const struct solver_layer *layers, int layer_count,
+    enum solver_strategy strategy, struct solver_result *result)
+{
+    struct solver_state state = {
+        .solver = solver,
+        .strategy = strategy,
+    };
+    struct solver_layer target;
+    uint64_t start = get_time_ns();
+    int composited, first, k;
+
+    if (layer_count > MAX_SOLVER_LAYERS || solver->plane_count > MAX_SOLVER_PLANES)
+        return -1;
+
+    memset(result, 0, sizeof(*result));
+    init_zpos(&state);
+
+    for (composited = 0; composited <= layer_count; composited++) {
+        for (first = 0; first + composited <= layer_count; first++) {
+            int target_index = -1;
+
+            state.count = 0;
+            for (k = 0; k < first; k++)
+                state.list[state.count++] = &layers[k];
+            if (composited) {
+                composition_target(solver, layers, first, composited, &target);
+                target_index = state.count;
+                state.list[state.count++] = &target;
+            }
+            for (k = first + composited; k < layer_count; k++)
+                state.list[state.count++] = &layers[k];
+
+            if (state.count > solver->plane_count || !assign(&state, 0, 0)) {
+                /* without composition there is only one list to try */
+                if (!composited)
+                    break;
+                continue;
+            }
+
+            for (k = 0; k < layer_count; k++) {
+                int entry = k < first ? k :
+                    k < first + composited ? -1 :
+                    k - composited + (composited ? 1 : 0);
+
+                result->plane_of_layer[k] = entry < 0 ? -1 : state.assignment[entry];
+                result->zpos_of_layer[k] = entry < 0 ? 0 : state.zpos[entry];
+            }
+            result->target_plane = -1;
+            if (target_index >= 0) {
+                result->target_plane = state.assignment[target_index];
+                result->target_zpos = state.zpos[target_index];
+                result->target = target;
+            }
+
+            result->composited = composited;
+            result->tests = state.tests;
+            result->time_ns = get_time_ns() - start;
+            return 0;
+        }
+    }
+
+    result->composited = -1;
+    result->tests = state.tests;
+    result->time_ns = get_time_ns() - start;
+    return -1;
+}
+
+void print_solver_result(const struct plane_solver *solver, const char *name,
+    int layer_count, const struct solver_result *result)
+{
+    int k;
+
+    printf("%s: %d TEST_ONLY commits in %.3f ms (%.1f us/test)\n", name, result->tests,
+        result->time_ns / 1e6, result->tests ? result->time_ns / 1e3 / result->tests : 0.0);
+
+    if (result->composited < 0) {
+        printf("    no assignment found\n");
+        return;
+    }
+
+    printf("    %d of %d layers GPU composited\n", result->composited, layer_count);
+    if (result->target_plane >= 0)
+        printf("    composition target %dx%d@%d,%d: plane %u zpos %llu\n",
+            result->target.w, result->target.h, result->target.x, result->target.y,
+            solver->planes[result->target_plane].plane->plane_id,
+            (unsigned long long)result->target_zpos);
+    for (k = 0; k < layer_count; k++) {
+        if (result->plane_of_layer[k] < 0)
+            printf("    layer %d: GPU\n", k);
+        else
+            printf("    layer %d: plane %u zpos %llu\n", k,
+                solver->planes[result->plane_of_layer[k]].plane->plane_id,
+                (unsigned long long)result->zpos_of_layer[k]);
+    }
+}
@@ -0,0 +1,62 @@
+#ifndef PLANE_SOLVER_H
+#define PLANE_SOLVER_H
+
+#include <stdint.h>
+#include <stdbool.h>
+
+#include "drm-atomic.h"
+
+#define MAX_SOLVER_LAYERS 16
+#define MAX_SOLVER_PLANES 16
+
+/* a client layer, bottom to top in the order they are given */
+struct solver_layer {
+    int w, h;                   /* buffer size */
+    uint32_t format;
+    int src_x, src_y;           /* source offset in the buffer */
+    int x, y;                   /* position on the CRTC */
+    int crtc_w, crtc_h;         /* size on the CRTC, scaled when != w x h */
+    uint32_t fb_id;
+};
+
+enum solver_strategy {
+    SOLVER_EXHAUSTIVE,          /* TEST_ONLY only complete assignments */
+    SOLVER_INCREMENTAL,         /* TEST_ONLY every partial assignment, prune early */
+};
+
+struct plane_solver {
+    int fd;
+    uint32_t crtc_id;
+    struct plane *planes;       /* any order, stacked by their zpos */
+    int plane_count;
+
+    /* CRTC/connector state every test commit starts from, and its flags */
+    drmModeAtomicReq *base_req;
+    uint32_t base_flags;
+
+    /* buffer the GPU composites the remaining layers into, at mode size */
+    uint32_t target_fb_id;
+    uint32_t target_format;
+    int target_w, target_h;
+};
+
+struct solver_result {
+    int plane_of_layer[MAX_SOLVER_LAYERS];  /* index into planes, -1: GPU composited */
+    uint64_t zpos_of_layer[MAX_SOLVER_LAYERS];
+    int composited;
+    int target_plane;                       /* plane of the composition target, -1: none */
+    uint64_t target_zpos;
+    struct solver_layer target;
+    int tests;
+    uint64_t time_ns;
+};
+
+bool parse_solver_layer(const char *spec, uint32_t default_format, struct solver_layer *layer);
+/* 0 with the assignment in result, -1: no assignment, not even with every layer composited */
+int solve_plane_assignment(const struct plane_solver *solver,
+    const struct solver_layer *layers, int layer_count,
+    enum solver_strategy strategy, struct solver_result *result);
+void print_solver_result(const struct plane_solver *solver, const char *name,
+    int layer_count, const struct solver_result *result);
+
+#endif /* PLANE_SOLVER_H */
@@ -239,6 +239,16 @@ bool fill_buffer(void* addr, uint32_t width, uint32_t height, uint32_t stride, p
     return true;
 }
 
+const void *png_buffer_pixels(png_buffer_handle png_buffer_handle, uint32_t *width, uint32_t *height, uint32_t *stride)
+{
+    struct png_buffer *png_buffer = png_buffer_handle;
+
+    *width = png_buffer->width;
+    *height = png_buffer->height;
+    *stride = png_buffer->stride;
+    return png_buffer->addr;
+}
+
 void destroy_png_buffer(png_buffer_handle png_buffer_handle)
 {
     struct png_buffer *png_buffer = png_buffer_handle;
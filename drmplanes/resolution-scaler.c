@@ -0,0 +1,162 @@
+#include "resolution-scaler.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+int resolution_scaler_init(struct resolution_scaler *scaler, const drmModeModeInfo *mode,
+    const char *levels, int width, int height)
+{
+    const char *p = levels;
+    char *end;
+    long percent, last = 101;
+    int i;
+
+    memset(scaler, 0, sizeof(*scaler));
+
+    /* clock is in kHz, leave a quarter of the frame to the commit and the display */
+    scaler->budget_ns = (uint64_t)mode->htotal * mode->vtotal * 1000000 / mode->clock * 3 / 4;
+
+    while (*p) {
+        percent = strtol(p, &end, 10);
+        if (end == p || percent <= 0 || percent > 100 ||
+                (*end && *end != ',') || scaler->count_levels == SCALER_MAX_LEVELS) {
+            printf("invalid resolution levels: %s\n", levels);
+            return -1;
+        }
+        if (percent >= last) {
+            printf("resolution levels must go down: %s\n", levels);
+            return -1;
+        }
+
+        /* even sizes keep subsampled formats and the scaler happy */
+        scaler->width[scaler->count_levels] = (width * percent / 100) & ~1;
+        scaler->height[scaler->count_levels] = (height * percent / 100) & ~1;
+        scaler->count_levels++;
+        last = percent;
+
+        p = *end ? end + 1 : end;
+    }
+
+    if (!scaler->count_levels) {
+        printf("no resolution levels: %s\n", levels);
+        return -1;
+    }
+
+    printf("resolution scaler: GPU budget %.3f ms, levels", scaler->budget_ns / 1e6);
+    for (i = 0; i < scaler->count_levels; i++)
+        printf(" %dx%d", scaler->width[i], scaler->height[i]);
+    printf("\n");
+
+    return 0;
+}
+
+uint64_t resolution_scaler_average(const struct resolution_scaler *scaler)
+{
+    uint64_t total = 0;
+    int i;
+
+    if (!scaler->window_count)
+        return 0;
+
+    for (i = 0; i < scaler->window_count; i++)
+        total += scaler->window[i];
+
+    return total / scaler->window_count;
+}
+
+static uint64_t level_pixels(const struct resolution_scaler *scaler, int level)
+{
+    return (uint64_t)scaler->width[level] * scaler->height[level];
+}
+
+/* the closest enabled level in direction step, -1 when there is none */
+static int next_level(const struct resolution_scaler *scaler, int level, int step)
+{
+    for (level += step; level >= 0 && level < scaler->count_levels; level += step) {
+        if (!scaler->disabled[level])
+            return level;
+    }
+    return -1;
+}
+
+static void set_level(struct resolution_scaler *scaler, int level)
+{
+    scaler->level = level;
+    scaler->window_count = 0;
+    scaler->window_pos = 0;
+}
+
+bool resolution_scaler_add(struct resolution_scaler *scaler, uint64_t gpu_ns)
+{
+    uint64_t average, predicted;
+    int level = scaler->level;
+    int lower = next_level(scaler, level, 1);
+    int higher = next_level(scaler, level, -1);
+
+    scaler->frames++;
+    scaler->level_frames[level]++;
+    if (gpu_ns > scaler->budget_ns)
+        scaler->over_budget++;
+
+    scaler->window[scaler->window_pos] = gpu_ns;
+    scaler->window_pos = (scaler->window_pos + 1) % SCALER_WINDOW;
+    if (scaler->window_count < SCALER_WINDOW)
+        scaler->window_count++;
+
+    /* decide on a full window only */
+    if (scaler->window_count < SCALER_WINDOW)
+        return false;
+
+    average = resolution_scaler_average(scaler);
+
+    if (average > scaler->budget_ns && lower >= 0) {
+        level = lower;
+    } else if (higher >= 0) {
+        /* GPU time grows with the pixels, go up only if that still fits with room */
+        predicted = average * level_pixels(scaler, higher) / level_pixels(scaler, level);
+        if (predicted < scaler->budget_ns * 3 / 4)
+            level = higher;
+    }
+
+    if (level == scaler->level)
+        return false;
+
+    printf("resolution scaler: frame %llu, GPU avg %.3f ms, %dx%d -> %dx%d\n",
+        (unsigned long long)scaler->frames, average / 1e6,
+        scaler->width[scaler->level], scaler->height[scaler->level],
+        scaler->width[level], scaler->height[level]);
+
+    scaler->switches++;
+    set_level(scaler, level);
+    return true;
+}
+
+void resolution_scaler_revert(struct resolution_scaler *scaler, int level)
+{
+    int failed = scaler->level;
+
+    printf("resolution scaler: %dx%d failed, disabled\n",
+        scaler->width[failed], scaler->height[failed]);
+
+    /* run_scaled keeps a surface per level index, so the levels are not compacted */
+    scaler->disabled[failed] = true;
+    set_level(scaler, level);
+}
+
+void resolution_scaler_print(const struct resolution_scaler *scaler)
+{
+    int i;
+
+    if (!scaler->frames)
+        return;
+
+    printf("resolution scaler: frames %llu over budget %llu, switches %llu, GPU avg %.3f ms at %dx%d\n",
+        (unsigned long long)scaler->frames, (unsigned long long)scaler->over_budget,
+        (unsigned long long)scaler->switches, resolution_scaler_average(scaler) / 1e6,
+        scaler->width[scaler->level], scaler->height[scaler->level]);
+    for (i = 0; i < scaler->count_levels; i++)
+        printf("  %dx%d: %.1f%% of frames%s\n", scaler->width[i], scaler->height[i],
+            100.0 * scaler->level_frames[i] / scaler->frames,
+            scaler->disabled[i] ? ", disabled" : "");
+}
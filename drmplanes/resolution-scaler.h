@@ -0,0 +1,46 @@
+#ifndef RESOLUTION_SCALER_H
+#define RESOLUTION_SCALER_H
+
+#include <stdint.h>
+#include <stdbool.h>
+#include <xf86drmMode.h>
+
+#define SCALER_MAX_LEVELS 8
+#define SCALER_WINDOW 16
+
+/*
+ * Picks the render resolution from the GPU time of the last frames. Levels
+ * go from the full size down; the plane scales each to the same CRTC
+ * rectangle. After a switch the window starts over, so one slow frame
+ * cannot flip the resolution back and forth.
+ */
+struct resolution_scaler {
+    uint64_t budget_ns;             /* GPU time a frame may take */
+    int count_levels;
+    int width[SCALER_MAX_LEVELS];
+    int height[SCALER_MAX_LEVELS];
+    int level;                      /* 0: full size */
+    bool disabled[SCALER_MAX_LEVELS];   /* the plane refused it */
+
+    uint64_t window[SCALER_WINDOW]; /* GPU time of the last frames */
+    int window_count;
+    int window_pos;
+
+    uint64_t frames;
+    uint64_t over_budget;
+    uint64_t switches;
+    uint64_t level_frames[SCALER_MAX_LEVELS];
+};
+
+/* levels: percentages of width x height, "100,75,50" */
+int resolution_scaler_init(struct resolution_scaler *scaler, const drmModeModeInfo *mode,
+    const char *levels, int width, int height);
+/* GPU time of a finished frame, true when the level changed */
+bool resolution_scaler_add(struct resolution_scaler *scaler, uint64_t gpu_ns);
+/* back to level when the commit of the current one failed, and disable that one;
+ * level indices stay the same */
+void resolution_scaler_revert(struct resolution_scaler *scaler, int level);
+uint64_t resolution_scaler_average(const struct resolution_scaler *scaler);
+void resolution_scaler_print(const struct resolution_scaler *scaler);
+
+#endif /* RESOLUTION_SCALER_H */
@@ -0,0 +1,170 @@
+#include "startup-profile.h"
+
+#include <stdio.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <string.h>
+#include <errno.h>
+#include <time.h>
+
+#define MAX_PHASES 64
+#define WATERFALL_WIDTH 40
+
+struct phase {
+    const char *name;
+    uint64_t start_ns;
+    uint64_t end_ns;            /* 0: did not finish */
+    int depth;
+};
+
+static struct {
+    bool active;
+    const char *json_path;
+    uint64_t start_ns;
+    int depth;
+    int count;
+    struct phase phases[MAX_PHASES];
+} profile;
+
+static uint64_t now_ns(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000ull + ts.tv_nsec;
+}
+
+void startup_profile_start(const char *json_path)
+{
+    memset(&profile, 0, sizeof(profile));
+    profile.json_path = json_path;
+    profile.start_ns = now_ns();
+    profile.active = true;
+}
+
+void startup_profile_begin(const char *phase)
+{
+    struct phase *p;
+
+    if (!profile.active || profile.count == MAX_PHASES)
+        return;
+
+    p = &profile.phases[profile.count++];
+    p->name = phase;
+    p->depth = profile.depth++;
+    p->start_ns = now_ns();
+    p->end_ns = 0;
+}
+
+void startup_profile_end(const char *phase)
+{
+    uint64_t ns = now_ns();
+    int k;
+
+    if (!profile.active)
+        return;
+
+    for (k = profile.count - 1; k >= 0; k--) {
+        struct phase *p = &profile.phases[k];
+
+        if (!p->end_ns && strcmp(p->name, phase) == 0) {
+            p->end_ns = ns;
+            profile.depth = p->depth;
+            return;
+        }
+    }
+}
+
+static double ms(uint64_t ns)
+{
+    return ns / 1e6;
+}
+
+/* str as a JSON string, quotes, backslashes and control characters escaped */
+static void write_json_string(FILE *fp, const char *str)
+{
+    const unsigned char *c;
+
+    fputc('"', fp);
+    for (c = (const unsigned char *)str; *c; c++) {
+        if (*c == '"' || *c == '\\')
+            fprintf(fp, "\\%c", *c);
+        else if (*c < 0x20)
+            fprintf(fp, "\\u%04x", *c);
+        else
+            fputc(*c, fp);
+    }
+    fputc('"', fp);
+}
+
+static void write_json(const char *json_path, uint64_t total_ns)
+{
+    FILE *fp = fopen(json_path, "w");
+    int k;
+
+    if (!fp) {
+        printf("failed to open %s: %s\n", json_path, strerror(errno));
+        return;
+    }
+
+    fprintf(fp, "{\n  \"total_ms\": %.3f,\n  \"phases\": [\n", ms(total_ns));
+    for (k = 0; k < profile.count; k++) {
+        const struct phase *p = &profile.phases[k];
+
+        fprintf(fp, "    { \"name\": ");
+        write_json_string(fp, p->name);
+        fprintf(fp, ", \"depth\": %d, \"start_ms\": %.3f, ",
+            p->depth, ms(p->start_ns - profile.start_ns));
+        if (p->end_ns)
+            fprintf(fp, "\"duration_ms\": %.3f }", ms(p->end_ns - p->start_ns));
+        else
+            fprintf(fp, "\"duration_ms\": null }");
+        fprintf(fp, "%s\n", k + 1 < profile.count ? "," : "");
+    }
+    fprintf(fp, "  ]\n}\n");
+    fclose(fp);
+}
+
+static void report(const char *end)
+{
+    uint64_t total_ns = now_ns() - profile.start_ns;
+    int k, c;
+
+    if (!profile.active)
+        return;
+    profile.active = false;
+
+    printf("startup: %.3f ms from main() to %s\n", ms(total_ns), end);
+    printf("%-28s %10s %10s\n", "phase", "start(ms)", "time(ms)");
+    for (k = 0; k < profile.count; k++) {
+        const struct phase *p = &profile.phases[k];
+        uint64_t end_ns = p->end_ns ? p->end_ns : p->start_ns;
+        int from = (p->start_ns - profile.start_ns) * WATERFALL_WIDTH / total_ns;
+        int to = (end_ns - profile.start_ns) * WATERFALL_WIDTH / total_ns;
+        char name[29];
+
+        snprintf(name, sizeof(name), "%*s%s", 2 * p->depth, "", p->name);
+        printf("%-28s %10.3f ", name, ms(p->start_ns - profile.start_ns));
+        if (p->end_ns)
+            printf("%10.3f |", ms(p->end_ns - p->start_ns));
+        else
+            printf("%10s |", "-");
+
+        for (c = 0; c < WATERFALL_WIDTH; c++)
+            putchar(c < from ? ' ' : c <= to ? '#' : ' ');
+        printf("|\n");
+    }
+
+    if (profile.json_path)
+        write_json(profile.json_path, total_ns);
+}
+
+void startup_profile_first_frame(void)
+{
+    report("the first frame");
+}
+
+void startup_profile_report(void)
+{
+    report("exit, no frame on screen");
+}
@@ -0,0 +1,19 @@
+#ifndef STARTUP_PROFILE_H
+#define STARTUP_PROFILE_H
+
+/*
+ * Timestamps of the startup phases, from startup_profile_start() at the
+ * top of main() to the first frame on screen. Phases may nest, a phase
+ * that runs more than once gets an entry per run. Nothing is recorded
+ * before startup_profile_start() or after the report.
+ */
+/* json_path: where the report writes the phases as JSON, NULL: nowhere */
+void startup_profile_start(const char *json_path);
+void startup_profile_begin(const char *phase);
+void startup_profile_end(const char *phase);
+/* the first frame is on screen: print the waterfall, later calls do nothing */
+void startup_profile_first_frame(void);
+/* on exit, the same for a run that ended before its first frame */
+void startup_profile_report(void);
+
+#endif /* STARTUP_PROFILE_H */
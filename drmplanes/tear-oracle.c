@@ -0,0 +1,105 @@
+#include "tear-oracle.h"
+
+#include <stdio.h>
+
+/* the blue channel checks the index bytes, so background pixels do not decode */
+static uint8_t marker_check(uint8_t lo, uint8_t hi)
+{
+    return lo ^ hi ^ 0x5a;
+}
+
+uint32_t tear_oracle_color(uint32_t frame)
+{
+    uint8_t lo = frame & 0xff, hi = (frame >> 8) & 0xff;
+
+    return 0xff000000 | lo << 16 | hi << 8 | marker_check(lo, hi);
+}
+
+static bool decode_marker(uint32_t pixel, uint32_t *index)
+{
+    uint8_t lo = (pixel >> 16) & 0xff, hi = (pixel >> 8) & 0xff;
+
+    if ((pixel & 0xff) != marker_check(lo, hi))
+        return false;
+
+    *index = lo | hi << 8;
+    return true;
+}
+
+void tear_oracle_init(struct tear_oracle *oracle, const char *name,
+    int src_w, int src_h, int crtc_w, int crtc_h)
+{
+    oracle->name = name;
+    oracle->src_w = src_w;
+    oracle->src_h = src_h;
+    oracle->crtc_w = crtc_w;
+    oracle->crtc_h = crtc_h;
+    oracle->frames = 0;
+    oracle->torn = 0;
+    oracle->unreadable = 0;
+    pthread_mutex_init(&oracle->lock, NULL);
+}
+
+/* half a band high, centered, so scaling never blends in a neighbour */
+void tear_oracle_marker(const struct tear_oracle *oracle, int band,
+    int *x, int *y, int *w, int *h)
+{
+    int band_h = oracle->src_h / TEAR_ORACLE_BANDS;
+
+    *x = 0;
+    *w = TEAR_ORACLE_MARKER_W;
+    *h = band_h / 2;
+    *y = band * band_h + band_h / 4;
+}
+
+void tear_oracle_check(const struct writeback_frame *frame, int width, int height, void *data)
+{
+    struct tear_oracle *oracle = data;
+    uint32_t index, expected = frame->frame_idx & 0xffff;
+    int band, x, y, w, h, cx, cy, valid = 0;
+    bool torn = false;
+
+    for (band = 0; band < TEAR_ORACLE_BANDS; band++) {
+        tear_oracle_marker(oracle, band, &x, &y, &w, &h);
+
+        /* the center of the marker where the plane puts it on the CRTC */
+        cx = (int64_t)(x + w / 2) * oracle->crtc_w / oracle->src_w;
+        cy = (int64_t)(y + h / 2) * oracle->crtc_h / oracle->src_h;
+        if (cx >= width || cy >= height)
+            continue;
+
+        if (!decode_marker(frame->data[cy * width + cx], &index))
+            continue;
+
+        /* a band of an older frame is torn too, even if all of them agree */
+        valid++;
+        if (index != expected)
+            torn = true;
+    }
+
+    pthread_mutex_lock(&oracle->lock);
+    oracle->frames++;
+    if (!valid)
+        oracle->unreadable++;
+    else if (torn)
+        oracle->torn++;
+    pthread_mutex_unlock(&oracle->lock);
+}
+
+void tear_oracle_print(struct tear_oracle *oracle)
+{
+    uint64_t frames, torn, unreadable;
+
+    pthread_mutex_lock(&oracle->lock);
+    frames = oracle->frames;
+    torn = oracle->torn;
+    unreadable = oracle->unreadable;
+    pthread_mutex_unlock(&oracle->lock);
+
+    if (frames == unreadable)
+        return;
+
+    printf("tearing oracle (%s): checked %llu torn %llu (%.1f per 1000) unreadable %llu\n",
+        oracle->name, (unsigned long long)frames, (unsigned long long)torn,
+        torn * 1000.0 / (frames - unreadable), (unsigned long long)unreadable);
+}
@@ -0,0 +1,41 @@
+#ifndef TEAR_ORACLE_H
+#define TEAR_ORACLE_H
+
+#include <stdint.h>
+#include <stdbool.h>
+#include <pthread.h>
+
+#include "writeback.h"
+
+#define TEAR_ORACLE_BANDS 16
+#define TEAR_ORACLE_MARKER_W 32
+
+/*
+ * Every horizontal band of a rendered frame carries a marker with the
+ * frame index in its color. A captured scanout with a band that does not
+ * show the index of the committed frame was put together from more than
+ * one frame, or still showed an older one.
+ */
+struct tear_oracle {
+    const char *name;           /* the sync mode under test */
+    int src_w, src_h;           /* rendered buffer */
+    int crtc_w, crtc_h;         /* the plane at 0,0 of the CRTC */
+
+    pthread_mutex_t lock;
+    uint64_t frames;
+    uint64_t torn;
+    uint64_t unreadable;        /* no band with a valid marker */
+};
+
+void tear_oracle_init(struct tear_oracle *oracle, const char *name,
+    int src_w, int src_h, int crtc_w, int crtc_h);
+/* 0xAARRGGBB marker color of frame */
+uint32_t tear_oracle_color(uint32_t frame);
+/* marker of band in the rendered buffer, y from the top */
+void tear_oracle_marker(const struct tear_oracle *oracle, int band,
+    int *x, int *y, int *w, int *h);
+/* writeback_frame_cb, data is the oracle */
+void tear_oracle_check(const struct writeback_frame *frame, int width, int height, void *data);
+void tear_oracle_print(struct tear_oracle *oracle);
+
+#endif /* TEAR_ORACLE_H */
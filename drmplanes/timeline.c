@@ -0,0 +1,200 @@
+#include "timeline.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+static int parse_key(struct timeline *timeline, char *args, int line)
+{
+    struct timeline_layer *layer;
+    struct timeline_key *key;
+    char *token, *save = NULL;
+    int index;
+    unsigned long ms;
+
+    token = strtok_r(args, " \t", &save);
+    if (!token || sscanf(token, "%d", &index) != 1 ||
+            index < 0 || index >= timeline->count_layers) {
+        printf("timeline:%d: no such layer\n", line);
+        return -1;
+    }
+    layer = &timeline->layers[index];
+
+    token = strtok_r(NULL, " \t", &save);
+    if (!token || sscanf(token, "%lu", &ms) != 1) {
+        printf("timeline:%d: key without a time\n", line);
+        return -1;
+    }
+
+    if (layer->count_keys == TIMELINE_MAX_KEYS) {
+        printf("timeline:%d: too many keys, at most %d per layer\n", line, TIMELINE_MAX_KEYS);
+        return -1;
+    }
+
+    key = &layer->keys[layer->count_keys];
+    if (layer->count_keys) {
+        *key = layer->keys[layer->count_keys - 1];
+        if (ms * 1000000ull < key->t_ns) {
+            printf("timeline:%d: keys of a layer must be in time order\n", line);
+            return -1;
+        }
+    } else {
+        key->state = (struct timeline_state) {
+            .w = layer->src_w, .h = layer->src_h, .visible = true,
+        };
+    }
+    key->t_ns = ms * 1000000ull;
+    key->ease = TIMELINE_LINEAR;
+
+    while ((token = strtok_r(NULL, " \t", &save))) {
+        int value;
+
+        if (strcmp(token, "ease=step") == 0)
+            key->ease = TIMELINE_STEP;
+        else if (strcmp(token, "ease=linear") == 0)
+            key->ease = TIMELINE_LINEAR;
+        else if (strcmp(token, "ease=ease") == 0)
+            key->ease = TIMELINE_EASE;
+        else if (sscanf(token, "x=%d", &value) == 1)
+            key->state.x = value;
+        else if (sscanf(token, "y=%d", &value) == 1)
+            key->state.y = value;
+        else if (sscanf(token, "w=%d", &value) == 1 && value > 0)
+            key->state.w = value;
+        else if (sscanf(token, "h=%d", &value) == 1 && value > 0)
+            key->state.h = value;
+        else if (sscanf(token, "visible=%d", &value) == 1)
+            key->state.visible = value;
+        else if (sscanf(token, "content=%d", &value) == 1)
+            key->state.content = value;
+        else {
+            printf("timeline:%d: invalid key attribute %s\n", line, token);
+            return -1;
+        }
+    }
+
+    layer->count_keys++;
+    if (key->t_ns > timeline->length_ns)
+        timeline->length_ns = key->t_ns;
+    return 0;
+}
+
+int timeline_load(struct timeline *timeline, const char *path)
+{
+    char buf[512];
+    FILE *fp;
+    int line = 0, ret = 0, i;
+
+    memset(timeline, 0, sizeof(*timeline));
+
+    fp = fopen(path, "r");
+    if (!fp) {
+        printf("could not open timeline %s\n", path);
+        return -1;
+    }
+
+    while (!ret && fgets(buf, sizeof(buf), fp)) {
+        char *p = buf, *comment = strchr(buf, '#');
+        unsigned long ms;
+        int w, h;
+
+        line++;
+        if (comment)
+            *comment = '\0';
+        buf[strcspn(buf, "\r\n")] = '\0';
+        while (*p == ' ' || *p == '\t')
+            p++;
+        if (!*p)
+            continue;
+
+        if (sscanf(p, "loop %lu", &ms) == 1) {
+            timeline->loop_ns = ms * 1000000ull;
+        } else if (sscanf(p, "layer %dx%d", &w, &h) == 2) {
+            if (w <= 0 || h <= 0) {
+                printf("timeline:%d: invalid layer size %dx%d\n", line, w, h);
+                ret = -1;
+                break;
+            }
+            if (timeline->count_layers == TIMELINE_MAX_LAYERS) {
+                printf("timeline:%d: too many layers, at most %d\n", line, TIMELINE_MAX_LAYERS);
+                ret = -1;
+                break;
+            }
+            timeline->layers[timeline->count_layers].src_w = w;
+            timeline->layers[timeline->count_layers].src_h = h;
+            timeline->count_layers++;
+        } else if (strncmp(p, "key ", 4) == 0) {
+            ret = parse_key(timeline, p + 4, line);
+        } else {
+            printf("timeline:%d: invalid statement: %s\n", line, p);
+            ret = -1;
+        }
+    }
+    fclose(fp);
+
+    if (ret)
+        return ret;
+
+    if (!timeline->count_layers) {
+        printf("timeline %s has no layers\n", path);
+        return -1;
+    }
+
+    for (i = 0; i < timeline->count_layers; i++) {
+        if (!timeline->layers[i].count_keys) {
+            printf("timeline %s: layer %d has no keys\n", path, i);
+            return -1;
+        }
+    }
+
+    printf("timeline %s: %d layers, %.3f s%s\n", path, timeline->count_layers,
+        timeline->length_ns / 1e9, timeline->loop_ns ? ", looped" : "");
+    return 0;
+}
+
+static int lerp(int a, int b, double f)
+{
+    return a + (int)((b - a) * f + (b >= a ? 0.5 : -0.5));
+}
+
+void timeline_eval(const struct timeline *timeline, int layer, uint64_t t_ns,
+    struct timeline_state *state)
+{
+    const struct timeline_layer *l = &timeline->layers[layer];
+    const struct timeline_key *from, *to;
+    double f;
+    int k;
+
+    if (timeline->loop_ns)
+        t_ns %= timeline->loop_ns;
+
+    /* the last key at or before t_ns */
+    for (k = 0; k + 1 < l->count_keys && l->keys[k + 1].t_ns <= t_ns; k++)
+        ;
+
+    from = &l->keys[k];
+    if (k + 1 == l->count_keys || t_ns < from->t_ns) {
+        *state = from->state;
+        return;
+    }
+
+    to = &l->keys[k + 1];
+    f = (double)(t_ns - from->t_ns) / (to->t_ns - from->t_ns);
+    if (to->ease == TIMELINE_STEP)
+        f = 0;
+    else if (to->ease == TIMELINE_EASE)
+        f = f * f * (3 - 2 * f);
+
+    state->x = lerp(from->state.x, to->state.x, f);
+    state->y = lerp(from->state.y, to->state.y, f);
+    state->w = lerp(from->state.w, to->state.w, f);
+    state->h = lerp(from->state.h, to->state.h, f);
+    state->content = lerp(from->state.content, to->state.content, f);
+    /* pops happen at the key */
+    state->visible = from->state.visible;
+}
+
+bool timeline_done(const struct timeline *timeline, uint64_t t_ns)
+{
+    return !timeline->loop_ns && t_ns > timeline->length_ns;
+}
@@ -0,0 +1,61 @@
+#ifndef TIMELINE_H
+#define TIMELINE_H
+
+#include <stdint.h>
+#include <stdbool.h>
+
+#define TIMELINE_MAX_LAYERS 8
+#define TIMELINE_MAX_KEYS 64
+
+/* how a key is reached from the one before it */
+enum timeline_ease {
+    TIMELINE_STEP,
+    TIMELINE_LINEAR,
+    TIMELINE_EASE,              /* smoothstep, slow at both ends */
+};
+
+struct timeline_state {
+    int x, y, w, h;             /* on the CRTC */
+    bool visible;
+    int content;                /* animation frame the content is drawn at */
+};
+
+struct timeline_key {
+    uint64_t t_ns;
+    struct timeline_state state;
+    enum timeline_ease ease;
+};
+
+struct timeline_layer {
+    int src_w, src_h;
+    int count_keys;
+    struct timeline_key keys[TIMELINE_MAX_KEYS];
+};
+
+/*
+ * Keyframed plane motion read from a scenario file, evaluated at the
+ * time a frame will be presented. One statement per line, # comments:
+ *
+ *   loop <ms>                  repeat every ms, 0 or missing: play once
+ *   layer <w>x<h>              next layer and its buffer size, bottom first
+ *   key <layer> <ms> [x=] [y=] [w=] [h=] [visible=0|1] [content=]
+ *       [ease=step|linear|ease]
+ *
+ * A key keeps whatever it does not set from the key before it, the first
+ * one of a layer starts from the whole buffer at 0,0, visible.
+ */
+struct timeline {
+    uint64_t loop_ns;
+    uint64_t length_ns;         /* time of the last key */
+    int count_layers;
+    struct timeline_layer layers[TIMELINE_MAX_LAYERS];
+};
+
+int timeline_load(struct timeline *timeline, const char *path);
+/* state of layer t_ns after the start, looped if the timeline loops */
+void timeline_eval(const struct timeline *timeline, int layer, uint64_t t_ns,
+    struct timeline_state *state);
+/* a timeline that plays once has passed its last key */
+bool timeline_done(const struct timeline *timeline, uint64_t t_ns);
+
+#endif /* TIMELINE_H */
@@ -0,0 +1,216 @@
+#include "vblank-timing.h"
+#include "drm-atomic.h"
+
+#include <string.h>
+
+static uint32_t vblank_crtc_flags(const struct vblank_timing *vt)
+{
+    if (vt->crtc_index == 1)
+        return DRM_VBLANK_SECONDARY;
+    if (vt->crtc_index > 1)
+        return (vt->crtc_index << DRM_VBLANK_HIGH_CRTC_SHIFT) & DRM_VBLANK_HIGH_CRTC_MASK;
+    return 0;
+}
+
+/* flip and vblank events only carry the low 32 bits of the sequence */
+static uint64_t extend_sequence(uint64_t reference, uint32_t sequence)
+{
+    uint64_t seq = (reference & ~0xffffffffull) | sequence;
+
+    if (seq + 0x80000000ull < reference)
+        seq += 0x100000000ull;
+    else if (seq > reference + 0x80000000ull && seq >= 0x100000000ull)
+        seq -= 0x100000000ull;
+
+    return seq;
+}
+
+int vblank_timing_init(struct vblank_timing *vt, int fd, uint32_t crtc_id,
+    const drmModeModeInfo *mode)
+{
+    memset(vt, 0, sizeof(*vt));
+    if (!mode->clock) {
+        printf("mode %s has no pixel clock\n", mode->name);
+        return -1;
+    }
+
+    vt->fd = fd;
+    vt->crtc_id = crtc_id;
+    vt->crtc_index = get_crtc_index(fd, crtc_id);
+    vt->period_ns = (uint64_t)mode->htotal * mode->vtotal * 1000000 / mode->clock;
+    vt->line_ns = (uint64_t)mode->htotal * 1000000 / mode->clock;
+    vt->vdisplay = mode->vdisplay;
+    vt->slack_min_ns = INT64_MAX;
+
+    if (vt->crtc_index < 0) {
+        printf("crtc %u not found\n", crtc_id);
+        return -1;
+    }
+
+    return 0;
+}
+
+static void vblank_timing_probed(struct vblank_timing *vt, bool has_sequence)
+{
+    vt->has_sequence = has_sequence;
+    vt->probed = true;
+
+    printf("vblank timing: %s, period %.3f ms\n",
+        vt->has_sequence ? "drmCrtcGetSequence" : "drmWaitVBlank", vt->period_ns / 1e6);
+}
+
+int vblank_timing_now(struct vblank_timing *vt, struct vblank_time *now)
+{
+    drmVBlank vbl;
+
+    /*
+     * drmCrtcGetSequence was added in 4.15, older kernels only have the 32
+     * bit drmWaitVBlank. Both fail while the CRTC is not on yet, so the
+     * choice is only made once one of them worked.
+     */
+    if (!vt->probed || vt->has_sequence) {
+        if (drmCrtcGetSequence(vt->fd, vt->crtc_id, &now->seq, &now->ns) == 0) {
+            if (!vt->probed)
+                vblank_timing_probed(vt, true);
+            return 0;
+        }
+        if (vt->probed)
+            return -1;
+    }
+
+    memset(&vbl, 0, sizeof(vbl));
+    vbl.request.type = DRM_VBLANK_RELATIVE | vblank_crtc_flags(vt);
+    vbl.request.sequence = 0;
+    if (drmWaitVBlank(vt->fd, &vbl))
+        return -1;
+    if (!vt->probed)
+        vblank_timing_probed(vt, false);
+
+    now->seq = extend_sequence(vt->commit.seq, vbl.reply.sequence);
+    now->ns = vbl.reply.tval_sec * 1000000000ull + vbl.reply.tval_usec * 1000ull;
+    return 0;
+}
+
+int vblank_timing_wait_after(struct vblank_timing *vt, uint64_t seq)
+{
+    drmVBlank vbl;
+
+    /* returns right away when that vblank has passed already */
+    memset(&vbl, 0, sizeof(vbl));
+    vbl.request.type = DRM_VBLANK_ABSOLUTE | vblank_crtc_flags(vt);
+    vbl.request.sequence = (uint32_t)(seq + 1);
+    return drmWaitVBlank(vt->fd, &vbl);
+}
+
+void vblank_timing_commit(struct vblank_timing *vt)
+{
+    drmVBlank vbl;
+
+    vt->commit_ns = get_time_ns();
+    if (vblank_timing_now(vt, &vt->commit))
+        return;
+
+    /* estimated until the event of the deadline vblank arrives */
+    vt->deadline.seq = vt->commit.seq + 1;
+    vt->deadline.ns = vt->commit.ns + vt->period_ns;
+
+    if (vt->has_sequence) {
+        drmCrtcQueueSequence(vt->fd, vt->crtc_id, 0, vt->deadline.seq, NULL,
+            (uint64_t)(uintptr_t)vt);
+        return;
+    }
+
+    memset(&vbl, 0, sizeof(vbl));
+    vbl.request.type = DRM_VBLANK_ABSOLUTE | DRM_VBLANK_EVENT | vblank_crtc_flags(vt);
+    vbl.request.sequence = (uint32_t)vt->deadline.seq;
+    vbl.request.signal = (unsigned long)vt;
+    drmWaitVBlank(vt->fd, &vbl);
+}
+
+static void vblank_timing_deadline(struct vblank_timing *vt, uint64_t sequence, uint64_t ns)
+{
+    if (sequence == vt->deadline.seq)
+        vt->deadline.ns = ns;
+}
+
+void vblank_timing_sequence_handler(int fd, uint64_t sequence, uint64_t ns, uint64_t user_data)
+{
+    struct vblank_timing *vt = (struct vblank_timing *)(uintptr_t)user_data;
+
+    vblank_timing_deadline(vt, sequence, ns);
+}
+
+void vblank_timing_vblank_handler(int fd, unsigned int sequence,
+    unsigned int tv_sec, unsigned int tv_usec, void *user_data)
+{
+    struct vblank_timing *vt = user_data;
+
+    vblank_timing_deadline(vt, extend_sequence(vt->deadline.seq, sequence),
+        tv_sec * 1000000000ull + tv_usec * 1000ull);
+}
+
+uint64_t vblank_timing_flip(struct vblank_timing *vt, unsigned int sequence,
+    unsigned int tv_sec, unsigned int tv_usec)
+{
+    struct vblank_time flip = {
+        .seq = extend_sequence(vt->commit.seq, sequence),
+        .ns = tv_sec * 1000000000ull + tv_usec * 1000ull,
+    };
+    uint64_t vblanks = vt->flip.seq ? flip.seq - vt->flip.seq : 0;
+    int64_t slack_ns = vt->deadline.ns - vt->commit_ns;
+
+    if (vt->flip.seq) {
+        vt->frames++;
+        vt->vblanks[vblanks < VBLANK_TIMING_MAX_VBLANKS ? vblanks : VBLANK_TIMING_MAX_VBLANKS]++;
+
+        vt->slack_total_ns += slack_ns;
+        if (slack_ns < vt->slack_min_ns)
+            vt->slack_min_ns = slack_ns;
+
+        if (flip.seq > vt->deadline.seq) {
+            vt->late++;
+            vt->late_total_ns += flip.ns - vt->deadline.ns;
+        }
+    }
+
+    vt->flip = flip;
+    return vblanks;
+}
+
+void vblank_timing_print(const struct vblank_timing *vt)
+{
+    int k;
+
+    if (!vt->frames)
+        return;
+
+    printf("vblank timing: frames %llu late %llu (avg %.3f ms after deadline), "
+        "commit before deadline avg %.3f ms min %.3f ms\n",
+        (unsigned long long)vt->frames, (unsigned long long)vt->late,
+        vt->late ? vt->late_total_ns / 1e6 / vt->late : 0.0,
+        vt->slack_total_ns / 1e6 / vt->frames, vt->slack_min_ns / 1e6);
+
+    printf("    vblanks/frame:");
+    for (k = 0; k <= VBLANK_TIMING_MAX_VBLANKS; k++) {
+        if (vt->vblanks[k])
+            printf(" %s%d: %llu", k == VBLANK_TIMING_MAX_VBLANKS ? ">=" : "", k,
+                (unsigned long long)vt->vblanks[k]);
+    }
+    printf("\n");
+}
+
+int vblank_timing_scanline(struct vblank_timing *vt, uint64_t ns)
+{
+    struct vblank_time now;
+    uint64_t elapsed;
+
+    if (vblank_timing_now(vt, &now))
+        return -1;
+
+    /* vblank timestamps mark the start of scanout of the first active line */
+    if (ns >= now.ns)
+        elapsed = (ns - now.ns) % vt->period_ns;
+    else
+        elapsed = (vt->period_ns - (now.ns - ns) % vt->period_ns) % vt->period_ns;
+    return elapsed / vt->line_ns;
+}
@@ -0,0 +1,63 @@
+#ifndef VBLANK_TIMING_H
+#define VBLANK_TIMING_H
+
+#include <stdint.h>
+#include <stdbool.h>
+#include <xf86drm.h>
+#include <xf86drmMode.h>
+
+#define VBLANK_TIMING_MAX_VBLANKS 8
+
+struct vblank_time {
+    uint64_t seq;
+    uint64_t ns;
+};
+
+/*
+ * Vblank sequence and timestamp of every commit and flip of one CRTC.
+ * Uses drmCrtcGetSequence/drmCrtcQueueSequence when the kernel has them,
+ * drmWaitVBlank otherwise.
+ */
+struct vblank_timing {
+    int fd;
+    uint32_t crtc_id;
+    int crtc_index;
+    bool probed;
+    bool has_sequence;
+    uint64_t period_ns;             /* from the mode, to estimate a missing deadline */
+    uint64_t line_ns;
+    int vdisplay;
+
+    struct vblank_time commit;      /* current vblank when the last commit returned */
+    uint64_t commit_ns;             /* when the last commit returned */
+    struct vblank_time deadline;    /* first vblank after the commit */
+    struct vblank_time flip;        /* last flip */
+
+    uint64_t frames;
+    uint64_t vblanks[VBLANK_TIMING_MAX_VBLANKS + 1];   /* between flips, last: more */
+    uint64_t late;                  /* flipped after the deadline vblank */
+    int64_t slack_total_ns;         /* deadline - commit */
+    int64_t slack_min_ns;
+    uint64_t late_total_ns;         /* flip - deadline */
+};
+
+int vblank_timing_init(struct vblank_timing *vt, int fd, uint32_t crtc_id,
+    const drmModeModeInfo *mode);
+int vblank_timing_now(struct vblank_timing *vt, struct vblank_time *now);
+/* block until the vblank after seq */
+int vblank_timing_wait_after(struct vblank_timing *vt, uint64_t seq);
+/* call right after a commit returned successfully */
+void vblank_timing_commit(struct vblank_timing *vt);
+/* call from the page flip handler, returns the vblanks since the previous flip */
+uint64_t vblank_timing_flip(struct vblank_timing *vt, unsigned int sequence,
+    unsigned int tv_sec, unsigned int tv_usec);
+void vblank_timing_print(const struct vblank_timing *vt);
+/* scanline being scanned out at ns, vdisplay and above: in the vertical blank */
+int vblank_timing_scanline(struct vblank_timing *vt, uint64_t ns);
+
+/* for drmEventContext, user data is the struct vblank_timing */
+void vblank_timing_sequence_handler(int fd, uint64_t sequence, uint64_t ns, uint64_t user_data);
+void vblank_timing_vblank_handler(int fd, unsigned int sequence,
+    unsigned int tv_sec, unsigned int tv_usec, void *user_data);
+
+#endif /* VBLANK_TIMING_H */
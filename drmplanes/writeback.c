@@ -0,0 +1,355 @@
+#include "writeback.h"
+
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <poll.h>
+#include <drm_fourcc.h>
+
+#define WRITEBACK_FENCE_TIMEOUT_MS 1000
+
+static bool connector_supports_format(struct writeback *wb, uint32_t format)
+{
+    drmModePropertyBlobPtr blob;
+    uint64_t blob_id;
+    const uint32_t *formats;
+    bool found = false;
+    uint32_t i;
+
+    if (!get_property_value(wb->connector.props, wb->connector.props_info,
+            "WRITEBACK_PIXEL_FORMATS", &blob_id))
+        return false;
+
+    blob = drmModeGetPropertyBlob(wb->fd, blob_id);
+    if (!blob)
+        return false;
+
+    formats = blob->data;
+    for (i = 0; i < blob->length / sizeof(*formats); i++) {
+        if (formats[i] == format)
+            found = true;
+    }
+    drmModeFreePropertyBlob(blob);
+
+    return found;
+}
+
+/* the first writeback connector whose encoder can be driven by crtc_id */
+static uint32_t find_writeback_connector(int fd, uint32_t crtc_id)
+{
+    drmModeRes *resources;
+    drmModeConnector *connector;
+    drmModeEncoder *encoder;
+    int crtc_index = get_crtc_index(fd, crtc_id);
+    uint32_t connector_id = 0;
+    int i;
+
+    resources = drmModeGetResources(fd);
+    if (!resources || crtc_index < 0)
+        return 0;
+
+    for (i = 0; i < resources->count_connectors && !connector_id; i++) {
+        connector = drmModeGetConnector(fd, resources->connectors[i]);
+        if (!connector)
+            continue;
+
+        if (connector->connector_type == DRM_MODE_CONNECTOR_WRITEBACK &&
+                connector->count_encoders > 0) {
+            encoder = drmModeGetEncoder(fd, connector->encoders[0]);
+            if (encoder && (encoder->possible_crtcs & (1 << crtc_index)))
+                connector_id = connector->connector_id;
+            drmModeFreeEncoder(encoder);
+        }
+        drmModeFreeConnector(connector);
+    }
+
+    drmModeFreeResources(resources);
+    return connector_id;
+}
+
+static void copy_frame(struct writeback *wb, int index, struct writeback_frame *frame)
+{
+    const struct dumb_buffer *buf = &wb->buffers[index];
+    int row;
+
+    for (row = 0; row < wb->height; row++)
+        memcpy(frame->data + row * wb->width,
+            (const uint8_t *)buf->map + (size_t)row * buf->pitch, wb->width * 4);
+}
+
+static void *capture_thread(void *data)
+{
+    struct writeback *wb = data;
+    struct writeback_frame *frame;
+    struct pollfd pfd = { .events = POLLIN };
+    uint64_t copy_start, copy_ns = 0, latency_ns;
+    int index, ret;
+
+    pthread_mutex_lock(&wb->lock);
+    while (true) {
+        while (!wb->queue_count && !wb->stop)
+            pthread_cond_wait(&wb->cond, &wb->lock);
+        if (wb->stop)
+            break;
+
+        index = wb->queue[wb->queue_head];
+        wb->queue_head = (wb->queue_head + 1) % WRITEBACK_BUFFERS;
+        wb->queue_count--;
+        pthread_mutex_unlock(&wb->lock);
+
+        pfd.fd = wb->fences[index];
+        ret = poll(&pfd, 1, WRITEBACK_FENCE_TIMEOUT_MS);
+        close(wb->fences[index]);
+        wb->fences[index] = -1;
+
+        frame = &wb->ring[wb->ring_count % WRITEBACK_RING];
+        frame->done_ns = get_time_ns();
+        if (ret == 1) {
+            copy_start = get_time_ns();
+            copy_frame(wb, index, frame);
+            copy_ns = get_time_ns() - copy_start;
+            frame->seq = wb->ring_count;
+            frame->commit_ns = wb->commit_ns[index];
+            frame->frame_idx = wb->frame_idx[index];
+            if (wb->frame_cb)
+                wb->frame_cb(frame, wb->width, wb->height, wb->frame_cb_data);
+        }
+
+        pthread_mutex_lock(&wb->lock);
+        wb->busy[index] = false;
+        if (ret == 1) {
+            latency_ns = frame->done_ns - frame->commit_ns;
+            wb->latency_total_ns += latency_ns;
+            if (latency_ns > wb->latency_max_ns)
+                wb->latency_max_ns = latency_ns;
+            wb->copy_ns += copy_ns;
+            wb->ring_count++;
+        } else {
+            wb->failed++;
+        }
+    }
+    pthread_mutex_unlock(&wb->lock);
+
+    return NULL;
+}
+
+int writeback_init(struct writeback *wb, int fd, uint32_t crtc_id,
+    const drmModeModeInfo *mode, writeback_frame_cb frame_cb, void *frame_cb_data)
+{
+    uint32_t connector_id;
+    int k;
+
+    memset(wb, 0, sizeof(*wb));
+    wb->fd = fd;
+    wb->crtc_id = crtc_id;
+    wb->width = mode->hdisplay;
+    wb->height = mode->vdisplay;
+    wb->attached = -1;
+    wb->frame_cb = frame_cb;
+    wb->frame_cb_data = frame_cb_data;
+    wb->with_capture.name = "with writeback";
+    wb->without_capture.name = "without writeback";
+
+    /* only exposed to atomic clients that ask for them */
+    if (drmSetClientCap(fd, DRM_CLIENT_CAP_WRITEBACK_CONNECTORS, 1)) {
+        printf("no writeback connector support: %s\n", strerror(errno));
+        return -1;
+    }
+
+    connector_id = find_writeback_connector(fd, crtc_id);
+    if (!connector_id) {
+        printf("no writeback connector for crtc %u\n", crtc_id);
+        return -1;
+    }
+
+    if (init_atomic_connector(fd, connector_id, &wb->connector))
+        return -1;
+
+    if (!wb->connector.prop_ids[CONNECTOR_PROP_WRITEBACK_OUT_FENCE_PTR]) {
+        printf("writeback connector %u has no out fence\n", connector_id);
+        return -1;
+    }
+
+    if (!connector_supports_format(wb, DRM_FORMAT_XRGB8888)) {
+        printf("writeback connector %u cannot write XR24\n", connector_id);
+        return -1;
+    }
+
+    for (k = 0; k < WRITEBACK_BUFFERS; k++) {
+        wb->fences[k] = -1;
+        if (dumb_buffer_create(fd, wb->width, wb->height, DRM_FORMAT_XRGB8888, &wb->buffers[k]))
+            return -1;
+    }
+
+    for (k = 0; k < WRITEBACK_RING; k++) {
+        wb->ring[k].data = malloc((size_t)wb->width * wb->height * 4);
+        if (!wb->ring[k].data) {
+            printf("failed to allocate the capture ring\n");
+            return -1;
+        }
+    }
+
+    pthread_mutex_init(&wb->lock, NULL);
+    pthread_cond_init(&wb->cond, NULL);
+    if (pthread_create(&wb->thread, NULL, capture_thread, wb)) {
+        printf("failed to start the capture thread\n");
+        return -1;
+    }
+
+    printf("writeback connector %u on crtc %u, capturing %dx%d\n",
+        connector_id, crtc_id, wb->width, wb->height);
+    wb->start_ns = get_time_ns();
+    return 0;
+}
+
+void writeback_fini(struct writeback *wb)
+{
+    int k;
+
+    pthread_mutex_lock(&wb->lock);
+    wb->stop = true;
+    pthread_cond_signal(&wb->cond);
+    pthread_mutex_unlock(&wb->lock);
+    pthread_join(wb->thread, NULL);
+
+    for (k = 0; k < WRITEBACK_BUFFERS; k++) {
+        if (wb->fences[k] >= 0)
+            close(wb->fences[k]);
+        dumb_buffer_destroy(&wb->buffers[k]);
+    }
+    for (k = 0; k < WRITEBACK_RING; k++)
+        free(wb->ring[k].data);
+    free_atomic_connector(&wb->connector);
+}
+
+static int take_buffer(struct writeback *wb)
+{
+    int k, index = -1;
+
+    pthread_mutex_lock(&wb->lock);
+    for (k = 0; k < WRITEBACK_BUFFERS && index < 0; k++) {
+        if (!wb->busy[k])
+            index = k;
+    }
+    if (index < 0)
+        wb->skipped++;
+    pthread_mutex_unlock(&wb->lock);
+
+    if (index >= 0)
+        wb->fences[index] = -1;
+    return index;
+}
+
+bool writeback_attach(struct writeback *wb, struct atomic_template *t, uint32_t frame_idx)
+{
+    int index = take_buffer(wb);
+
+    if (index < 0)
+        return false;
+
+    /* the same CRTC_ID every time, so only the first capture is a modeset */
+    wb->template_count = t->count;
+    if (atomic_template_add_connector(t, &wb->connector, CONNECTOR_PROP_CRTC_ID, wb->crtc_id) < 0 ||
+            atomic_template_add_connector(t, &wb->connector, CONNECTOR_PROP_WRITEBACK_FB_ID,
+                wb->buffers[index].fb_id) < 0 ||
+            atomic_template_add_connector(t, &wb->connector, CONNECTOR_PROP_WRITEBACK_OUT_FENCE_PTR,
+                (uint64_t)(uintptr_t)&wb->fences[index]) < 0) {
+        atomic_template_truncate(t, wb->template_count);
+        return false;
+    }
+
+    wb->attached = index;
+    wb->commit_ns[index] = get_time_ns();
+    wb->frame_idx[index] = frame_idx;
+    return true;
+}
+
+bool writeback_attach_request(struct writeback *wb, drmModeAtomicReq *req, uint32_t frame_idx)
+{
+    int index = take_buffer(wb);
+    int cursor = drmModeAtomicGetCursor(req);
+
+    if (index < 0)
+        return false;
+
+    if (add_connector_property(req, &wb->connector, CONNECTOR_PROP_CRTC_ID, wb->crtc_id) < 0 ||
+            add_connector_property(req, &wb->connector, CONNECTOR_PROP_WRITEBACK_FB_ID,
+                wb->buffers[index].fb_id) < 0 ||
+            add_connector_property(req, &wb->connector, CONNECTOR_PROP_WRITEBACK_OUT_FENCE_PTR,
+                (uint64_t)(uintptr_t)&wb->fences[index]) < 0) {
+        /* no half set up capture in the caller's commit */
+        drmModeAtomicSetCursor(req, cursor);
+        return false;
+    }
+
+    wb->attached = index;
+    wb->commit_ns[index] = get_time_ns();
+    wb->frame_idx[index] = frame_idx;
+    return true;
+}
+
+void writeback_committed(struct writeback *wb, struct atomic_template *t,
+    int ret, uint64_t commit_ns)
+{
+    int index = wb->attached;
+
+    if (index < 0) {
+        if (!ret)
+            commit_stats_add(&wb->without_capture, commit_ns);
+        return;
+    }
+
+    if (t)
+        atomic_template_truncate(t, wb->template_count);
+    wb->attached = -1;
+
+    if (ret || wb->fences[index] < 0) {
+        if (wb->fences[index] >= 0)
+            close(wb->fences[index]);
+        wb->fences[index] = -1;
+        return;
+    }
+
+    commit_stats_add(&wb->with_capture, commit_ns);
+
+    pthread_mutex_lock(&wb->lock);
+    wb->busy[index] = true;
+    wb->queue[(wb->queue_head + wb->queue_count) % WRITEBACK_BUFFERS] = index;
+    wb->queue_count++;
+    pthread_cond_signal(&wb->cond);
+    pthread_mutex_unlock(&wb->lock);
+}
+
+void writeback_print(struct writeback *wb)
+{
+    double elapsed_s = (get_time_ns() - wb->start_ns) / 1e9;
+    uint64_t captured, skipped, failed, copy_ns, latency_total_ns, latency_max_ns;
+    double with_ms, without_ms;
+
+    pthread_mutex_lock(&wb->lock);
+    captured = wb->ring_count;
+    skipped = wb->skipped;
+    failed = wb->failed;
+    copy_ns = wb->copy_ns;
+    latency_total_ns = wb->latency_total_ns;
+    latency_max_ns = wb->latency_max_ns;
+    pthread_mutex_unlock(&wb->lock);
+
+    if (!captured)
+        return;
+
+    printf("writeback %dx%d: captured %llu (%.2f fps, %.1f MB/s) skipped %llu failed %llu, "
+        "copy avg %.3f ms, commit to capture avg %.3f ms max %.3f ms\n",
+        wb->width, wb->height, (unsigned long long)captured, captured / elapsed_s,
+        captured * wb->width * wb->height * 4.0 / elapsed_s / 1e6,
+        (unsigned long long)skipped, (unsigned long long)failed,
+        copy_ns / 1e6 / captured, latency_total_ns / 1e6 / captured, latency_max_ns / 1e6);
+
+    commit_stats_print(&wb->with_capture);
+    commit_stats_print(&wb->without_capture);
+    if (wb->with_capture.count && wb->without_capture.count) {
+        with_ms = wb->with_capture.total_ns / 1e6 / wb->with_capture.count;
+        without_ms = wb->without_capture.total_ns / 1e6 / wb->without_capture.count;
+        printf("writeback: capture adds %.3f ms to a commit\n", with_ms - without_ms);
+    }
+}
@@ -0,0 +1,86 @@
+#ifndef WRITEBACK_H
+#define WRITEBACK_H
+
+#include <stdint.h>
+#include <stdbool.h>
+#include <pthread.h>
+
+#include "drm-atomic.h"
+#include "dumb-buffer.h"
+
+#define WRITEBACK_BUFFERS 3     /* attached to commits, waiting for their fence */
+#define WRITEBACK_RING 8        /* captured frames kept in memory */
+
+struct writeback_frame {
+    uint32_t *data;             /* XRGB8888, width * 4 bytes a row */
+    uint64_t seq;               /* capture number */
+    uint32_t frame_idx;         /* the frame its commit put on screen */
+    uint64_t commit_ns;
+    uint64_t done_ns;           /* out fence signalled */
+};
+
+/* called on the capture thread for every frame copied into the ring */
+typedef void (*writeback_frame_cb)(const struct writeback_frame *frame,
+    int width, int height, void *data);
+
+/*
+ * Scanout capture with a writeback connector. A commit that carries a
+ * capture gets WRITEBACK_FB_ID and WRITEBACK_OUT_FENCE_PTR, a thread waits
+ * for the fences in commit order and copies the frames out of the dumb
+ * buffers into a ring, so the commit path only pays for the properties.
+ */
+struct writeback {
+    int fd;
+    uint32_t crtc_id;
+    int width, height;
+    struct connector connector;
+
+    struct dumb_buffer buffers[WRITEBACK_BUFFERS];
+    int fences[WRITEBACK_BUFFERS];
+    uint64_t commit_ns[WRITEBACK_BUFFERS];
+    uint32_t frame_idx[WRITEBACK_BUFFERS];
+    bool busy[WRITEBACK_BUFFERS];
+    int attached;               /* buffer of the commit being built, -1: none */
+    uint32_t template_count;    /* to take the capture out of the template again */
+
+    /* committed captures in commit order, taken by the thread */
+    int queue[WRITEBACK_BUFFERS];
+    int queue_head, queue_count;
+
+    pthread_t thread;
+    pthread_mutex_t lock;
+    pthread_cond_t cond;
+    bool stop;
+
+    struct writeback_frame ring[WRITEBACK_RING];
+    uint64_t ring_count;        /* frames written, the oldest get overwritten */
+    writeback_frame_cb frame_cb;
+    void *frame_cb_data;
+
+    uint64_t start_ns;
+    uint64_t skipped;           /* no free buffer, the thread fell behind */
+    uint64_t failed;            /* fence timed out */
+    uint64_t copy_ns;
+    uint64_t latency_total_ns;
+    uint64_t latency_max_ns;
+    struct commit_stats with_capture;
+    struct commit_stats without_capture;
+};
+
+/* the writeback connector that can be driven by crtc_id, at the mode size */
+int writeback_init(struct writeback *wb, int fd, uint32_t crtc_id,
+    const drmModeModeInfo *mode, writeback_frame_cb frame_cb, void *frame_cb_data);
+void writeback_fini(struct writeback *wb);
+/*
+ * Add a capture of frame_idx to the template, false if every buffer is
+ * still in flight. writeback_committed() takes it out again.
+ */
+bool writeback_attach(struct writeback *wb, struct atomic_template *t, uint32_t frame_idx);
+/* the same for a request built for a single commit */
+bool writeback_attach_request(struct writeback *wb, drmModeAtomicReq *req, uint32_t frame_idx);
+/* after every commit, with or without a capture; t is NULL for a request */
+void writeback_committed(struct writeback *wb, struct atomic_template *t,
+    int ret, uint64_t commit_ns);
+void writeback_print(struct writeback *wb);
+
+#endif /* WRITEBACK_H */